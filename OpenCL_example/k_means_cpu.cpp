@@ -0,0 +1,701 @@
+// Native multithreaded k-means engine, see k_means_cpu.h
+// *********************************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <vector>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "k_means_cpu.h"
+
+// Number of threads to use when the caller passes num_threads <= 0
+// *********************************************************************
+static int KMeansThreadCount(int num_threads)
+{
+#ifdef _OPENMP
+	return (num_threads > 0) ? num_threads : omp_get_max_threads();
+#else
+	(void)num_threads;
+	return 1;
+#endif
+}
+
+// Squared distance between a point and a centroid of D values
+// *********************************************************************
+static inline float KMeansDistance(const float* point, const float* centroid, int D)
+{
+	float distance = 0.0f;
+	for (int d = 0; d < D; d++)
+	{
+		float x = point[d] - centroid[d];
+		distance += x * x;
+	}
+	return distance;
+}
+
+// Copy point i of the feature table to a D-major row
+// *********************************************************************
+static inline void KMeansLoadPoint(const KMeansFeatures& features, unsigned int i, float* point)
+{
+	if (features.interleaved)
+	{
+		memcpy(point, features.interleaved + (size_t)i * features.D, features.D * sizeof(float));
+	}
+	else
+	{
+		for (int d = 0; d < features.D; d++)
+		{
+			point[d] = features.planes[d][i];
+		}
+	}
+}
+
+// k-means++ seeding
+// The first centroid is point (random_seed % count), the following ones are
+// sampled with probability proportional to the squared distance to the
+// nearest centroid chosen so far.
+// *********************************************************************
+void KMeansSeedHost(const KMeansFeatures& features, int k, unsigned int random_seed, unsigned int random_seed2,
+					float* centroids, int num_threads)
+{
+	const int D = features.D;
+	const unsigned int count = features.count;
+	const int nthreads = KMeansThreadCount(num_threads);
+	const int n = (int)count;
+
+	std::vector<float> min_distance(count, FLT_MAX);
+	std::vector<double> distance_accumulation(count);
+	unsigned int m_z = random_seed, m_w = random_seed2;
+
+	// choose the first centroid at random
+	unsigned int random = random_seed % count;
+	KMeansLoadPoint(features, random, centroids);
+
+	for (int c = 1; c < k; c++)
+	{
+		const float* last = centroids + (c - 1) * D;
+
+		// distance to the nearest centroid, only the last one can have changed it
+		#pragma omp parallel for num_threads(nthreads) schedule(static)
+		for (int i = 0; i < n; i++)
+		{
+			float point[K_MEANS_MAX_D];
+			KMeansLoadPoint(features, i, point);
+			float distance = KMeansDistance(point, last, D);
+			if (distance < min_distance[i])
+			{
+				min_distance[i] = distance;
+			}
+		}
+
+		double total = 0.0;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			total += min_distance[i];
+			distance_accumulation[i] = total;
+		}
+
+		// binary search the cumulative distribution for the sampled cutoff
+		double cutoff = (KMeansRandom(&m_z, &m_w) / 4294967296.0) * total;
+		unsigned int lo = 0, hi = count - 1;
+		while (lo < hi)
+		{
+			unsigned int mid = lo + (hi - lo) / 2;
+			if (distance_accumulation[mid] > cutoff)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		random = lo;
+
+		KMeansLoadPoint(features, random, centroids + c * D);
+	}
+}
+
+// Lloyd iterations
+// All iterations run inside a single parallel region so the thread pool is
+// created once. Each thread owns a contiguous range of points and its own
+// sums/counts; one thread merges them in thread order (which keeps the result
+// independent of scheduling) and updates the centroids.
+// *********************************************************************
+int KMeansLloydHost(const KMeansFeatures& features, int k, float* centroids, unsigned int* label_ptr,
+					int max_iterations, int num_threads)
+{
+	const int D = features.D;
+	const unsigned int count = features.count;
+	const int nthreads = KMeansThreadCount(num_threads);
+	const int stride = k * (D + 1);
+
+	if (max_iterations <= 0)
+	{
+		max_iterations = K_MEANS_MAX_ITERATIONS;
+	}
+
+	// per-thread accumulators: k * D sums followed by k counts
+	std::vector<double> accumulators((size_t)nthreads * stride);
+	int iterations = 0;
+	bool done = false;
+
+	#pragma omp parallel num_threads(nthreads)
+	{
+#ifdef _OPENMP
+		const int tid = omp_get_thread_num();
+		const int active = omp_get_num_threads();
+#else
+		const int tid = 0;
+		const int active = 1;
+#endif
+		const unsigned int chunk = (count + active - 1) / active;
+		const unsigned int first = (tid * chunk < count) ? tid * chunk : count;
+		const unsigned int last = (first + chunk < count) ? first + chunk : count;
+		double* sums = &accumulators[(size_t)tid * stride];
+		double* quantity = sums + k * D;
+
+		while (!done)
+		{
+			// Empty all clusters before classification
+			memset(sums, 0, stride * sizeof(double));
+
+			// Use the current means to classify the samples into K clusters
+			for (unsigned int i = first; i < last; i++)
+			{
+				float point[K_MEANS_MAX_D];
+				KMeansLoadPoint(features, i, point);
+
+				unsigned int centroids_index = 0;
+				float distance = KMeansDistance(point, centroids, D);
+
+				for (int j = 1; j < k; j++)
+				{
+					float distance_new = KMeansDistance(point, centroids + j * D, D);
+					if (distance_new < distance)
+					{
+						centroids_index = j;
+						distance = distance_new;
+					}
+				}
+
+				label_ptr[i] = centroids_index;
+				quantity[centroids_index] += 1.0;
+				for (int d = 0; d < D; d++)
+				{
+					sums[centroids_index * D + d] += point[d];
+				}
+			}
+
+			#pragma omp barrier
+
+			#pragma omp single
+			{
+				// merge the per-thread accumulators into the first one
+				double* total = &accumulators[0];
+				for (int t = 1; t < active; t++)
+				{
+					const double* partial = &accumulators[(size_t)t * stride];
+					for (int j = 0; j < stride; j++)
+					{
+						total[j] += partial[j];
+					}
+				}
+
+				// estimate the values of the new centers; empty clusters keep their position
+				int changed = 0;
+				for (int c = 0; c < k; c++)
+				{
+					double n = total[k * D + c];
+					if (n > 0)
+					{
+						float moved = 0.0f;
+						for (int d = 0; d < D; d++)
+						{
+							float value = (float)(total[c * D + d] / n);
+							moved += fabsf(centroids[c * D + d] - value);
+							centroids[c * D + d] = value;
+						}
+						if (moved > K_MEANS_EPSILON)
+						{
+							changed++;
+						}
+					}
+				}
+
+				iterations++;
+				done = (changed == 0) || (iterations >= max_iterations);
+			}
+			// implicit barrier at the end of the single block
+		}
+	}
+
+	return iterations;
+}
+
+// k-means|| reclustering
+// The candidates are few (a few rounds of ~2k points), so this runs serially.
+// *********************************************************************
+void KMeansReclusterHost(const float* candidates, const unsigned int* weights, int m, int k, int D,
+						 unsigned int random_seed, unsigned int random_seed2, float* centroids)
+{
+	unsigned int m_z = random_seed, m_w = random_seed2;
+
+	// not enough candidates to choose from: take them all, repeat the last one
+	if (m <= k)
+	{
+		for (int c = 0; c < k; c++)
+		{
+			memcpy(centroids + c * D, candidates + ((c < m) ? c : m - 1) * D, D * sizeof(float));
+		}
+		return;
+	}
+
+	// weighted k-means++
+	std::vector<double> min_distance(m, DBL_MAX);
+	int random = (int)(random_seed % m);
+	memcpy(centroids, candidates + random * D, D * sizeof(float));
+	for (int c = 1; c < k; c++)
+	{
+		double total = 0.0;
+		for (int i = 0; i < m; i++)
+		{
+			double distance = 0.0;
+			for (int d = 0; d < D; d++)
+			{
+				double x = candidates[i * D + d] - centroids[(c - 1) * D + d];
+				distance += x * x;
+			}
+			distance *= weights[i];
+			if (distance < min_distance[i])
+			{
+				min_distance[i] = distance;
+			}
+			total += min_distance[i];
+		}
+
+		double cutoff = (KMeansRandom(&m_z, &m_w) / 4294967296.0) * total;
+		random = m - 1;
+		for (int i = 0; i < m; i++)
+		{
+			cutoff -= min_distance[i];
+			if (cutoff < 0)
+			{
+				random = i;
+				break;
+			}
+		}
+		memcpy(centroids + c * D, candidates + random * D, D * sizeof(float));
+	}
+
+	// weighted Lloyd iterations
+	std::vector<double> sums(k * D);
+	std::vector<double> quantity(k);
+	for (int iteration = 0; iteration < K_MEANS_MAX_ITERATIONS; iteration++)
+	{
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(quantity.begin(), quantity.end(), 0.0);
+		for (int i = 0; i < m; i++)
+		{
+			int nearest = 0;
+			float distance = FLT_MAX;
+			for (int c = 0; c < k; c++)
+			{
+				float distance_new = 0.0f;
+				for (int d = 0; d < D; d++)
+				{
+					float x = candidates[i * D + d] - centroids[c * D + d];
+					distance_new += x * x;
+				}
+				if (distance_new < distance)
+				{
+					nearest = c;
+					distance = distance_new;
+				}
+			}
+			quantity[nearest] += weights[i];
+			for (int d = 0; d < D; d++)
+			{
+				sums[nearest * D + d] += (double)weights[i] * candidates[i * D + d];
+			}
+		}
+
+		int changed = 0;
+		for (int c = 0; c < k; c++)
+		{
+			if (quantity[c] > 0)
+			{
+				float moved = 0.0f;
+				for (int d = 0; d < D; d++)
+				{
+					float value = (float)(sums[c * D + d] / quantity[c]);
+					moved += fabsf(centroids[c * D + d] - value);
+					centroids[c * D + d] = value;
+				}
+				if (moved > K_MEANS_EPSILON)
+				{
+					changed++;
+				}
+			}
+		}
+		if (changed == 0)
+		{
+			break;
+		}
+	}
+}
+
+// Feature extraction from a scalar volume
+// Same stencil as kmeans_volume_features, one z slice per loop iteration.
+// *********************************************************************
+void KMeansVolumeFeaturesHost(const float* scalar_value, int nx, int ny, int nz,
+							  float* gradient_magnitude, float* second_derivative_magnitude, int num_threads)
+{
+	const int nthreads = KMeansThreadCount(num_threads);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int z = 0; z < nz; z++)
+	{
+		const int z_index[3] = { (z > 0) ? z - 1 : 0, z, (z < nz - 1) ? z + 1 : nz - 1 };
+		for (int y = 0; y < ny; y++)
+		{
+			const int y_index[3] = { (y > 0) ? y - 1 : 0, y, (y < ny - 1) ? y + 1 : ny - 1 };
+			for (int x = 0; x < nx; x++)
+			{
+				const int x_index[3] = { (x > 0) ? x - 1 : 0, x, (x < nx - 1) ? x + 1 : nx - 1 };
+
+				// 27-point neighbourhood, s[dz + 1][dy + 1][dx + 1]
+				float s[3][3][3];
+				for (int dz = 0; dz < 3; dz++)
+				{
+					for (int dy = 0; dy < 3; dy++)
+					{
+						const float* row = scalar_value + ((size_t)z_index[dz] * ny + y_index[dy]) * nx;
+						for (int dx = 0; dx < 3; dx++)
+						{
+							s[dz][dy][dx] = row[x_index[dx]];
+						}
+					}
+				}
+				float f = s[1][1][1];
+
+				float gx = 0.5f * (s[1][1][2] - s[1][1][0]);
+				float gy = 0.5f * (s[1][2][1] - s[1][0][1]);
+				float gz = 0.5f * (s[2][1][1] - s[0][1][1]);
+
+				float hxx = s[1][1][2] - 2.0f * f + s[1][1][0];
+				float hyy = s[1][2][1] - 2.0f * f + s[1][0][1];
+				float hzz = s[2][1][1] - 2.0f * f + s[0][1][1];
+				float hxy = 0.25f * (s[1][2][2] - s[1][0][2] - s[1][2][0] + s[1][0][0]);
+				float hxz = 0.25f * (s[2][1][2] - s[0][1][2] - s[2][1][0] + s[0][1][0]);
+				float hyz = 0.25f * (s[2][2][1] - s[0][2][1] - s[2][0][1] + s[0][0][1]);
+
+				float g2 = gx * gx + gy * gy + gz * gz;
+				float second = 0.0f;
+				if (g2 > 0.0f)
+				{
+					second = (gx * (hxx * gx + hxy * gy + hxz * gz) + 
+							  gy * (hxy * gx + hyy * gy + hyz * gz) + 
+							  gz * (hxz * gx + hyz * gy + hzz * gz)) / g2;
+				}
+
+				size_t i = ((size_t)z * ny + y) * nx + x;
+				gradient_magnitude[i] = sqrtf(g2);
+				second_derivative_magnitude[i] = fabsf(second);
+			}
+		}
+	}
+}
+
+// Nearest centroid of every point and the sum of the squared distances
+// *********************************************************************
+double KMeansInertiaHost(const KMeansFeatures& features, int k, const float* centroids, unsigned int* label_ptr, int num_threads)
+{
+	const int D = features.D;
+	const int n = (int)features.count;
+	const int nthreads = KMeansThreadCount(num_threads);
+	double inertia = 0.0;
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static) reduction(+:inertia)
+	for (int i = 0; i < n; i++)
+	{
+		float point[K_MEANS_MAX_D];
+		KMeansLoadPoint(features, i, point);
+
+		unsigned int centroids_index = 0;
+		float distance = KMeansDistance(point, centroids, D);
+		for (int j = 1; j < k; j++)
+		{
+			float distance_new = KMeansDistance(point, centroids + j * D, D);
+			if (distance_new < distance)
+			{
+				centroids_index = j;
+				distance = distance_new;
+			}
+		}
+
+		if (label_ptr)
+		{
+			label_ptr[i] = centroids_index;
+		}
+		inertia += distance;
+	}
+	return inertia;
+}
+
+// Storage types of the device feature table
+// *********************************************************************
+static const char* featureTypeNames[K_MEANS_FEATURE_TYPES] = { "float", "half", "u16", "u8" };
+
+size_t KMeansFeatureBytes(int type)
+{
+	switch (type)
+	{
+	case K_MEANS_FEATURE_HALF:
+	case K_MEANS_FEATURE_UINT16:
+		return 2;
+	case K_MEANS_FEATURE_UINT8:
+		return 1;
+	default:
+		return sizeof(float);
+	}
+}
+
+const char* KMeansFeatureTypeName(int type)
+{
+	return (type >= 0 && type < K_MEANS_FEATURE_TYPES) ? featureTypeNames[type] : "unknown";
+}
+
+int KMeansFeatureTypeByName(const char* name)
+{
+	for (int type = 0; type < K_MEANS_FEATURE_TYPES; type++)
+	{
+		if (strcmp(name, featureTypeNames[type]) == 0)
+		{
+			return type;
+		}
+	}
+	return -1;
+}
+
+// IEEE half precision, rounded to nearest even as vstore_half does
+static unsigned short KMeansFloatToHalf(float value)
+{
+	unsigned int f;
+	memcpy(&f, &value, sizeof(f));
+	unsigned int sign = (f >> 16) & 0x8000;
+	unsigned int magnitude = f & 0x7fffffff;
+	if (magnitude > 0x7f800000)
+	{
+		return (unsigned short)(sign | 0x7e00);                 // NaN
+	}
+	if (magnitude >= 0x477ff000)
+	{
+		return (unsigned short)(sign | 0x7c00);                 // rounds past 65504
+	}
+	if (magnitude < 0x38800000)
+	{
+		// subnormal: a multiple of 2^-24, the scaling is exact
+		float x = fabsf(value) * 16777216.0f;
+		unsigned int q = (unsigned int)x;
+		float rest = x - (float)q;
+		if (rest > 0.5f || (rest == 0.5f && (q & 1))) q++;
+		return (unsigned short)(sign | q);
+	}
+	unsigned int h = (magnitude >> 13) - (112 << 10);           // rebias the exponent from 127 to 15
+	unsigned int rest = magnitude & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;      // a carry moves on to the exponent
+	return (unsigned short)(sign | h);
+}
+
+static float KMeansHalfToFloat(unsigned short h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	if (exponent == 0)
+	{
+		float value = (float)mantissa * (1.0f / 16777216.0f);
+		return sign ? -value : value;
+	}
+	unsigned int f = sign | ((exponent == 31) ? (0x7f800000 | (mantissa << 13)) : (((exponent + 112) << 23) | (mantissa << 13)));
+	float value;
+	memcpy(&value, &f, sizeof(value));
+	return value;
+}
+
+// Range of every feature, spread over the integer range of the type
+// *********************************************************************
+void KMeansFeatureScaleHost(const KMeansFeatures& features, int type, float* scale, float* offset, int num_threads)
+{
+	const int D = features.D;
+	const unsigned int count = features.count;
+	const int nthreads = KMeansThreadCount(num_threads);
+
+	for (int d = 0; d < D; d++)
+	{
+		scale[d] = 1.0f;
+		offset[d] = 0.0f;
+	}
+	if (type != K_MEANS_FEATURE_UINT16 && type != K_MEANS_FEATURE_UINT8)
+	{
+		return;
+	}
+	const float levels = (type == K_MEANS_FEATURE_UINT8) ? 255.0f : 65535.0f;
+
+	// minimum, maximum and integrality of every feature, per thread
+	std::vector<float> lo((size_t)nthreads * D, FLT_MAX);
+	std::vector<float> hi((size_t)nthreads * D, -FLT_MAX);
+	std::vector<int> integral((size_t)nthreads * D, 1);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int t = 0; t < nthreads; t++)
+	{
+		unsigned int first = (unsigned int)((unsigned long long)count * t / nthreads);
+		unsigned int last = (unsigned int)((unsigned long long)count * (t + 1) / nthreads);
+		float* tlo = &lo[(size_t)t * D];
+		float* thi = &hi[(size_t)t * D];
+		int* tintegral = &integral[(size_t)t * D];
+		float point[K_MEANS_MAX_D];
+		for (unsigned int i = first; i < last; i++)
+		{
+			KMeansLoadPoint(features, i, point);
+			for (int d = 0; d < D; d++)
+			{
+				tlo[d] = std::min(tlo[d], point[d]);
+				thi[d] = std::max(thi[d], point[d]);
+				if (point[d] != floorf(point[d])) tintegral[d] = 0;
+			}
+		}
+	}
+
+	for (int d = 0; d < D; d++)
+	{
+		float flo = FLT_MAX, fhi = -FLT_MAX;
+		int iintegral = 1;
+		for (int t = 0; t < nthreads; t++)
+		{
+			flo = std::min(flo, lo[(size_t)t * D + d]);
+			fhi = std::max(fhi, hi[(size_t)t * D + d]);
+			iintegral &= integral[(size_t)t * D + d];
+		}
+		if (fhi < flo)
+		{
+			continue;                       // no points
+		}
+		offset[d] = flo;
+		if (!(iintegral && fhi - flo <= levels) && fhi > flo)
+		{
+			scale[d] = (fhi - flo) / levels;
+		}
+	}
+}
+
+// Narrow and widen stored values
+// *********************************************************************
+void KMeansEncodeHost(const float* values, size_t value_stride, size_t n, int type, float scale, float offset,
+					  void* stored, size_t stored_stride, int num_threads)
+{
+	const int m = (int)n;
+	const int nthreads = KMeansThreadCount(num_threads);
+	const float levels = (type == K_MEANS_FEATURE_UINT8) ? 255.0f : 65535.0f;
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int i = 0; i < m; i++)
+	{
+		float x = (values[(size_t)i * value_stride] - offset) / scale;
+		size_t o = (size_t)i * stored_stride;
+		switch (type)
+		{
+		case K_MEANS_FEATURE_HALF:
+			((unsigned short*)stored)[o] = KMeansFloatToHalf(x);
+			break;
+		case K_MEANS_FEATURE_UINT16:
+		case K_MEANS_FEATURE_UINT8:
+			x = floorf(x + 0.5f);
+			x = (x < 0.0f) ? 0.0f : ((x > levels) ? levels : x);
+			if (type == K_MEANS_FEATURE_UINT16)
+				((unsigned short*)stored)[o] = (unsigned short)x;
+			else
+				((unsigned char*)stored)[o] = (unsigned char)x;
+			break;
+		default:
+			((float*)stored)[o] = x;
+			break;
+		}
+	}
+}
+
+void KMeansDecodeHost(const void* stored, size_t stored_stride, size_t n, int type, float scale, float offset,
+					  float* values, size_t value_stride, int num_threads)
+{
+	const int m = (int)n;
+	const int nthreads = KMeansThreadCount(num_threads);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int i = 0; i < m; i++)
+	{
+		size_t o = (size_t)i * stored_stride;
+		float x;
+		switch (type)
+		{
+		case K_MEANS_FEATURE_HALF:
+			x = KMeansHalfToFloat(((const unsigned short*)stored)[o]);
+			break;
+		case K_MEANS_FEATURE_UINT16:
+			x = (float)((const unsigned short*)stored)[o];
+			break;
+		case K_MEANS_FEATURE_UINT8:
+			x = (float)((const unsigned char*)stored)[o];
+			break;
+		default:
+			x = ((const float*)stored)[o];
+			break;
+		}
+		values[(size_t)i * value_stride] = x * scale + offset;
+	}
+}
+
+// Distance every point moved between two frames
+// *********************************************************************
+void KMeansFeatureMovesHost(const KMeansFeatures& previous, const KMeansFeatures& current, float* moved, int num_threads)
+{
+	const int n = (int)std::min(previous.count, current.count);
+	const int nthreads = KMeansThreadCount(num_threads);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(static)
+	for (int i = 0; i < n; i++)
+	{
+		float before[K_MEANS_MAX_D], after[K_MEANS_MAX_D];
+		KMeansLoadPoint(previous, i, before);
+		KMeansLoadPoint(current, i, after);
+		moved[i] = sqrtf(KMeansDistance(after, before, current.D));
+	}
+}
+
+// Spread raw cluster ids over the 0-255 range for display
+// *********************************************************************
+void KMeansQuantizeLabelsHost(const unsigned int* label_ptr, unsigned char* display, unsigned int count, int k)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		display[i] = (unsigned char)(((unsigned long long)label_ptr[i] * 256) / k);
+	}
+}
+
+// Host equivalent of the k_means kernel
+// *********************************************************************
+void KMeansHost(const float* scalar_value, const float* gradient_magnitude, const float* second_derivative_magnitude,
+				unsigned char* label_ptr, unsigned int count, int k, unsigned int random_seed, unsigned int random_seed2,
+				int num_threads)
+{
+	const float* planes[K_MEANS_D] = { scalar_value, gradient_magnitude, second_derivative_magnitude };
+	KMeansFeatures features = { count, K_MEANS_D, planes, NULL, NULL, NULL };
+	std::vector<float> centroids(k * K_MEANS_D);
+	std::vector<unsigned int> labels(count);
+
+	KMeansSeedHost(features, k, random_seed, random_seed2, &centroids[0], num_threads);
+	KMeansLloydHost(features, k, &centroids[0], &labels[0], K_MEANS_MAX_ITERATIONS, num_threads);
+	KMeansQuantizeLabelsHost(&labels[0], label_ptr, count, k);
+}
@@ -0,0 +1,129 @@
+#ifndef __K_MEANS_CPU_H__
+#define __K_MEANS_CPU_H__
+
+#include <stddef.h>
+
+// Native C++ k-means engine
+// *********************************************************************
+// Clusters the same feature table as the k-means kernels and writes the
+// same label_ptr output. Points are split across a pool of OpenMP
+// threads, each with its own centroid accumulators, which are merged in
+// thread order at the end of every iteration. Without OpenMP the engine
+// runs on the calling thread only.
+//
+// Used on nodes without an OpenCL device and as the golden reference for
+// the device path.
+// *********************************************************************
+
+// Convergence threshold on the L1 move of every centroid (same as the kernel)
+#define K_MEANS_EPSILON 1e-4f
+
+// Iteration cap used when the caller does not provide one
+#define K_MEANS_MAX_ITERATIONS 500
+
+// Default dimension of the feature space (scalar value, gradient magnitude, second derivative magnitude)
+#define K_MEANS_D 3
+
+// Largest dimension the native engine accepts
+#define K_MEANS_MAX_D 256
+
+// Feature table: D values per point, either one array per feature (SoA)
+// or all features of a point next to each other (AoS)
+// *********************************************************************
+struct KMeansFeatures
+{
+	unsigned int count;             // # of points
+	int D;                          // # of features per point
+	const float* const* planes;     // SoA: D arrays of count values, or NULL
+	const float* interleaved;       // AoS: count * D values, or NULL
+	const float* scale;             // narrow device storage: D scales and offsets, value = stored * scale + offset,
+	const float* offset;            // or NULL to fit them to the range of every feature (KMeansFeatureScaleHost)
+};
+
+// Storage type of the device feature table
+// *********************************************************************
+// The kernels read the narrow types and widen them to float in registers:
+// half as it is, the integer types as stored * scale[d] + offset[d]. At
+// small D the assignment step is bound by the bandwidth of the table, so
+// 2 and 1 byte values cut the time of every pass and let 2 to 4 times
+// more points fit on the device.
+// *********************************************************************
+enum KMeansFeatureType
+{
+	K_MEANS_FEATURE_FLOAT,          // 32 bit float
+	K_MEANS_FEATURE_HALF,           // 16 bit float
+	K_MEANS_FEATURE_UINT16,         // 16 bit unsigned
+	K_MEANS_FEATURE_UINT8,          // 8 bit unsigned
+	K_MEANS_FEATURE_TYPES
+};
+
+// Bytes of one stored value
+size_t KMeansFeatureBytes(int type);
+
+// Name of a storage type ("float", "half", "u16", "u8"), and the type of a name (-1 if unknown)
+const char* KMeansFeatureTypeName(int type);
+int KMeansFeatureTypeByName(const char* name);
+
+// Scale and offset of every feature stored as type: the range of the
+// feature spread over the integer range, or scale 1 and offset the minimum
+// when the values are integers that fit as they are (8 and 16 bit volumes
+// are stored exactly). The float types keep scale 1 and offset 0.
+void KMeansFeatureScaleHost(const KMeansFeatures& features, int type, float* scale, float* offset, int num_threads);
+
+// Store n values (value i at values[i * value_stride]) as type, rounded to
+// the nearest representable value, to stored (value i at element
+// i * stored_stride); and widen them back
+void KMeansEncodeHost(const float* values, size_t value_stride, size_t n, int type, float scale, float offset,
+					  void* stored, size_t stored_stride, int num_threads);
+void KMeansDecodeHost(const void* stored, size_t stored_stride, size_t n, int type, float scale, float offset,
+					  float* values, size_t value_stride, int num_threads);
+
+// Multiply-with-carry generator shared by host and device seeding
+// *********************************************************************
+inline unsigned int KMeansRandom(unsigned int *m_z, unsigned int *m_w)
+{
+	(*m_z) = 36969 * ((*m_z) & 65535) + ((*m_z) >> 16);
+	(*m_w) = 18000 * ((*m_w) & 65535) + ((*m_w) >> 16);
+	return ((*m_z) << 16) + (*m_w);  /* 32-bit result */
+}
+
+// k-means++ seeding; writes k * D values to centroids
+void KMeansSeedHost(const KMeansFeatures& features, int k, unsigned int random_seed, unsigned int random_seed2,
+					float* centroids, int num_threads);
+
+// Lloyd iterations starting from centroids (updated in place); writes raw cluster ids
+// to label_ptr and returns the number of iterations run
+int KMeansLloydHost(const KMeansFeatures& features, int k, float* centroids, unsigned int* label_ptr,
+					int max_iterations, int num_threads);
+
+// Full clustering of the three default features (seeding, iterations, display
+// labels), the host equivalent of the original k_means kernel
+void KMeansHost(const float* scalar_value, const float* gradient_magnitude, const float* second_derivative_magnitude,
+				unsigned char* label_ptr, unsigned int count, int k, unsigned int random_seed, unsigned int random_seed2,
+				int num_threads);
+
+// Weighted k-means++ and Lloyd iterations on a small candidate set (k-means|| reclustering).
+// candidates holds m points of D values, weights the number of points each one stands for.
+void KMeansReclusterHost(const float* candidates, const unsigned int* weights, int m, int k, int D,
+						 unsigned int random_seed, unsigned int random_seed2, float* centroids);
+
+// Gradient magnitude and second derivative along the gradient of a scalar
+// volume of nx * ny * nz values (x fastest), by central differences clamped
+// at the border, as the kmeans_volume_features kernel computes them
+void KMeansVolumeFeaturesHost(const float* scalar_value, int nx, int ny, int nz,
+							  float* gradient_magnitude, float* second_derivative_magnitude, int num_threads);
+
+// Label every point with its nearest centroid (label_ptr may be NULL) and
+// return the inertia, the sum of the squared distances to those centroids
+double KMeansInertiaHost(const KMeansFeatures& features, int k, const float* centroids, unsigned int* label_ptr, int num_threads);
+
+// Distance every point moved in feature space between two tables of the
+// same points (consecutive frames of a time series), the moved input of a
+// warm start (KMeansWarmStart)
+void KMeansFeatureMovesHost(const KMeansFeatures& previous, const KMeansFeatures& current, float* moved, int num_threads);
+
+// Spread raw cluster ids over the 0-255 range for display (label * 256 / k),
+// as the kmeans_quantize kernel does
+void KMeansQuantizeLabelsHost(const unsigned int* label_ptr, unsigned char* display, unsigned int count, int k);
+
+#endif
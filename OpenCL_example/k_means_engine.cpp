@@ -0,0 +1,2157 @@
+// Device k-means engine, see k_means_engine.h
+// *********************************************************************
+
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "k_means_engine.h"
+
+// compiled program cache shared with oclReduction
+#include "../oclReduction/oclProgramCache.h"
+
+// Engine mutex
+// *********************************************************************
+#ifdef _WIN32
+typedef CRITICAL_SECTION KMeansMutex;
+static void KMeansMutexInit(KMeansMutex* mutex) { InitializeCriticalSection(mutex); }
+static void KMeansMutexDestroy(KMeansMutex* mutex) { DeleteCriticalSection(mutex); }
+static void KMeansMutexLock(KMeansMutex* mutex) { EnterCriticalSection(mutex); }
+static void KMeansMutexUnlock(KMeansMutex* mutex) { LeaveCriticalSection(mutex); }
+#else
+typedef pthread_mutex_t KMeansMutex;
+static void KMeansMutexInit(KMeansMutex* mutex) { pthread_mutex_init(mutex, NULL); }
+static void KMeansMutexDestroy(KMeansMutex* mutex) { pthread_mutex_destroy(mutex); }
+static void KMeansMutexLock(KMeansMutex* mutex) { pthread_mutex_lock(mutex); }
+static void KMeansMutexUnlock(KMeansMutex* mutex) { pthread_mutex_unlock(mutex); }
+#endif
+
+// Holds the engine mutex for the duration of a public call
+class KMeansLock
+{
+public:
+	explicit KMeansLock(void* mutex) : m((KMeansMutex*)mutex) { KMeansMutexLock(m); }
+	~KMeansLock() { KMeansMutexUnlock(m); }
+private:
+	KMeansMutex* m;
+};
+
+// Defaults
+// *********************************************************************
+KMeansEngineConfig::KMeansEngineConfig()
+	: local_size(256), max_groups(64), layout(K_MEANS_LAYOUT_AUTO), streaming(false), chunk_size(0), profiling(false),
+	  feature_type(K_MEANS_FEATURE_FLOAT), assign(K_MEANS_ASSIGN_AUTO), compensated(false)
+{
+}
+
+KMeansRun::KMeansRun()
+	: k(8), random_seed(362436069), random_seed2(521288629), centroids(NULL), inertia(0)
+{
+}
+
+KMeansWarmStart::KMeansWarmStart()
+	: labels(NULL), upper(NULL), lower(NULL), moved(NULL), threshold(0)
+{
+}
+
+KMeansIterationProfile::KMeansIterationProfile()
+	: assign_ms(0), update_ms(0), inertia(-1), moved(-1)
+{
+}
+
+KMeansProfile::KMeansProfile()
+	: commands(0), k(0)
+{
+	for (int s = 0; s < K_MEANS_STAGES; s++)
+	{
+		stage_ms[s] = 0;
+	}
+}
+
+const char* KMeansStageName(int stage)
+{
+	static const char* names[K_MEANS_STAGES] = { "upload", "features", "seed", "assign", "update", "stats", "display", "readback" };
+	return (stage >= 0 && stage < K_MEANS_STAGES) ? names[stage] : "unknown";
+}
+
+KMeansOptions::KMeansOptions()
+	: k(8), max_iterations(K_MEANS_MAX_ITERATIONS), random_seed(362436069), random_seed2(521288629),
+	  parallel_seeding(false), seed_rounds(5), oversampling(0), hamerly(false), num_threads(0),
+	  check_interval(K_MEANS_CHECK_INTERVAL)
+{
+}
+
+// Construction and teardown
+// *********************************************************************
+KMeansEngine::KMeansEngine()
+	: cdDevice(NULL), cxGPUContext(NULL), cqCommandQueue(NULL), cqTransferQueue(NULL),
+	  iProfileIteration(-1), bIterationStats(false), bWarmBounds(false), ulMaxAllocSize(0), ulLocalMemSize(0), ulMaxConstantSize(0), bHostMemory(false), szAssignTile(16),
+	  ckAssign(NULL), ckAccumulate(NULL), ckConverge(NULL), ckCheck(NULL), ckFold(NULL), ckAssignBounded(NULL),
+	  ckCentroidBounds(NULL), ckWarmBounds(NULL), ckQuantize(NULL), ckVolumeFeatures(NULL), ckSeedDistance(NULL),
+	  ckScanReduce(NULL), ckScan(NULL), ckSeedSample(NULL), ckParallelSelect(NULL),
+	  ckParallelDistance(NULL), ckParallelWeights(NULL), ckAssignBatch(NULL), ckAccumulateBatch(NULL), ckInertiaBatch(NULL),
+	  ckIterationStats(NULL),
+	  bLoaded(false), featureRows(NULL), storedRows(NULL), szFeatureBytes(sizeof(cl_float)), bInterleaved(false), bStreaming(false), bZeroCopy(false),
+	  uiChunkSize(0), szLocalWorkSize(0), szGlobalWorkSize(0), szNumGroups(0), szAccumulateWorkSize(0), szCentroidTile(1),
+	  szLabelBytes(sizeof(cl_uchar)), iAssignKernel(ASSIGN_STAGED), szAssignLocalWorkSize(0), cmDevFeatures(NULL), cmDevHostFeatures(NULL),
+	  iBoundsK(0), uiBoundsCount(0)
+{
+	memset(&features, 0, sizeof(features));
+	szTile[0] = 8;
+	szTile[1] = 8;
+	szTile[2] = 4;
+	KMeansMutex* mutex = new KMeansMutex;
+	KMeansMutexInit(mutex);
+	pMutex = mutex;
+}
+
+KMeansEngine::~KMeansEngine()
+{
+	release();
+	KMeansMutexDestroy((KMeansMutex*)pMutex);
+	delete (KMeansMutex*)pMutex;
+}
+
+// Release every OpenCL object of the engine
+void KMeansEngine::release()
+{
+	releaseKernels();
+	for (size_t c = 0; c < profileCommands.size(); c++)
+	{
+		if(profileCommands[c].event)clReleaseEvent(profileCommands[c].event);
+	}
+	profileCommands.clear();
+
+	Buffer* buffers[] = { &cmDevFeatureTable, &cmDevScalar, &cmDevFeatureChunks[0], &cmDevFeatureChunks[1],
+						  &cmDevClusterSums, &cmDevClusterCounts, &cmDevUpper, &cmDevLower, &cmDevDrift, &cmDevHalfMin,
+						  &cmDevPointMoves, &cmDevLabels, &cmDevDisplay, &cmDevCentroids[0], &cmDevCentroids[1], &cmDevPartialSums,
+						  &cmDevPartialCounts, &cmDevChanged, &cmDevStatus, &cmDevMinDistance, &cmDevDistanceAccumulation,
+						  &cmDevBlockSums, &cmDevCandidates, &cmDevCandidateCount, &cmDevWeights, &cmDevRunFirst, &cmDevRunK,
+						  &cmDevPartialInertia, &cmDevPrevLabels, &cmDevMoved };
+	for (size_t b = 0; b < sizeof(buffers) / sizeof(buffers[0]); b++)
+	{
+		if(buffers[b]->mem)clReleaseMemObject(buffers[b]->mem);
+		*buffers[b] = Buffer();
+	}
+	if(cmDevHostFeatures)clReleaseMemObject(cmDevHostFeatures);
+	cmDevHostFeatures = NULL;
+	cmDevFeatures = NULL;
+	bLoaded = false;
+
+	if(cqTransferQueue)clReleaseCommandQueue(cqTransferQueue);
+	if(cqCommandQueue)clReleaseCommandQueue(cqCommandQueue);
+	if(cxGPUContext)oclReleaseProgramCache(cxGPUContext);
+	if(cxGPUContext)clReleaseContext(cxGPUContext);
+	cqTransferQueue = NULL;
+	cqCommandQueue = NULL;
+	cxGPUContext = NULL;
+}
+
+// Release the kernels of the current specialization, the program cache
+// keeps their program
+void KMeansEngine::releaseKernels()
+{
+	cl_kernel* kernels[] = { &ckAssign, &ckAccumulate, &ckConverge, &ckCheck, &ckFold, &ckAssignBounded, &ckCentroidBounds,
+							 &ckWarmBounds, &ckQuantize, &ckVolumeFeatures, &ckSeedDistance, &ckScanReduce, &ckScan, &ckSeedSample,
+							 &ckParallelSelect, &ckParallelDistance, &ckParallelWeights, &ckAssignBatch, &ckAccumulateBatch,
+							 &ckInertiaBatch, &ckIterationStats };
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if(*kernels[i])clReleaseKernel(*kernels[i]);
+		*kernels[i] = NULL;
+	}
+	sPreamble.clear();
+}
+
+// Context, queues and device limits
+// *********************************************************************
+cl_int KMeansEngine::init(cl_device_id device, const char* source_path, const KMeansEngineConfig& engine_config)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1, ciErr2;
+
+	release();
+	cdDevice = device;
+	sSourcePath = source_path;
+	config = engine_config;
+	profileData = KMeansProfile();
+	if (config.local_size < 1) config.local_size = 256;
+	if (config.max_groups < 1) config.max_groups = 64;
+	if (config.feature_type < 0 || config.feature_type >= K_MEANS_FEATURE_TYPES)
+	{
+		shrLog("Error: unknown feature storage type %d\n\n", config.feature_type);
+		return CL_INVALID_VALUE;
+	}
+	szFeatureBytes = KMeansFeatureBytes(config.feature_type);
+
+	cxGPUContext = clCreateContext(0, 1, &cdDevice, NULL, NULL, &ciErr1);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clCreateContext, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+	cl_command_queue_properties properties = config.profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+	cqCommandQueue = clCreateCommandQueue(cxGPUContext, cdDevice, properties, &ciErr1);
+	cqTransferQueue = clCreateCommandQueue(cxGPUContext, cdDevice, properties, &ciErr2);
+	ciErr1 |= ciErr2;
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clCreateCommandQueue, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		release();
+		return ciErr1;
+	}
+
+	clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &ulMaxAllocSize, NULL);
+	clGetDeviceInfo(cdDevice, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &ulLocalMemSize, NULL);
+	clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(cl_ulong), &ulMaxConstantSize, NULL);
+
+	// CPU and unified memory devices can work on the host memory itself
+	cl_device_type deviceType = 0;
+	cl_bool bUnifiedMemory = CL_FALSE;
+	clGetDeviceInfo(cdDevice, CL_DEVICE_TYPE, sizeof(cl_device_type), &deviceType, NULL);
+	clGetDeviceInfo(cdDevice, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &bUnifiedMemory, NULL);
+	bHostMemory = (deviceType & CL_DEVICE_TYPE_CPU) || bUnifiedMemory;
+
+	// One voxel per work item in the feature extraction stencil
+	size_t szMaxWorkGroupSize = 0;
+	clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &szMaxWorkGroupSize, NULL);
+	szTile[0] = 8;
+	szTile[1] = 8;
+	szTile[2] = 4;
+	for (int t = 2; szMaxWorkGroupSize > 0 && szTile[0] * szTile[1] * szTile[2] > szMaxWorkGroupSize; t = (t + 2) % 3)
+	{
+		if (szTile[t] > 1) szTile[t] /= 2;
+	}
+
+	// The reduction trees and the bitonic sort of the accumulate step need a
+	// power of 2 work group, unrolled up to K_MEANS_MAX_LOCAL_SIZE
+	size_t szLimit = K_MEANS_MAX_LOCAL_SIZE;
+	if (szMaxWorkGroupSize > 0) szLimit = MIN(szLimit, szMaxWorkGroupSize);
+	size_t szLocal = 1;
+	while (szLocal * 2 <= MIN(config.local_size, szLimit))
+	{
+		szLocal *= 2;
+	}
+	if (szLocal != config.local_size)
+	{
+		shrLog("Work-group size %u is used instead of %u\n", (unsigned int)szLocal, (unsigned int)config.local_size);
+		config.local_size = szLocal;
+	}
+
+	// The tiled assignment stages 2 * 8 features of 4 * tile points and
+	// centroids and a candidate per point and work item column in local memory
+	szAssignTile = 16;
+	while (szAssignTile > 4 &&
+		   ((szMaxWorkGroupSize > 0 && szAssignTile * szAssignTile > szMaxWorkGroupSize) ||
+			(2 * 8 * 4 * szAssignTile + 2 * 4 * szAssignTile * szAssignTile) * sizeof(cl_float) > ulLocalMemSize))
+	{
+		szAssignTile /= 2;
+	}
+	return CL_SUCCESS;
+}
+
+// Make sure a pooled buffer holds at least bytes, contents are not kept
+// *********************************************************************
+cl_int KMeansEngine::reserve(Buffer& buffer, size_t bytes, cl_mem_flags flags)
+{
+	if (buffer.mem && buffer.bytes >= bytes)
+	{
+		return CL_SUCCESS;
+	}
+	if(buffer.mem)clReleaseMemObject(buffer.mem);
+	buffer = Buffer();
+
+	cl_int ciErr1;
+	buffer.mem = clCreateBuffer(cxGPUContext, flags, bytes, NULL, &ciErr1);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clCreateBuffer (%u bytes), Line %u in file %s !!!\n\n", bytes, __LINE__, __FILE__);
+		buffer.mem = NULL;
+		return ciErr1;
+	}
+	buffer.bytes = bytes;
+	return CL_SUCCESS;
+}
+
+size_t KMeansEngine::labelBytes(int k)
+{
+	return (k <= 256) ? sizeof(cl_uchar) : ((k <= 65536) ? sizeof(cl_ushort) : sizeof(cl_uint));
+}
+
+// Assignment kernel for k centroids: the tiled matrix product for large
+// D * k, otherwise the centroids are bound as a constant buffer when the
+// table fits in one next to the feature scales, or staged in local memory
+int KMeansEngine::assignKernel(int k) const
+{
+	bool bTiled = (config.assign == K_MEANS_ASSIGN_AUTO) ? ((long long)features.D * k >= K_MEANS_TILED_MIN_DK) :
+				  (config.assign == K_MEANS_ASSIGN_TILED);
+	if (bTiled)
+	{
+		return ASSIGN_TILED;
+	}
+	return (sizeof(cl_float) * (k + 2) * (cl_ulong)features.D <= ulMaxConstantSize) ? ASSIGN_CONSTANT : ASSIGN_STAGED;
+}
+
+// # of work items of the assignment step over count points: one per point,
+// or one work group per 4 * szAssignTile points when tiled
+size_t KMeansEngine::assignWorkSize(cl_uint count) const
+{
+	if (iAssignKernel == ASSIGN_TILED)
+	{
+		size_t szPoints = 4 * szAssignTile;
+		return ((count + szPoints - 1) / szPoints) * szAssignLocalWorkSize;
+	}
+	return shrRoundUp((int)szLocalWorkSize, count);
+}
+
+// Floats per cluster dimension of the accumulation: the sum, and its
+// compensation when compensated
+int KMeansEngine::sumPlanes() const
+{
+	return config.compensated ? 2 : 1;
+}
+
+// Bytes of the sums, quantities and sort order the accumulation kernels
+// keep in local memory for the given bins and columns
+void KMeansEngine::binLocalSizes(int bins, cl_uint columns, size_t sizes[3]) const
+{
+	sizes[0] = sizeof(cl_float) * MAX((size_t)1, (size_t)sumPlanes() * bins * features.D * columns);
+	sizes[1] = sizeof(cl_uint) * MAX(szLocalWorkSize, (size_t)bins * columns);
+	sizes[2] = sizeof(cl_uint) * szLocalWorkSize;
+}
+
+// Copies of every bin the accumulation kernels keep in local memory, a
+// power of two up to the work-group size; 0 selects their sorted path when
+// fewer than 1/32 of the work-items would get a column of their own
+cl_uint KMeansEngine::binColumns(int bins) const
+{
+	size_t sizes[3];
+	cl_uint columns = (cl_uint)szLocalWorkSize;
+	for (; columns > 0; columns /= 2)
+	{
+		binLocalSizes(bins, columns, sizes);
+		if ((cl_ulong)sizes[0] + sizes[1] + sizes[2] <= ulLocalMemSize)
+		{
+			break;
+		}
+	}
+	return ((size_t)columns * 32 < szLocalWorkSize) ? 0 : columns;
+}
+
+// Local memory and bin columns of kmeans_accumulate(_batch), in the four
+// arguments from first_arg on
+cl_int KMeansEngine::setBinArgs(cl_kernel kernel, cl_uint first_arg, int bins)
+{
+	cl_uint columns = binColumns(bins);
+	size_t sizes[3];
+	binLocalSizes(bins, columns, sizes);
+	cl_int ciErr1 = clSetKernelArg(kernel, first_arg, sizes[0], NULL);
+	ciErr1 |= clSetKernelArg(kernel, first_arg + 1, sizes[1], NULL);
+	ciErr1 |= clSetKernelArg(kernel, first_arg + 2, sizes[2], NULL);
+	ciErr1 |= clSetKernelArg(kernel, first_arg + 3, sizeof(cl_uint), (void*)&columns);
+	return ciErr1;
+}
+
+// Layout, streaming decision and work sizes of a dataset
+// *********************************************************************
+void KMeansEngine::configure(unsigned int count, int D)
+{
+	if (config.layout == K_MEANS_LAYOUT_AUTO)
+	{
+		bInterleaved = (D >= K_MEANS_AOS_MIN_D);
+	}
+	else
+	{
+		bInterleaved = (config.layout == K_MEANS_LAYOUT_INTERLEAVED);
+	}
+
+	// Stream the features in chunks when they do not fit in a single allocation
+	cl_ulong ulMaxChunk = ulMaxAllocSize / (szFeatureBytes * D);
+	bStreaming = config.streaming || (ulMaxChunk > 0 && (cl_ulong)count > ulMaxChunk);
+	uiChunkSize = count;
+	if (bStreaming)
+	{
+		cl_ulong ulChunk = (config.chunk_size > 0) ? (cl_ulong)config.chunk_size : K_MEANS_DEFAULT_CHUNK;
+		if (ulMaxChunk > 0) ulChunk = MIN(ulChunk, ulMaxChunk);
+		uiChunkSize = (cl_uint)MIN(ulChunk, (cl_ulong)count);
+	}
+
+	// The accumulate step keeps D sums (and D compensations) and a count per
+	// work item in local memory; halve the work group until they fit
+	szLocalWorkSize = config.local_size;
+	while (szLocalWorkSize > 1 && (sumPlanes() * D + 1) * sizeof(cl_float) * szLocalWorkSize > ulLocalMemSize)
+	{
+		szLocalWorkSize /= 2;
+	}
+	szGlobalWorkSize = shrRoundUp((int)szLocalWorkSize, uiChunkSize);
+	szNumGroups = MIN((size_t)config.max_groups, szGlobalWorkSize / szLocalWorkSize);
+	szAccumulateWorkSize = szNumGroups * szLocalWorkSize;
+
+	// kmeans_assign stages the centroids in a quarter of the local memory,
+	// so that several work groups still fit on a compute unit
+	szCentroidTile = (size_t)MIN((cl_ulong)1024, ulLocalMemSize / 4 / (sizeof(cl_float) * D));
+	if (szCentroidTile < 1) szCentroidTile = 1;
+}
+
+// Kernels for the current dataset, label size and assignment kernel,
+// rebuilt only when the specialization changes
+// *********************************************************************
+cl_int KMeansEngine::prepareKernels(size_t label_bytes, int assign_kernel)
+{
+	static const char* featureTypes[K_MEANS_FEATURE_TYPES] = { "float", "half", "ushort", "uchar" };
+	static const char* assignKernels[] = { "kmeans_assign", "kmeans_assign_constant", "kmeans_assign_tiled" };
+	std::ostringstream preamble;
+	preamble << "#define blockSize " << szLocalWorkSize << std::endl;
+	preamble << "#define D " << features.D << std::endl;
+	preamble << "#define FEATURE_AOS " << (bInterleaved ? 1 : 0) << std::endl;
+	preamble << "#define FEATURE_T " << featureTypes[config.feature_type] << std::endl;
+	preamble << "#define FEATURE_HALF " << ((config.feature_type == K_MEANS_FEATURE_HALF) ? 1 : 0) << std::endl;
+	if (!identityScale())
+	{
+		// 9 significant digits give back the float the host stored with
+		preamble.precision(9);
+		preamble.setf(std::ios::showpoint);
+		preamble << "#define FEATURE_SCALE {";
+		for (int d = 0; d < features.D; d++)
+		{
+			preamble << ((d > 0) ? ", " : "") << featureScales[d] << "f";
+		}
+		preamble << "}" << std::endl << "#define FEATURE_OFFSET {";
+		for (int d = 0; d < features.D; d++)
+		{
+			preamble << ((d > 0) ? ", " : "") << featureOffsets[d] << "f";
+		}
+		preamble << "}" << std::endl;
+	}
+	preamble << "#define TILE_X " << szTile[0] << std::endl;
+	preamble << "#define TILE_Y " << szTile[1] << std::endl;
+	preamble << "#define TILE_Z " << szTile[2] << std::endl;
+	preamble << "#define ASSIGN_TILE " << szAssignTile << std::endl;
+	preamble << "#define CENTROID_TILE " << szCentroidTile << std::endl;
+	preamble << "#define COMPENSATED " << (config.compensated ? 1 : 0) << std::endl;
+	preamble << "#define LABEL_T " << ((label_bytes == sizeof(cl_uchar)) ? "uchar" : ((label_bytes == sizeof(cl_ushort)) ? "ushort" : "uint")) << std::endl;
+	if (ckAssign && preamble.str() == sPreamble && assign_kernel == iAssignKernel)
+	{
+		return CL_SUCCESS;
+	}
+	releaseKernels();
+
+	// compiled only if neither this process nor a previous run has built it for the device
+	cl_int ciErr1, ciErr2;
+	cl_program cpProgram = oclGetCachedProgram(cxGPUContext, cdDevice, sSourcePath.c_str(), preamble.str().c_str(), NULL, &ciErr1);
+	if (cpProgram == NULL || ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clBuildProgram, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		if(cpProgram)clReleaseProgram(cpProgram);
+		return (ciErr1 != CL_SUCCESS) ? ciErr1 : CL_INVALID_PROGRAM;
+	}
+
+	ckAssign = clCreateKernel(cpProgram, assignKernels[assign_kernel], &ciErr1);
+	ckAccumulate = clCreateKernel(cpProgram, "kmeans_accumulate", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckConverge = clCreateKernel(cpProgram, "kmeans_converge", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckCheck = clCreateKernel(cpProgram, "kmeans_check", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckSeedDistance = clCreateKernel(cpProgram, "kmeans_seed_distance", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckScanReduce = clCreateKernel(cpProgram, "kmeans_scan_reduce", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckScan = clCreateKernel(cpProgram, "kmeans_scan", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckSeedSample = clCreateKernel(cpProgram, "kmeans_seed_sample", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckParallelSelect = clCreateKernel(cpProgram, "kmeans_parallel_select", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckParallelDistance = clCreateKernel(cpProgram, "kmeans_parallel_distance", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckParallelWeights = clCreateKernel(cpProgram, "kmeans_parallel_weights", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckFold = clCreateKernel(cpProgram, "kmeans_fold", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckAssignBounded = clCreateKernel(cpProgram, "kmeans_assign_bounded", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckCentroidBounds = clCreateKernel(cpProgram, "kmeans_centroid_bounds", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckWarmBounds = clCreateKernel(cpProgram, "kmeans_warm_bounds", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckQuantize = clCreateKernel(cpProgram, "kmeans_quantize", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckVolumeFeatures = clCreateKernel(cpProgram, "kmeans_volume_features", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckAssignBatch = clCreateKernel(cpProgram, "kmeans_assign_batch", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckAccumulateBatch = clCreateKernel(cpProgram, "kmeans_accumulate_batch", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckInertiaBatch = clCreateKernel(cpProgram, "kmeans_inertia_batch", &ciErr2);
+	ciErr1 |= ciErr2;
+	ckIterationStats = clCreateKernel(cpProgram, "kmeans_iteration_stats", &ciErr2);
+	ciErr1 |= ciErr2;
+	clReleaseProgram(cpProgram);
+
+	// outside the iteration loop no convergence flag stops the steps
+	if (ciErr1 == CL_SUCCESS) ciErr1 = setStatusArgs(NULL);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clCreateKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		releaseKernels();
+		return ciErr1;
+	}
+
+	sPreamble = preamble.str();
+	szLabelBytes = label_bytes;
+	iAssignKernel = assign_kernel;
+	szAssignLocalWorkSize = (assign_kernel == ASSIGN_TILED) ? szAssignTile * szAssignTile : szLocalWorkSize;
+	return CL_SUCCESS;
+}
+
+// Datasets
+// *********************************************************************
+cl_int KMeansEngine::load(const KMeansFeatures& host_features)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doLoad(host_features);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doLoad(const KMeansFeatures& host_features)
+{
+	const int D = host_features.D;
+	const unsigned int count = host_features.count;
+	bLoaded = false;
+	if (cxGPUContext == NULL || count == 0 || D < 1 || D > K_MEANS_MAX_D || (host_features.planes == NULL && host_features.interleaved == NULL))
+	{
+		shrLog("Error: KMeansEngine::load needs an initialized engine and 1 to %d features of at least one point\n\n", K_MEANS_MAX_D);
+		return CL_INVALID_VALUE;
+	}
+
+	// keep a view of the host features, the engine does not own them
+	features = host_features;
+	planes.clear();
+	if (host_features.planes)
+	{
+		planes.assign(host_features.planes, host_features.planes + D);
+		features.planes = &planes[0];
+	}
+	featureRows = host_features.interleaved;
+	derivedPlanes.clear();
+
+	// scale and offset of the stored values, given or fitted to the range of every feature
+	featureScales.assign(D, 1.0f);
+	featureOffsets.assign(D, 0.0f);
+	if (host_features.scale && host_features.offset)
+	{
+		featureScales.assign(host_features.scale, host_features.scale + D);
+		featureOffsets.assign(host_features.offset, host_features.offset + D);
+	}
+	else
+	{
+		KMeansFeatureScaleHost(host_features, config.feature_type, &featureScales[0], &featureOffsets[0], 0);
+	}
+	features.scale = &featureScales[0];
+	features.offset = &featureOffsets[0];
+
+	configure(count, D);
+	if (featureRows && !features.planes)
+	{
+		// the host only has rows
+		bInterleaved = true;
+	}
+	return uploadFeatures();
+}
+
+// Stored values are the values themselves
+bool KMeansEngine::identityScale() const
+{
+	for (size_t d = 0; d < featureScales.size(); d++)
+	{
+		if (featureScales[d] != 1.0f || featureOffsets[d] != 0.0f) return false;
+	}
+	return true;
+}
+
+// Device feature table of the current dataset
+cl_int KMeansEngine::uploadFeatures()
+{
+	const int D = features.D;
+	const cl_uint count = features.count;
+	const int type = config.feature_type;
+	cl_int ciErr1 = CL_SUCCESS;
+
+	// a previous table may wrap storedTable
+	if(cmDevHostFeatures)clReleaseMemObject(cmDevHostFeatures);
+	cmDevHostFeatures = NULL;
+	cmDevFeatures = NULL;
+
+	// the host features are uploaded as they are if the device stores floats
+	// in their layout; otherwise a copy is packed into rows and / or narrowed
+	// to the storage type
+	storedTable.clear();
+	storedPlanes.assign(D, (const unsigned char*)NULL);
+	storedRows = NULL;
+	bool bAsIs = (type == K_MEANS_FEATURE_FLOAT) && identityScale();
+	if (bAsIs && bInterleaved && featureRows)
+	{
+		storedRows = (const unsigned char*)featureRows;
+	}
+	else if (bAsIs && !bInterleaved)
+	{
+		for (int d = 0; d < D; d++)
+		{
+			storedPlanes[d] = (const unsigned char*)features.planes[d];
+		}
+	}
+	else
+	{
+		storedTable.resize(szFeatureBytes * count * D);
+		for (int d = 0; d < D; d++)
+		{
+			unsigned char* stored = &storedTable[0] + szFeatureBytes * (bInterleaved ? (size_t)d : (size_t)d * count);
+			if (featureRows)
+			{
+				KMeansEncodeHost(featureRows + d, D, count, type, featureScales[d], featureOffsets[d], stored, bInterleaved ? D : 1, 0);
+			}
+			else
+			{
+				KMeansEncodeHost(features.planes[d], 1, count, type, featureScales[d], featureOffsets[d], stored, bInterleaved ? D : 1, 0);
+			}
+			if (!bInterleaved) storedPlanes[d] = stored;
+		}
+		if (bInterleaved) storedRows = &storedTable[0];
+	}
+
+	// CPU and unified memory devices work on the host memory itself (the
+	// mapped volume, the host arrays or the stored copy), provided it is one block
+	const unsigned char* host_features = NULL;
+	if (bInterleaved)
+	{
+		host_features = storedRows;
+	}
+	else
+	{
+		host_features = storedPlanes[0];
+		for (int d = 1; d < D && host_features; d++)
+		{
+			if (storedPlanes[d] != storedPlanes[0] + szFeatureBytes * d * count) host_features = NULL;
+		}
+	}
+	bZeroCopy = !bStreaming && host_features != NULL && bHostMemory;
+
+	if (bStreaming)
+	{
+		ciErr1 = reserve(cmDevFeatureChunks[0], szFeatureBytes * uiChunkSize * D, CL_MEM_READ_ONLY);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevFeatureChunks[1], szFeatureBytes * uiChunkSize * D, CL_MEM_READ_ONLY);
+	}
+	else if (bZeroCopy)
+	{
+		cmDevHostFeatures = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, szFeatureBytes * count * D, (void*)host_features, &ciErr1);
+		if (ciErr1 != CL_SUCCESS) cmDevHostFeatures = NULL;
+		cmDevFeatures = cmDevHostFeatures;
+	}
+	else
+	{
+		ciErr1 = reserve(cmDevFeatureTable, szFeatureBytes * count * D);
+		cmDevFeatures = cmDevFeatureTable.mem;
+		if (ciErr1 == CL_SUCCESS && bInterleaved)
+		{
+			ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevFeatures, CL_FALSE, 0, szFeatureBytes * count * D,
+										  storedRows, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+		}
+		else if (ciErr1 == CL_SUCCESS)
+		{
+			// one upload per plane, straight from the mapping when the planes are separate files
+			for (int d = 0; d < D; d++)
+			{
+				ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevFeatures, CL_FALSE, szFeatureBytes * d * count, szFeatureBytes * count,
+											   storedPlanes[d], 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+			}
+		}
+	}
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in KMeansEngine::load, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+	bLoaded = true;
+	return CL_SUCCESS;
+}
+
+cl_int KMeansEngine::loadVolume(const float* scalar_value, const int dims[3], int num_threads)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doLoadVolume(scalar_value, dims, num_threads);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doLoadVolume(const float* scalar_value, const int dims[3], int num_threads)
+{
+	const unsigned int count = (unsigned int)dims[0] * dims[1] * dims[2];
+	bLoaded = false;
+	if (cxGPUContext == NULL || scalar_value == NULL || count == 0)
+	{
+		shrLog("Error: KMeansEngine::loadVolume needs an initialized engine and a non-empty volume\n\n");
+		return CL_INVALID_VALUE;
+	}
+
+	planes.assign(K_MEANS_D, (const float*)NULL);
+	planes[0] = scalar_value;
+	features.count = count;
+	features.D = K_MEANS_D;
+	features.planes = &planes[0];
+	features.interleaved = NULL;
+	featureRows = NULL;
+	featureScales.assign(K_MEANS_D, 1.0f);
+	featureOffsets.assign(K_MEANS_D, 0.0f);
+	features.scale = &featureScales[0];
+	features.offset = &featureOffsets[0];
+	configure(count, K_MEANS_D);
+
+	// the stencil needs the neighbouring slices of every chunk, and the
+	// integer types a scale fitted to the derived values: derive on the host
+	if (bStreaming || config.feature_type == K_MEANS_FEATURE_UINT16 || config.feature_type == K_MEANS_FEATURE_UINT8)
+	{
+		shrLog("Deriving the features on the host...\n");
+		derivedPlanes.resize((size_t)count * 2);
+		planes[1] = &derivedPlanes[0];
+		planes[2] = &derivedPlanes[0] + count;
+		KMeansVolumeFeaturesHost(scalar_value, dims[0], dims[1], dims[2], &derivedPlanes[0], &derivedPlanes[0] + count, num_threads);
+		KMeansFeatureScaleHost(features, config.feature_type, &featureScales[0], &featureOffsets[0], num_threads);
+		return uploadFeatures();
+	}
+
+	// only the scalar volume crosses the bus, the stencil fills the feature
+	// table in float or half
+	if(cmDevHostFeatures)clReleaseMemObject(cmDevHostFeatures);
+	cmDevHostFeatures = NULL;
+	derivedPlanes.clear();
+	storedTable.clear();
+	storedPlanes.clear();
+	storedRows = NULL;
+	bZeroCopy = false;
+
+	cl_int ciErr1 = prepareKernels(szLabelBytes, iAssignKernel);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevFeatureTable, szFeatureBytes * count * K_MEANS_D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevScalar, sizeof(cl_float) * count, CL_MEM_READ_ONLY);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+	cmDevFeatures = cmDevFeatureTable.mem;
+
+	size_t szVolumeWorkSize[3];
+	for (int t = 0; t < 3; t++)
+	{
+		szVolumeWorkSize[t] = shrRoundUp((int)szTile[t], dims[t]);
+	}
+	cl_uint pitch = count;
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevScalar.mem, CL_FALSE, 0, sizeof(cl_float) * count, scalar_value, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 0, sizeof(cl_mem), (void*)&cmDevScalar.mem);
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 1, sizeof(cl_int), (void*)&dims[0]);
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 2, sizeof(cl_int), (void*)&dims[1]);
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 3, sizeof(cl_int), (void*)&dims[2]);
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 4, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckVolumeFeatures, 5, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckVolumeFeatures, 3, NULL, szVolumeWorkSize, szTile, 0, NULL, tag(K_MEANS_STAGE_FEATURES));
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in kmeans_volume_features, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+	bLoaded = true;
+	return CL_SUCCESS;
+}
+
+// Point i of the device feature table
+cl_int KMeansEngine::readPoint(unsigned int i, float* point)
+{
+	const int D = features.D;
+	std::vector<unsigned char> stored(szFeatureBytes * D);
+	cl_int ciErr1 = CL_SUCCESS;
+	if (bInterleaved)
+	{
+		ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevFeatures, CL_TRUE, szFeatureBytes * i * D, szFeatureBytes * D, &stored[0], 0, NULL, tag(K_MEANS_STAGE_SEED));
+	}
+	else
+	{
+		for (int d = 0; d < D; d++)
+		{
+			ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevFeatures, CL_FALSE, szFeatureBytes * ((size_t)d * uiChunkSize + i), szFeatureBytes,
+										  &stored[0] + szFeatureBytes * d, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		}
+		ciErr1 |= clFinish(cqCommandQueue);
+	}
+
+	// widened as the kernels do
+	for (int d = 0; d < D && ciErr1 == CL_SUCCESS; d++)
+	{
+		KMeansDecodeHost(&stored[0] + szFeatureBytes * d, 1, 1, config.feature_type, featureScales[d], featureOffsets[d], point + d, 1, 1);
+	}
+	return ciErr1;
+}
+
+// Seeding
+// *********************************************************************
+cl_int KMeansEngine::seed(const KMeansOptions& options, float* centroids)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doSeed(options, centroids);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doSeed(const KMeansOptions& options, float* centroids)
+{
+	const int k = options.k;
+	const int D = features.D;
+	const cl_uint count = features.count;
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansEngine::seed needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+
+	// the device seeding kernels need all points resident, seed on the host
+	if (bStreaming)
+	{
+		shrLog("k-means++ seeding on the host...\n");
+		KMeansSeedHost(features, k, options.random_seed, options.random_seed2, centroids, options.num_threads);
+		return CL_SUCCESS;
+	}
+
+	// the seeding kernels do not read labels, any label width will do
+	cl_int ciErr1 = prepareKernels(szLabelBytes, iAssignKernel);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[0], sizeof(cl_float) * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevMinDistance, sizeof(cl_float) * count);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevBlockSums, sizeof(cl_float) * szNumGroups);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	if (options.parallel_seeding)
+	{
+		ciErr1 = seedParallel(options);
+	}
+	else
+	{
+		shrLog("k-means++ seeding...\n");
+		ciErr1 = reserve(cmDevDistanceAccumulation, sizeof(cl_float) * count);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = seedPlusPlus(options);
+	}
+	if (ciErr1 == CL_SUCCESS)
+	{
+		ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_TRUE, 0, sizeof(cl_float) * k * D, centroids, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	}
+	return ciErr1;
+}
+
+// k-means++ seeding on the device
+// Every round computes the nearest distances, scans them and draws one point
+// by binary search. The uniform draws come from the host generator, so all k
+// rounds are enqueued without reading anything back.
+// *********************************************************************
+cl_int KMeansEngine::seedPlusPlus(const KMeansOptions& options)
+{
+	const int k = options.k;
+	unsigned int m_z = options.random_seed, m_w = options.random_seed2;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	cl_uint num_groups = (cl_uint)szNumGroups;
+	size_t szOne = 1;
+	cl_int ciErr1;
+
+	// choose the first centroid at random
+	unsigned int random = options.random_seed % count;
+	float first[K_MEANS_MAX_D];
+	ciErr1 = readPoint(random, first);
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_TRUE, 0, sizeof(float) * features.D, first, 0, NULL, tag(K_MEANS_STAGE_SEED));
+
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 2, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 4, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 5, sizeof(cl_uint), (void*)&count);
+
+	ciErr1 |= clSetKernelArg(ckScanReduce, 0, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 1, sizeof(cl_mem), (void*)&cmDevBlockSums.mem);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 2, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 3, sizeof(cl_float) * szLocalWorkSize, NULL);
+
+	ciErr1 |= clSetKernelArg(ckScan, 0, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckScan, 1, sizeof(cl_mem), (void*)&cmDevDistanceAccumulation.mem);
+	ciErr1 |= clSetKernelArg(ckScan, 2, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckScan, 3, sizeof(cl_float) * szLocalWorkSize, NULL);
+
+	ciErr1 |= clSetKernelArg(ckSeedSample, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 2, sizeof(cl_mem), (void*)&cmDevDistanceAccumulation.mem);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 3, sizeof(cl_mem), (void*)&cmDevBlockSums.mem);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 4, sizeof(cl_uint), (void*)&num_groups);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 6, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clSetKernelArg(ckSeedSample, 8, sizeof(cl_uint), (void*)&count);
+
+	// choose more centers
+	for (cl_int c = 1; c < k && ciErr1 == CL_SUCCESS; c++)
+	{
+		cl_int last = c - 1;
+		cl_float u = (cl_float)(KMeansRandom(&m_z, &m_w) / 4294967296.0);
+		ciErr1 |= clSetKernelArg(ckSeedDistance, 3, sizeof(cl_int), (void*)&last);
+		ciErr1 |= clSetKernelArg(ckSeedSample, 5, sizeof(cl_float), (void*)&u);
+		ciErr1 |= clSetKernelArg(ckSeedSample, 7, sizeof(cl_int), (void*)&c);
+
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckSeedDistance, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckScanReduce, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckScan, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckSeedSample, 1, NULL, &szOne, &szOne, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	}
+
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in k-means++ seeding, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+	}
+	return ciErr1;
+}
+
+// k-means|| seeding on the device
+// Each round keeps every point with probability l * d^2 / phi and folds the
+// new candidates into the nearest distances; only the candidate count is read
+// back per round. The weighted candidates are then reclustered on the host.
+// *********************************************************************
+cl_int KMeansEngine::seedParallel(const KMeansOptions& options)
+{
+	const int k = options.k;
+	const int D = features.D;
+	unsigned int m_z = options.random_seed, m_w = options.random_seed2;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	cl_float fOversampling = (options.oversampling > 0) ? options.oversampling : 2.0f * k;
+	cl_uint uiMaxCandidates = 1 + (cl_uint)(2 * fOversampling * options.seed_rounds);
+	cl_uint uiCandidates = 1;
+	cl_uint uiFirst = 0;
+	cl_uint num_groups = (cl_uint)szNumGroups;
+	cl_int zero = 0;
+	cl_int ciErr1;
+
+	shrLog("k-means|| seeding (%d rounds, %.1f candidates per round)...\n", options.seed_rounds, fOversampling);
+	ciErr1 = reserve(cmDevCandidates, sizeof(cl_float) * uiMaxCandidates * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCandidateCount, sizeof(cl_uint));
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevWeights, sizeof(cl_uint) * uiMaxCandidates);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	// the first candidate is a point at random
+	unsigned int random = options.random_seed % count;
+	float first[K_MEANS_MAX_D];
+	ciErr1 = readPoint(random, first);
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevCandidates.mem, CL_TRUE, 0, sizeof(float) * D, first, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevCandidateCount.mem, CL_TRUE, 0, sizeof(cl_uint), &uiCandidates, 0, NULL, tag(K_MEANS_STAGE_SEED));
+
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 2, sizeof(cl_mem), (void*)&cmDevCandidates.mem);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 3, sizeof(cl_int), (void*)&zero);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 4, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckSeedDistance, 5, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckSeedDistance, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+
+	ciErr1 |= clSetKernelArg(ckScanReduce, 0, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 1, sizeof(cl_mem), (void*)&cmDevBlockSums.mem);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 2, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckScanReduce, 3, sizeof(cl_float) * szLocalWorkSize, NULL);
+
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 2, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 3, sizeof(cl_mem), (void*)&cmDevBlockSums.mem);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 4, sizeof(cl_uint), (void*)&num_groups);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 5, sizeof(cl_float), (void*)&fOversampling);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 8, sizeof(cl_mem), (void*)&cmDevCandidates.mem);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 9, sizeof(cl_mem), (void*)&cmDevCandidateCount.mem);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 10, sizeof(cl_uint), (void*)&uiMaxCandidates);
+	ciErr1 |= clSetKernelArg(ckParallelSelect, 11, sizeof(cl_uint), (void*)&count);
+
+	ciErr1 |= clSetKernelArg(ckParallelDistance, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckParallelDistance, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckParallelDistance, 2, sizeof(cl_mem), (void*)&cmDevCandidates.mem);
+	ciErr1 |= clSetKernelArg(ckParallelDistance, 5, sizeof(cl_mem), (void*)&cmDevMinDistance.mem);
+	ciErr1 |= clSetKernelArg(ckParallelDistance, 6, sizeof(cl_uint), (void*)&count);
+
+	for (int round = 0; round < options.seed_rounds && ciErr1 == CL_SUCCESS; round++)
+	{
+		// fresh per-point random streams every round
+		cl_uint seed = KMeansRandom(&m_z, &m_w);
+		cl_uint seed2 = KMeansRandom(&m_z, &m_w);
+		ciErr1 |= clSetKernelArg(ckParallelSelect, 6, sizeof(cl_uint), (void*)&seed);
+		ciErr1 |= clSetKernelArg(ckParallelSelect, 7, sizeof(cl_uint), (void*)&seed2);
+
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckScanReduce, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckParallelSelect, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevCandidateCount.mem, CL_TRUE, 0, sizeof(cl_uint), &uiCandidates, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		uiCandidates = MIN(uiCandidates, uiMaxCandidates);
+
+		ciErr1 |= clSetKernelArg(ckParallelDistance, 3, sizeof(cl_uint), (void*)&uiFirst);
+		ciErr1 |= clSetKernelArg(ckParallelDistance, 4, sizeof(cl_uint), (void*)&uiCandidates);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckParallelDistance, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+		uiFirst = uiCandidates;
+	}
+
+	// weight every candidate by the number of points it is nearest to
+	cl_uint* weights = (cl_uint*)calloc(uiCandidates, sizeof(cl_uint));
+	float* candidates = (float*)malloc(sizeof(float) * uiCandidates * D);
+	float* seeds = (float*)malloc(sizeof(float) * k * D);
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevWeights.mem, CL_FALSE, 0, sizeof(cl_uint) * uiCandidates, weights, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 2, sizeof(cl_mem), (void*)&cmDevCandidates.mem);
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 3, sizeof(cl_uint), (void*)&uiCandidates);
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 4, sizeof(cl_mem), (void*)&cmDevWeights.mem);
+	ciErr1 |= clSetKernelArg(ckParallelWeights, 5, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckParallelWeights, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevWeights.mem, CL_FALSE, 0, sizeof(cl_uint) * uiCandidates, weights, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevCandidates.mem, CL_TRUE, 0, sizeof(float) * uiCandidates * D, candidates, 0, NULL, tag(K_MEANS_STAGE_SEED));
+
+	// recluster the candidates down to k on the host
+	if (ciErr1 == CL_SUCCESS)
+	{
+		shrLog("k-means|| reclustering %u candidates...\n", uiCandidates);
+		KMeansReclusterHost(candidates, weights, (int)uiCandidates, k, D, options.random_seed, options.random_seed2, seeds);
+		ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_TRUE, 0, sizeof(float) * k * D, seeds, 0, NULL, tag(K_MEANS_STAGE_SEED));
+	}
+	free(weights);
+	free(candidates);
+	free(seeds);
+
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in k-means|| seeding, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+	}
+	return ciErr1;
+}
+
+// Lloyd iterations
+// *********************************************************************
+cl_int KMeansEngine::iterate(const KMeansOptions& options, float* centroids, int* iterations)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doIterate(options, centroids, iterations);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::iterateWarm(const KMeansOptions& options, const KMeansWarmStart& warm, float* centroids, int* iterations)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doIterate(options, centroids, iterations, &warm);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doIterate(const KMeansOptions& options, float* centroids, int* iterations, const KMeansWarmStart* warm)
+{
+	const int k = options.k;
+	const int D = features.D;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	cl_uint num_groups = (cl_uint)szNumGroups;
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansEngine::iterate needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+
+	// labels and bounds of the last warm start, overwritten from here on
+	bool bKept = (iBoundsK == k && uiBoundsCount == count);
+	iBoundsK = 0;
+
+	// the bounds are per point, as large as the input itself
+	bool bHamerly = (options.hamerly || warm) && !bStreaming;
+	if ((options.hamerly || warm) && bStreaming)
+	{
+		shrLog("Hamerly bounds are not used when streaming\n");
+	}
+
+	cl_int ciErr1 = prepareKernels(labelBytes(k), assignKernel(k));
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevLabels, szLabelBytes * szGlobalWorkSize);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[0], sizeof(cl_float) * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[1], sizeof(cl_float) * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialSums, sizeof(cl_float) * sumPlanes() * szNumGroups * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialCounts, sizeof(cl_uint) * szNumGroups * k);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevChanged, sizeof(cl_uint));
+	if (ciErr1 == CL_SUCCESS && bStreaming)
+	{
+		ciErr1 = reserve(cmDevClusterSums, sizeof(cl_float) * sumPlanes() * k * D);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevClusterCounts, sizeof(cl_uint) * k);
+	}
+	if (ciErr1 == CL_SUCCESS && bHamerly)
+	{
+		ciErr1 = reserve(cmDevUpper, sizeof(cl_float) * count);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevLower, sizeof(cl_float) * count);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevDrift, sizeof(cl_float) * k);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevHalfMin, sizeof(cl_float) * k);
+	}
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	// Set the Argument values that do not change between iterations
+	//////////////////////////////////////////////////////////////////////////
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_FALSE, 0, sizeof(cl_float) * k * D, centroids, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clSetKernelArg(ckAssign, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAssign, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAssign, 3, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAssign, 4, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAssign, 5, sizeof(cl_int), (void*)&k);
+
+	ciErr1 |= clSetKernelArg(ckAccumulate, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 2, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 3, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 4, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 5, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 6, sizeof(cl_int), (void*)&k);
+	ciErr1 |= setBinArgs(ckAccumulate, 7, k);
+
+	if (bStreaming)
+	{
+		// the running sums of all chunks stand for a single work group
+		cl_uint one = 1;
+		ciErr1 |= clSetKernelArg(ckFold, 0, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+		ciErr1 |= clSetKernelArg(ckFold, 1, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+		ciErr1 |= clSetKernelArg(ckFold, 2, sizeof(cl_uint), (void*)&num_groups);
+		ciErr1 |= clSetKernelArg(ckFold, 3, sizeof(cl_mem), (void*)&cmDevClusterSums.mem);
+		ciErr1 |= clSetKernelArg(ckFold, 4, sizeof(cl_mem), (void*)&cmDevClusterCounts.mem);
+		ciErr1 |= clSetKernelArg(ckFold, 5, sizeof(cl_int), (void*)&k);
+
+		ciErr1 |= clSetKernelArg(ckConverge, 0, sizeof(cl_mem), (void*)&cmDevClusterSums.mem);
+		ciErr1 |= clSetKernelArg(ckConverge, 1, sizeof(cl_mem), (void*)&cmDevClusterCounts.mem);
+		ciErr1 |= clSetKernelArg(ckConverge, 2, sizeof(cl_uint), (void*)&one);
+	}
+	else
+	{
+		ciErr1 |= clSetKernelArg(ckConverge, 0, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+		ciErr1 |= clSetKernelArg(ckConverge, 1, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+		ciErr1 |= clSetKernelArg(ckConverge, 2, sizeof(cl_uint), (void*)&num_groups);
+	}
+	ciErr1 |= clSetKernelArg(ckConverge, 5, sizeof(cl_mem), (void*)&cmDevChanged.mem);
+	ciErr1 |= clSetKernelArg(ckConverge, 6, sizeof(cl_int), (void*)&k);
+
+	if (bHamerly)
+	{
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 1, sizeof(cl_uint), (void*)&pitch);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 3, sizeof(cl_mem), (void*)&cmDevDrift.mem);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 4, sizeof(cl_mem), (void*)&cmDevHalfMin.mem);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 5, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 6, sizeof(cl_mem), (void*)&cmDevUpper.mem);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 7, sizeof(cl_mem), (void*)&cmDevLower.mem);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 8, sizeof(cl_uint), (void*)&count);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 9, sizeof(cl_int), (void*)&k);
+
+		ciErr1 |= clSetKernelArg(ckCentroidBounds, 2, sizeof(cl_mem), (void*)&cmDevDrift.mem);
+		ciErr1 |= clSetKernelArg(ckCentroidBounds, 3, sizeof(cl_mem), (void*)&cmDevHalfMin.mem);
+		ciErr1 |= clSetKernelArg(ckCentroidBounds, 4, sizeof(cl_int), (void*)&k);
+	}
+	//////////////////////////////////////////////////////////////////////////
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+
+	// Profiling: inertia and moved points of every iteration, one row each
+	bIterationStats = config.profiling && !bStreaming;
+	if (bIterationStats)
+	{
+		const int iMaxIterations = (options.max_iterations > 0) ? options.max_iterations : K_MEANS_MAX_ITERATIONS;
+		std::vector<cl_uint> zeros(iMaxIterations, 0);
+		ciErr1 = reserve(cmDevPrevLabels, szLabelBytes * count);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialInertia, sizeof(cl_float) * szNumGroups * iMaxIterations);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevMoved, sizeof(cl_uint) * iMaxIterations);
+		if (ciErr1 == CL_SUCCESS)
+		{
+			ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevMoved.mem, CL_TRUE, 0, sizeof(cl_uint) * iMaxIterations, &zeros[0], 0, NULL, tag(K_MEANS_STAGE_STATS));
+			ciErr1 |= clSetKernelArg(ckIterationStats, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 1, sizeof(cl_uint), (void*)&pitch);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 3, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 4, sizeof(cl_mem), (void*)&cmDevPrevLabels.mem);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 5, sizeof(cl_mem), (void*)&cmDevPartialInertia.mem);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 6, sizeof(cl_mem), (void*)&cmDevMoved.mem);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 8, sizeof(cl_uint), (void*)&count);
+			ciErr1 |= clSetKernelArg(ckIterationStats, 9, sizeof(cl_float) * szLocalWorkSize, NULL);
+		}
+		if (ciErr1 != CL_SUCCESS)
+		{
+			bIterationStats = false;
+			return ciErr1;
+		}
+	}
+
+	// Labels and bounds of the previous frame
+	if (warm && bHamerly)
+	{
+		ciErr1 = warmStart(k, *warm, bKept);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			return ciErr1;
+		}
+	}
+
+	// Iterate assign / accumulate / converge until no centroid moves
+	int iIteration = 0;
+	ciErr1 = runIterations(options, k, false, bHamerly, &iIteration);
+	bWarmBounds = false;
+	profileData.k = k;
+	profileData.iterations.assign(iIteration, KMeansIterationProfile());
+	if (ciErr1 == CL_SUCCESS && bIterationStats)
+	{
+		ciErr1 = readIterationStats(iIteration);
+	}
+	bIterationStats = false;
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+	shrLog("k-means converged after %d iterations\n", iIteration);
+	if (iterations)
+	{
+		*iterations = iIteration;
+	}
+
+	// the last update is in the buffer the next iteration would have read
+	cl_mem cmFinal = cmDevCentroids[iIteration % 2].mem;
+	if (warm && bHamerly)
+	{
+		// labels and bounds are against the centroids before the last
+		// update: one more bounded assignment, with the drift of that update,
+		// leaves them against the returned ones for the next frame
+		cl_int init = 0;
+		ciErr1 = clSetKernelArg(ckAssignBounded, 2, sizeof(cl_mem), (void*)&cmFinal);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 10, sizeof(cl_int), (void*)&init);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssignBounded, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		if (ciErr1 != CL_SUCCESS)
+		{
+			return ciErr1;
+		}
+		iBoundsK = k;
+		uiBoundsCount = count;
+	}
+	return clEnqueueReadBuffer(cqCommandQueue, cmFinal, CL_TRUE, 0, sizeof(cl_float) * k * D, centroids, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+}
+
+// Warm start: labels and bounds of the previous frame, from the host or as
+// the last warm start left them, loosened by the moves of the points; the
+// centroids do not drift before the first assignment. Without labels the
+// loop starts cold from the centroids.
+cl_int KMeansEngine::warmStart(int k, const KMeansWarmStart& warm, bool kept)
+{
+	cl_uint count = features.count;
+	cl_int has_bounds = warm.labels ? ((warm.upper && warm.lower) ? 1 : 0) : 1;
+	bWarmBounds = false;
+	if (!warm.labels && !kept)
+	{
+		shrLog("No labels of a previous frame for k = %d, the warm start only keeps the centroids\n", k);
+		return CL_SUCCESS;
+	}
+
+	cl_int ciErr1 = CL_SUCCESS;
+	if (warm.labels)
+	{
+		ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevLabels.mem, CL_FALSE, 0, szLabelBytes * count, warm.labels, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+		if (has_bounds)
+		{
+			ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevUpper.mem, CL_FALSE, 0, sizeof(cl_float) * count, warm.upper, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+			ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevLower.mem, CL_FALSE, 0, sizeof(cl_float) * count, warm.lower, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+		}
+	}
+	cl_mem cmMoves = NULL;
+	if (ciErr1 == CL_SUCCESS && warm.moved && has_bounds)
+	{
+		ciErr1 = reserve(cmDevPointMoves, sizeof(cl_float) * count, CL_MEM_READ_ONLY);
+		if (ciErr1 == CL_SUCCESS) ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevPointMoves.mem, CL_FALSE, 0, sizeof(cl_float) * count, warm.moved, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+		cmMoves = cmDevPointMoves.mem;
+	}
+
+	// bounds for the new positions, then drift 0 and half_min of the starting centroids
+	size_t szClusterWorkSize = shrRoundUp((int)szLocalWorkSize, k);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 0, sizeof(cl_mem), (void*)&cmMoves);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 1, sizeof(cl_mem), (void*)&cmDevUpper.mem);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 2, sizeof(cl_mem), (void*)&cmDevLower.mem);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 3, sizeof(cl_float), (void*)&warm.threshold);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 4, sizeof(cl_int), (void*)&has_bounds);
+	ciErr1 |= clSetKernelArg(ckWarmBounds, 5, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckWarmBounds, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	ciErr1 |= clSetKernelArg(ckCentroidBounds, 0, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clSetKernelArg(ckCentroidBounds, 1, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckCentroidBounds, 1, NULL, &szClusterWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in the warm start, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+	bWarmBounds = true;
+	return CL_SUCCESS;
+}
+
+// Labels and bounds the last iterateWarm() of k clusters left on the device
+cl_int KMeansEngine::readBounds(int k, void* labels, float* upper, float* lower)
+{
+	KMeansLock lock(pMutex);
+	if (k < 1 || iBoundsK != k || uiBoundsCount != features.count)
+	{
+		shrLog("Error: KMeansEngine::readBounds needs a preceding iterateWarm() of k = %d on the current dataset\n\n", k);
+		return CL_INVALID_OPERATION;
+	}
+	cl_uint count = features.count;
+	cl_int ciErr1 = CL_SUCCESS;
+	if (labels) ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevLabels.mem, CL_FALSE, 0, szLabelBytes * count, labels, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	if (upper) ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevUpper.mem, CL_FALSE, 0, sizeof(cl_float) * count, upper, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	if (lower) ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevLower.mem, CL_FALSE, 0, sizeof(cl_float) * count, lower, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	ciErr1 |= clFinish(cqCommandQueue);
+	collectProfile();
+	return ciErr1;
+}
+
+// Status argument of the iteration steps: the convergence flag inside the
+// iteration loop, NULL everywhere else so that the steps always run
+cl_int KMeansEngine::setStatusArgs(cl_mem status)
+{
+	cl_int ciErr1 = clSetKernelArg(ckAssign, 6, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 11, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckConverge, 7, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckAssignBounded, 11, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckCentroidBounds, 5, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 8, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 13, sizeof(cl_mem), (void*)&status);
+	ciErr1 |= clSetKernelArg(ckIterationStats, 10, sizeof(cl_mem), (void*)&status);
+	return ciErr1;
+}
+
+// One iteration from cmDevCentroids[iteration % 2] into the other buffer,
+// then the convergence flag. The caller sets the arguments that do not
+// change between iterations; the ones set here are captured at enqueue
+// time, so several iterations can be queued before any of them runs.
+cl_int KMeansEngine::enqueueIteration(int iteration, int k, bool batch, bool hamerly)
+{
+	size_t szClusterWorkSize = shrRoundUp((int)szLocalWorkSize, k);
+	size_t szAssignWorkSize = assignWorkSize(uiChunkSize);
+	size_t szOne = 1;
+	cl_mem cmCurrent = cmDevCentroids[iteration % 2].mem;
+	cl_mem cmNext = cmDevCentroids[1 - iteration % 2].mem;
+	iProfileIteration = iteration;
+
+	cl_int ciErr1 = clSetKernelArg(ckConverge, 3, sizeof(cl_mem), (void*)&cmCurrent);
+	ciErr1 |= clSetKernelArg(ckConverge, 4, sizeof(cl_mem), (void*)&cmNext);
+	if (batch)
+	{
+		ciErr1 |= clSetKernelArg(ckAssignBatch, 2, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssignBatch, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAccumulateBatch, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	}
+	else if (bStreaming)
+	{
+		ciErr1 |= clSetKernelArg(ckAssign, 2, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= streamChunks(k, NULL);
+	}
+	else if (hamerly)
+	{
+		// the first pass computes the bounds (unless a warm start brought
+		// them), later ones only visit the points they do not settle
+		cl_int init = (iteration == 0 && !bWarmBounds) ? 1 : 0;
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 2, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= clSetKernelArg(ckAssignBounded, 10, sizeof(cl_int), (void*)&init);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssignBounded, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAccumulate, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	}
+	else
+	{
+		ciErr1 |= clSetKernelArg(ckAssign, 2, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssign, 1, NULL, &szAssignWorkSize, &szAssignLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAccumulate, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	}
+	if (bIterationStats)
+	{
+		// labels of this iteration against the centroids they were assigned to
+		cl_int it = iteration;
+		ciErr1 |= clSetKernelArg(ckIterationStats, 2, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= clSetKernelArg(ckIterationStats, 7, sizeof(cl_int), (void*)&it);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckIterationStats, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_STATS));
+	}
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckConverge, 1, NULL, &szClusterWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	if (hamerly)
+	{
+		// how far the centroids moved, read by the next assignment
+		ciErr1 |= clSetKernelArg(ckCentroidBounds, 0, sizeof(cl_mem), (void*)&cmCurrent);
+		ciErr1 |= clSetKernelArg(ckCentroidBounds, 1, sizeof(cl_mem), (void*)&cmNext);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckCentroidBounds, 1, NULL, &szClusterWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	}
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckCheck, 1, NULL, &szOne, NULL, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	return ciErr1;
+}
+
+// Iterations until no centroid moves or the cap, with k the # of entries of
+// the centroid table. They are queued check_interval at a time, each batch
+// followed by a non-blocking read of the convergence flag; the host waits
+// for the flag of a batch only once the next one is queued behind it, so the
+// device does not idle on the round trip. The batch queued past convergence
+// does no work. *iterations receives the # of iterations that ran, the final
+// centroids are in cmDevCentroids[*iterations % 2].
+cl_int KMeansEngine::runIterations(const KMeansOptions& options, int k, bool batch, bool hamerly, int* iterations)
+{
+	const int iMaxIterations = (options.max_iterations > 0) ? options.max_iterations : K_MEANS_MAX_ITERATIONS;
+
+	// a streaming pass uploads every chunk again, none is queued on speculation
+	const int iInterval = bStreaming ? 1 : ((options.check_interval > 0) ? options.check_interval : K_MEANS_CHECK_INTERVAL);
+	const int iAhead = bStreaming ? 0 : 1;
+
+	cl_int ciErr1 = reserve(cmDevStatus, sizeof(cl_uint) * 2);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+	const cl_uint uiZero[2] = { 0, 0 };
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevStatus.mem, CL_FALSE, 0, sizeof(cl_uint) * 2, uiZero, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevChanged.mem, CL_FALSE, 0, sizeof(cl_uint), uiZero, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	ciErr1 |= clSetKernelArg(ckCheck, 0, sizeof(cl_mem), (void*)&cmDevChanged.mem);
+	ciErr1 |= clSetKernelArg(ckCheck, 1, sizeof(cl_mem), (void*)&cmDevStatus.mem);
+	ciErr1 |= setStatusArgs(cmDevStatus.mem);
+
+	// batch b reads the flag into uiStatus[b % 2], at most iAhead + 1 batches are in flight
+	cl_uint uiStatus[2][2] = { { 0, 0 }, { 0, 0 } };
+	cl_event ceStatus[2] = { NULL, NULL };
+	int iQueued = 0;                // iterations queued
+	int iBatches = 0;               // batches queued
+	int iChecked = 0;               // batches whose flag the host has seen
+	bool bConverged = false;
+	while (ciErr1 == CL_SUCCESS && !bConverged)
+	{
+		if (iQueued < iMaxIterations && iBatches - iChecked <= iAhead)
+		{
+			int b = iBatches % 2;
+			int iEnd = MIN(iQueued + iInterval, iMaxIterations);
+			for (; iQueued < iEnd && ciErr1 == CL_SUCCESS; iQueued++)
+			{
+				ciErr1 = enqueueIteration(iQueued, k, batch, hamerly);
+			}
+			ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevStatus.mem, CL_FALSE, 0, sizeof(cl_uint) * 2, uiStatus[b], 0, NULL, &ceStatus[b]);
+			tagEvent(K_MEANS_STAGE_READBACK, ceStatus[b]);
+			ciErr1 |= clFlush(cqCommandQueue);
+			iBatches++;
+		}
+		else if (iChecked < iBatches)
+		{
+			int b = iChecked % 2;
+			ciErr1 = clWaitForEvents(1, &ceStatus[b]);
+			clReleaseEvent(ceStatus[b]);
+			ceStatus[b] = NULL;
+			bConverged = (uiStatus[b][0] != 0);
+			iChecked++;
+		}
+		else
+		{
+			// iteration cap
+			break;
+		}
+	}
+
+	// the batch still in flight only skips, but it writes uiStatus
+	for (int b = 0; b < 2; b++)
+	{
+		if (ceStatus[b])
+		{
+			ciErr1 |= clWaitForEvents(1, &ceStatus[b]);
+			clReleaseEvent(ceStatus[b]);
+		}
+	}
+	ciErr1 |= setStatusArgs(NULL);
+	iProfileIteration = -1;
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in iteration %d, Line %u in file %s !!!\n\n", iQueued, __LINE__, __FILE__);
+		return ciErr1;
+	}
+	*iterations = (int)uiStatus[(iBatches - 1) % 2][1];
+	return CL_SUCCESS;
+}
+
+cl_int KMeansEngine::fit(const KMeansOptions& options, float* centroids, int* iterations)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doSeed(options, centroids);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doIterate(options, centroids, iterations);
+	collectProfile();
+	return ciErr1;
+}
+
+// Labels
+// *********************************************************************
+cl_int KMeansEngine::predict(int k, const float* centroids, void* labels, unsigned char* display)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doPredict(k, centroids, labels, display);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doPredict(int k, const float* centroids, void* labels, unsigned char* display)
+{
+	const int D = features.D;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansEngine::predict needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+	iBoundsK = 0;
+
+	cl_int ciErr1 = prepareKernels(labelBytes(k), assignKernel(k));
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevLabels, szLabelBytes * szGlobalWorkSize);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[0], sizeof(cl_float) * k * D);
+	if (ciErr1 == CL_SUCCESS && display && !bStreaming) ciErr1 = reserve(cmDevDisplay, sizeof(cl_uchar) * count, CL_MEM_WRITE_ONLY);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	size_t szAssignWorkSize = assignWorkSize(count);
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_FALSE, 0, sizeof(cl_float) * k * D, centroids, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clSetKernelArg(ckAssign, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAssign, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAssign, 2, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clSetKernelArg(ckAssign, 3, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAssign, 4, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAssign, 5, sizeof(cl_int), (void*)&k);
+	if (bStreaming)
+	{
+		// labels are read back chunk by chunk as they are assigned
+		ciErr1 |= streamChunks(k, (unsigned char*)labels);
+		ciErr1 |= clFinish(cqCommandQueue);
+	}
+	else
+	{
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssign, 1, NULL, &szAssignWorkSize, &szAssignLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevLabels.mem, CL_TRUE, 0, szLabelBytes * count, labels, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	}
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in kmeans_assign, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+
+	// Optional display pass: spread the raw cluster ids over 0-255
+	if (display && bStreaming)
+	{
+		// the device only holds the labels of the last chunk
+		const unsigned char* label_ptr = (const unsigned char*)labels;
+		std::vector<unsigned int> wide(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			wide[i] = (szLabelBytes == sizeof(cl_uchar)) ? label_ptr[i] :
+					  ((szLabelBytes == sizeof(cl_ushort)) ? ((const cl_ushort*)label_ptr)[i] : ((const cl_uint*)label_ptr)[i]);
+		}
+		KMeansQuantizeLabelsHost(&wide[0], display, count, k);
+	}
+	else if (display)
+	{
+		ciErr1 = clSetKernelArg(ckQuantize, 0, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+		ciErr1 |= clSetKernelArg(ckQuantize, 1, sizeof(cl_mem), (void*)&cmDevDisplay.mem);
+		ciErr1 |= clSetKernelArg(ckQuantize, 2, sizeof(cl_uint), (void*)&count);
+		ciErr1 |= clSetKernelArg(ckQuantize, 3, sizeof(cl_int), (void*)&k);
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckQuantize, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_DISPLAY));
+		ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevDisplay.mem, CL_TRUE, 0, sizeof(cl_uchar) * count, display, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in kmeans_quantize, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+			return ciErr1;
+		}
+	}
+	return CL_SUCCESS;
+}
+
+// Cluster sums of one pass
+// The partials of the accumulate step are folded into the running sums
+// used when streaming, so a resident dataset and a streamed one end up in
+// the same k * D sums, read back in one go.
+// *********************************************************************
+cl_int KMeansEngine::accumulate(int k, const float* centroids, float* sums, unsigned int* counts)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doAccumulate(k, centroids, sums, counts);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::prepare(int k)
+{
+	KMeansLock lock(pMutex);
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansEngine::prepare needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+	return prepareKernels(labelBytes(k), assignKernel(k));
+}
+
+cl_int KMeansEngine::doAccumulate(int k, const float* centroids, float* sums, unsigned int* counts)
+{
+	const int D = features.D;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	cl_uint num_groups = (cl_uint)szNumGroups;
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansEngine::accumulate needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+	iBoundsK = 0;
+
+	cl_int ciErr1 = prepareKernels(labelBytes(k), assignKernel(k));
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevLabels, szLabelBytes * szGlobalWorkSize);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[0], sizeof(cl_float) * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialSums, sizeof(cl_float) * sumPlanes() * szNumGroups * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialCounts, sizeof(cl_uint) * szNumGroups * k);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevClusterSums, sizeof(cl_float) * sumPlanes() * k * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevClusterCounts, sizeof(cl_uint) * k);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_FALSE, 0, sizeof(cl_float) * k * D, centroids, 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clSetKernelArg(ckAssign, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAssign, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAssign, 2, sizeof(cl_mem), (void*)&cmDevCentroids[0].mem);
+	ciErr1 |= clSetKernelArg(ckAssign, 3, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAssign, 4, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAssign, 5, sizeof(cl_int), (void*)&k);
+
+	ciErr1 |= clSetKernelArg(ckAccumulate, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 2, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 3, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 4, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 5, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAccumulate, 6, sizeof(cl_int), (void*)&k);
+	ciErr1 |= setBinArgs(ckAccumulate, 7, k);
+
+	ciErr1 |= clSetKernelArg(ckFold, 0, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+	ciErr1 |= clSetKernelArg(ckFold, 1, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+	ciErr1 |= clSetKernelArg(ckFold, 2, sizeof(cl_uint), (void*)&num_groups);
+	ciErr1 |= clSetKernelArg(ckFold, 3, sizeof(cl_mem), (void*)&cmDevClusterSums.mem);
+	ciErr1 |= clSetKernelArg(ckFold, 4, sizeof(cl_mem), (void*)&cmDevClusterCounts.mem);
+	ciErr1 |= clSetKernelArg(ckFold, 5, sizeof(cl_int), (void*)&k);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+
+	if (bStreaming)
+	{
+		// empties the running sums, then folds chunk after chunk into them
+		ciErr1 = streamChunks(k, NULL);
+	}
+	else
+	{
+		size_t szClusterWorkSize = shrRoundUp((int)szLocalWorkSize, k);
+		size_t szAssignWorkSize = assignWorkSize(count);
+		std::vector<cl_float> zero_sums(sumPlanes() * k * D, 0.0f);
+		std::vector<cl_uint> zero_counts(k, 0);
+		ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevClusterSums.mem, CL_FALSE, 0, sizeof(cl_float) * zero_sums.size(), &zero_sums[0], 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevClusterCounts.mem, CL_FALSE, 0, sizeof(cl_uint) * k, &zero_counts[0], 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssign, 1, NULL, &szAssignWorkSize, &szAssignLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAccumulate, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckFold, 1, NULL, &szClusterWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+	}
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevClusterSums.mem, CL_FALSE, 0, sizeof(cl_float) * k * D, sums, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	// blocking, the zero vectors above must outlive their writes
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevClusterCounts.mem, CL_TRUE, 0, sizeof(cl_uint) * k, counts, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in KMeansEngine::accumulate, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+	}
+	return ciErr1;
+}
+
+cl_int KMeansEngine::fit_predict(const KMeansOptions& options, float* centroids, void* labels, unsigned char* display)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doSeed(options, centroids);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doIterate(options, centroids, NULL);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doPredict(options.k, centroids, labels, display);
+	collectProfile();
+	return ciErr1;
+}
+
+// Batched runs
+// All centroids sit in one table, run r owning entries run_first[r] ..
+// run_first[r] + k - 1; kmeans_converge updates the whole table at once,
+// so the runs iterate in lock step until none moves.
+// *********************************************************************
+cl_int KMeansEngine::fitBatch(const KMeansOptions& options, KMeansRun* runs, int num_runs, void* best_labels, int* best_run, int* iterations)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doFitBatch(options, runs, num_runs, best_labels, best_run, iterations);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::doFitBatch(const KMeansOptions& options, KMeansRun* runs, int num_runs, void* best_labels, int* best_run, int* iterations)
+{
+	const int D = features.D;
+	cl_uint count = features.count;
+	cl_uint pitch = uiChunkSize;
+	if (!bLoaded || bStreaming || num_runs < 1)
+	{
+		shrLog("Error: KMeansEngine::fitBatch needs a resident (not streamed) dataset and at least one run\n\n");
+		return CL_INVALID_OPERATION;
+	}
+	iBoundsK = 0;
+
+	// layout of the centroid table
+	std::vector<cl_int> run_first(num_runs), run_k(num_runs);
+	cl_int k_total = 0;
+	int k_max = 0;
+	for (int r = 0; r < num_runs; r++)
+	{
+		if (runs[r].k < 1)
+		{
+			shrLog("Error: KMeansEngine::fitBatch run %d has k < 1\n\n", r);
+			return CL_INVALID_VALUE;
+		}
+		run_first[r] = k_total;
+		run_k[r] = runs[r].k;
+		k_total += runs[r].k;
+		k_max = MAX(k_max, runs[r].k);
+	}
+	cl_int runs_total = num_runs;
+	if (options.hamerly)
+	{
+		shrLog("Hamerly bounds are not used in batch mode\n");
+	}
+
+	cl_int ciErr1 = prepareKernels(labelBytes(k_max), iAssignKernel);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	// seed every run on its own, then upload the whole table
+	std::vector<float> table((size_t)k_total * D);
+	for (int r = 0; r < num_runs && ciErr1 == CL_SUCCESS; r++)
+	{
+		KMeansOptions run_options = options;
+		run_options.k = runs[r].k;
+		run_options.random_seed = runs[r].random_seed;
+		run_options.random_seed2 = runs[r].random_seed2;
+		ciErr1 = doSeed(run_options, &table[(size_t)run_first[r] * D]);
+	}
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevLabels, szLabelBytes * num_runs * count);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[0], sizeof(cl_float) * k_total * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevCentroids[1], sizeof(cl_float) * k_total * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialSums, sizeof(cl_float) * sumPlanes() * szNumGroups * k_total * D);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialCounts, sizeof(cl_uint) * szNumGroups * k_total);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevChanged, sizeof(cl_uint));
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevRunFirst, sizeof(cl_int) * num_runs);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevRunK, sizeof(cl_int) * num_runs);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = reserve(cmDevPartialInertia, sizeof(cl_float) * szNumGroups * num_runs);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+	cl_uint num_groups = (cl_uint)szNumGroups;
+
+	// Set the Argument values that do not change between iterations
+	//////////////////////////////////////////////////////////////////////////
+	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevCentroids[0].mem, CL_FALSE, 0, sizeof(cl_float) * k_total * D, &table[0], 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevRunFirst.mem, CL_FALSE, 0, sizeof(cl_int) * num_runs, &run_first[0], 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevRunK.mem, CL_FALSE, 0, sizeof(cl_int) * num_runs, &run_k[0], 0, NULL, tag(K_MEANS_STAGE_UPLOAD));
+
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 3, sizeof(cl_mem), (void*)&cmDevRunFirst.mem);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 4, sizeof(cl_mem), (void*)&cmDevRunK.mem);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 5, sizeof(cl_int), (void*)&runs_total);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 6, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAssignBatch, 7, sizeof(cl_uint), (void*)&count);
+
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 2, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 3, sizeof(cl_mem), (void*)&cmDevRunFirst.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 4, sizeof(cl_int), (void*)&runs_total);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 5, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 6, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 7, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckAccumulateBatch, 8, sizeof(cl_int), (void*)&k_total);
+	ciErr1 |= setBinArgs(ckAccumulateBatch, 9, k_total);
+
+	ciErr1 |= clSetKernelArg(ckConverge, 0, sizeof(cl_mem), (void*)&cmDevPartialSums.mem);
+	ciErr1 |= clSetKernelArg(ckConverge, 1, sizeof(cl_mem), (void*)&cmDevPartialCounts.mem);
+	ciErr1 |= clSetKernelArg(ckConverge, 2, sizeof(cl_uint), (void*)&num_groups);
+	ciErr1 |= clSetKernelArg(ckConverge, 5, sizeof(cl_mem), (void*)&cmDevChanged.mem);
+	ciErr1 |= clSetKernelArg(ckConverge, 6, sizeof(cl_int), (void*)&k_total);
+	//////////////////////////////////////////////////////////////////////////
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+
+	// Iterate all runs until no centroid of any run moves
+	int iIteration = 0;
+	ciErr1 = runIterations(options, k_total, true, false, &iIteration);
+	profileData.k = k_total;
+	profileData.iterations.assign(iIteration, KMeansIterationProfile());
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+	int iCurrent = iIteration % 2;
+	shrLog("%d runs converged after %d iterations\n", num_runs, iIteration);
+	if (iterations)
+	{
+		*iterations = iIteration;
+	}
+
+	// Labels and inertia of every run against its final centroids
+	std::vector<cl_float> partial_inertia(szNumGroups * num_runs);
+	ciErr1 = clSetKernelArg(ckAssignBatch, 2, sizeof(cl_mem), (void*)&cmDevCentroids[iCurrent].mem);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 0, sizeof(cl_mem), (void*)&cmDevFeatures);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 1, sizeof(cl_uint), (void*)&pitch);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 2, sizeof(cl_mem), (void*)&cmDevCentroids[iCurrent].mem);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 3, sizeof(cl_mem), (void*)&cmDevRunFirst.mem);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 4, sizeof(cl_int), (void*)&runs_total);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 5, sizeof(cl_mem), (void*)&cmDevLabels.mem);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 6, sizeof(cl_mem), (void*)&cmDevPartialInertia.mem);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 7, sizeof(cl_uint), (void*)&count);
+	ciErr1 |= clSetKernelArg(ckInertiaBatch, 8, sizeof(cl_float) * szLocalWorkSize, NULL);
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssignBatch, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_ASSIGN));
+	ciErr1 |= clEnqueueNDRangeKernel(cqCommandQueue, ckInertiaBatch, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_STATS));
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevPartialInertia.mem, CL_FALSE, 0, sizeof(cl_float) * szNumGroups * num_runs, &partial_inertia[0], 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevCentroids[iCurrent].mem, CL_TRUE, 0, sizeof(cl_float) * k_total * D, &table[0], 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in kmeans_inertia_batch, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+
+	// keep only the labels of the best run
+	int best = 0;
+	for (int r = 0; r < num_runs; r++)
+	{
+		runs[r].inertia = 0.0;
+		for (size_t g = 0; g < szNumGroups; g++)
+		{
+			runs[r].inertia += partial_inertia[g * num_runs + r];
+		}
+		if (runs[r].centroids)
+		{
+			memcpy(runs[r].centroids, &table[(size_t)run_first[r] * D], sizeof(float) * runs[r].k * D);
+		}
+		if (runs[r].inertia < runs[best].inertia)
+		{
+			best = r;
+		}
+	}
+	if (best_run)
+	{
+		*best_run = best;
+	}
+	if (best_labels)
+	{
+		ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevLabels.mem, CL_TRUE, szLabelBytes * best * count, szLabelBytes * count, best_labels, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	}
+	return ciErr1;
+}
+
+// Same on new data
+// *********************************************************************
+cl_int KMeansEngine::fit(const KMeansFeatures& host_features, const KMeansOptions& options, float* centroids, int* iterations)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doLoad(host_features);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doSeed(options, centroids);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doIterate(options, centroids, iterations);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::predict(const KMeansFeatures& host_features, int k, const float* centroids, void* labels, unsigned char* display)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doLoad(host_features);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doPredict(k, centroids, labels, display);
+	collectProfile();
+	return ciErr1;
+}
+
+cl_int KMeansEngine::fit_predict(const KMeansFeatures& host_features, const KMeansOptions& options, float* centroids, void* labels, unsigned char* display)
+{
+	KMeansLock lock(pMutex);
+	cl_int ciErr1 = doLoad(host_features);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doSeed(options, centroids);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doIterate(options, centroids, NULL);
+	if (ciErr1 == CL_SUCCESS) ciErr1 = doPredict(options.k, centroids, labels, display);
+	collectProfile();
+	return ciErr1;
+}
+
+// One streaming pass over the input on the device
+// Chunk j is uploaded into cmDevFeatureChunks[j % 2] on the transfer queue
+// while the compute queue still works on chunk j - 1; the upload waits for
+// the kernels of chunk j - 2, the previous user of that buffer. Without
+// label_out every chunk is assigned, accumulated and folded into the running
+// cluster sums; with it, chunks are only assigned and their labels read back.
+// *********************************************************************
+cl_int KMeansEngine::streamChunks(int k, unsigned char* label_out)
+{
+	const int D = features.D;
+	size_t szClusterWorkSize = shrRoundUp((int)szLocalWorkSize, k);
+	cl_event evUpload[2] = { NULL, NULL };
+	cl_event evDone[2] = { NULL, NULL };
+	cl_int ciErr = CL_SUCCESS;
+
+	// empty the running sums
+	if (!label_out)
+	{
+		float* zero_sums = (float*)calloc(sumPlanes() * k * D, sizeof(float));
+		cl_uint* zero_counts = (cl_uint*)calloc(k, sizeof(cl_uint));
+		ciErr |= clEnqueueWriteBuffer(cqCommandQueue, cmDevClusterSums.mem, CL_TRUE, 0, sizeof(cl_float) * sumPlanes() * k * D, zero_sums, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		ciErr |= clEnqueueWriteBuffer(cqCommandQueue, cmDevClusterCounts.mem, CL_TRUE, 0, sizeof(cl_uint) * k, zero_counts, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		free(zero_sums);
+		free(zero_counts);
+	}
+
+	cl_uint j = 0;
+	for (cl_uint first = 0; first < features.count && ciErr == CL_SUCCESS; first += uiChunkSize, j++)
+	{
+		int b = j % 2;
+		cl_uint num = MIN(uiChunkSize, features.count - first);
+		size_t szChunkWorkSize = assignWorkSize(num);
+		cl_uint uiWait = evDone[b] ? 1 : 0;
+		cl_event* pWait = evDone[b] ? &evDone[b] : NULL;
+
+		// asynchronous upload, planes land pitch = uiChunkSize values apart
+		if (storedRows)
+		{
+			ciErr |= clEnqueueWriteBuffer(cqTransferQueue, cmDevFeatureChunks[b].mem, CL_FALSE, 0, szFeatureBytes * num * D,
+										  storedRows + szFeatureBytes * first * D, uiWait, pWait, &evUpload[b]);
+		}
+		else
+		{
+			for (int d = 0; d < D; d++)
+			{
+				ciErr |= clEnqueueWriteBuffer(cqTransferQueue, cmDevFeatureChunks[b].mem, CL_FALSE, szFeatureBytes * d * uiChunkSize, szFeatureBytes * num,
+											  storedPlanes[d] + szFeatureBytes * first, (d == 0) ? uiWait : 0, (d == 0) ? pWait : NULL, (d == D - 1) ? &evUpload[b] : tag(K_MEANS_STAGE_UPLOAD));
+			}
+		}
+		tagEvent(K_MEANS_STAGE_UPLOAD, evUpload[b]);
+		ciErr |= clFlush(cqTransferQueue);
+		if (evDone[b])
+		{
+			clReleaseEvent(evDone[b]);
+			evDone[b] = NULL;
+		}
+		if (ciErr != CL_SUCCESS)
+		{
+			break;
+		}
+
+		ciErr |= clSetKernelArg(ckAssign, 0, sizeof(cl_mem), (void*)&cmDevFeatureChunks[b].mem);
+		ciErr |= clSetKernelArg(ckAssign, 4, sizeof(cl_uint), (void*)&num);
+		if (label_out)
+		{
+			ciErr |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssign, 1, NULL, &szChunkWorkSize, &szAssignLocalWorkSize, 1, &evUpload[b], &evDone[b]);
+			tagEvent(K_MEANS_STAGE_ASSIGN, evDone[b]);
+			ciErr |= clEnqueueReadBuffer(cqCommandQueue, cmDevLabels.mem, CL_FALSE, 0, szLabelBytes * num, label_out + szLabelBytes * first, 0, NULL, tag(K_MEANS_STAGE_READBACK));
+		}
+		else
+		{
+			ciErr |= clSetKernelArg(ckAccumulate, 0, sizeof(cl_mem), (void*)&cmDevFeatureChunks[b].mem);
+			ciErr |= clSetKernelArg(ckAccumulate, 5, sizeof(cl_uint), (void*)&num);
+			ciErr |= clEnqueueNDRangeKernel(cqCommandQueue, ckAssign, 1, NULL, &szChunkWorkSize, &szAssignLocalWorkSize, 1, &evUpload[b], tag(K_MEANS_STAGE_ASSIGN));
+			ciErr |= clEnqueueNDRangeKernel(cqCommandQueue, ckAccumulate, 1, NULL, &szAccumulateWorkSize, &szLocalWorkSize, 0, NULL, &evDone[b]);
+			tagEvent(K_MEANS_STAGE_UPDATE, evDone[b]);
+			ciErr |= clEnqueueNDRangeKernel(cqCommandQueue, ckFold, 1, NULL, &szClusterWorkSize, &szLocalWorkSize, 0, NULL, tag(K_MEANS_STAGE_UPDATE));
+		}
+		ciErr |= clFlush(cqCommandQueue);
+		clReleaseEvent(evUpload[b]);
+		evUpload[b] = NULL;
+	}
+
+	for (int b = 0; b < 2; b++)
+	{
+		if (evDone[b])clReleaseEvent(evDone[b]);
+	}
+	return ciErr;
+}
+
+// Profiling
+// Every enqueue passes tag(stage) as its event: NULL unless profiling,
+// otherwise a slot in profileCommands, filled by the enqueue itself.
+// collectProfile waits for the queues and adds the command times to the
+// profile; the public calls run it before they return.
+// *********************************************************************
+cl_event* KMeansEngine::tag(int stage)
+{
+	if (!config.profiling)
+	{
+		return NULL;
+	}
+	ProfileCommand command = { stage, iProfileIteration, NULL };
+	profileCommands.push_back(command);
+	return &profileCommands.back().event;
+}
+
+// Profile a command whose event the engine also uses itself
+void KMeansEngine::tagEvent(int stage, cl_event event)
+{
+	if (!config.profiling || event == NULL)
+	{
+		return;
+	}
+	clRetainEvent(event);
+	ProfileCommand command = { stage, iProfileIteration, event };
+	profileCommands.push_back(command);
+}
+
+void KMeansEngine::collectProfile()
+{
+	if (profileCommands.empty())
+	{
+		return;
+	}
+	if(cqTransferQueue)clFinish(cqTransferQueue);
+	if(cqCommandQueue)clFinish(cqCommandQueue);
+	for (size_t c = 0; c < profileCommands.size(); c++)
+	{
+		const ProfileCommand& command = profileCommands[c];
+		cl_ulong ulStart = 0, ulEnd = 0;
+		if (command.event &&
+			clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &ulStart, NULL) == CL_SUCCESS &&
+			clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &ulEnd, NULL) == CL_SUCCESS)
+		{
+			double ms = (ulEnd - ulStart) * 1.0e-6;
+			profileData.stage_ms[command.stage] += ms;
+			profileData.commands++;
+
+			// iterations queued past convergence only count in the stage totals
+			if (command.iteration >= 0 && command.iteration < (int)profileData.iterations.size())
+			{
+				KMeansIterationProfile& iteration = profileData.iterations[command.iteration];
+				if (command.stage == K_MEANS_STAGE_ASSIGN) iteration.assign_ms += ms;
+				else if (command.stage == K_MEANS_STAGE_UPDATE) iteration.update_ms += ms;
+			}
+		}
+		if(command.event)clReleaseEvent(command.event);
+	}
+	profileCommands.clear();
+}
+
+void KMeansEngine::resetProfile()
+{
+	KMeansLock lock(pMutex);
+	collectProfile();
+	profileData = KMeansProfile();
+}
+
+// Inertia and moved points of the first n iterations, from the rows
+// kmeans_iteration_stats wrote
+cl_int KMeansEngine::readIterationStats(int n)
+{
+	if (n < 1)
+	{
+		return CL_SUCCESS;
+	}
+	std::vector<cl_float> partial_inertia(szNumGroups * n);
+	std::vector<cl_uint> moved(n);
+	cl_int ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevPartialInertia.mem, CL_FALSE, 0, sizeof(cl_float) * szNumGroups * n, &partial_inertia[0], 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	ciErr1 |= clEnqueueReadBuffer(cqCommandQueue, cmDevMoved.mem, CL_TRUE, 0, sizeof(cl_uint) * n, &moved[0], 0, NULL, tag(K_MEANS_STAGE_READBACK));
+	if (ciErr1 != CL_SUCCESS)
+	{
+		shrLog("Error in kmeans_iteration_stats, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		return ciErr1;
+	}
+	for (int it = 0; it < n; it++)
+	{
+		double inertia = 0.0;
+		for (size_t g = 0; g < szNumGroups; g++)
+		{
+			inertia += partial_inertia[it * szNumGroups + g];
+		}
+		profileData.iterations[it].inertia = inertia;
+		profileData.iterations[it].moved = moved[it];
+	}
+	return CL_SUCCESS;
+}
+
+// JSON report of the profile
+bool KMeansEngine::writeProfile(const char* path) const
+{
+	FILE* pFile = fopen(path, "w");
+	if (pFile == NULL)
+	{
+		return false;
+	}
+
+	// device names are plain text, keep the report valid anyway
+	char cDeviceName[256] = "";
+	if(cdDevice)clGetDeviceInfo(cdDevice, CL_DEVICE_NAME, sizeof(cDeviceName) - 1, cDeviceName, NULL);
+	for (char* c = cDeviceName; *c; c++)
+	{
+		if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) *c = ' ';
+	}
+
+	fprintf(pFile, "{\n");
+	fprintf(pFile, "  \"device\": \"%s\",\n", cDeviceName);
+	fprintf(pFile, "  \"points\": %u,\n", features.count);
+	fprintf(pFile, "  \"dimensions\": %d,\n", features.D);
+	fprintf(pFile, "  \"k\": %d,\n", profileData.k);
+	fprintf(pFile, "  \"layout\": \"%s\",\n", bInterleaved ? "interleaved" : "planar");
+	static const char* assignNames[] = { "staged", "constant", "tiled" };
+	fprintf(pFile, "  \"assign\": \"%s\",\n", assignNames[iAssignKernel]);
+	fprintf(pFile, "  \"streaming\": %s,\n", bStreaming ? "true" : "false");
+	fprintf(pFile, "  \"compensated\": %s,\n", config.compensated ? "true" : "false");
+	fprintf(pFile, "  \"zero_copy\": %s,\n", bZeroCopy ? "true" : "false");
+	fprintf(pFile, "  \"local_size\": %u,\n", (unsigned int)szLocalWorkSize);
+	fprintf(pFile, "  \"groups\": %u,\n", (unsigned int)szNumGroups);
+	fprintf(pFile, "  \"commands\": %u,\n", profileData.commands);
+	fprintf(pFile, "  \"stages_ms\": {");
+	for (int s = 0; s < K_MEANS_STAGES; s++)
+	{
+		fprintf(pFile, "%s\n    \"%s\": %.6f", s ? "," : "", KMeansStageName(s), profileData.stage_ms[s]);
+	}
+	fprintf(pFile, "\n  },\n");
+	fprintf(pFile, "  \"iterations\": [");
+	for (size_t it = 0; it < profileData.iterations.size(); it++)
+	{
+		const KMeansIterationProfile& iteration = profileData.iterations[it];
+		fprintf(pFile, "%s\n    { \"iteration\": %u, \"assign_ms\": %.6f, \"update_ms\": %.6f, ", it ? "," : "",
+				(unsigned int)it, iteration.assign_ms, iteration.update_ms);
+		if (iteration.moved >= 0)
+			fprintf(pFile, "\"moved\": %lld, ", iteration.moved);
+		else
+			fprintf(pFile, "\"moved\": null, ");
+		if (iteration.inertia >= 0)
+			fprintf(pFile, "\"inertia\": %.9g }", iteration.inertia);
+		else
+			fprintf(pFile, "\"inertia\": null }");
+	}
+	fprintf(pFile, "%s]\n", profileData.iterations.empty() ? "" : "\n  ");
+	fprintf(pFile, "}\n");
+
+	bool bWritten = !ferror(pFile);
+	fclose(pFile);
+	return bWritten;
+}
@@ -0,0 +1,434 @@
+#ifndef __K_MEANS_ENGINE_H__
+#define __K_MEANS_ENGINE_H__
+
+// common SDK header for standard utilities and system libs
+#include <oclUtils.h>
+
+#include <string>
+#include <vector>
+
+#include "k_means_cpu.h"
+
+// Device k-means engine
+// *********************************************************************
+// Owns an OpenCL context and queues on one device, the kernels of the
+// specialization it last ran (programs come from the program cache, so
+// switching back and forth does not compile again) and a pool of device
+// buffers that only grows. Clustering many datasets in one process pays
+// the platform, context and compile setup once.
+//
+//   engine.init(device, source_path)
+//   engine.load(features)                load or derive a dataset
+//   engine.fit(options, centroids)       seeding and Lloyd iterations
+//   engine.predict(k, centroids, labels) nearest centroid of every point
+//   engine.iterateWarm(options, warm, centroids)  next frame of a time series
+//
+// All calls return an OpenCL error code and never exit. The host features
+// of a loaded dataset must stay valid until the next load: streaming reads
+// them on every pass and zero-copy buffers wrap them. Calls from several
+// threads are serialized on the engine; use one engine per thread to run
+// them concurrently.
+// *********************************************************************
+
+// From this dimension on the features are interleaved per point by default:
+// a work item then reads one contiguous row, while for small D the planes
+// give coalesced loads across the work group
+#define K_MEANS_AOS_MIN_D 8
+
+// From this D * k on the assignment step runs as a tiled matrix product
+// (kmeans_assign_tiled) by default: the centroids are then too many to
+// stream from global memory for every point
+#define K_MEANS_TILED_MIN_DK 2048
+
+// Largest work-group size: the local memory trees of the kernels are
+// unrolled from 512 down, and their work groups must be powers of 2
+#define K_MEANS_MAX_LOCAL_SIZE 512
+
+// Default # of points per chunk when streaming
+#define K_MEANS_DEFAULT_CHUNK (1 << 20)
+
+// Default # of iterations queued between two reads of the convergence flag
+#define K_MEANS_CHECK_INTERVAL 8
+
+// Device layout of the feature table
+enum KMeansLayout
+{
+	K_MEANS_LAYOUT_AUTO,            // interleaved from K_MEANS_AOS_MIN_D features on
+	K_MEANS_LAYOUT_PLANAR,          // one plane per feature (SoA)
+	K_MEANS_LAYOUT_INTERLEAVED      // D values per point (AoS)
+};
+
+// Kernel of the assignment step
+enum KMeansAssign
+{
+	K_MEANS_ASSIGN_AUTO,            // tiled from K_MEANS_TILED_MIN_DK on
+	K_MEANS_ASSIGN_DIRECT,          // one point per work item, centroids in constant or local memory (kmeans_assign_constant, kmeans_assign)
+	K_MEANS_ASSIGN_TILED            // dot products as a tiled matrix product with a fused argmin (kmeans_assign_tiled)
+};
+
+// Launch configuration, fixed for the lifetime of an engine
+// *********************************************************************
+struct KMeansEngineConfig
+{
+	size_t local_size;              // work-group size, rounded down to a power of 2 up to K_MEANS_MAX_LOCAL_SIZE and the device limit, halved until the accumulate step fits in local memory
+	int max_groups;                 // maximum # of work groups of the accumulate step
+	int layout;                     // KMeansLayout
+	bool streaming;                 // stream every dataset in chunks, not only the ones larger than one allocation
+	unsigned int chunk_size;        // points per chunk when streaming (0 = K_MEANS_DEFAULT_CHUNK)
+	bool profiling;                 // time every command on the device (CL_QUEUE_PROFILING_ENABLE), see KMeansProfile
+	int feature_type;               // KMeansFeatureType of the device feature table, float values are narrowed on load
+	int assign;                     // KMeansAssign, the Hamerly and batch steps always use their own kernels
+	bool compensated;               // Neumaier-compensated centroid sums (COMPENSATED), twice the local memory of the accumulate step
+
+	KMeansEngineConfig();
+};
+
+// Parameters of one clustering
+// *********************************************************************
+struct KMeansOptions
+{
+	int k;                          // # of clusters
+	int max_iterations;             // iteration cap (<= 0 = K_MEANS_MAX_ITERATIONS)
+	unsigned int random_seed;       // seeding generator state
+	unsigned int random_seed2;
+	bool parallel_seeding;          // seed with k-means|| instead of k-means++
+	int seed_rounds;                // k-means|| rounds
+	float oversampling;             // k-means|| expected candidates per round (<= 0 = 2k)
+	bool hamerly;                   // skip the distances that cannot change a label (not when streaming)
+	int num_threads;                // host threads for the host-side steps (0 = one per core)
+	int check_interval;             // iterations queued per read of the convergence flag (<= 0 = K_MEANS_CHECK_INTERVAL, 1 when streaming)
+
+	KMeansOptions();
+};
+
+// One run of a batch (see KMeansEngine::fitBatch)
+// *********************************************************************
+struct KMeansRun
+{
+	int k;                          // # of clusters
+	unsigned int random_seed;       // seeding generator state
+	unsigned int random_seed2;
+	float* centroids;               // out: k * D final centroids (may be NULL)
+	double inertia;                 // out: sum of the squared distances of the points to their centroids
+
+	KMeansRun();
+};
+
+// Warm start of the next frame of a time series (see KMeansEngine::iterateWarm)
+// *********************************************************************
+struct KMeansWarmStart
+{
+	const void* labels;             // labels of the previous frame against the starting centroids (NULL = those the last iterateWarm() left on the device)
+	const float* upper;             // with labels: their Hamerly bounds (readBounds), or NULL to start from the
+	const float* lower;             // distance to the labelled centroid only
+	const float* moved;             // distance every point moved since the previous frame (KMeansFeatureMovesHost), NULL if none did
+	float threshold;                // points that moved at most this far keep their labels and bounds as they are (0 = exact)
+
+	KMeansWarmStart();
+};
+
+// Device time of the profiled commands, by stage
+// *********************************************************************
+enum KMeansStage
+{
+	K_MEANS_STAGE_UPLOAD,           // features and chunks to the device
+	K_MEANS_STAGE_FEATURES,         // derived volume features
+	K_MEANS_STAGE_SEED,             // k-means++ or k-means|| seeding
+	K_MEANS_STAGE_ASSIGN,           // assignment steps
+	K_MEANS_STAGE_UPDATE,           // accumulate, converge, bounds and convergence flag
+	K_MEANS_STAGE_STATS,            // inertia and moved points
+	K_MEANS_STAGE_DISPLAY,          // labels spread over 0-255
+	K_MEANS_STAGE_READBACK,         // results and convergence flags to the host
+	K_MEANS_STAGES
+};
+
+// Name of a stage in logs and reports
+const char* KMeansStageName(int stage);
+
+// One iteration of the last iterate(), fit() or fitBatch()
+struct KMeansIterationProfile
+{
+	double assign_ms;               // assignment step
+	double update_ms;               // accumulate, converge, bounds and flag
+	double inertia;                 // sum of the squared distances to the centroids the points were assigned to (< 0 = not measured)
+	long long moved;                // # of points whose label changed (< 0 = not measured)
+
+	KMeansIterationProfile();
+};
+
+// Profile of an engine since init() or resetProfile()
+struct KMeansProfile
+{
+	double stage_ms[K_MEANS_STAGES];        // device time of every stage
+	unsigned int commands;          // # of commands timed
+	int k;                          // # of clusters of the last iteration loop (table size in batch mode)
+	std::vector<KMeansIterationProfile> iterations;
+
+	KMeansProfile();
+};
+
+// Engine
+// *********************************************************************
+class KMeansEngine
+{
+public:
+	KMeansEngine();
+	~KMeansEngine();
+
+	// Create the context and queues on a device; source_path is the full
+	// path of k_means_kernel.cc
+	cl_int init(cl_device_id device, const char* source_path, const KMeansEngineConfig& config = KMeansEngineConfig());
+
+	// Make a dataset current: upload it, wrap it in place on CPU and unified
+	// memory devices, or prepare to stream it
+	cl_int load(const KMeansFeatures& features);
+
+	// Make the default 3 features of a scalar volume of dims[0] * dims[1] *
+	// dims[2] values current, derived on the device (on the host when streaming
+	// or storing them as integers)
+	cl_int loadVolume(const float* scalar_value, const int dims[3], int num_threads = 0);
+
+	// Initial centroids of the current dataset, k * D values
+	cl_int seed(const KMeansOptions& options, float* centroids);
+
+	// Lloyd iterations from centroids (updated in place). The device keeps
+	// the convergence flag; the host only reads it every check_interval
+	// iterations, and the iterations queued past convergence do no work.
+	cl_int iterate(const KMeansOptions& options, float* centroids, int* iterations = NULL);
+
+	// seed() then iterate()
+	cl_int fit(const KMeansOptions& options, float* centroids, int* iterations = NULL);
+
+	// iterate() for the next frame of a time series: from the centroids of
+	// the previous frame, with its labels and Hamerly bounds, so that the
+	// first assignment only rescans the points that moved (options.hamerly
+	// is implied). Leaves labels and bounds against the returned centroids
+	// on the device for the next frame, readBounds() copies them out.
+	// Streamed datasets keep no bounds and only start from the centroids.
+	cl_int iterateWarm(const KMeansOptions& options, const KMeansWarmStart& warm, float* centroids, int* iterations = NULL);
+	cl_int readBounds(int k, void* labels, float* upper, float* lower);
+
+	// Raw cluster ids of labelBytes(k) bytes each, and optionally the ids
+	// spread over 0-255 for display
+	cl_int predict(int k, const float* centroids, void* labels, unsigned char* display = NULL);
+
+	// One assignment and accumulation pass against centroids: the sum of the
+	// points of every cluster (k * D values) and their # (k values), read
+	// back to the host. The building block of data-parallel clustering over
+	// several engines (k_means_multi.h), which adds up the sums of all of them.
+	cl_int accumulate(int k, const float* centroids, float* sums, unsigned int* counts);
+
+	// Build the kernels that predict() and accumulate() use for k ahead of
+	// them, so that engines driven from several host threads never build
+	// programs concurrently
+	cl_int prepare(int k);
+
+	// fit() then predict() with the final centroids
+	cl_int fit_predict(const KMeansOptions& options, float* centroids, void* labels, unsigned char* display = NULL);
+
+	// Cluster several runs (restarts, values of k) of the current dataset
+	// at once: each is seeded as options say with its own k and seeds, then
+	// all of them iterate together, every pass reading the features once,
+	// until no centroid of any run moves. Writes the inertia of every run and
+	// the labels of the run with the lowest one, labelBytes(largest k) bytes
+	// each. Inertia falls with k, so across k values the largest usually wins;
+	// compare restarts of the same k, or read the inertias for an elbow curve.
+	// Not available when streaming.
+	cl_int fitBatch(const KMeansOptions& options, KMeansRun* runs, int num_runs, void* best_labels, int* best_run, int* iterations = NULL);
+
+	// Same on new data, loaded first
+	cl_int fit(const KMeansFeatures& features, const KMeansOptions& options, float* centroids, int* iterations = NULL);
+	cl_int predict(const KMeansFeatures& features, int k, const float* centroids, void* labels, unsigned char* display = NULL);
+	cl_int fit_predict(const KMeansFeatures& features, const KMeansOptions& options, float* centroids, void* labels, unsigned char* display = NULL);
+
+	// Byte size of a label, the narrowest of 1, 2, 4 that holds k - 1
+	static size_t labelBytes(int k);
+
+	// State of the current dataset
+	bool interleaved() const { return bInterleaved; }
+	bool streaming() const { return bStreaming; }
+	bool zeroCopy() const { return bZeroCopy; }
+	cl_uint chunkSize() const { return uiChunkSize; }
+	size_t localWorkSize() const { return szLocalWorkSize; }
+	int featureType() const { return config.feature_type; }
+	const float* featureScale() const { return featureScales.empty() ? NULL : &featureScales[0]; }
+	const float* featureOffset() const { return featureOffsets.empty() ? NULL : &featureOffsets[0]; }
+
+	// Profiling (KMeansEngineConfig::profiling): per stage device times and
+	// the iterations of the last clustering; writeProfile stores them with
+	// the device and dataset as a JSON report, false if the file cannot be written
+	const KMeansProfile& profile() const { return profileData; }
+	void resetProfile();
+	bool writeProfile(const char* path) const;
+
+private:
+	// device buffer that is only reallocated to grow
+	struct Buffer
+	{
+		cl_mem mem;
+		size_t bytes;
+		Buffer() : mem(NULL), bytes(0) {}
+	};
+
+	// profiled command: stage, iteration (-1 outside the loop) and event
+	struct ProfileCommand
+	{
+		int stage;
+		int iteration;
+		cl_event event;
+	};
+
+	// kernel of the assignment step (ckAssign)
+	enum AssignKernel
+	{
+		ASSIGN_STAGED,              // kmeans_assign, centroids staged in local memory tile by tile
+		ASSIGN_CONSTANT,            // kmeans_assign_constant, centroids in a constant buffer
+		ASSIGN_TILED                // kmeans_assign_tiled, matrix product with a fused argmin
+	};
+
+	// not copyable, the engine owns its OpenCL objects
+	KMeansEngine(const KMeansEngine&);
+	KMeansEngine& operator=(const KMeansEngine&);
+
+	void release();
+	void releaseKernels();
+	cl_int reserve(Buffer& buffer, size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE);
+	void configure(unsigned int count, int D);
+	cl_int prepareKernels(size_t label_bytes, int assign_kernel);
+	int assignKernel(int k) const;
+	size_t assignWorkSize(cl_uint count) const;
+	int sumPlanes() const;
+	void binLocalSizes(int bins, cl_uint columns, size_t sizes[3]) const;
+	cl_uint binColumns(int bins) const;
+	cl_int setBinArgs(cl_kernel kernel, cl_uint first_arg, int bins);
+	bool identityScale() const;
+	cl_int uploadFeatures();
+	cl_int readPoint(unsigned int i, float* point);
+	cl_int doLoad(const KMeansFeatures& features);
+	cl_int doLoadVolume(const float* scalar_value, const int dims[3], int num_threads);
+	cl_int doSeed(const KMeansOptions& options, float* centroids);
+	cl_int doIterate(const KMeansOptions& options, float* centroids, int* iterations, const KMeansWarmStart* warm = NULL);
+	cl_int warmStart(int k, const KMeansWarmStart& warm, bool kept);
+	cl_int doPredict(int k, const float* centroids, void* labels, unsigned char* display);
+	cl_int doAccumulate(int k, const float* centroids, float* sums, unsigned int* counts);
+	cl_int doFitBatch(const KMeansOptions& options, KMeansRun* runs, int num_runs, void* best_labels, int* best_run, int* iterations);
+	cl_int seedPlusPlus(const KMeansOptions& options);
+	cl_int seedParallel(const KMeansOptions& options);
+	cl_int streamChunks(int k, unsigned char* label_out);
+	cl_int setStatusArgs(cl_mem status);
+	cl_int enqueueIteration(int iteration, int k, bool batch, bool hamerly);
+	cl_int runIterations(const KMeansOptions& options, int k, bool batch, bool hamerly, int* iterations);
+	cl_event* tag(int stage);
+	void tagEvent(int stage, cl_event event);
+	void collectProfile();
+	cl_int readIterationStats(int iterations);
+
+	// OpenCL objects
+	cl_device_id cdDevice;          // OpenCL device
+	cl_context cxGPUContext;        // OpenCL context
+	cl_command_queue cqCommandQueue;// OpenCL command queue
+	cl_command_queue cqTransferQueue;// OpenCL command queue for the chunk uploads when streaming
+	std::string sSourcePath;        // full path of the kernel source
+	KMeansEngineConfig config;      // launch configuration
+	void* pMutex;                   // serializes the public calls
+
+	// profiling
+	KMeansProfile profileData;      // what the collected commands add up to
+	std::vector<ProfileCommand> profileCommands;    // enqueued, not collected yet
+	int iProfileIteration;          // iteration the next commands belong to (-1 outside the loop)
+	bool bIterationStats;           // the current iteration loop runs kmeans_iteration_stats
+	bool bWarmBounds;               // the first assignment of the current loop starts from existing bounds
+
+	// device limits
+	cl_ulong ulMaxAllocSize;        // largest single allocation
+	cl_ulong ulLocalMemSize;        // local memory per work group
+	cl_ulong ulMaxConstantSize;     // largest constant buffer
+	bool bHostMemory;               // CPU or unified memory device, buffers can wrap host memory
+	size_t szTile[3];               // work group of the feature extraction stencil
+	size_t szAssignTile;            // edge of the kmeans_assign_tiled work group
+
+	// kernels of the current specialization
+	std::string sPreamble;          // #defines they were built with
+	cl_kernel ckAssign;             // assignment step, kmeans_assign or kmeans_assign_tiled
+	cl_kernel ckAccumulate;         // per work-group cluster sums
+	cl_kernel ckConverge;           // centroid update and convergence count
+	cl_kernel ckCheck;              // convergence flag
+	cl_kernel ckFold;               // streaming: add the partials of a chunk to the running sums
+	cl_kernel ckAssignBounded;      // assignment step skipping points with Hamerly bounds
+	cl_kernel ckCentroidBounds;     // Hamerly bounds: centroid drifts and half distances to the nearest centroid
+	cl_kernel ckWarmBounds;         // warm start: bounds of the previous frame loosened by the moves of the points
+	cl_kernel ckQuantize;           // display pass spreading the labels over 0-255
+	cl_kernel ckVolumeFeatures;     // gradient and second derivative features from the scalar volume
+	cl_kernel ckSeedDistance;       // seeding: distance to the nearest centroid
+	cl_kernel ckScanReduce;         // seeding: per work group distance totals
+	cl_kernel ckScan;               // seeding: cumulative distance distribution
+	cl_kernel ckSeedSample;         // seeding: k-means++ draw
+	cl_kernel ckParallelSelect;     // seeding: k-means|| oversampling round
+	cl_kernel ckParallelDistance;   // seeding: k-means|| distance update
+	cl_kernel ckParallelWeights;    // seeding: k-means|| candidate weights
+	cl_kernel ckAssignBatch;        // batch: assignment step of all runs
+	cl_kernel ckAccumulateBatch;    // batch: per work-group sums of the centroids of all runs
+	cl_kernel ckInertiaBatch;       // batch: per work-group inertia of every run
+	cl_kernel ckIterationStats;     // profiling: per-iteration inertia and moved points
+
+	// current dataset
+	bool bLoaded;                   // a dataset is current
+	KMeansFeatures features;        // host view of it
+	std::vector<const float*> planes;       // its planes, if planar on the host
+	std::vector<float> derivedPlanes;       // host derived features when streaming a volume
+	const float* featureRows;       // D values per point on the host, if interleaved
+	std::vector<unsigned char> storedTable; // host copy of the table as stored on the device, when packed or narrowed
+	std::vector<const unsigned char*> storedPlanes; // planes of the table as stored on the device, if planar
+	const unsigned char* storedRows;        // rows of the table as stored on the device, if interleaved
+	std::vector<float> featureScales;       // scale of the stored values of every feature
+	std::vector<float> featureOffsets;      // offset of the stored values of every feature
+	size_t szFeatureBytes;          // bytes of a stored value
+	bool bInterleaved;              // device table interleaved per point (FEATURE_AOS)
+	bool bStreaming;                // streamed in chunks of uiChunkSize points
+	bool bZeroCopy;                 // device table wraps the host memory (CL_MEM_USE_HOST_PTR)
+	cl_uint uiChunkSize;            // points resident on the device at a time (all of them when not streaming)
+	size_t szLocalWorkSize;         // # of work items in the work group
+	size_t szGlobalWorkSize;        // # of work items of the per-point kernels
+	size_t szNumGroups;             // # of work groups of the accumulate step, i.e. # of partial sums per cluster
+	size_t szAccumulateWorkSize;    // # of work items of the accumulate step
+	size_t szCentroidTile;          // # of centroids kmeans_assign stages in local memory at a time
+	size_t szLabelBytes;            // label size of the current specialization
+	int iAssignKernel;              // AssignKernel of ckAssign
+	size_t szAssignLocalWorkSize;   // # of work items in the work group of ckAssign
+
+	// device buffers
+	cl_mem cmDevFeatures;           // current feature table, cmDevFeatureTable or cmDevHostFeatures
+	cl_mem cmDevHostFeatures;       // feature table wrapping the host memory
+	Buffer cmDevFeatureTable;       // feature table, D values of FEATURE_T per point (see FEATURE_AOS)
+	Buffer cmDevScalar;             // scalar volume the feature table is derived from
+	Buffer cmDevFeatureChunks[2];   // feature tables of two chunks when streaming, uploaded alternately
+	Buffer cmDevClusterSums;        // running cluster sums over the chunks (and of accumulate())
+	Buffer cmDevClusterCounts;      // running cluster counts over the chunks (and of accumulate())
+	Buffer cmDevUpper;              // Hamerly upper bound of every point
+	Buffer cmDevLower;              // Hamerly lower bound of every point
+	Buffer cmDevDrift;              // distance every centroid moved in the last update
+	Buffer cmDevHalfMin;            // half distance of every centroid to its nearest other centroid
+	Buffer cmDevPointMoves;         // warm start: distance every point moved since the previous frame
+	int iBoundsK;                   // k of the labels and bounds iterateWarm() left on the device (0 = none)
+	cl_uint uiBoundsCount;          // # of points they cover
+	Buffer cmDevLabels;             // raw cluster ids of LABEL_T
+	Buffer cmDevDisplay;            // labels spread over 0-255 for display
+	Buffer cmDevCentroids[2];       // centroid buffers, ping-ponged between iterations
+	Buffer cmDevPartialSums;        // per work-group cluster sums
+	Buffer cmDevPartialCounts;      // per work-group cluster counts
+	Buffer cmDevChanged;            // count of centroids that moved
+	Buffer cmDevStatus;             // convergence flag and # of iterations run
+	Buffer cmDevMinDistance;        // seeding distance of every point to its nearest centroid
+	Buffer cmDevDistanceAccumulation;       // seeding cumulative distance distribution
+	Buffer cmDevBlockSums;          // seeding per work group distance totals
+	Buffer cmDevCandidates;         // k-means|| candidate centroids
+	Buffer cmDevCandidateCount;     // k-means|| # of candidates drawn
+	Buffer cmDevWeights;            // k-means|| # of points closest to every candidate
+	Buffer cmDevRunFirst;           // batch: first centroid of every run in the table
+	Buffer cmDevRunK;               // batch: # of centroids of every run
+	Buffer cmDevPartialInertia;     // batch: per work-group inertia of every run, profiling: of every iteration
+	Buffer cmDevPrevLabels;         // profiling: labels of the previous iteration
+	Buffer cmDevMoved;              // profiling: # of points moved in every iteration
+};
+
+#endif
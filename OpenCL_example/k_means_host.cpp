@@ -2,49 +2,109 @@
 // common SDK header for standard utilities and system libs 
 #include <oclUtils.h>
 
+// additional includes
+#include <string>
+#include <vector>
+#include <limits.h>
+
+// native k-means engine, used as golden reference and on CPU-only nodes
+#include "k_means_cpu.h"
+
+// device k-means engine
+#include "k_means_engine.h"
+
+// memory-mapped raw input volumes
+#include "k_means_volume.h"
+
+// benchmark sweep and auto-tuning
+#include "k_means_shmoo.h"
+
+// data-parallel clustering over several devices
+#include "k_means_multi.h"
+
+// launch configuration tuning file shared with oclReduction
+#include "../oclReduction/oclTuning.h"
+
+// compiled program cache shared with oclReduction
+#include "../oclReduction/oclProgramCache.h"
+
 // Name of the file with the source code for the computation kernel
 // *********************************************************************
 const char* cSourceFile = "k_means_kernel.cc";
 
 // Host buffers for demo
 // *********************************************************************
-void *srcA, *srcB, *dst;        // Host buffers for OpenCL test
-void* Golden;                   // Host buffer for host golden processing cross check
+unsigned int* Golden;           // Host buffer for host golden processing cross check (raw cluster ids)
+KMeansVolume Volumes[K_MEANS_MAX_D];    // Mapped input volumes, one per feature or a single one holding all of them
+int iNumVolumes = 0;            // # of mapped volumes
+const float* VolumeValues[K_MEANS_MAX_D];       // Values of every volume, the mapping itself or WidenedVolumes
+float* WidenedVolumes[K_MEANS_MAX_D];   // Float copies of 8 and 16 bit volumes (NULL = the mapping holds floats)
 
 // OpenCL Vars
-cl_context cxGPUContext;        // OpenCL context
-cl_command_queue cqCommandQueue;// OpenCL command que
 cl_platform_id cpPlatform;      // OpenCL platform
 cl_device_id cdDevice;          // OpenCL device
-cl_program cpProgram;           // OpenCL program
-cl_kernel ckKernel;             // OpenCL kernel
-cl_mem cmDevSrcA;               // OpenCL device source buffer A
-cl_mem cmDevSrcB;               // OpenCL device source buffer B 
-cl_mem cmDevDst;                // OpenCL device destination buffer 
-size_t szGlobalWorkSize;        // 1D var for Total # of work items
-size_t szLocalWorkSize;		    // 1D var for # of work items in the work group	
-size_t szParmDataBytes;			// Byte size of context information
-size_t szKernelLength;			// Byte size of kernel code
-cl_int ciErr1, ciErr2;			// Error code var
+KMeansEngine* pEngine = NULL;   // Device engine: context, queues, kernels and buffers
+size_t szLabelBytes;            // Byte size of a label, the narrowest of 1, 2, 4 that holds k - 1
+cl_int ciErr1;                  // Error code var
 char* cPathAndName = NULL;      // var for full paths to data, src, etc.
-char* cSourceCL = NULL;         // Buffer to hold source for compilation 
 
-//////////////////////////////////////////////////////////////////////////
 #include <time.h>
 #include <stdlib.h>
-cl_mem cmDevSrc_scalar_value;               // OpenCL device source buffer A
-cl_mem cmDevSrc_gradient_magnitude;               // OpenCL device source buffer B 
-cl_mem cmDevSrc_second_derivative_magnitude;               // OpenCL device source buffer B 
-cl_mem cmDevDst_label_ptr;                // OpenCL device destination buffer 
-//////////////////////////////////////////////////////////////////////////
 
 // demo config vars
 int iNumElements = 64;	// Length of float arrays to process (odd # for illustration)
+int iNumThreads = 0;    // Threads for the native engine (0 = one per core)
+int iMaxGroups = 64;    // Maximum # of work groups of the accumulate step (each work item sums several points)
+int iLocalSize = 256;   // Work-group size (halved by the engine until the accumulate step fits in local memory)
+int iSeedRounds = 5;    // k-means|| rounds
+int iFeatures = K_MEANS_D;      // Dimension of the feature space, extra features past the first 3 are synthetic
+int iCheckInterval = K_MEANS_CHECK_INTERVAL;   // Iterations queued per read of the device convergence flag
+int iChunkSize = 0;     // Points per chunk when streaming (0 = K_MEANS_DEFAULT_CHUNK, capped by the device allocation limit)
+float fOversampling = 0;        // k-means|| expected candidates per round (0 = 2k)
+shrBOOL bParallelSeeding = shrFALSE;    // Seed with k-means|| instead of k-means++
 shrBOOL bNoPrompt = shrFALSE;  
+shrBOOL bCpuOnly = shrFALSE;    // Cluster with the native engine only, no OpenCL device needed
+shrBOOL bInterleaved = shrFALSE;        // Features interleaved per point (AoS) instead of one plane per feature (SoA)
+shrBOOL bStreaming = shrFALSE;  // Stream the features through the device in chunks (forced when they exceed one allocation)
+shrBOOL bNoDiskCache = shrFALSE;        // Keep compiled programs in memory only
+shrBOOL bHamerly = shrFALSE;    // Skip the distances that cannot change a label using per-point bounds
+shrBOOL bCompensated = shrFALSE;        // Neumaier-compensated centroid sums, bit-reproducible and close to double precision
+shrBOOL bDisplay = shrFALSE;    // Also produce labels spread over 0-255 for display
+char* cCacheDir = NULL;         // Directory for the compiled program binaries (NULL = current directory)
+char* cVolumeFiles = NULL;      // Comma separated raw volume files (NULL = synthetic features)
+char* cVolumeDims = NULL;       // Volume dimensions NXxNYxNZ: derive the features from the scalar volume
+int iVolumeDims[3] = { 0, 0, 0 };       // Volume dimensions, x fastest
+shrBOOL bDeriveFeatures = shrFALSE;     // Compute gradient and second derivative magnitudes from the scalar value
+int iRestarts = 1;      // Batch mode: clusterings per value of k, each from its own seeds
+char* cKList = NULL;    // Batch mode: comma separated values of k (NULL = --k only)
+shrBOOL bTune = shrFALSE;       // Time the launch configurations on this device and data, store and use the fastest
+char* cTuneFile = NULL;         // Tuning file (NULL = oclTuning.txt)
+shrBOOL bProfile = shrFALSE;    // Time every device command and write a JSON report
+char* cProfileFile = (char*)"k_means_profile.json";     // Profile report written with --profile
+shrBOOL bMulti = shrFALSE;      // Partition the points over every device of every platform
+shrBOOL bNuma = shrFALSE;       // With --multi, one sub-device per NUMA node of the CPU devices
+char* cWeights = NULL;          // With --multi, comma separated shares of the points per device (NULL = compute units times clock)
+char* cStorage = NULL;          // Storage type of the device feature table: float, half, u16 or u8 (NULL = float)
+char* cVolumeType = NULL;       // Value type of the raw volume files: float, half, u16 or u8 (NULL = float)
+int iFeatureType = K_MEANS_FEATURE_FLOAT;       // KMeansFeatureType of --storage
+int iVolumeType = K_MEANS_FEATURE_FLOAT;        // KMeansFeatureType of --volume_type
+char* cAssign = NULL;           // Assignment kernel: auto, direct or tiled (NULL = auto, tiled for large D * k)
+int iAssign = K_MEANS_ASSIGN_AUTO;      // KMeansAssign of --assign
+
+// Fraction of labels allowed to differ from the golden clustering
+// (float partial sums on the device vs double on the host can flip ties)
+#define LABEL_TOLERANCE 1e-3
 
 // Forward Declarations
 // *********************************************************************
-void VectorAddHost(const float* pfData1, const float* pfData2, float* pfResult, int iNumElements);
+unsigned int KMeansLabel(const unsigned char* data, size_t label_bytes, unsigned int i);
+unsigned int KMeansCompareLabels(const unsigned int* reference, const unsigned char* data, size_t label_bytes, unsigned int count);
+void KMeansLogRuns(const std::vector<KMeansRun>& runs, int best_run);
+std::vector<std::string> KMeansSplitList(const char* list);
+bool KMeansRunShmoo(int argc, const char** argv);
+bool KMeansRunMulti(const KMeansFeatures& features, int k, unsigned int random_seed, unsigned int random_seed2,
+					unsigned char* label_ptr, unsigned char* display);
+KMeansFeatures KMeansStoredFeatures(const KMeansFeatures& features, int type, std::vector<float>& values, std::vector<const float*>& planes);
 void Cleanup (int iExitCode);
 
 // Main function 
@@ -62,227 +122,598 @@ int main(int argc, char **argv)
 
 	// get command line arg for quick test, if provided
 	bNoPrompt = shrCheckCmdLineFlag(argc, (const char**)argv, "noprompt");
+	bCpuOnly = shrCheckCmdLineFlag(argc, (const char**)argv, "cpu");
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "threads", &iNumThreads);
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "maxgroups", &iMaxGroups);
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "localsize", &iLocalSize);
+	bTune = shrCheckCmdLineFlag(argc, (const char**)argv, "tune");
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "tunefile", &cTuneFile);
+	bParallelSeeding = shrCheckCmdLineFlag(argc, (const char**)argv, "kmeans_parallel");
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "rounds", &iSeedRounds);
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "k", &k);
+	if (k < 1)
+	{
+		shrLog("Error: --k must be at least 1\n\n");
+		Cleanup(EXIT_FAILURE);
+	}
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "restarts", &iRestarts);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "klist", &cKList);
+	if (iRestarts < 1)
+	{
+		shrLog("Error: --restarts must be at least 1\n\n");
+		Cleanup(EXIT_FAILURE);
+	}
+
+	// Batch mode: every value of k times iRestarts seeds, all clustered in one pass over the points
+	std::vector<KMeansRun> runs;
+	if (iRestarts > 1 || cKList)
+	{
+		std::vector<int> kvalues;
+		if (cKList)
+		{
+			std::vector<std::string> list = KMeansSplitList(cKList);
+			for (size_t i = 0; i < list.size(); i++)
+			{
+				int kv = atoi(list[i].c_str());
+				if (kv < 1)
+				{
+					shrLog("Error: --klist values must be at least 1\n\n");
+					Cleanup(EXIT_FAILURE);
+				}
+				kvalues.push_back(kv);
+			}
+		}
+		else
+		{
+			kvalues.push_back(k);
+		}
+
+		// the first restart of every k uses the given seeds, the next ones draw theirs from them
+		k = 1;
+		for (size_t v = 0; v < kvalues.size(); v++)
+		{
+			unsigned int m_z = random_seed, m_w = random_seed2;
+			for (int r = 0; r < iRestarts; r++)
+			{
+				KMeansRun run;
+				run.k = kvalues[v];
+				run.random_seed = r ? KMeansRandom(&m_z, &m_w) : random_seed;
+				run.random_seed2 = r ? KMeansRandom(&m_z, &m_w) : random_seed2;
+				runs.push_back(run);
+			}
+			if (kvalues[v] > k) k = kvalues[v];
+		}
+	}
+	bDisplay = shrCheckCmdLineFlag(argc, (const char**)argv, "display");
+	shrGetCmdLineArgumentf(argc, (const char**)argv, "oversampling", &fOversampling);
+	if (fOversampling <= 0) fOversampling = 2.0f * k;
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "d", &iFeatures);
+	if (iFeatures < 1 || iFeatures > K_MEANS_MAX_D)
+	{
+		shrLog("Error: --d must be between 1 and %d\n\n", K_MEANS_MAX_D);
+		Cleanup(EXIT_FAILURE);
+	}
+	bInterleaved = (iFeatures >= K_MEANS_AOS_MIN_D) ? shrTRUE : shrFALSE;
+	if (shrCheckCmdLineFlag(argc, (const char**)argv, "aos")) bInterleaved = shrTRUE;
+	if (shrCheckCmdLineFlag(argc, (const char**)argv, "soa")) bInterleaved = shrFALSE;
+	bStreaming = shrCheckCmdLineFlag(argc, (const char**)argv, "stream");
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "chunk", &iChunkSize);
+	shrGetCmdLineArgumenti(argc, (const char**)argv, "check", &iCheckInterval);
+	bNoDiskCache = shrCheckCmdLineFlag(argc, (const char**)argv, "nodiskcache");
+	bHamerly = shrCheckCmdLineFlag(argc, (const char**)argv, "hamerly");
+	bCompensated = shrCheckCmdLineFlag(argc, (const char**)argv, "compensated");
+	bProfile = shrCheckCmdLineFlag(argc, (const char**)argv, "profile");
+	if (shrGetCmdLineArgumentstr(argc, (const char**)argv, "profile", &cProfileFile)) bProfile = shrTRUE;
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "cachedir", &cCacheDir);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "volume", &cVolumeFiles);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "dims", &cVolumeDims);
+	bNuma = shrCheckCmdLineFlag(argc, (const char**)argv, "numa");
+	bMulti = (shrCheckCmdLineFlag(argc, (const char**)argv, "multi") || bNuma) ? shrTRUE : shrFALSE;
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "weights", &cWeights);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "storage", &cStorage);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "volume_type", &cVolumeType);
+	shrGetCmdLineArgumentstr(argc, (const char**)argv, "assign", &cAssign);
+
+	// Benchmark sweep instead of one clustering
+	if (shrCheckCmdLineFlag(argc, (const char**)argv, "shmoo"))
+	{
+		if (!bNoDiskCache)
+		{
+			oclSetProgramCacheDir(cCacheDir ? cCacheDir : ".");
+		}
+		cPathAndName = shrFindFilePath(cSourceFile, argv[0]);
+		Cleanup(KMeansRunShmoo(argc, (const char**)argv) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// narrow types: --storage for the device feature table, --volume_type for the input files
+	if (cStorage && (iFeatureType = KMeansFeatureTypeByName(cStorage)) < 0)
+	{
+		shrLog("Error: --storage must be float, half, u16 or u8\n\n");
+		Cleanup(EXIT_FAILURE);
+	}
+	if (cVolumeType && (iVolumeType = KMeansFeatureTypeByName(cVolumeType)) < 0)
+	{
+		shrLog("Error: --volume_type must be float, half, u16 or u8\n\n");
+		Cleanup(EXIT_FAILURE);
+	}
+	if (cAssign)
+	{
+		std::string sAssign(cAssign);
+		if (sAssign == "direct") iAssign = K_MEANS_ASSIGN_DIRECT;
+		else if (sAssign == "tiled") iAssign = K_MEANS_ASSIGN_TILED;
+		else if (sAssign != "auto")
+		{
+			shrLog("Error: --assign must be auto, direct or tiled\n\n");
+			Cleanup(EXIT_FAILURE);
+		}
+	}
+
+	// Only the scalar volume is given, the other two default features are derived from it
+	if (cVolumeDims)
+	{
+		if (sscanf(cVolumeDims, "%dx%dx%d", &iVolumeDims[0], &iVolumeDims[1], &iVolumeDims[2]) != 3 || 
+			iVolumeDims[0] < 1 || iVolumeDims[1] < 1 || iVolumeDims[2] < 1 || 
+			(double)iVolumeDims[0] * iVolumeDims[1] * iVolumeDims[2] > (double)INT_MAX)
+		{
+			shrLog("Error: --dims must be NXxNYxNZ\n\n");
+			Cleanup(EXIT_FAILURE);
+		}
+		bDeriveFeatures = shrTRUE;
+		iFeatures = K_MEANS_D;
+		iNumElements = iVolumeDims[0] * iVolumeDims[1] * iVolumeDims[2];
+		count = (unsigned int)iNumElements;
+	}
+
+	// Map the input volumes: several files hold one feature each, a single file
+	// holds all D features, interleaved per point with --aos or plane after plane
+	if (cVolumeFiles)
+	{
+		std::string files(cVolumeFiles);
+		size_t start = 0;
+		while (start <= files.size() && iNumVolumes < K_MEANS_MAX_D)
+		{
+			size_t end = files.find(',', start);
+			if (end == std::string::npos) end = files.size();
+			std::string path = files.substr(start, end - start);
+			if (!KMeansMapVolume(path.c_str(), &Volumes[iNumVolumes]))
+			{
+				shrLog("Error: cannot map volume %s\n\n", path.c_str());
+				Cleanup(EXIT_FAILURE);
+			}
+			iNumVolumes++;
+			start = end + 1;
+		}
+		if (bDeriveFeatures && iNumVolumes > 1)
+		{
+			shrLog("Error: --dims takes a single scalar volume\n\n");
+			Cleanup(EXIT_FAILURE);
+		}
+		if (iNumVolumes > 1)
+		{
+			// one feature per file, kept planar unless --aos asks for the packed copy
+			iFeatures = iNumVolumes;
+			bInterleaved = shrCheckCmdLineFlag(argc, (const char**)argv, "aos") ? shrTRUE : shrFALSE;
+		}
+
+		size_t szValueBytes = KMeansFeatureBytes(iVolumeType);
+		size_t szValues = Volumes[0].bytes / szValueBytes;
+		int iPerPoint = (iNumVolumes > 1 || bDeriveFeatures) ? 1 : iFeatures;
+		size_t szPoints = szValues / iPerPoint;
+		for (int v = 0; v < iNumVolumes; v++)
+		{
+			if (Volumes[v].bytes != szPoints * iPerPoint * szValueBytes || (bDeriveFeatures && szPoints != count))
+			{
+				shrLog("Error: volume sizes do not match %d features of %u points\n\n", iFeatures, (unsigned int)szPoints);
+				Cleanup(EXIT_FAILURE);
+			}
+		}
+		if (szPoints == 0 || szPoints > (size_t)INT_MAX)
+		{
+			shrLog("Error: volumes must hold between 1 and %d points\n\n", INT_MAX);
+			Cleanup(EXIT_FAILURE);
+		}
+		iNumElements = (int)szPoints;
+		count = (unsigned int)szPoints;
+
+		// 8 and 16 bit volumes are widened to float on the host; --storage
+		// decides what the device keeps (u8 / u16 store them exactly)
+		for (int v = 0; v < iNumVolumes; v++)
+		{
+			VolumeValues[v] = Volumes[v].data;
+			if (iVolumeType != K_MEANS_FEATURE_FLOAT)
+			{
+				WidenedVolumes[v] = new float[szPoints * iPerPoint];
+				KMeansDecodeHost(Volumes[v].data, 1, szPoints * iPerPoint, iVolumeType, 1.0f, 0.0f, WidenedVolumes[v], 1, iNumThreads);
+				VolumeValues[v] = WidenedVolumes[v];
+			}
+		}
+	}
+	const int D = iFeatures;
+
+	// labels hold raw cluster ids in as few bytes as k allows
+	szLabelBytes = KMeansEngine::labelBytes(k);
 
 	// start logs 
 	shrSetLogFileName ("oclVectorAdd.txt");
 	shrLog("%s Starting...\n\n# of float elements per Array \t= %i\n", argv[0], iNumElements); 
-
-	// set and log Global and Local work size dimensions
-	szLocalWorkSize = 256;
-	szGlobalWorkSize = shrRoundUp((int)szLocalWorkSize, iNumElements);  // rounded up to the nearest multiple of the LocalWorkSize
-	shrLog("Global Work Size \t\t= %u\nLocal Work Size \t\t= %u\n# of Work Groups \t\t= %u\n\n", 
-		szGlobalWorkSize, szLocalWorkSize, (szGlobalWorkSize % szLocalWorkSize + szGlobalWorkSize/szLocalWorkSize)); 
+	shrLog("# of features per point \t= %i (%s)\n", D, bInterleaved ? "interleaved" : "planar");
+	shrLog("# of clusters \t\t\t= %i (%u byte labels)\n", k, szLabelBytes);
+	if (iFeatureType != K_MEANS_FEATURE_FLOAT)
+	{
+		shrLog("Device feature storage \t\t= %s\n", KMeansFeatureTypeName(iFeatureType));
+	}
+	if (!runs.empty())
+	{
+		shrLog("# of batched clusterings \t= %u (%d per k)\n", (unsigned int)runs.size(), iRestarts);
+	}
 
 	// Allocate and initialize host arrays 
 	shrLog( "Allocate and Init Host Mem...\n"); 
-	srcA = (void *)malloc(sizeof(cl_float) * szGlobalWorkSize);
-	srcB = (void *)malloc(sizeof(cl_float) * szGlobalWorkSize);
-	dst = (void *)malloc(sizeof(cl_float) * szGlobalWorkSize);
-	Golden = (void *)malloc(sizeof(cl_float) * iNumElements);
-	shrFillArray((float*)srcA, iNumElements);
-	shrFillArray((float*)srcB, iNumElements);
+	Golden = (unsigned int *)malloc(sizeof(unsigned int) * count);
 	//////////////////////////////////////////////////////////////////////////
-	float *scalar_value = new float[count];
-	float *gradient_magnitude = new float[count];
-	float *second_derivative_magnitude = new float[count];
-	unsigned char *label_ptr = new unsigned char[count];
-	shrFillArray(scalar_value, count);
-	shrFillArray(gradient_magnitude, count);
-	shrFillArray(second_derivative_magnitude, count);
+	// one plane per feature: scalar value, gradient magnitude, second derivative magnitude, then synthetic ones
+	float *feature_planes = NULL;               // owned synthetic planes
+	const float *contiguous_planes = NULL;      // all D planes back to back, if they are
+	const float *feature_rows = NULL;           // D values per point, if interleaved
+	const float **planes = new const float*[D];
+	if (iNumVolumes == 1 && bInterleaved && !bDeriveFeatures)
+	{
+		feature_rows = VolumeValues[0];
+	}
+	for (int d = 0; d < D; d++)
+	{
+		if (bDeriveFeatures && d > 0)
+		{
+			planes[d] = NULL;               // derived below
+		}
+		else if (iNumVolumes > 1)
+		{
+			planes[d] = VolumeValues[d];
+		}
+		else if (iNumVolumes == 1 && feature_rows)
+		{
+			planes[d] = NULL;               // the volume only has rows
+		}
+		else if (iNumVolumes == 1)
+		{
+			contiguous_planes = VolumeValues[0];
+			planes[d] = contiguous_planes + (size_t)d * count;
+		}
+		else
+		{
+			if (feature_planes == NULL) feature_planes = new float[(size_t)count * (bDeriveFeatures ? 1 : D)];
+			shrFillArray(feature_planes + (size_t)d * count, count);
+			contiguous_planes = feature_planes;
+			planes[d] = feature_planes + (size_t)d * count;
+		}
+	}
+	// host copies of the derived features, only computed where they are needed
+	// (native engine, streaming, golden check)
+	float *derived_planes = NULL;
+	if (bDeriveFeatures)
+	{
+		derived_planes = new float[(size_t)count * 2];
+		planes[1] = derived_planes;
+		planes[2] = derived_planes + count;
+		contiguous_planes = NULL;
+	}
+	KMeansFeatures features = { count, D, feature_rows ? NULL : planes, feature_rows, NULL, NULL };
+	unsigned char *label_ptr = new unsigned char[szLabelBytes * count];
+	unsigned char *display = bDisplay ? new unsigned char[count] : NULL;
+	float *centroids = new float[k * D];
+
+	// batch mode: final centroids of every run, one after the other
+	std::vector<float> run_centroids;
+	int iBestRun = 0;
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		run_centroids.resize(run_centroids.size() + runs[r].k * D);
+	}
+	for (size_t r = 0, offset = 0; r < runs.size(); offset += runs[r].k * D, r++)
+	{
+		runs[r].centroids = &run_centroids[offset];
+	}
 	//////////////////////////////////////////////////////////////////////////
 
 	//Get an OpenCL platform
-	ciErr1 = clGetPlatformIDs(1, &cpPlatform, NULL);
-
-	shrLog("clGetPlatformID...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	if (!bCpuOnly)
 	{
-		shrLog("Error in clGetPlatformID, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		ciErr1 = clGetPlatformIDs(1, &cpPlatform, NULL);
+		shrLog("clGetPlatformID...\n"); 
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("No OpenCL platform found (error %d), falling back to the native engine\n", ciErr1);
+			bCpuOnly = shrTRUE;
+		}
 	}
 
-	//Get the devices
-	ciErr1 = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 1, &cdDevice, NULL);
-	shrLog("clGetDeviceIDs...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	// Native path: cluster on the host thread pool and leave
+	if (bCpuOnly)
 	{
-		shrLog("Error in clGetDeviceIDs, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		shrLog("KMeansHost (%d points, k = %d, D = %d)...\n\n", count, k, D);
+		shrDeltaT(0);
+		if (bDeriveFeatures)
+		{
+			KMeansVolumeFeaturesHost(planes[0], iVolumeDims[0], iVolumeDims[1], iVolumeDims[2], derived_planes, derived_planes + count, iNumThreads);
+		}
+		if (!runs.empty())
+		{
+			// one full clustering per run, keeping the labels of the lowest inertia
+			std::vector<unsigned int> labels(count);
+			for (size_t r = 0; r < runs.size(); r++)
+			{
+				KMeansSeedHost(features, runs[r].k, runs[r].random_seed, runs[r].random_seed2, runs[r].centroids, iNumThreads);
+				KMeansLloydHost(features, runs[r].k, runs[r].centroids, &labels[0], K_MEANS_MAX_ITERATIONS, iNumThreads);
+				runs[r].inertia = KMeansInertiaHost(features, runs[r].k, runs[r].centroids, &labels[0], iNumThreads);
+				if (r == 0 || runs[r].inertia < runs[iBestRun].inertia)
+				{
+					iBestRun = (int)r;
+					memcpy(Golden, &labels[0], sizeof(unsigned int) * count);
+				}
+			}
+			KMeansLogRuns(runs, iBestRun);
+		}
+		else
+		{
+			KMeansSeedHost(features, k, random_seed, random_seed2, centroids, iNumThreads);
+			KMeansLloydHost(features, k, centroids, Golden, K_MEANS_MAX_ITERATIONS, iNumThreads);
+		}
+		if (bDisplay)
+		{
+			KMeansQuantizeLabelsHost(Golden, display, count, runs.empty() ? k : runs[iBestRun].k);
+		}
+		shrLog("KMeansHost time = %.5f s\n\n", shrDeltaT(0));
+
+		delete [] feature_planes;
+		delete [] derived_planes;
+		delete [] planes;
+		delete [] label_ptr;
+		delete [] display;
+		delete [] centroids;
+		Cleanup (EXIT_SUCCESS);
 	}
 
-	//Create the context
-	cxGPUContext = clCreateContext(0, 1, &cdDevice, NULL, NULL, &ciErr1);
-	shrLog("clCreateContext...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	// Data-parallel path: every device clusters its share of the points, the
+	// host adds up their cluster sums every iteration
+	if (bMulti)
 	{
-		shrLog("Error in clCreateContext, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		if (!runs.empty())
+		{
+			shrLog("Error: --multi does not run batches (--restarts, --klist)\n\n");
+			Cleanup(EXIT_FAILURE);
+		}
+		if (!bNoDiskCache)
+		{
+			oclSetProgramCacheDir(cCacheDir ? cCacheDir : ".");
+		}
+		cPathAndName = shrFindFilePath(cSourceFile, argv[0]);
+		if (bDeriveFeatures)
+		{
+			// the stencil reaches across partition borders, derive once on the host
+			KMeansVolumeFeaturesHost(planes[0], iVolumeDims[0], iVolumeDims[1], iVolumeDims[2], derived_planes, derived_planes + count, iNumThreads);
+		}
+		bool bPassed = KMeansRunMulti(features, k, random_seed, random_seed2, label_ptr, display);
+
+		delete [] feature_planes;
+		delete [] derived_planes;
+		delete [] planes;
+		delete [] label_ptr;
+		delete [] display;
+		delete [] centroids;
+		Cleanup (bPassed ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
 
-	// Create a command-queue
-	cqCommandQueue = clCreateCommandQueue(cxGPUContext, cdDevice, 0, &ciErr1);
-	shrLog("clCreateCommandQueue...\n"); 
+	//Get the devices
+	ciErr1 = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 1, &cdDevice, NULL);
+	shrLog("clGetDeviceIDs...\n"); 
 	if (ciErr1 != CL_SUCCESS)
 	{
-		shrLog("Error in clCreateCommandQueue, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		shrLog("Error in clGetDeviceIDs, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
 		Cleanup(EXIT_FAILURE);
 	}
 
-	// Allocate the OpenCL buffer memory objects for source and result on the device GMEM
-	cmDevSrcA = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr1);
-	cmDevSrcB = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr2);
-	ciErr1 |= ciErr2;
-	cmDevDst = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr2);
-	ciErr1 |= ciErr2;
-	//////////////////////////////////////////////////////////////////////////
-	cmDevSrc_scalar_value = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr1);
-	cmDevSrc_gradient_magnitude = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr2);
-	ciErr1 |= ciErr2;
-	cmDevSrc_second_derivative_magnitude = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr2);
-	ciErr1 |= ciErr2;
-	cmDevDst_label_ptr = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, sizeof(cl_float) * szGlobalWorkSize, NULL, &ciErr2);
-	ciErr1 |= ciErr2;
-	//////////////////////////////////////////////////////////////////////////
-	shrLog("clCreateBuffer...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	// Programs are compiled only if neither this process nor a previous run
+	// has built them for the device
+	if (!bNoDiskCache)
 	{
-		shrLog("Error in clCreateBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		oclSetProgramCacheDir(cCacheDir ? cCacheDir : ".");
 	}
-
-	// Read the OpenCL kernel in from source file
-	shrLog("oclLoadProgSource (%s)...\n", cSourceFile); 
 	cPathAndName = shrFindFilePath(cSourceFile, argv[0]);
-	cSourceCL = oclLoadProgSource(cPathAndName, "", &szKernelLength);
 	printf("%s\n%s\n", cSourceFile, cPathAndName);
 
-	// Create the program
-	cpProgram = clCreateProgramWithSource(cxGPUContext, 1, (const char **)&cSourceCL, &szKernelLength, &ciErr1);
-	shrLog("clCreateProgramWithSource...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	// Launch configuration: --tune times the candidates on this device and
+	// data; otherwise the winner stored for this device, driver and size is
+	// used, unless the command line sets the configuration
+	oclSetTuningFile(cTuneFile ? cTuneFile : "oclTuning.txt");
+	KMeansTuning tuning;
+	bool bTuned = false;
+	bool bHostDerived = false;      // derived features already on the host
+	if (bTune && runs.empty())
 	{
-		shrLog("Error in clCreateProgramWithSource, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		if (bDeriveFeatures)
+		{
+			bHostDerived = true;
+			KMeansVolumeFeaturesHost(planes[0], iVolumeDims[0], iVolumeDims[1], iVolumeDims[2], derived_planes, derived_planes + count, iNumThreads);
+		}
+		bTuned = KMeansTune(cdDevice, cPathAndName, features, k, 10, iNumThreads, &tuning);
 	}
-
-	// Build the program with 'mad' Optimization option
-#ifdef MAC
-	char* flags = "-cl-fast-relaxed-math -DMAC";
-#else
-	char* flags = "-cl-fast-relaxed-math";
-#endif
-	ciErr1 = clBuildProgram(cpProgram, 0, NULL, NULL, NULL, NULL);
-	shrLog("clBuildProgram...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	else if (!shrCheckCmdLineFlag(argc, (const char**)argv, "localsize") && !shrCheckCmdLineFlag(argc, (const char**)argv, "maxgroups") &&
+			 !shrCheckCmdLineFlag(argc, (const char**)argv, "aos") && !shrCheckCmdLineFlag(argc, (const char**)argv, "soa") && !bHamerly)
 	{
-		shrLog("Error in clBuildProgram, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		bTuned = KMeansGetTuning(cdDevice, count, D, k, &tuning);
 	}
-
-	// Create the kernel
-	ckKernel = clCreateKernel(cpProgram, "k_means", &ciErr1);
-	shrLog("clCreateKernel (VectorAdd)...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	if (bTuned)
 	{
-		shrLog("Error in clCreateKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		iLocalSize = tuning.local_size;
+		iMaxGroups = tuning.max_groups;
+		bInterleaved = (tuning.layout == K_MEANS_LAYOUT_INTERLEAVED) ? shrTRUE : shrFALSE;
+		bHamerly = tuning.hamerly ? shrTRUE : shrFALSE;
+		shrLog("Tuned launch configuration: local %d, %d groups, %s, %s\n", iLocalSize, iMaxGroups,
+			   bInterleaved ? "interleaved" : "planar", bHamerly ? "hamerly" : "lloyd");
 	}
 
-	// Set the Argument values
-	//ciErr1 = clSetKernelArg(ckKernel, 0, sizeof(cl_mem), (void*)&cmDevSrcA);
-	//ciErr1 |= clSetKernelArg(ckKernel, 1, sizeof(cl_mem), (void*)&cmDevSrcB);
-	//ciErr1 |= clSetKernelArg(ckKernel, 2, sizeof(cl_mem), (void*)&cmDevDst);
-	//ciErr1 |= clSetKernelArg(ckKernel, 3, sizeof(cl_int), (void*)&iNumElements);
-	//////////////////////////////////////////////////////////////////////////
-	// __global const float *scalar_value, __global const float *gradient_magnitude, __global const float *second_derivative_magnitude, __global unsigned char *label_ptr, __global const unsigned int count, __global const int k, __global const unsigned int random_seed, __global const unsigned int random_seed2
-	ciErr1 = clSetKernelArg(ckKernel, 0, sizeof(cl_mem), (void*)&cmDevSrc_scalar_value);
-	ciErr1 |= clSetKernelArg(ckKernel, 1, sizeof(cl_mem), (void*)&cmDevSrc_gradient_magnitude);
-	ciErr1 |= clSetKernelArg(ckKernel, 2, sizeof(cl_mem), (void*)&cmDevSrc_second_derivative_magnitude);
-	ciErr1 |= clSetKernelArg(ckKernel, 3, sizeof(cl_mem), (void*)&cmDevDst_label_ptr);
-	ciErr1 |= clSetKernelArg(ckKernel, 4, sizeof(cl_uint), (void*)&count);
-	ciErr1 |= clSetKernelArg(ckKernel, 5, sizeof(cl_uint), (void*)&k);
-	ciErr1 |= clSetKernelArg(ckKernel, 6, sizeof(cl_uint), (void*)&random_seed);
-	ciErr1 |= clSetKernelArg(ckKernel, 7, sizeof(cl_uint), (void*)&random_seed2);
-	//////////////////////////////////////////////////////////////////////////
-	shrLog("clSetKernelArg 0 - 3...\n\n"); 
+	// Create the engine: context, compute and transfer queues
+	KMeansEngineConfig config;
+	config.local_size = iLocalSize;
+	config.max_groups = iMaxGroups;
+	config.layout = bInterleaved ? K_MEANS_LAYOUT_INTERLEAVED : K_MEANS_LAYOUT_PLANAR;
+	config.streaming = bStreaming ? true : false;
+	config.chunk_size = (iChunkSize > 0) ? (unsigned int)iChunkSize : 0;
+	config.profiling = bProfile ? true : false;
+	config.feature_type = iFeatureType;
+	config.assign = iAssign;
+	config.compensated = bCompensated ? true : false;
+	pEngine = new KMeansEngine;
+	ciErr1 = pEngine->init(cdDevice, cPathAndName, config);
+	shrLog("KMeansEngine::init...\n"); 
 	if (ciErr1 != CL_SUCCESS)
 	{
-		shrLog("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		shrLog("Error in KMeansEngine::init, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
 		Cleanup(EXIT_FAILURE);
 	}
 
-	// --------------------------------------------------------
 	// Start Core sequence... copy input data to GPU, compute, copy results back
+	// --------------------------------------------------------
 
-	// Asynchronous write of data to GPU device
-	//ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevSrcA, CL_FALSE, 0, sizeof(cl_float) * szGlobalWorkSize, srcA, 0, NULL, NULL);
-	//ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevSrcB, CL_FALSE, 0, sizeof(cl_float) * szGlobalWorkSize, srcB, 0, NULL, NULL);
-	//////////////////////////////////////////////////////////////////////////
-	ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmDevSrc_scalar_value, CL_FALSE, 0, sizeof(cl_float) * szGlobalWorkSize, scalar_value, 0, NULL, NULL);
-	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevSrc_gradient_magnitude, CL_FALSE, 0, sizeof(cl_float) * szGlobalWorkSize, gradient_magnitude, 0, NULL, NULL);
-	ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmDevSrc_second_derivative_magnitude, CL_FALSE, 0, sizeof(cl_float) * szGlobalWorkSize, second_derivative_magnitude, 0, NULL, NULL);
-	//////////////////////////////////////////////////////////////////////////
-	shrLog("clEnqueueWriteBuffer (SrcA and SrcB)...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	// Upload the features, or only the scalar volume and derive the others on the device
+	if (bDeriveFeatures)
 	{
-		shrLog("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		ciErr1 = pEngine->loadVolume(planes[0], iVolumeDims, iNumThreads);
+		shrLog("KMeansEngine::loadVolume...\n"); 
 	}
-
-	// Launch kernel
-	ciErr1 = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize, 0, NULL, NULL);
-	shrLog("clEnqueueNDRangeKernel (VectorAdd)...\n"); 
-	if (ciErr1 != CL_SUCCESS)
+	else
 	{
-		shrLog("Error in clEnqueueNDRangeKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+		ciErr1 = pEngine->load(features);
+		shrLog("KMeansEngine::load...\n"); 
 	}
-
-	// Synchronous/blocking read of results, and check accumulated errors
-	//ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevDst, CL_TRUE, 0, sizeof(cl_float) * szGlobalWorkSize, dst, 0, NULL, NULL);
-	//////////////////////////////////////////////////////////////////////////
-		ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmDevDst_label_ptr, CL_TRUE, 0, sizeof(cl_float) * szGlobalWorkSize, label_ptr, 0, NULL, NULL);
-	//////////////////////////////////////////////////////////////////////////
-	shrLog("clEnqueueReadBuffer (Dst)...\n\n"); 
 	if (ciErr1 != CL_SUCCESS)
 	{
-		shrLog("Error in clEnqueueReadBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		shrLog("Error in KMeansEngine::load, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
 		Cleanup(EXIT_FAILURE);
 	}
+	if (pEngine->streaming())
+	{
+		shrLog("Streaming %u points in chunks of %u\n", count, pEngine->chunkSize());
+	}
+	if (pEngine->zeroCopy())
+	{
+		shrLog("Device works on the host features in place (no upload)\n");
+	}
+	shrLog("Local Work Size for D = %d \t= %u\n\n", D, pEngine->localWorkSize());
+
+	// Make initial guesses for the means, kept for the golden run
+	KMeansOptions options;
+	options.k = k;
+	options.random_seed = random_seed;
+	options.random_seed2 = random_seed2;
+	options.parallel_seeding = bParallelSeeding ? true : false;
+	options.seed_rounds = iSeedRounds;
+	options.oversampling = fOversampling;
+	options.hamerly = bHamerly ? true : false;
+	options.num_threads = iNumThreads;
+	options.check_interval = iCheckInterval;
+	if (!runs.empty())
+	{
+		// Seed and iterate every run at once, only the labels of the best one come back
+		ciErr1 = pEngine->fitBatch(options, &runs[0], (int)runs.size(), label_ptr, &iBestRun);
+		shrLog("KMeansEngine::fitBatch...\n\n"); 
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansEngine::fitBatch, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+			Cleanup(EXIT_FAILURE);
+		}
+		KMeansLogRuns(runs, iBestRun);
+		if (bDisplay)
+		{
+			for (unsigned int i = 0; i < count; i++)
+			{
+				display[i] = (unsigned char)(KMeansLabel(label_ptr, szLabelBytes, i) * 256 / runs[iBestRun].k);
+			}
+		}
+	}
+	else
+	{
+		ciErr1 = pEngine->seed(options, centroids);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansEngine::seed, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+			Cleanup(EXIT_FAILURE);
+		}
+
+		// Iterate assign / accumulate / converge until no centroid moves
+		std::vector<float> fitted(centroids, centroids + k * D);
+		ciErr1 = pEngine->iterate(options, &fitted[0]);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansEngine::iterate, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+			Cleanup(EXIT_FAILURE);
+		}
+
+		// Final labels, and the optional display pass spreading them over 0-255
+		ciErr1 = pEngine->predict(k, &fitted[0], label_ptr, display);
+		shrLog("KMeansEngine::predict...\n\n"); 
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansEngine::predict, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+			Cleanup(EXIT_FAILURE);
+		}
+	}
 	//--------------------------------------------------------
 
+	// Device time per stage, and the JSON report with the per-iteration breakdown
+	if (bProfile)
+	{
+		const KMeansProfile& profile = pEngine->profile();
+		shrLog("Device profile (%u commands):\n", profile.commands);
+		for (int s = 0; s < K_MEANS_STAGES; s++)
+		{
+			shrLog("  %-10s %10.3f ms\n", KMeansStageName(s), profile.stage_ms[s]);
+		}
+		if (pEngine->writeProfile(cProfileFile))
+		{
+			shrLog("Profile written to %s\n\n", cProfileFile);
+		}
+		else
+		{
+			shrLog("Error: could not write the profile to %s\n\n", cProfileFile);
+		}
+	}
+
 	// Compute and compare results for golden-host and report errors and pass/fail
 	shrLog("Comparing against Host/C++ computation...\n\n"); 
-	VectorAddHost ((const float*)srcA, (const float*)srcB, (float*)Golden, iNumElements);
-	shrBOOL bMatch = shrComparefet((const float*)Golden, (const float*)dst, (unsigned int)iNumElements, 0.0f, 0);
-	shrLog("%s\n\n", (bMatch == shrTRUE) ? "PASSED" : "FAILED");
+	if (bDeriveFeatures && !bHostDerived)
+	{
+		KMeansVolumeFeaturesHost(planes[0], iVolumeDims[0], iVolumeDims[1], iVolumeDims[2], derived_planes, derived_planes + count, iNumThreads);
+	}
+	std::vector<float> stored_values;
+	std::vector<const float*> stored_planes;
+	KMeansFeatures golden_features = KMeansStoredFeatures(features, iFeatureType, stored_values, stored_planes);
+	if (!runs.empty())
+	{
+		// the best run's centroids label the points as the device should have
+		const KMeansRun& best = runs[iBestRun];
+		double dInertia = KMeansInertiaHost(golden_features, best.k, best.centroids, Golden, iNumThreads);
+		shrLog("Inertia of run %d: host %.6g, device %.6g\n", iBestRun, dInertia, best.inertia);
+	}
+	else
+	{
+		KMeansLloydHost(golden_features, k, centroids, Golden, K_MEANS_MAX_ITERATIONS, iNumThreads);
+	}
+	unsigned int uiMismatches = KMeansCompareLabels(Golden, label_ptr, szLabelBytes, count);
+	shrLog("%u of %u labels differ\n", uiMismatches, count);
+	shrLog("%s\n\n", (uiMismatches <= LABEL_TOLERANCE * count) ? "PASSED" : "FAILED");
 
 	//////////////////////////////////////////////////////////////////////////
-	//float *a = (float *)srcA;
-	//float *b = (float *)srcB;
-	//float *c = (float *)dst;
-	//float *d = (float *)Golden;
-	//for (int i=0; i<iNumElements; i++)
-	//{
-	//	printf("%f+%f=%f=%f\t", a[i], b[i], c[i], a[i]+b[i]);
-	//	printf("%s\n", (a[i]+b[i]==c[i]?"equal":"not equal"));
-	//}
-
-	//for (int i=0; i<iNumElements; i++)
-	//{
-	//	printf("%f\n", ((float *)dst)[i]);
-	//}
+	delete [] feature_planes;
+	delete [] derived_planes;
+	delete [] planes;
+	delete [] label_ptr;
+	delete [] display;
+	delete [] centroids;
 	//////////////////////////////////////////////////////////////////////////
 
 	// Cleanup and leave
 	Cleanup (EXIT_SUCCESS);
-
-	//////////////////////////////////////////////////////////////////////////
-	delete [] scalar_value;
-	delete [] gradient_magnitude;
-	delete [] second_derivative_magnitude;
-	delete [] label_ptr;
-	//////////////////////////////////////////////////////////////////////////
 }
 
 void Cleanup (int iExitCode)
@@ -290,26 +721,17 @@ void Cleanup (int iExitCode)
 	// Cleanup allocated objects
 	shrLog("Starting Cleanup...\n\n");
 	if(cPathAndName)free(cPathAndName);
-	if(cSourceCL)free(cSourceCL);
-	if(ckKernel)clReleaseKernel(ckKernel);  
-	if(cpProgram)clReleaseProgram(cpProgram);
-	if(cqCommandQueue)clReleaseCommandQueue(cqCommandQueue);
-	if(cxGPUContext)clReleaseContext(cxGPUContext);
-	if(cmDevSrcA)clReleaseMemObject(cmDevSrcA);
-	if(cmDevSrcB)clReleaseMemObject(cmDevSrcB);
-	if(cmDevDst)clReleaseMemObject(cmDevDst);
+	oclReleaseProgramCache();
+	delete pEngine;
 
-	//////////////////////////////////////////////////////////////////////////
-	if(cmDevSrc_scalar_value)clReleaseMemObject(cmDevSrc_scalar_value);
-	if(cmDevSrc_gradient_magnitude)clReleaseMemObject(cmDevSrc_gradient_magnitude);
-	if(cmDevSrc_second_derivative_magnitude)clReleaseMemObject(cmDevSrc_second_derivative_magnitude);
-	if(cmDevDst_label_ptr)clReleaseMemObject(cmDevDst_label_ptr);
-	//////////////////////////////////////////////////////////////////////////
+	// Unmap the inputs once no buffer wraps them anymore
+	for (int v = 0; v < iNumVolumes; v++)
+	{
+		KMeansUnmapVolume(&Volumes[v]);
+		delete [] WidenedVolumes[v];
+	}
 
 	// Free host memory
-	free(srcA); 
-	free(srcB);
-	free (dst);
 	free(Golden);
 
 	// finalize logs and leave
@@ -325,13 +747,258 @@ void Cleanup (int iExitCode)
 	exit (iExitCode);
 }
 
-// "Golden" Host processing vector addition function for comparison purposes
+// Count the labels that differ from the "Golden" host clustering
 // *********************************************************************
-void VectorAddHost(const float* pfData1, const float* pfData2, float* pfResult, int iNumElements)
+unsigned int KMeansLabel(const unsigned char* data, size_t label_bytes, unsigned int i)
+{
+	if (label_bytes == sizeof(cl_uchar))
+		return data[i];
+	else if (label_bytes == sizeof(cl_ushort))
+		return ((const cl_ushort*)data)[i];
+	else
+		return ((const cl_uint*)data)[i];
+}
+
+unsigned int KMeansCompareLabels(const unsigned int* reference, const unsigned char* data, size_t label_bytes, unsigned int count)
 {
-	int i;
-	for (i = 0; i < iNumElements; i++) 
+	unsigned int mismatches = 0;
+	for (unsigned int i = 0; i < count; i++) 
+	{
+		if (reference[i] != KMeansLabel(data, label_bytes, i))
+		{
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
+// Table of the batched clusterings, the best one marked
+// *********************************************************************
+void KMeansLogRuns(const std::vector<KMeansRun>& runs, int best_run)
+{
+	shrLog("  k    seeds                inertia\n");
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		shrLog("%4d   %08x %08x  %14.6g%s\n", runs[r].k, runs[r].random_seed, runs[r].random_seed2, runs[r].inertia, 
+			   (int)r == best_run ? "  <- best" : "");
+	}
+	shrLog("\n");
+}
+
+// Data-parallel clustering (--multi): seeds on the host, iterates on every
+// device with the centroid sums combined on the host, then compares the
+// labels with the native engine started from the same seeds
+// *********************************************************************
+bool KMeansRunMulti(const KMeansFeatures& features, int k, unsigned int random_seed, unsigned int random_seed2,
+					unsigned char* label_ptr, unsigned char* display)
+{
+	const int D = features.D;
+	std::vector<cl_device_id> devices = KMeansAllDevices(bNuma ? true : false);
+	shrLog("Data-parallel k-means on %u devices%s...\n", (unsigned int)devices.size(), bNuma ? " (CPU devices split by NUMA node)" : "");
+
+	KMeansEngineConfig config;
+	config.local_size = iLocalSize;
+	config.max_groups = iMaxGroups;
+	config.layout = bInterleaved ? K_MEANS_LAYOUT_INTERLEAVED : K_MEANS_LAYOUT_PLANAR;
+	config.streaming = bStreaming ? true : false;
+	config.chunk_size = (iChunkSize > 0) ? (unsigned int)iChunkSize : 0;
+	config.feature_type = iFeatureType;
+	config.assign = iAssign;
+	config.compensated = bCompensated ? true : false;
+
+	KMeansOptions options;
+	options.k = k;
+	options.random_seed = random_seed;
+	options.random_seed2 = random_seed2;
+	options.num_threads = iNumThreads;
+
+	std::vector<float> seeds(k * D), fitted(k * D);
+	bool bPassed = false;
+	{
+		// the engines go before their sub-devices
+		KMeansMultiEngine multi;
+		ciErr1 = multi.init(devices, cPathAndName, config);
+		if (ciErr1 == CL_SUCCESS && cWeights)
+		{
+			std::vector<std::string> items = KMeansSplitList(cWeights);
+			std::vector<double> shares;
+			for (size_t i = 0; i < items.size(); i++)
+			{
+				shares.push_back(atof(items[i].c_str()));
+			}
+			if (!multi.setWeights(shares))
+			{
+				shrLog("Error: --weights needs one share per device (%d)\n\n", multi.numEngines());
+				ciErr1 = CL_INVALID_VALUE;
+			}
+		}
+		if (ciErr1 == CL_SUCCESS) ciErr1 = multi.load(features);
+		if (ciErr1 == CL_SUCCESS)
+		{
+			shrDeltaT(0);
+			multi.seed(options, &seeds[0]);
+			fitted = seeds;
+			ciErr1 = multi.iterate(options, &fitted[0]);
+			if (ciErr1 == CL_SUCCESS) ciErr1 = multi.predict(k, &fitted[0], label_ptr, display);
+			shrLog("KMeansMultiEngine time = %.5f s\n\n", shrDeltaT(0));
+		}
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansMultiEngine (%d), Line %u in file %s !!!\n\n", ciErr1, __LINE__, __FILE__);
+		}
+	}
+	KMeansReleaseDevices(devices);
+
+	if (ciErr1 == CL_SUCCESS)
+	{
+		shrLog("Comparing against Host/C++ computation...\n\n"); 
+		std::vector<float> stored_values;
+		std::vector<const float*> stored_planes;
+		KMeansFeatures golden_features = KMeansStoredFeatures(features, iFeatureType, stored_values, stored_planes);
+		KMeansLloydHost(golden_features, k, &seeds[0], Golden, K_MEANS_MAX_ITERATIONS, iNumThreads);
+		unsigned int uiMismatches = KMeansCompareLabels(Golden, label_ptr, szLabelBytes, features.count);
+		shrLog("%u of %u labels differ\n", uiMismatches, features.count);
+		bPassed = (uiMismatches <= LABEL_TOLERANCE * features.count);
+		shrLog("%s\n\n", bPassed ? "PASSED" : "FAILED");
+	}
+	return bPassed;
+}
+
+// Host copy of the features as the device stores them (--storage): narrowed
+// with the scale and offset the engines fit, then widened back, so that the
+// golden clustering sees the values the kernels see
+// *********************************************************************
+KMeansFeatures KMeansStoredFeatures(const KMeansFeatures& features, int type, std::vector<float>& values, std::vector<const float*>& planes)
+{
+	const int D = features.D;
+	const unsigned int count = features.count;
+	if (type == K_MEANS_FEATURE_FLOAT)
+	{
+		return features;
+	}
+
+	std::vector<float> scale(D), offset(D);
+	KMeansFeatureScaleHost(features, type, &scale[0], &offset[0], iNumThreads);
+	std::vector<unsigned char> stored(KMeansFeatureBytes(type) * count);
+	values.resize((size_t)count * D);
+	planes.resize(D);
+	for (int d = 0; d < D; d++)
+	{
+		const float* source = features.interleaved ? features.interleaved + d : features.planes[d];
+		KMeansEncodeHost(source, features.interleaved ? D : 1, count, type, scale[d], offset[d], &stored[0], 1, iNumThreads);
+		KMeansDecodeHost(&stored[0], 1, count, type, scale[d], offset[d], &values[(size_t)d * count], 1, iNumThreads);
+		planes[d] = &values[(size_t)d * count];
+	}
+	KMeansFeatures stored_features = { count, D, &planes[0], NULL, NULL, NULL };
+	return stored_features;
+}
+
+// Items of a comma separated list
+// *********************************************************************
+std::vector<std::string> KMeansSplitList(const char* list)
+{
+	std::vector<std::string> items;
+	std::string text(list);
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos) end = text.size();
+		items.push_back(text.substr(start, end - start));
+		start = end + 1;
+	}
+	return items;
+}
+
+// Benchmark sweep (--shmoo), every parameter a comma separated list:
+//   --shmoo_n=1048576,...       # of points
+//   --shmoo_k=4,8,...           # of clusters
+//   --shmoo_d=3,8               # of features
+//   --shmoo_local=64,128,256    work-group sizes
+//   --shmoo_variants=lloyd,hamerly,stream
+//   --shmoo_devices=gpu,cpu,native
+//   --shmoo_iterations=10       iterations timed per case
+//   --shmoo_file=k_means_shmoo.csv
+// --cpu restricts the sweep to the native engine
+// *********************************************************************
+bool KMeansRunShmoo(int argc, const char** argv)
+{
+	shrSetLogFileName ("oclVectorAdd.txt");
+	KMeansShmooConfig shmoo;
+	shmoo.max_groups = iMaxGroups;
+	shmoo.num_threads = iNumThreads;
+	shrGetCmdLineArgumenti(argc, argv, "shmoo_iterations", &shmoo.iterations);
+	char* cList = NULL;
+	if (shrGetCmdLineArgumentstr(argc, argv, "shmoo_file", &cList)) shmoo.csv_path = cList;
+
+	const char* cIntLists[4] = { "shmoo_n", "shmoo_k", "shmoo_d", "shmoo_local" };
+	for (int l = 0; l < 4; l++)
+	{
+		if (!shrGetCmdLineArgumentstr(argc, argv, cIntLists[l], &cList))
+		{
+			continue;
+		}
+		std::vector<std::string> items = KMeansSplitList(cList);
+		std::vector<int> values;
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			int value = atoi(items[i].c_str());
+			if (value < 1)
+			{
+				shrLog("Error: --%s values must be at least 1\n\n", cIntLists[l]);
+				return false;
+			}
+			values.push_back(value);
+		}
+		if (l == 0) shmoo.sizes.assign(values.begin(), values.end());
+		else if (l == 1) shmoo.ks = values;
+		else if (l == 2) shmoo.dims = values;
+		else shmoo.local_sizes = values;
+	}
+
+	if (shrGetCmdLineArgumentstr(argc, argv, "shmoo_variants", &cList))
+	{
+		std::vector<std::string> items = KMeansSplitList(cList);
+		shmoo.variants.clear();
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			int v = 0;
+			while (v < K_MEANS_SHMOO_VARIANTS && items[i] != KMeansShmooVariantName(v)) v++;
+			if (v == K_MEANS_SHMOO_VARIANTS)
+			{
+				shrLog("Error: unknown variant %s in --shmoo_variants\n\n", items[i].c_str());
+				return false;
+			}
+			shmoo.variants.push_back(v);
+		}
+	}
+	if (shrGetCmdLineArgumentstr(argc, argv, "shmoo_devices", &cList))
+	{
+		std::vector<std::string> items = KMeansSplitList(cList);
+		shmoo.devices.clear();
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			int d = 0;
+			while (d < K_MEANS_SHMOO_DEVICES && items[i] != KMeansShmooDeviceName(d)) d++;
+			if (d == K_MEANS_SHMOO_DEVICES)
+			{
+				shrLog("Error: unknown device %s in --shmoo_devices\n\n", items[i].c_str());
+				return false;
+			}
+			shmoo.devices.push_back(d);
+		}
+	}
+	if (bCpuOnly)
+	{
+		shmoo.devices.assign(1, K_MEANS_SHMOO_NATIVE);
+	}
+	for (size_t d = 0; d < shmoo.dims.size(); d++)
 	{
-		pfResult[i] = pfData1[i] + pfData2[i]; 
+		if (shmoo.dims[d] > K_MEANS_MAX_D)
+		{
+			shrLog("Error: --shmoo_d must be between 1 and %d\n\n", K_MEANS_MAX_D);
+			return false;
+		}
 	}
+	return KMeansShmoo(shmoo, cPathAndName);
 }
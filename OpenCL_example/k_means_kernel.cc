@@ -15,215 +15,1601 @@ inline unsigned int circular_shift_right(unsigned int value, unsigned int offset
 	return (value>>offset) | (value<<(total_bits - offset));
 }
 
-// OpenCL Kernel Function for element by element vector addition
-__kernel void k_means(__global const float *scalar_value, __global const float *gradient_magnitude, __global const float *second_derivative_magnitude, __global unsigned char *label_ptr, __global const unsigned int count, __global const int k, __global const unsigned int random_seed, __global const unsigned int random_seed2)
+/************************************************************************
+k-means is run as a host-driven pipeline, one launch per step:
+
+  kmeans_assign      label every point with its nearest centroid
+                     (kmeans_assign_constant when the centroids fit in a
+                     constant buffer, kmeans_assign_tiled for large D * k)
+  kmeans_accumulate  per work-group sums and counts of every cluster,
+                     binned in one pass over the points
+  kmeans_converge    merge the partials into the new centroids and count
+                     the centroids that moved more than EPSILON
+  kmeans_check       raise the convergence flag once none moved
+
+barrier() only synchronizes the work-items of one work-group, so every step
+that needs the whole NDRange to be done is a separate kernel. The host
+ping-pongs two centroid buffers between iterations.
+
+The host does not wait for every iteration: it queues them in batches and
+reads the convergence flag once per batch, while the next batch is already
+queued. Every step of an iteration queued past convergence sees the flag
+and returns at once, leaving the labels and centroids as they were.
+
+Inputs larger than one device allocation are streamed in chunks: assign and
+accumulate run per chunk and kmeans_fold adds the chunk's partials to
+running cluster sums, which kmeans_converge then reads as a single group.
+
+The sums of a cluster are always added in the same order for a given launch
+configuration (strided per work-item, a fixed tree per group, then the
+groups and chunks in turn), so they are bit-reproducible from run to run.
+With COMPENSATED every one of those adds also carries the rounding error
+it lost (Neumaier), which keeps float sums over 100M points close to a
+double accumulation.
+************************************************************************/
+
+// The following defines are set during runtime compilation, see k_means_engine.cpp
+// #define blockSize 256
+// #define D 3              dimension of the feature space
+// #define FEATURE_AOS 0    1: features interleaved per point, 0: one plane of pitch values per feature
+// #define FEATURE_T float  storage type of the feature table: float, half, ushort or uchar
+// #define FEATURE_HALF 0   1: FEATURE_T is half, read with vload_half
+// #define FEATURE_SCALE {..}  D scales and offsets of the stored values, only when they
+// #define FEATURE_OFFSET {..} are not 1 and 0: value = stored * scale + offset
+// #define LABEL_T uchar    label type, the narrowest of uchar/ushort/uint that holds k - 1
+// #define ASSIGN_TILE 16   edge of the kmeans_assign_tiled work-group
+// #define CENTROID_TILE 256 centroids kmeans_assign stages in local memory at a time
+// #define COMPENSATED 0    1: Neumaier-compensated centroid sums
+
+// Convergence threshold on the L1 move of a centroid
+#define EPSILON 1e-4f
+
+// Set in status[0] by kmeans_check; status is NULL outside the iteration loop
+#define CONVERGED(status) ((status) && (status)[0])
+
+// Up to UNROLL_MAX_D dimensions the point is held in registers and the
+// per-dimension loops are fully unrolled; above it they run in tiles of DTILE
+#define UNROLL_MAX_D 16
+#define DTILE 4
+
+// Centroids kmeans_assign stages in local memory at a time, set by the host
+#ifndef CENTROID_TILE
+#define CENTROID_TILE 256
+#endif
+
+#ifndef FEATURE_T
+#define FEATURE_T float
+#endif
+
+#ifndef COMPENSATED
+#define COMPENSATED 0
+#endif
+
+// sum_reduce and the other unrolled trees start at 512 and sort_tile pairs
+// work items by xor, so larger or non power of 2 groups would drop values
+#if blockSize > 512 || (blockSize & (blockSize - 1)) != 0
+#error "blockSize must be a power of 2 up to 512 (K_MEANS_MAX_LOCAL_SIZE)"
+#endif
+
+// Position of feature d of point i in the table
+#if FEATURE_AOS
+#define FEATURE_INDEX(pitch, i, d) ((size_t)(i) * D + (d))
+#else
+#define FEATURE_INDEX(pitch, i, d) ((size_t)(d) * (pitch) + (i))
+#endif
+
+// Narrow stored values are widened to float in registers
+#if FEATURE_HALF
+#define FEATURE_LOAD(features, index) vload_half(index, features)
+#define FEATURE_STORE(features, index, value) vstore_half(value, index, features)
+#else
+#define FEATURE_LOAD(features, index) convert_float((features)[index])
+#define FEATURE_STORE(features, index, value) ((features)[index] = (value))
+#endif
+
+// Value of feature d of point i
+#ifdef FEATURE_SCALE
+__constant float feature_scale[D] = FEATURE_SCALE;
+__constant float feature_offset[D] = FEATURE_OFFSET;
+#define FEATURE(features, pitch, i, d) (FEATURE_LOAD(features, FEATURE_INDEX(pitch, i, d)) * feature_scale[d] + feature_offset[d])
+#else
+#define FEATURE(features, pitch, i, d) FEATURE_LOAD(features, FEATURE_INDEX(pitch, i, d))
+#endif
+
+// Distance loops shared by the address spaces a centroid can be read from
+// (OpenCL C has no generic one): distance += the squared distance to
+// centroid[] of point i of the feature table, or of point[] in registers
+#define FEATURE_DISTANCE(centroid, distance) \
+{ \
+	float partial[DTILE]; \
+	for (int dd=0; dd<DTILE; dd++) \
+	{ \
+		partial[dd] = 0; \
+	} \
+	int d0 = 0; \
+	for (; d0 + DTILE <= D; d0 += DTILE) \
+	{ \
+		for (int dd=0; dd<DTILE; dd++) \
+		{ \
+			float x = FEATURE(features, pitch, i, d0 + dd) - (centroid)[d0 + dd]; \
+			partial[dd] += x * x; \
+		} \
+	} \
+	for (; d0 < D; d0++) \
+	{ \
+		float x = FEATURE(features, pitch, i, d0) - (centroid)[d0]; \
+		partial[0] += x * x; \
+	} \
+	for (int dd=0; dd<DTILE; dd++) \
+	{ \
+		distance += partial[dd]; \
+	} \
+}
+#define REGISTER_DISTANCE(centroid, distance) \
+{ \
+	for (int d=0; d<D; d++) \
+	{ \
+		float x = point[d] - (centroid)[d]; \
+		distance += x * x; \
+	} \
+}
+
+// Squared distance of point i to centroid j of a D-major table
+inline float point_distance(__global const FEATURE_T *features, unsigned int pitch, unsigned int i, __global const float *centroids, int j)
 {
-    // get index into global data array
-    int iGID = get_global_id(0);
+	__global const float *centroid = centroids + j*D;
+	float distance = 0;
+#if D <= UNROLL_MAX_D
+	#pragma unroll
+	for (int d=0; d<D; d++)
+	{
+		float x = FEATURE(features, pitch, i, d) - centroid[d];
+		distance += x * x;
+	}
+#else
+	FEATURE_DISTANCE(centroid, distance)
+#endif
+	return distance;
+}
 
-    // bound check (equivalent to the limit on a 'for' loop for standard/serial C code
-    if (iGID >= count)
-    {   
-        return; 
-    }
+// Squared distance of a point held in registers to centroid j (small D only)
+inline float register_distance(const float *point, __global const float *centroids, int j)
+{
+	__global const float *centroid = centroids + j*D;
+	float distance = 0;
+	REGISTER_DISTANCE(centroid, distance)
+	return distance;
+}
 
-	const int D = 3;
+// Same for centroids staged in local memory and bound as a constant buffer:
+// the point is in registers for small D, read from the feature table otherwise
+inline float local_distance(__global const FEATURE_T *features, unsigned int pitch, unsigned int i, const float *point, __local const float *centroids, int j)
+{
+	__local const float *centroid = centroids + j*D;
+	float distance = 0;
+#if D <= UNROLL_MAX_D
+	REGISTER_DISTANCE(centroid, distance)
+#else
+	FEATURE_DISTANCE(centroid, distance)
+#endif
+	return distance;
+}
 
-	//////////////////////////////////////////////////////////////////////////
-	// to be allocated in device memory
-	//float *centroids = new float[k * D];
-	//float *centroids_new = new float[k * D];
-	//int *centroids_quantity = new int[k];
-	//float *distance_accumulation = new float[count];
-	//////////////////////////////////////////////////////////////////////////
+inline float constant_distance(__global const FEATURE_T *features, unsigned int pitch, unsigned int i, const float *point, __constant float *centroids, int j)
+{
+	__constant float *centroid = centroids + j*D;
+	float distance = 0;
+#if D <= UNROLL_MAX_D
+	REGISTER_DISTANCE(centroid, distance)
+#else
+	FEATURE_DISTANCE(centroid, distance)
+#endif
+	return distance;
+}
 
-	float *temp_ptr;
-	float distance, distance_new, x, y, z;
+// Copy point i to a D-major table entry
+inline void copy_point(__global const FEATURE_T *features, unsigned int pitch, unsigned int i, __global float *table, int j)
+{
+	for (int d=0; d<D; d++)
+	{
+		table[j*D + d] = FEATURE(features, pitch, i, d);
+	}
+}
 
-	if (iGID == 0)
+// Assignment step: label every point with the raw id of its nearest centroid.
+// Every work item reads every centroid, so the work-group stages them in
+// local memory CENTROID_TILE at a time and the k * D values come from global
+// memory once per work-group instead of once per point.
+__kernel void kmeans_assign(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global LABEL_T *label_ptr, const unsigned int count, const int k, __global const unsigned int *status)
+{
+	__local float centroid_tile[CENTROID_TILE * D];
+
+	// queued past convergence, the same for the whole work-group
+	if (CONVERGED(status))
 	{
-		// Make initial guesses for the means m1, m2, ..., mk
-		// choose the first centroid at random
-		int random = random_seed % count;
-		centroids[0] = scalar_value[random];
-		centroids[1] = gradient_magnitude[random];
-		centroids[2] = second_derivative_magnitude[random];
+		return;
 	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// Synchronize to make sure all threads are done
-	barrier(CLK_LOCAL_MEM_FENCE);
-	//////////////////////////////////////////////////////////////////////////
+	// the work items past the end still help staging the centroids
+	int iGID = get_global_id(0);
+	int valid = (iGID < count);
 
-	x = scalar_value[iGID] - centroids[0];
-	y = gradient_magnitude[iGID] - centroids[1];
-	z = second_derivative_magnitude[iGID] - centroids[2];
-	distance_accumulation[iGID] = x * x + y * y + z * z;
+#if D <= UNROLL_MAX_D
+	// small D: the point stays in registers for all k centroids
+	float point[D];
+	#pragma unroll
+	for (int d=0; d<D; d++)
+	{
+		point[d] = valid ? FEATURE(features, pitch, iGID, d) : 0.0f;
+	}
+#else
+	const float *point = 0;
+#endif
 
-	//////////////////////////////////////////////////////////////////////////
-	// Synchronize to make sure all threads are done
-	barrier(CLK_LOCAL_MEM_FENCE);
-	//////////////////////////////////////////////////////////////////////////
+	float distance = FLT_MAX;
+	LABEL_T centroids_index = 0;
+	for (int c0=0; c0<k; c0+=CENTROID_TILE)
+	{
+		int tile_k = min(CENTROID_TILE, k - c0);
+		for (int t=get_local_id(0); t<tile_k*D; t+=get_local_size(0))
+		{
+			centroid_tile[t] = centroids[c0*D + t];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// look for a smaller distance in this tile, the first of equal ones wins
+		if (valid)
+		{
+			for (int j=0; j<tile_k; j++)
+			{
+				float distance_new = local_distance(features, pitch, iGID, point, centroid_tile, j);
+				if (distance_new < distance)
+				{
+					centroids_index = c0 + j;
+					distance = distance_new;
+				}
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (valid)
+	{
+		label_ptr[iGID] = centroids_index;
+	}
+}
+
+// Same with the centroid table bound as a constant buffer, for tables that
+// fit in one (CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE): all work items read the
+// same centroid at a time, which the constant cache broadcasts
+__kernel void kmeans_assign_constant(__global const FEATURE_T *features, const unsigned int pitch, __constant float *centroids, __global LABEL_T *label_ptr, const unsigned int count, const int k, __global const unsigned int *status)
+{
+	// queued past convergence
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	int iGID = get_global_id(0);
+	if (iGID >= count)
+	{
+		return;
+	}
+
+#if D <= UNROLL_MAX_D
+	float point[D];
+	#pragma unroll
+	for (int d=0; d<D; d++)
+	{
+		point[d] = FEATURE(features, pitch, iGID, d);
+	}
+#else
+	const float *point = 0;
+#endif
 
-	if (iGID == 0)
+	float distance = constant_distance(features, pitch, iGID, point, centroids, 0);
+	LABEL_T centroids_index = 0;
+	for (int j=1; j<k; j++)
 	{
-		for (unsigned int i=1; i<count; i++)
+		float distance_new = constant_distance(features, pitch, iGID, point, centroids, j);
+		if (distance_new < distance)
 		{
-			distance_accumulation[iGID] += distance_accumulation[iGID-1];
+			centroids_index = j;
+			distance = distance_new;
 		}
 	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// Synchronize to make sure all threads are done
-	barrier(CLK_LOCAL_MEM_FENCE);
-	//////////////////////////////////////////////////////////////////////////
+	label_ptr[iGID] = centroids_index;
+}
 
-	// the total cost is in distance_accumulation[count - 1];
+/************************************************************************
+Tiled assignment
 
-	bool loop;
-	float cutoff;
-	unsigned int random1 = random_seed ^ iGID ^ circular_shift_right(~random_seed2, iGID % 32, 32);
-	unsigned int random2 = random_seed2 ^ iGID ^ circular_shift_right(~random_seed, iGID % 32, 32);
+For many features and clusters kmeans_assign is bound by its loads: every
+work item still reads all k * D centroid values, one per multiply-add. With
+
+  ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2
+
+the k dot products of a point are a row of the matrix product of the
+points and the transposed centroid table, and ||x||^2 is the same for all
+centroids of a point, so the nearest centroid is the one with the smallest
+||c||^2 - 2 x.c.
+
+kmeans_assign_tiled computes that product the way a GEMM does: a work-group
+of ASSIGN_TILE * ASSIGN_TILE work items owns ASSIGN_TP points and walks the
+centroids ASSIGN_TC at a time. Each step stages ASSIGN_TD features of the
+points and centroids in local memory, and every work item accumulates an
+ASSIGN_R * ASSIGN_R block of dot products in registers, so one local load
+feeds ASSIGN_R multiply-adds. The argmin is fused: every work item keeps
+the nearest of its centroids per point, and the ASSIGN_TILE candidates of
+a point are folded in local memory at the end, ties to the lower centroid
+id as in kmeans_assign.
 
-	// choose more centers
-	if (iGID > 0 && iGID < k)
+The expansion cancels when the points are far from the origin relative to
+their distances; near ties can then resolve differently from kmeans_assign.
+The host only picks this kernel for large D * k (k_means_engine.cpp).
+************************************************************************/
+
+// Edge of the work-group, set by the host to fit the device
+#ifndef ASSIGN_TILE
+#define ASSIGN_TILE 16
+#endif
+#define ASSIGN_R 4                              // points and centroids per work item
+#define ASSIGN_TP (ASSIGN_TILE * ASSIGN_R)      // points per work-group
+#define ASSIGN_TC (ASSIGN_TILE * ASSIGN_R)      // centroids per tile
+#define ASSIGN_TD 8                             // features per step
+
+__kernel __attribute__((reqd_work_group_size(ASSIGN_TILE * ASSIGN_TILE, 1, 1)))
+void kmeans_assign_tiled(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global LABEL_T *label_ptr, const unsigned int count, const int k, __global const unsigned int *status)
+{
+	__local float point_tile[ASSIGN_TD][ASSIGN_TP];
+	__local float centroid_tile[ASSIGN_TD][ASSIGN_TC];
+	__local float candidate_distance[ASSIGN_TP][ASSIGN_TILE];
+	__local unsigned int candidate_index[ASSIGN_TP][ASSIGN_TILE];
+
+	// queued past convergence, the same for the whole work-group
+	if (CONVERGED(status))
 	{
-		loop = true;
-		while (loop)
+		return;
+	}
+
+	// work item (tx, ty) holds points ty + r * ASSIGN_TILE and centroids tx + r * ASSIGN_TILE of a tile
+	const int lid = get_local_id(0);
+	const int tx = lid % ASSIGN_TILE;
+	const int ty = lid / ASSIGN_TILE;
+	const unsigned int first = get_group_id(0) * ASSIGN_TP;
+
+	float best[ASSIGN_R];
+	unsigned int best_index[ASSIGN_R];
+	#pragma unroll
+	for (int r=0; r<ASSIGN_R; r++)
+	{
+		best[r] = FLT_MAX;
+		best_index[r] = 0;
+	}
+
+	for (int c0=0; c0<k; c0+=ASSIGN_TC)
+	{
+		float dot[ASSIGN_R][ASSIGN_R];
+		float norm[ASSIGN_R];
+		#pragma unroll
+		for (int q=0; q<ASSIGN_R; q++)
 		{
-			cutoff = (get_random(&random1, &random2) / float(RAND_MAX)) * distance_accumulation[count - 1];
+			norm[q] = 0;
+			#pragma unroll
+			for (int r=0; r<ASSIGN_R; r++)
+			{
+				dot[r][q] = 0;
+			}
+		}
 
-			for (unsigned int j = 0; j < count; j++)
+		for (int d0=0; d0<D; d0+=ASSIGN_TD)
+		{
+			// stage the next features of the points and centroids, 0 past the edges;
+			// consecutive work items read consecutive addresses of either layout
+			for (int e=lid; e<ASSIGN_TD*ASSIGN_TP; e+=ASSIGN_TILE*ASSIGN_TILE)
+			{
+#if FEATURE_AOS
+				int dd = e % ASSIGN_TD;
+				int p = e / ASSIGN_TD;
+#else
+				int dd = e / ASSIGN_TP;
+				int p = e % ASSIGN_TP;
+#endif
+				unsigned int i = first + p;
+				point_tile[dd][p] = (i < count && d0 + dd < D) ? FEATURE(features, pitch, i, d0 + dd) : 0.0f;
+			}
+			for (int e=lid; e<ASSIGN_TD*ASSIGN_TC; e+=ASSIGN_TILE*ASSIGN_TILE)
+			{
+				int dd = e % ASSIGN_TD;
+				int j = c0 + e / ASSIGN_TD;
+				centroid_tile[dd][e / ASSIGN_TD] = (j < k && d0 + dd < D) ? centroids[j*D + d0 + dd] : 0.0f;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			#pragma unroll
+			for (int dd=0; dd<ASSIGN_TD; dd++)
+			{
+				float x[ASSIGN_R], c[ASSIGN_R];
+				#pragma unroll
+				for (int r=0; r<ASSIGN_R; r++)
+				{
+					x[r] = point_tile[dd][ty + r*ASSIGN_TILE];
+					c[r] = centroid_tile[dd][tx + r*ASSIGN_TILE];
+					norm[r] += c[r] * c[r];
+				}
+				#pragma unroll
+				for (int r=0; r<ASSIGN_R; r++)
+				{
+					#pragma unroll
+					for (int q=0; q<ASSIGN_R; q++)
+					{
+						dot[r][q] += x[r] * c[q];
+					}
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		// fused argmin over the centroids of this tile, in increasing id
+		#pragma unroll
+		for (int q=0; q<ASSIGN_R; q++)
+		{
+			int j = c0 + tx + q*ASSIGN_TILE;
+			if (j < k)
 			{
-				if (distance_accumulation[j] >= cutoff)
+				#pragma unroll
+				for (int r=0; r<ASSIGN_R; r++)
 				{
-					random = j;
-					loop = false;
-					break;
+					float distance = norm[q] - 2.0f * dot[r][q];
+					if (distance < best[r])
+					{
+						best[r] = distance;
+						best_index[r] = j;
+					}
 				}
 			}
 		}
-		centroids[iGID*D] = scalar_value[random];
-		centroids[iGID*D+1] = gradient_magnitude[random];
-		centroids[iGID*D+2] = second_derivative_magnitude[random];
 	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// Synchronize to make sure all threads are done
+	// fold the ASSIGN_TILE candidates of every point
+	#pragma unroll
+	for (int r=0; r<ASSIGN_R; r++)
+	{
+		candidate_distance[ty + r*ASSIGN_TILE][tx] = best[r];
+		candidate_index[ty + r*ASSIGN_TILE][tx] = best_index[r];
+	}
 	barrier(CLK_LOCAL_MEM_FENCE);
-	//////////////////////////////////////////////////////////////////////////
+	if (lid < ASSIGN_TP && first + lid < count)
+	{
+		float distance = candidate_distance[lid][0];
+		unsigned int index = candidate_index[lid][0];
+		for (int t=1; t<ASSIGN_TILE; t++)
+		{
+			float distance_new = candidate_distance[lid][t];
+			unsigned int index_new = candidate_index[lid][t];
+			if (distance_new < distance || (distance_new == distance && index_new < index))
+			{
+				distance = distance_new;
+				index = index_new;
+			}
+		}
+		label_ptr[first + lid] = (LABEL_T)index;
+	}
+}
+
+/************************************************************************
+Hamerly bounds
+
+With --hamerly the assignment keeps two bounds per point: upper on the
+distance to its own centroid, lower on the distance to every other centroid.
+They are plain distances, not squared, as the triangle inequality needs.
+After each update step kmeans_centroid_bounds stores how far every centroid
+moved (drift) and half the distance to its nearest other centroid (half_min).
+A point whose upper bound does not exceed max(lower bound, half_min) cannot
+change label and skips all k distances; in late iterations that is nearly
+every point.
+
+A warm start (next frame of a time series) keeps the labels and bounds of
+the previous frame against the starting centroids: kmeans_warm_bounds
+loosens them by how far every point moved, and the first assignment then
+only rescans the points whose move may have changed their label.
+************************************************************************/
 
-	const float epsilon = 1e-4;
-	unsigned char centroids_index;
-	//bool changed = true;
+// Assignment step with bounds; init computes the bounds of every point from scratch
+__kernel void kmeans_assign_bounded(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global const float *drift, __global const float *half_min, __global LABEL_T *label_ptr, __global float *upper, __global float *lower, const unsigned int count, const int k, const int init, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	int iGID = get_global_id(0);
+	if (iGID >= count)
+	{
+		return;
+	}
+
+#if D <= UNROLL_MAX_D
+	float point[D];
+	#pragma unroll
+	for (int d=0; d<D; d++)
+	{
+		point[d] = FEATURE(features, pitch, iGID, d);
+	}
+	#define ASSIGN_DISTANCE(j) register_distance(point, centroids, j)
+#else
+	#define ASSIGN_DISTANCE(j) point_distance(features, pitch, iGID, centroids, j)
+#endif
 
-	// Until there are no changes in any mean
-	while (true)
+	if (!init)
 	{
-		// Empty all clusters before classification
-		if (iGID >= 0 && iGID < k)
+		// move the bounds by the centroid drifts
+		LABEL_T a = label_ptr[iGID];
+		float max_drift = 0;
+		for (int j=0; j<k; j++)
 		{
-			centroids_quantity[iGID] = 0;
+			if (j != a)
+			{
+				max_drift = max(max_drift, drift[j]);
+			}
 		}
+		float u = upper[iGID] + drift[a];
+		float l = lower[iGID] - max_drift;
+		float z = max(l, half_min[a]);
 
-		if (iGID >= 0 && iGID < k * D)
+		// tighten the upper bound only when the loose one is not enough
+		if (u > z)
+		{
+			u = sqrt(ASSIGN_DISTANCE(a));
+		}
+		if (u <= z)
 		{
-			centroids_new[iGID] = 0;
+			upper[iGID] = u;
+			lower[iGID] = l;
+			return;
 		}
+	}
 
-		//////////////////////////////////////////////////////////////////////////
-		// Synchronize to make sure all threads are done
+	// full scan for the nearest and the second nearest centroid
+	float d1 = MAXFLOAT, d2 = MAXFLOAT;
+	LABEL_T nearest = 0;
+	for (int j=0; j<k; j++)
+	{
+		float distance = ASSIGN_DISTANCE(j);
+		if (distance < d1)
+		{
+			d2 = d1;
+			d1 = distance;
+			nearest = j;
+		}
+		else if (distance < d2)
+		{
+			d2 = distance;
+		}
+	}
+	#undef ASSIGN_DISTANCE
+
+	label_ptr[iGID] = nearest;
+	upper[iGID] = sqrt(d1);
+	lower[iGID] = sqrt(d2);
+}
+
+// Neumaier summation: adds x to *sum and the rounding error of that add to
+// *comp, so that *sum + *comp stays close to the exact total. Only valid
+// while the program is built without -cl-fast-relaxed-math, which may
+// fold (a - t) + b to zero.
+inline void neumaier_add(float *sum, float *comp, float x)
+{
+	float t = *sum + x;
+	*comp += (fabs(*sum) >= fabs(x)) ? ((*sum - t) + x) : ((x - t) + *sum);
+	*sum = t;
+}
+
+#if COMPENSATED
+#define ACCUMULATE(sum, comp, x) neumaier_add(&(sum), &(comp), (x))
+#else
+#define ACCUMULATE(sum, comp, x) ((sum) += (x))
+#endif
+
+// Key of the padding work-items past count on the accumulation paths
+#define NO_BIN 0xffffffffu
+
+// Private bins of the one-pass accumulation. Every bin (a cluster, or a
+// cluster of one run in the batch) has `columns` copies of its D sums in
+// sdata at ((bin * D + d) * columns + col), followed with COMPENSATED by the
+// compensations of all of them, and of its count in squantity at
+// (bin * columns + col). Work-item tid owns column tid % columns.
+inline void bins_clear(__local float *sdata, __local unsigned int *squantity, unsigned int tid, unsigned int bins, unsigned int columns)
+{
+	for (unsigned int j = tid; j < (COMPENSATED ? 2 : 1) * bins * D * columns; j += blockSize)
+	{
+		sdata[j] = 0;
+	}
+	for (unsigned int j = tid; j < bins * columns; j += blockSize)
+	{
+		squantity[j] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Add the point x to column col of bin
+inline void bin_add(__local float *sdata, __local unsigned int *squantity, unsigned int bins, unsigned int columns, unsigned int bin, unsigned int col, const float *x)
+{
+	for (int d=0; d<D; d++)
+	{
+		unsigned int j = (bin*D + d)*columns + col;
+#if COMPENSATED
+		float sum = sdata[j];
+		float comp = sdata[bins*D*columns + j];
+		neumaier_add(&sum, &comp, x[d]);
+		sdata[j] = sum;
+		sdata[bins*D*columns + j] = comp;
+#else
+		sdata[j] += x[d];
+#endif
+	}
+	squantity[bin*columns + col]++;
+}
+
+// Add the point of every work-item of the tile to its bin (NO_BIN for none).
+// The blockSize / columns work-items sharing a column take turns, one
+// barrier apart; with a column per work-item no barrier is needed at all.
+inline void bins_scatter(__local float *sdata, __local unsigned int *squantity, unsigned int tid, unsigned int bins, unsigned int columns, unsigned int bin, const float *x)
+{
+	for (unsigned int turn = 0; turn < blockSize / columns; turn++)
+	{
+		if (bin != NO_BIN && tid / columns == turn)
+		{
+			bin_add(sdata, squantity, bins, columns, bin, tid % columns, x);
+		}
+		if (columns < blockSize)
+		{
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+}
+
+// Merge the columns of all bins with a tree as in reduce6, one level per
+// barrier, and write column 0 of every bin to sums[bins][D] and
+// counts[bins]
+inline void bins_reduce(__local float *sdata, __local unsigned int *squantity, unsigned int tid, unsigned int bins, unsigned int columns, __global float *sums, __global unsigned int *counts)
+{
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (unsigned int s = columns / 2; s > 0; s >>= 1)
+	{
+		for (unsigned int j = tid; j < bins * s; j += blockSize)
+		{
+			unsigned int bin = j / s;
+			unsigned int col = j % s;
+			for (int d=0; d<D; d++)
+			{
+				unsigned int i = (bin*D + d)*columns + col;
+#if COMPENSATED
+				float sum = sdata[i];
+				float comp = sdata[bins*D*columns + i] + sdata[bins*D*columns + i + s];
+				neumaier_add(&sum, &comp, sdata[i + s]);
+				sdata[i] = sum;
+				sdata[bins*D*columns + i] = comp;
+#else
+				sdata[i] += sdata[i + s];
+#endif
+			}
+			squantity[bin*columns + col] += squantity[bin*columns + col + s];
+		}
 		barrier(CLK_LOCAL_MEM_FENCE);
-		//////////////////////////////////////////////////////////////////////////
+	}
+
+	for (unsigned int bin = tid; bin < bins; bin += blockSize)
+	{
+		for (int d=0; d<D; d++)
+		{
+#if COMPENSATED
+			sums[bin*D + d] = sdata[(bin*D + d)*columns] + sdata[bins*D*columns + (bin*D + d)*columns];
+#else
+			sums[bin*D + d] = sdata[(bin*D + d)*columns];
+#endif
+		}
+		counts[bin] = squantity[bin*columns];
+	}
+}
 
-		// Use the estimated means to classify the samples into K clusters
+// Sorted path for bins that do not fit in local memory: sort the keys of the
+// tile together with their positions (bitonic, ties broken by position so
+// the order is deterministic)
+inline void sort_tile(__local unsigned int *skeys, __local unsigned int *sorder, unsigned int tid)
+{
+	sorder[tid] = tid;
+	for (unsigned int size = 2; size <= blockSize; size <<= 1)
+	{
+		for (unsigned int stride = size / 2; stride > 0; stride >>= 1)
+		{
+			barrier(CLK_LOCAL_MEM_FENCE);
+			unsigned int partner = tid ^ stride;
+			if (partner > tid)
+			{
+				unsigned int key = skeys[tid];
+				unsigned int order = sorder[tid];
+				bool greater = key > skeys[partner] || (key == skeys[partner] && order > sorder[partner]);
+				if (greater == ((tid & size) == 0))
+				{
+					skeys[tid] = skeys[partner];
+					sorder[tid] = sorder[partner];
+					skeys[partner] = key;
+					sorder[partner] = order;
+				}
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
 
-		// estimate the distance between points[i] and centroids[0]
-		centroids_index = 0;
-		x = scalar_value[iGID] - centroids[0];
-		y = gradient_magnitude[iGID] - centroids[1];
-		z = second_derivative_magnitude[iGID] - centroids[2];
-		distance = x * x + y * y + z * z;
+// The first work-item of every run of equal keys in the sorted tile sums the
+// points of the run and adds them to the bin in the group's slice of
+// partial sums, so each bin has one writer per tile. With COMPENSATED the
+// compensations are kept in comps until bins_finish.
+inline void bins_segment(__global const FEATURE_T *features, unsigned int pitch, __local const unsigned int *skeys, __local const unsigned int *sorder, unsigned int first, unsigned int tid, __global float *sums, __global float *comps, __global unsigned int *counts)
+{
+	unsigned int key = skeys[tid];
+	if (key == NO_BIN || (tid > 0 && skeys[tid - 1] == key))
+	{
+		return;
+	}
 
-		// look for a smaller distance in the rest of centroids
-		for (unsigned char j=1; j<k; j++)
+	float sum[D];
+	float comp[D];
+	unsigned int quantity = 0;
+	for (int d=0; d<D; d++)
+	{
+		sum[d] = 0;
+		comp[d] = 0;
+	}
+	for (unsigned int p = tid; p < blockSize && skeys[p] == key; p++)
+	{
+		unsigned int i = first + sorder[p];
+		for (int d=0; d<D; d++)
 		{
-			x = scalar_value[iGID] - centroids[j*D];
-			y = gradient_magnitude[iGID] - centroids[j*D+1];
-			z = second_derivative_magnitude[iGID] - centroids[j*D+2];
-			distance_new = x * x + y * y + z * z;
+			ACCUMULATE(sum[d], comp[d], FEATURE(features, pitch, i, d));
+		}
+		quantity++;
+	}
 
-			if (distance_new < distance)
+	for (int d=0; d<D; d++)
+	{
+#if COMPENSATED
+		float total = sums[key*D + d];
+		float error = comps[key*D + d] + comp[d];
+		neumaier_add(&total, &error, sum[d]);
+		sums[key*D + d] = total;
+		comps[key*D + d] = error;
+#else
+		sums[key*D + d] += sum[d];
+#endif
+	}
+	counts[key] += quantity;
+}
+
+// Zero the group's slice of partial sums before the sorted path
+inline void bins_zero(__global float *sums, __global float *comps, __global unsigned int *counts, unsigned int tid, unsigned int bins)
+{
+	for (unsigned int j = tid; j < bins * D; j += blockSize)
+	{
+		sums[j] = 0;
+#if COMPENSATED
+		comps[j] = 0;
+#endif
+	}
+	for (unsigned int j = tid; j < bins; j += blockSize)
+	{
+		counts[j] = 0;
+	}
+	barrier(CLK_GLOBAL_MEM_FENCE);
+}
+
+// Fold the compensations of the sorted path into the sums
+inline void bins_finish(__global float *sums, __global const float *comps, unsigned int tid, unsigned int bins)
+{
+#if COMPENSATED
+	barrier(CLK_GLOBAL_MEM_FENCE);
+	for (unsigned int j = tid; j < bins * D; j += blockSize)
+	{
+		sums[j] += comps[j];
+	}
+#endif
+}
+
+// Update step: every work-group writes the sums and counts of its points
+// to partial_sums[group][k][D] and partial_counts[group][k] in a single
+// pass over its points, tile by tile of blockSize points.
+// With columns > 0 every point is added to a private copy of its cluster's
+// bin in local memory (see bins_clear) and the copies are merged once at
+// the end. With columns == 0 (k * D too large for local memory) every tile
+// is sorted by label and each run of equal labels is added to the group's
+// slice of partial_sums, whose second half holds the compensations, so
+// partial_sums must hold 2 * num_groups * k * D floats with COMPENSATED.
+// No two work-items ever write the same location at the same time, so the
+// sums do not depend on scheduling. sdata must hold
+// max(1, k * D * columns) floats (twice as many with COMPENSATED),
+// squantity max(k * columns, blockSize) and sorder blockSize uints.
+__kernel void kmeans_accumulate(__global const FEATURE_T *features, const unsigned int pitch, __global const LABEL_T *label_ptr, __global float *partial_sums, __global unsigned int *partial_counts, const unsigned int count, const int k, __local float *sdata, __local unsigned int *squantity, __local unsigned int *sorder, const unsigned int columns, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	unsigned int tid = get_local_id(0);
+	unsigned int group = get_group_id(0);
+	unsigned int gridSize = blockSize*get_num_groups(0);
+	__global float *sums = partial_sums + group * k * D;
+	__global unsigned int *counts = partial_counts + group * k;
+
+	if (columns > 0)
+	{
+		bins_clear(sdata, squantity, tid, k, columns);
+		for (unsigned int first = group*blockSize; first < count; first += gridSize)
+		{
+			unsigned int i = first + tid;
+			unsigned int bin = NO_BIN;
+			float x[D];
+			if (i < count)
 			{
-				centroids_index = j;
-				distance = distance_new;
+				bin = label_ptr[i];
+				for (int d=0; d<D; d++)
+				{
+					x[d] = FEATURE(features, pitch, i, d);
+				}
 			}
+			bins_scatter(sdata, squantity, tid, k, columns, bin, x);
 		}
-		label_ptr[iGID] = centroids_index;
-		centroids_quantity[centroids_index]++;
-		centroids_new[centroids_index*D] += scalar_value[iGID];
-		centroids_new[centroids_index*D+1] += gradient_magnitude[iGID];
-		centroids_new[centroids_index*D+2] += second_derivative_magnitude[iGID];
+		bins_reduce(sdata, squantity, tid, k, columns, sums, counts);
+	}
+	else
+	{
+		__global float *comps = partial_sums + (get_num_groups(0) + group) * k * D;
+		bins_zero(sums, comps, counts, tid, k);
+		for (unsigned int first = group*blockSize; first < count; first += gridSize)
+		{
+			unsigned int i = first + tid;
+			squantity[tid] = (i < count) ? label_ptr[i] : NO_BIN;
+			sort_tile(squantity, sorder, tid);
+			bins_segment(features, pitch, squantity, sorder, first, tid, sums, comps, counts);
+			barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+		}
+		bins_finish(sums, comps, tid, k);
+	}
+}
+
+// Convergence step: one work-item per cluster merges the partials of all
+// groups, writes the new centroid and counts it in changed[0] if it moved.
+// Empty clusters keep their previous position.
+__kernel void kmeans_converge(__global const float *partial_sums, __global const unsigned int *partial_counts, const unsigned int num_groups, __global const float *centroids, __global float *centroids_new, __global unsigned int *changed, const int k, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
 
-		if (iGID == 0)
+	int i = get_global_id(0);
+	if (i >= k)
+	{
+		return;
+	}
+
+	float mean[D];
+	float comp[D];
+	unsigned int quantity = 0;
+	for (int d=0; d<D; d++)
+	{
+		mean[d] = 0;
+		comp[d] = 0;
+	}
+	for (unsigned int g=0; g<num_groups; g++)
+	{
+		__global const float *sums = partial_sums + (g * k + i) * D;
+		for (int d=0; d<D; d++)
+		{
+			ACCUMULATE(mean[d], comp[d], sums[d]);
+		}
+		quantity += partial_counts[g * k + i];
+	}
+
+	// estimate the values of the new centers
+	float distance_new = 0;
+	for (int d=0; d<D; d++)
+	{
+		float value = (quantity > 0) ? (mean[d] + comp[d]) / quantity : centroids[i*D + d];
+		distance_new += fabs(centroids[i*D + d] - value);
+		centroids_new[i*D + d] = value;
+	}
+
+	// the loop will continue if some centroids have changed
+	if (distance_new > EPSILON)
+	{
+		atomic_inc(changed);
+	}
+}
+
+// Convergence flag, one work-item after kmeans_converge (and the bounds):
+// status[0] is raised once no centroid moved, status[1] counts the
+// iterations that really ran; changed is emptied for the next iteration
+__kernel void kmeans_check(__global unsigned int *changed, __global unsigned int *status)
+{
+	if (get_global_id(0) == 0 && status[0] == 0)
+	{
+		status[1]++;
+		if (changed[0] == 0)
+		{
+			status[0] = 1;
+		}
+		changed[0] = 0;
+	}
+}
+
+// Optional display pass: spread the raw cluster ids over 0-255
+__kernel void kmeans_quantize(__global const LABEL_T *label_ptr, __global unsigned char *display, const unsigned int count, const int k)
+{
+	unsigned int i = get_global_id(0);
+	if (i >= count)
+	{
+		return;
+	}
+
+	display[i] = (unsigned char)(((ulong)label_ptr[i] * 256) / k);
+}
+
+// Hamerly bounds: drift of every centroid over the last update step and
+// half the distance to its nearest other centroid, one work-item per centroid
+__kernel void kmeans_centroid_bounds(__global const float *centroids_old, __global const float *centroids, __global float *drift, __global float *half_min, const int k, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	int i = get_global_id(0);
+	if (i >= k)
+	{
+		return;
+	}
+
+	float moved = 0;
+	for (int d=0; d<D; d++)
+	{
+		float x = centroids[i*D + d] - centroids_old[i*D + d];
+		moved += x * x;
+	}
+	drift[i] = sqrt(moved);
+
+	float nearest = MAXFLOAT;
+	for (int j=0; j<k; j++)
+	{
+		if (j != i)
+		{
+			float distance = 0;
+			for (int d=0; d<D; d++)
+			{
+				float x = centroids[i*D + d] - centroids[j*D + d];
+				distance += x * x;
+			}
+			nearest = min(nearest, distance);
+		}
+	}
+	half_min[i] = 0.5f * sqrt(nearest);
+}
+
+// Warm start: bounds of the previous frame for the new positions of the
+// points. moved[i] is the distance point i moved in feature space (moved
+// may be NULL if none did); by the triangle inequality upper grows and
+// lower shrinks by it. Points that moved at most threshold keep their
+// bounds as they are, so they skip the first assignment unless a centroid
+// drifts (threshold 0 keeps the bounds exact). Without bounds (has_bounds
+// 0) they are reset to [0, MAXFLOAT): the first assignment then measures
+// the distance to the previous label and settles the points closer to it
+// than half_min without a full scan.
+__kernel void kmeans_warm_bounds(__global const float *moved, __global float *upper, __global float *lower, const float threshold, const int has_bounds, const unsigned int count)
+{
+	int i = get_global_id(0);
+	if (i >= count)
+	{
+		return;
+	}
+
+	if (!has_bounds)
+	{
+		upper[i] = MAXFLOAT;
+		lower[i] = 0;
+		return;
+	}
+	float distance = moved ? moved[i] : 0;
+	if (distance > threshold)
+	{
+		upper[i] += distance;
+		lower[i] = max(lower[i] - distance, 0.0f);
+	}
+}
+
+// Streaming: add the partials of one chunk of points to the running sums
+// and counts of every cluster, one work-item per cluster. After the last
+// chunk kmeans_converge runs on the running sums with num_groups = 1.
+// With COMPENSATED cluster_sums holds k * D more floats, the low parts of
+// the running sums: the first k * D stay the best float value of every sum
+// and the two halves together carry it across chunks.
+__kernel void kmeans_fold(__global const float *partial_sums, __global const unsigned int *partial_counts, const unsigned int num_groups, __global float *cluster_sums, __global unsigned int *cluster_counts, const int k)
+{
+	int i = get_global_id(0);
+	if (i >= k)
+	{
+		return;
+	}
+
+	float sum[D];
+	float comp[D];
+	unsigned int quantity = 0;
+	for (int d=0; d<D; d++)
+	{
+#if COMPENSATED
+		sum[d] = cluster_sums[i*D + d];
+		comp[d] = cluster_sums[(k + i)*D + d];
+#else
+		sum[d] = 0;
+		comp[d] = 0;
+#endif
+	}
+	for (unsigned int g=0; g<num_groups; g++)
+	{
+		__global const float *sums = partial_sums + (g * k + i) * D;
+		for (int d=0; d<D; d++)
 		{
-			// the loop will continue if some centroids have changed
-			//changed = false;
-			distance_accumulation[0] = 0;
+			ACCUMULATE(sum[d], comp[d], sums[d]);
 		}
+		quantity += partial_counts[g * k + i];
+	}
+
+	for (int d=0; d<D; d++)
+	{
+#if COMPENSATED
+		// renormalize: the rounded total and what it lost
+		float total = sum[d] + comp[d];
+		cluster_sums[i*D + d] = total;
+		cluster_sums[(k + i)*D + d] = comp[d] - (total - sum[d]);
+#else
+		cluster_sums[i*D + d] += sum[d];
+#endif
+	}
+	cluster_counts[i] += quantity;
+}
+
+/************************************************************************
+Seeding
+
+k-means++ runs one round per centroid, each round fully parallel:
+
+  kmeans_seed_distance  squared distance of every point to its nearest centroid so far
+  kmeans_scan_reduce    per work-group totals of those distances
+  kmeans_scan           inclusive prefix sum within every tile (the D^2
+                        cumulative distribution, relative to the tile start)
+  kmeans_seed_sample    search of the tile totals, then of the tile prefix,
+                        for a cutoff drawn on the host, copy the chosen point
+
+k-means|| (oversampling) instead draws many candidates per round:
+
+  kmeans_parallel_select    keep every point with probability l * d^2 / phi
+  kmeans_parallel_distance  fold the new candidates into the nearest distances
+  kmeans_parallel_weights   number of points closest to every candidate
+
+and the weighted candidates are reclustered on the host.
+
+The scan kernels split the input into get_num_groups(0) contiguous tiles and
+every tile into blockSize contiguous chunks, one per work-item.
+************************************************************************/
+
+// Range [*first, *last) of the points scanned by this work-item
+inline void scan_chunk(unsigned int count, unsigned int *first, unsigned int *last)
+{
+	unsigned int tile = (count + get_num_groups(0) - 1) / get_num_groups(0);
+	unsigned int chunk = (tile + blockSize - 1) / blockSize;
+	unsigned int tile_end = min((unsigned int)((get_group_id(0) + 1) * tile), count);
+	*first = min((unsigned int)(get_group_id(0) * tile + get_local_id(0) * chunk), tile_end);
+	*last = min(*first + chunk, tile_end);
+}
+
+// Sum of sdata[0 .. blockSize) into sdata[0]
+inline void sum_reduce(__local float *sdata, unsigned int tid)
+{
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (blockSize >= 512) { if (tid < 256) { sdata[tid] += sdata[tid + 256]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >= 256) { if (tid < 128) { sdata[tid] += sdata[tid + 128]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >= 128) { if (tid <  64) { sdata[tid] += sdata[tid +  64]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=  64) { if (tid <  32) { sdata[tid] += sdata[tid +  32]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=  32) { if (tid <  16) { sdata[tid] += sdata[tid +  16]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=  16) { if (tid <   8) { sdata[tid] += sdata[tid +   8]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=   8) { if (tid <   4) { sdata[tid] += sdata[tid +   4]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=   4) { if (tid <   2) { sdata[tid] += sdata[tid +   2]; } barrier(CLK_LOCAL_MEM_FENCE); }
+	if (blockSize >=   2) { if (tid <   1) { sdata[tid] += sdata[tid +   1]; } barrier(CLK_LOCAL_MEM_FENCE); }
+}
+
+// Distance of every point to the nearest of the centroids chosen so far;
+// only centroid c is new, so the previous minimum is reused
+__kernel void kmeans_seed_distance(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, const int c, __global float *min_distance, const unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if (i >= count)
+	{
+		return;
+	}
+
+	float distance = point_distance(features, pitch, i, centroids, c);
+	min_distance[i] = (c == 0) ? distance : min(min_distance[i], distance);
+}
 
-		//////////////////////////////////////////////////////////////////////////
-		// Synchronize to make sure all threads are done
+// First pass of the scan: total of every tile to block_sums[group]
+__kernel void kmeans_scan_reduce(__global const float *g_idata, __global float *block_sums, const unsigned int count, __local float *sdata)
+{
+	unsigned int tid = get_local_id(0);
+	unsigned int first, last;
+	scan_chunk(count, &first, &last);
+
+	float total = 0;
+	for (unsigned int i = first; i < last; i++)
+	{
+		total += g_idata[i];
+	}
+	sdata[tid] = total;
+
+	sum_reduce(sdata, tid);
+	if (tid == 0) block_sums[get_group_id(0)] = sdata[0];
+}
+
+// Second pass of the scan: inclusive prefix sum of g_idata to g_odata,
+// relative to the start of every tile, so that a long float prefix does not
+// swallow the late small distances; the tiles are chained through
+// block_sums at sampling time. The work-items scan their chunk totals in
+// local memory (Hillis-Steele) and run through their chunk with
+// compensation, so a large distance early in a tile does not swallow the
+// small ones after it either.
+__kernel void kmeans_scan(__global const float *g_idata, __global float *g_odata, const unsigned int count, __local float *sdata)
+{
+	unsigned int tid = get_local_id(0);
+	unsigned int first, last;
+	scan_chunk(count, &first, &last);
+
+	float total = 0, comp = 0;
+	for (unsigned int i = first; i < last; i++)
+	{
+		neumaier_add(&total, &comp, g_idata[i]);
+	}
+	total += comp;
+	sdata[tid] = total;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (unsigned int s = 1; s < blockSize; s <<= 1)
+	{
+		float t = (tid >= s) ? sdata[tid - s] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		sdata[tid] += t;
 		barrier(CLK_LOCAL_MEM_FENCE);
-		//////////////////////////////////////////////////////////////////////////
+	}
+
+	float running = sdata[tid] - total;
+	comp = 0;
+	for (unsigned int i = first; i < last; i++)
+	{
+		neumaier_add(&running, &comp, g_idata[i]);
+		g_odata[i] = running + comp;
+	}
+}
+
+// Draw centroid c: the first point whose cumulative distance exceeds
+// u * total, in two levels (launched with a single work-item). The tile is
+// picked from the num_groups tile totals of kmeans_scan_reduce, summed with
+// compensation, then the rest of the cutoff is found by binary search of
+// the tile's own prefix from kmeans_scan.
+__kernel void kmeans_seed_sample(__global const FEATURE_T *features, const unsigned int pitch, __global const float *distance_accumulation, __global const float *block_sums, const unsigned int num_groups, const float u, __global float *centroids, const int c, const unsigned int count)
+{
+	float total = 0, comp = 0;
+	for (unsigned int g = 0; g < num_groups; g++)
+	{
+		neumaier_add(&total, &comp, block_sums[g]);
+	}
+	float cutoff = u * (total + comp);
+
+	// the tile the cutoff falls into; rounding past the end picks the last
+	// tile with any distance
+	unsigned int tile = 0;
+	float tile_start = 0;
+	float before = 0, before_comp = 0;
+	for (unsigned int g = 0; g < num_groups; g++)
+	{
+		if (block_sums[g] > 0)
+		{
+			tile = g;
+			tile_start = before + before_comp;
+			if (tile_start + block_sums[g] > cutoff)
+			{
+				break;
+			}
+			neumaier_add(&before, &before_comp, block_sums[g]);
+		}
+	}
+	cutoff -= tile_start;
+
+	unsigned int tile_size = (count + num_groups - 1) / num_groups;
+	unsigned int lo = tile * tile_size;
+	unsigned int hi = min(lo + tile_size, count) - 1;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (distance_accumulation[mid] > cutoff)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	copy_point(features, pitch, lo, centroids, c);
+}
+
+// k-means|| round: keep point i with probability l * d^2 / phi, where phi is
+// the sum of block_sums (from kmeans_scan_reduce). Candidates are appended
+// to candidates[] through an atomic counter, up to max_candidates.
+__kernel void kmeans_parallel_select(__global const FEATURE_T *features, const unsigned int pitch, __global const float *min_distance, __global const float *block_sums, const unsigned int num_groups, const float l, const unsigned int random_seed, const unsigned int random_seed2, __global float *candidates, __global unsigned int *candidate_count, const unsigned int max_candidates, const unsigned int count)
+{
+	unsigned int iGID = get_global_id(0);
+	if (iGID >= count)
+	{
+		return;
+	}
+
+	float phi = 0;
+	for (unsigned int g = 0; g < num_groups; g++)
+	{
+		phi += block_sums[g];
+	}
+
+	// per-point stream, decorrelated by the point index
+	unsigned int random1 = random_seed ^ iGID ^ circular_shift_right(~random_seed2, iGID % 32, 32);
+	unsigned int random2 = random_seed2 ^ iGID ^ circular_shift_right(~random_seed, iGID % 32, 32);
+	float u = get_random(&random1, &random2) / 4294967296.0f;
 
-		if (iGID >= 0 && iGID < k)
+	if (phi > 0 && u * phi < l * min_distance[iGID])
+	{
+		unsigned int index = atomic_inc(candidate_count);
+		if (index < max_candidates)
 		{
-			// estimate the values of the new centers
-			if (centroids_quantity[i] > 0)
+			copy_point(features, pitch, iGID, candidates, index);
+		}
+	}
+}
+
+// Fold candidates [first_candidate, num_candidates) into the nearest distances
+__kernel void kmeans_parallel_distance(__global const FEATURE_T *features, const unsigned int pitch, __global const float *candidates, const unsigned int first_candidate, const unsigned int num_candidates, __global float *min_distance, const unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if (i >= count)
+	{
+		return;
+	}
+
+	float distance = min_distance[i];
+	for (unsigned int j = first_candidate; j < num_candidates; j++)
+	{
+		distance = min(distance, point_distance(features, pitch, i, candidates, j));
+	}
+	min_distance[i] = distance;
+}
+
+// Weight of every candidate: the number of points closest to it
+__kernel void kmeans_parallel_weights(__global const FEATURE_T *features, const unsigned int pitch, __global const float *candidates, const unsigned int num_candidates, __global unsigned int *weights, const unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if (i >= count)
+	{
+		return;
+	}
+
+	unsigned int nearest = 0;
+	float distance = point_distance(features, pitch, i, candidates, 0);
+	for (unsigned int j = 1; j < num_candidates; j++)
+	{
+		float distance_new = point_distance(features, pitch, i, candidates, j);
+		if (distance_new < distance)
+		{
+			nearest = j;
+			distance = distance_new;
+		}
+	}
+	atomic_inc(&weights[nearest]);
+}
+
+/************************************************************************
+Batched clustering
+
+Several runs (restarts with other seeds, other values of k) are clustered
+side by side on one resident feature table. Their centroids sit back to
+back in one table: run r owns entries [run_first[r], run_first[r] +
+run_k[r]). The labels of run r are the plane label_ptr + r * count and
+hold ids local to the run.
+
+  kmeans_assign_batch      every point is read once for all the runs
+  kmeans_accumulate_batch  per work-group sums of every entry of the table
+  kmeans_converge          unchanged, with k the size of the whole table
+  kmeans_inertia_batch     per work-group sum of squared distances per run
+************************************************************************/
+
+// Assignment step of all runs
+__kernel void kmeans_assign_batch(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global const int *run_first, __global const int *run_k, const int num_runs, __global LABEL_T *label_ptr, const unsigned int count, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	int iGID = get_global_id(0);
+	if (iGID >= count)
+	{
+		return;
+	}
+
+#if D <= UNROLL_MAX_D
+	float point[D];
+	#pragma unroll
+	for (int d=0; d<D; d++)
+	{
+		point[d] = FEATURE(features, pitch, iGID, d);
+	}
+	#define ASSIGN_DISTANCE(j) register_distance(point, centroids, j)
+#else
+	#define ASSIGN_DISTANCE(j) point_distance(features, pitch, iGID, centroids, j)
+#endif
+
+	for (int r=0; r<num_runs; r++)
+	{
+		int first = run_first[r];
+		int k = run_k[r];
+		LABEL_T centroids_index = 0;
+		float distance = ASSIGN_DISTANCE(first);
+		for (int j=1; j<k; j++)
+		{
+			float distance_new = ASSIGN_DISTANCE(first + j);
+			if (distance_new < distance)
 			{
-				centroids_new[i*D] /= centroids_quantity[i];
-				centroids_new[i*D+1] /= centroids_quantity[i];
-				centroids_new[i*D+2] /= centroids_quantity[i];
+				centroids_index = j;
+				distance = distance_new;
 			}
+		}
+		label_ptr[(size_t)r * count + iGID] = centroids_index;
+	}
+	#undef ASSIGN_DISTANCE
+}
+
+// Update step of all runs, kmeans_accumulate over the whole table of
+// k_total entries in one pass over the points: every point is read once
+// and added to entry run_first[r] + label of each run r.
+// partial_sums[group][k_total][D], partial_counts[group][k_total];
+// sdata, squantity, sorder and columns as in kmeans_accumulate with
+// k_total bins.
+__kernel void kmeans_accumulate_batch(__global const FEATURE_T *features, const unsigned int pitch, __global const LABEL_T *label_ptr, __global const int *run_first, const int num_runs, __global float *partial_sums, __global unsigned int *partial_counts, const unsigned int count, const int k_total, __local float *sdata, __local unsigned int *squantity, __local unsigned int *sorder, const unsigned int columns, __global const unsigned int *status)
+{
+	if (CONVERGED(status))
+	{
+		return;
+	}
 
-			distance_new
-				= abs(centroids[i*D] - centroids_new[i*D])
-				+ abs(centroids[i*D+1] - centroids_new[i*D+1])
-				+ abs(centroids[i*D+2] - centroids_new[i*D+2]);
+	unsigned int tid = get_local_id(0);
+	unsigned int group = get_group_id(0);
+	unsigned int gridSize = blockSize*get_num_groups(0);
+	__global float *sums = partial_sums + group * k_total * D;
+	__global unsigned int *counts = partial_counts + group * k_total;
 
-			if (distance_new > epsilon)
+	if (columns > 0)
+	{
+		bins_clear(sdata, squantity, tid, k_total, columns);
+		for (unsigned int first = group*blockSize; first < count; first += gridSize)
+		{
+			unsigned int i = first + tid;
+			float x[D];
+			if (i < count)
+			{
+				for (int d=0; d<D; d++)
+				{
+					x[d] = FEATURE(features, pitch, i, d);
+				}
+			}
+			for (int r=0; r<num_runs; r++)
 			{
-				//changed = true;
-				distance_accumulation[0] += 1;
+				unsigned int bin = (i < count) ? run_first[r] + label_ptr[(size_t)r * count + i] : NO_BIN;
+				bins_scatter(sdata, squantity, tid, k_total, columns, bin, x);
 			}
 		}
+		bins_reduce(sdata, squantity, tid, k_total, columns, sums, counts);
+	}
+	else
+	{
+		__global float *comps = partial_sums + (get_num_groups(0) + group) * k_total * D;
+		bins_zero(sums, comps, counts, tid, k_total);
+		for (unsigned int first = group*blockSize; first < count; first += gridSize)
+		{
+			unsigned int i = first + tid;
+			for (int r=0; r<num_runs; r++)
+			{
+				squantity[tid] = (i < count) ? run_first[r] + label_ptr[(size_t)r * count + i] : NO_BIN;
+				sort_tile(squantity, sorder, tid);
+				bins_segment(features, pitch, squantity, sorder, first, tid, sums, comps, counts);
+				barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+			}
+		}
+		bins_finish(sums, comps, tid, k_total);
+	}
+}
 
-		//////////////////////////////////////////////////////////////////////////
-		// Synchronize to make sure all threads are done
-		barrier(CLK_LOCAL_MEM_FENCE);
-		//////////////////////////////////////////////////////////////////////////
+// Inertia of all runs: every work-group writes the sum of the squared
+// distances of its points to their centroids to partial_inertia[group][run].
+// sdata must hold blockSize floats.
+__kernel void kmeans_inertia_batch(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global const int *run_first, const int num_runs, __global const LABEL_T *label_ptr, __global float *partial_inertia, const unsigned int count, __local float *sdata)
+{
+	unsigned int tid = get_local_id(0);
+	unsigned int group = get_group_id(0);
+	unsigned int gridSize = blockSize*get_num_groups(0);
 
-		// if the counter is larger than zero, which means some centroids have changed
-		if (distance_accumulation[0] > 0.1)
+	for (int r=0; r<num_runs; r++)
+	{
+		__global const LABEL_T *labels = label_ptr + (size_t)r * count;
+		int first = run_first[r];
+		float inertia = 0;
+		for (unsigned int i = group*blockSize + tid; i < count; i += gridSize)
 		{
-			break;
+			inertia += point_distance(features, pitch, i, centroids, first + labels[i]);
 		}
+		sdata[tid] = inertia;
+
+		sum_reduce(sdata, tid);
+		if (tid == 0) partial_inertia[group * num_runs + r] = sdata[0];
+
+		// sdata is reused by the next run
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+/************************************************************************
+Profiling
+
+With profiling on, kmeans_iteration_stats runs after every assignment step
+and records how the iteration went: the inertia of the new labels against
+the centroids they were assigned to, and the number of points whose label
+changed. Each iteration owns one row of the stats buffers, so they are read
+back once after the last iteration.
+************************************************************************/
 
-		if (iGID == 0)
+// Every work-group writes its inertia to partial_inertia[iteration][group]
+// and adds its moved points to moved[iteration]; all points count as moved
+// in the first iteration. prev_labels keeps the labels for the next one.
+// sdata must hold blockSize floats.
+__kernel void kmeans_iteration_stats(__global const FEATURE_T *features, const unsigned int pitch, __global const float *centroids, __global const LABEL_T *label_ptr, __global LABEL_T *prev_labels, __global float *partial_inertia, __global unsigned int *moved, const int iteration, const unsigned int count, __local float *sdata, __global const unsigned int *status)
+{
+	__local unsigned int smoved;
+	if (CONVERGED(status))
+	{
+		return;
+	}
+
+	unsigned int tid = get_local_id(0);
+	unsigned int group = get_group_id(0);
+	unsigned int gridSize = blockSize*get_num_groups(0);
+	if (tid == 0) smoved = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	float inertia = 0;
+	unsigned int changed = 0;
+	for (unsigned int i = group*blockSize + tid; i < count; i += gridSize)
+	{
+		LABEL_T label = label_ptr[i];
+		inertia += point_distance(features, pitch, i, centroids, label);
+		if (iteration == 0 || prev_labels[i] != label)
 		{
-			// swap the new centroids with the old ones
-			temp_ptr = centroids;
-			centroids = centroids_new;
-			centroids_new = temp_ptr;
+			changed++;
 		}
+		prev_labels[i] = label;
 	}
+	sdata[tid] = inertia;
+	if (changed > 0) atomic_add(&smoved, changed);
+
+	// sum_reduce starts with a barrier, the local count is complete after it
+	sum_reduce(sdata, tid);
+	if (tid == 0)
+	{
+		partial_inertia[iteration * get_num_groups(0) + group] = sdata[0];
+		if (smoved > 0) atomic_add(moved + iteration, smoved);
+	}
+}
+
+/************************************************************************
+Feature extraction
+
+kmeans_volume_features derives the default feature space from the scalar
+volume alone: the scalar value, the gradient magnitude and the second
+derivative along the gradient direction (g^T H g / |g|^2), by central
+differences clamped at the volume border. Every work-group loads its
+TILE_X * TILE_Y * TILE_Z block with a one voxel halo to local memory once;
+the 27-point stencil of every voxel then reads local memory only.
+
+The volume is nx * ny * nz values, x fastest; point i of the feature table
+is voxel (x, y, z) with i = (z * ny + y) * nx + x. The table is float or
+half; the integer types need a scale fitted to the derived values, so the
+host derives those (k_means_engine.cpp).
+************************************************************************/
+
+// Tile of one work-group, set by the host
+#ifndef TILE_X
+#define TILE_X 8
+#endif
+#ifndef TILE_Y
+#define TILE_Y 8
+#endif
+#ifndef TILE_Z
+#define TILE_Z 4
+#endif
+
+__kernel __attribute__((reqd_work_group_size(TILE_X, TILE_Y, TILE_Z)))
+void kmeans_volume_features(__global const float *scalar_value, const int nx, const int ny, const int nz, __global FEATURE_T *features, const unsigned int pitch)
+{
+	__local float tile[TILE_Z + 2][TILE_Y + 2][TILE_X + 2];
 
-	//////////////////////////////////////////////////////////////////////////
-	// Synchronize to make sure all the threads are done
+	// cooperative load of the tile and its halo
+	const int x0 = get_group_id(0) * TILE_X - 1;
+	const int y0 = get_group_id(1) * TILE_Y - 1;
+	const int z0 = get_group_id(2) * TILE_Z - 1;
+	const int lid = (get_local_id(2) * TILE_Y + get_local_id(1)) * TILE_X + get_local_id(0);
+	for (int t = lid; t < (TILE_X + 2) * (TILE_Y + 2) * (TILE_Z + 2); t += TILE_X * TILE_Y * TILE_Z)
+	{
+		int tx = t % (TILE_X + 2);
+		int ty = (t / (TILE_X + 2)) % (TILE_Y + 2);
+		int tz = t / ((TILE_X + 2) * (TILE_Y + 2));
+		int x = clamp(x0 + tx, 0, nx - 1);
+		int y = clamp(y0 + ty, 0, ny - 1);
+		int z = clamp(z0 + tz, 0, nz - 1);
+		tile[tz][ty][tx] = scalar_value[((size_t)z * ny + y) * nx + x];
+	}
 	barrier(CLK_LOCAL_MEM_FENCE);
-	//////////////////////////////////////////////////////////////////////////
 
-	int shift = (int)(log2(256./k));
-	label_ptr[iGID] = label_ptr[iGID] << shift;
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	if (x >= nx || y >= ny || z >= nz)
+	{
+		return;
+	}
+
+	const int tx = get_local_id(0) + 1;
+	const int ty = get_local_id(1) + 1;
+	const int tz = get_local_id(2) + 1;
+#define S(dx, dy, dz) tile[tz + (dz)][ty + (dy)][tx + (dx)]
+	float f = S(0, 0, 0);
+
+	// gradient
+	float gx = 0.5f * (S(1, 0, 0) - S(-1, 0, 0));
+	float gy = 0.5f * (S(0, 1, 0) - S(0, -1, 0));
+	float gz = 0.5f * (S(0, 0, 1) - S(0, 0, -1));
+
+	// Hessian
+	float hxx = S(1, 0, 0) - 2.0f * f + S(-1, 0, 0);
+	float hyy = S(0, 1, 0) - 2.0f * f + S(0, -1, 0);
+	float hzz = S(0, 0, 1) - 2.0f * f + S(0, 0, -1);
+	float hxy = 0.25f * (S(1, 1, 0) - S(1, -1, 0) - S(-1, 1, 0) + S(-1, -1, 0));
+	float hxz = 0.25f * (S(1, 0, 1) - S(1, 0, -1) - S(-1, 0, 1) + S(-1, 0, -1));
+	float hyz = 0.25f * (S(0, 1, 1) - S(0, 1, -1) - S(0, -1, 1) + S(0, -1, -1));
+#undef S
+
+	float g2 = gx * gx + gy * gy + gz * gz;
+	float second = 0.0f;
+	if (g2 > 0.0f)
+	{
+		second = (gx * (hxx * gx + hxy * gy + hxz * gz) + 
+				  gy * (hxy * gx + hyy * gy + hyz * gz) + 
+				  gz * (hxz * gx + hyz * gy + hzz * gz)) / g2;
+	}
+
+	unsigned int i = ((unsigned int)z * ny + y) * nx + x;
+	FEATURE_STORE(features, FEATURE_INDEX(pitch, i, 0), f);
+	FEATURE_STORE(features, FEATURE_INDEX(pitch, i, 1), sqrt(g2));
+	FEATURE_STORE(features, FEATURE_INDEX(pitch, i, 2), fabs(second));
 }
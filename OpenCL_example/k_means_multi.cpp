@@ -0,0 +1,420 @@
+// Data-parallel k-means over several devices, see k_means_multi.h
+// *********************************************************************
+
+// common SDK header for standard utilities and system libs
+#include <oclUtils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "k_means_cpu.h"
+#include "k_means_engine.h"
+#include "k_means_multi.h"
+
+// Devices
+// *********************************************************************
+#ifdef CL_VERSION_1_2
+// One sub-device per NUMA node of a CPU device, nothing if the device or
+// its platform cannot be partitioned that way
+static std::vector<cl_device_id> KMeansNumaSubDevices(cl_device_id device)
+{
+	std::vector<cl_device_id> sub_devices;
+	char cVersion[64] = "";
+	clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(cVersion) - 1, cVersion, NULL);
+	int iMajor = 0, iMinor = 0;
+	if (sscanf(cVersion, "OpenCL %d.%d", &iMajor, &iMinor) != 2 || iMajor * 10 + iMinor < 12)
+	{
+		return sub_devices;
+	}
+
+	const cl_device_partition_property properties[3] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+	cl_uint uiNum = 0;
+	if (clCreateSubDevices(device, properties, 0, NULL, &uiNum) != CL_SUCCESS || uiNum < 2)
+	{
+		return sub_devices;
+	}
+	sub_devices.resize(uiNum);
+	if (clCreateSubDevices(device, properties, uiNum, &sub_devices[0], NULL) != CL_SUCCESS)
+	{
+		sub_devices.clear();
+	}
+	return sub_devices;
+}
+#endif
+
+std::vector<cl_device_id> KMeansAllDevices(bool split_numa)
+{
+	std::vector<cl_device_id> devices;
+	cl_platform_id platforms[16];
+	cl_uint uiPlatforms = 0;
+	if (clGetPlatformIDs(16, platforms, &uiPlatforms) != CL_SUCCESS)
+	{
+		return devices;
+	}
+	for (cl_uint p = 0; p < uiPlatforms && p < 16; p++)
+	{
+		cl_uint uiDevices = 0;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &uiDevices) != CL_SUCCESS || uiDevices == 0)
+		{
+			continue;
+		}
+		std::vector<cl_device_id> platform_devices(uiDevices);
+		clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, uiDevices, &platform_devices[0], NULL);
+		for (cl_uint d = 0; d < uiDevices; d++)
+		{
+			cl_device_type type = 0;
+			clGetDeviceInfo(platform_devices[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+#ifdef CL_VERSION_1_2
+			if (split_numa && (type & CL_DEVICE_TYPE_CPU))
+			{
+				std::vector<cl_device_id> nodes = KMeansNumaSubDevices(platform_devices[d]);
+				if (!nodes.empty())
+				{
+					devices.insert(devices.end(), nodes.begin(), nodes.end());
+					continue;
+				}
+			}
+#else
+			(void)split_numa;
+#endif
+			devices.push_back(platform_devices[d]);
+		}
+	}
+	return devices;
+}
+
+void KMeansReleaseDevices(const std::vector<cl_device_id>& devices)
+{
+#ifdef CL_VERSION_1_2
+	// root devices ignore the release, only sub-devices are reference counted
+	for (size_t d = 0; d < devices.size(); d++)
+	{
+		cl_device_id parent = NULL;
+		if (clGetDeviceInfo(devices[d], CL_DEVICE_PARENT_DEVICE, sizeof(parent), &parent, NULL) == CL_SUCCESS && parent)
+		{
+			clReleaseDevice(devices[d]);
+		}
+	}
+#else
+	(void)devices;
+#endif
+}
+
+// Engine
+// *********************************************************************
+KMeansMultiEngine::KMeansMultiEngine()
+	: bLoaded(false)
+{
+	memset(&features, 0, sizeof(features));
+}
+
+KMeansMultiEngine::~KMeansMultiEngine()
+{
+	release();
+}
+
+void KMeansMultiEngine::release()
+{
+	for (size_t e = 0; e < engines.size(); e++)
+	{
+		delete engines[e];
+	}
+	engines.clear();
+	weights.clear();
+	first.clear();
+	counts.clear();
+	partitionPlanes.clear();
+	bLoaded = false;
+}
+
+// Build the kernels of every engine for k one engine after the other: the
+// program cache is shared, and the parallel loops of iterate and predict
+// must find them built
+cl_int KMeansMultiEngine::prepare(int k)
+{
+	for (size_t e = 0; e < engines.size(); e++)
+	{
+		cl_int ciErr1 = (counts[e] == 0) ? CL_SUCCESS : engines[e]->prepare(k);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error: kernels of partition %d did not build\n\n", (int)e);
+			return ciErr1;
+		}
+	}
+	return CL_SUCCESS;
+}
+
+cl_int KMeansMultiEngine::init(const std::vector<cl_device_id>& devices, const char* source_path, const KMeansEngineConfig& config)
+{
+	release();
+	if (devices.empty())
+	{
+		shrLog("Error: KMeansMultiEngine::init needs at least one device\n\n");
+		return CL_DEVICE_NOT_FOUND;
+	}
+
+	double dTotal = 0;
+	for (size_t d = 0; d < devices.size(); d++)
+	{
+		KMeansEngine* pEngine = new KMeansEngine;
+		cl_int ciErr1 = pEngine->init(devices[d], source_path, config);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			delete pEngine;
+			release();
+			return ciErr1;
+		}
+		engines.push_back(pEngine);
+
+		// same estimate as oclGetMaxFlopsDev
+		cl_uint uiComputeUnits = 1, uiClock = 1;
+		char cName[256] = "";
+		clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(uiComputeUnits), &uiComputeUnits, NULL);
+		clGetDeviceInfo(devices[d], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(uiClock), &uiClock, NULL);
+		clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(cName) - 1, cName, NULL);
+		weights.push_back((double)MAX(uiComputeUnits, 1u) * MAX(uiClock, 1u));
+		dTotal += weights.back();
+		shrLog("  device %u: %s (%u compute units, %u MHz)\n", (unsigned int)d, cName, uiComputeUnits, uiClock);
+	}
+	for (size_t e = 0; e < weights.size(); e++)
+	{
+		weights[e] /= dTotal;
+	}
+	return CL_SUCCESS;
+}
+
+bool KMeansMultiEngine::setWeights(const std::vector<double>& shares)
+{
+	double dTotal = 0;
+	for (size_t e = 0; e < shares.size(); e++)
+	{
+		if (shares[e] < 0)
+		{
+			return false;
+		}
+		dTotal += shares[e];
+	}
+	if (shares.size() != engines.size() || dTotal <= 0)
+	{
+		return false;
+	}
+	for (size_t e = 0; e < shares.size(); e++)
+	{
+		weights[e] = shares[e] / dTotal;
+	}
+	return true;
+}
+
+cl_int KMeansMultiEngine::load(const KMeansFeatures& host_features)
+{
+	const int iEngines = (int)engines.size();
+	bLoaded = false;
+	if (iEngines == 0)
+	{
+		shrLog("Error: KMeansMultiEngine::load before init\n\n");
+		return CL_INVALID_CONTEXT;
+	}
+	if (host_features.D < 1 || host_features.D > K_MEANS_MAX_D)
+	{
+		shrLog("Error: KMeansMultiEngine::load needs 1 to %d features\n\n", K_MEANS_MAX_D);
+		return CL_INVALID_VALUE;
+	}
+	features = host_features;
+	featureScales.assign(features.D, 1.0f);
+	featureOffsets.assign(features.D, 0.0f);
+	if (host_features.scale && host_features.offset)
+	{
+		featureScales.assign(host_features.scale, host_features.scale + features.D);
+		featureOffsets.assign(host_features.offset, host_features.offset + features.D);
+	}
+	else
+	{
+		KMeansFeatureScaleHost(host_features, engines[0]->featureType(), &featureScales[0], &featureOffsets[0], 0);
+	}
+	features.scale = &featureScales[0];
+	features.offset = &featureOffsets[0];
+	first.assign(iEngines, 0);
+	counts.assign(iEngines, 0);
+	partitionPlanes.assign(iEngines, std::vector<const float*>());
+
+	// contiguous partitions by weight, the last one takes the rounding
+	unsigned int uiNext = 0;
+	for (int e = 0; e < iEngines; e++)
+	{
+		unsigned int uiCount = (e == iEngines - 1) ? features.count - uiNext : (unsigned int)(features.count * weights[e]);
+		first[e] = uiNext;
+		counts[e] = MIN(uiCount, features.count - uiNext);
+		uiNext += counts[e];
+		if (counts[e] == 0)
+		{
+			continue;
+		}
+
+		KMeansFeatures partition = { counts[e], features.D, NULL, NULL, features.scale, features.offset };
+		if (features.interleaved)
+		{
+			partition.interleaved = features.interleaved + (size_t)first[e] * features.D;
+		}
+		else
+		{
+			for (int d = 0; d < features.D; d++)
+			{
+				partitionPlanes[e].push_back(features.planes[d] + first[e]);
+			}
+			partition.planes = &partitionPlanes[e][0];
+		}
+		cl_int ciErr1 = engines[e]->load(partition);
+		if (ciErr1 != CL_SUCCESS)
+		{
+			shrLog("Error: partition %d (%u points) did not load\n\n", e, counts[e]);
+			return ciErr1;
+		}
+		shrLog("  partition %d: points %u - %u%s\n", e, first[e], first[e] + counts[e] - 1, engines[e]->streaming() ? " (streamed)" : "");
+	}
+	bLoaded = true;
+	return CL_SUCCESS;
+}
+
+void KMeansMultiEngine::seed(const KMeansOptions& options, float* centroids)
+{
+	KMeansSeedHost(features, options.k, options.random_seed, options.random_seed2, centroids, options.num_threads);
+}
+
+cl_int KMeansMultiEngine::iterate(const KMeansOptions& options, float* centroids, int* iterations)
+{
+	const int k = options.k;
+	const int D = features.D;
+	const int iEngines = (int)engines.size();
+	const int iMaxIterations = (options.max_iterations > 0) ? options.max_iterations : K_MEANS_MAX_ITERATIONS;
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansMultiEngine::iterate needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+
+	cl_int ciErr1 = prepare(k);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	// per-partition sums and counts, and their all-reduce
+	std::vector<float> partial_sums((size_t)iEngines * k * D);
+	std::vector<unsigned int> partial_counts((size_t)iEngines * k);
+	std::vector<cl_int> errors(iEngines);
+	std::vector<double> sums(k * D);
+	std::vector<double> quantity(k);
+
+	int iIteration = 0;
+	bool bConverged = false;
+	while (!bConverged && iIteration < iMaxIterations)
+	{
+		// every engine on its own host thread, the devices run concurrently
+		#pragma omp parallel for num_threads(iEngines) schedule(static, 1)
+		for (int e = 0; e < iEngines; e++)
+		{
+			errors[e] = (counts[e] == 0) ? CL_SUCCESS :
+						engines[e]->accumulate(k, centroids, &partial_sums[(size_t)e * k * D], &partial_counts[(size_t)e * k]);
+		}
+		for (int e = 0; e < iEngines; e++)
+		{
+			if (errors[e] != CL_SUCCESS)
+			{
+				shrLog("Error in KMeansEngine::accumulate of partition %d, iteration %d\n\n", e, iIteration);
+				return errors[e];
+			}
+		}
+
+		// all-reduce in partition order, then the kmeans_converge update
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(quantity.begin(), quantity.end(), 0.0);
+		for (int e = 0; e < iEngines; e++)
+		{
+			if (counts[e] == 0)
+			{
+				continue;
+			}
+			for (int i = 0; i < k * D; i++)
+			{
+				sums[i] += partial_sums[(size_t)e * k * D + i];
+			}
+			for (int c = 0; c < k; c++)
+			{
+				quantity[c] += partial_counts[(size_t)e * k + c];
+			}
+		}
+		int iChanged = 0;
+		for (int c = 0; c < k; c++)
+		{
+			float distance_new = 0;
+			for (int d = 0; d < D; d++)
+			{
+				float value = (quantity[c] > 0) ? (float)(sums[c * D + d] / quantity[c]) : centroids[c * D + d];
+				distance_new += fabs(centroids[c * D + d] - value);
+				centroids[c * D + d] = value;
+			}
+			if (distance_new > K_MEANS_EPSILON)
+			{
+				iChanged++;
+			}
+		}
+		iIteration++;
+		bConverged = (iChanged == 0);
+	}
+
+	shrLog("k-means converged after %d iterations on %d devices\n", iIteration, iEngines);
+	if (iterations)
+	{
+		*iterations = iIteration;
+	}
+	return CL_SUCCESS;
+}
+
+cl_int KMeansMultiEngine::fit(const KMeansOptions& options, float* centroids, int* iterations)
+{
+	if (!bLoaded)
+	{
+		shrLog("Error: KMeansMultiEngine::fit needs a loaded dataset\n\n");
+		return CL_INVALID_VALUE;
+	}
+	seed(options, centroids);
+	return iterate(options, centroids, iterations);
+}
+
+cl_int KMeansMultiEngine::predict(int k, const float* centroids, void* labels, unsigned char* display)
+{
+	const int iEngines = (int)engines.size();
+	const size_t szLabelBytes = KMeansEngine::labelBytes(k);
+	if (!bLoaded || k < 1)
+	{
+		shrLog("Error: KMeansMultiEngine::predict needs a loaded dataset and k >= 1\n\n");
+		return CL_INVALID_VALUE;
+	}
+
+	cl_int ciErr1 = prepare(k);
+	if (ciErr1 != CL_SUCCESS)
+	{
+		return ciErr1;
+	}
+
+	// every partition writes its own range of the outputs
+	std::vector<cl_int> errors(iEngines);
+	#pragma omp parallel for num_threads(iEngines) schedule(static, 1)
+	for (int e = 0; e < iEngines; e++)
+	{
+		errors[e] = (counts[e] == 0) ? CL_SUCCESS :
+					engines[e]->predict(k, centroids, (unsigned char*)labels + szLabelBytes * first[e], display ? display + first[e] : NULL);
+	}
+	for (int e = 0; e < iEngines; e++)
+	{
+		if (errors[e] != CL_SUCCESS)
+		{
+			shrLog("Error in KMeansEngine::predict of partition %d\n\n", e);
+			return errors[e];
+		}
+	}
+	return CL_SUCCESS;
+}
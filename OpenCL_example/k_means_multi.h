@@ -0,0 +1,93 @@
+#ifndef __K_MEANS_MULTI_H__
+#define __K_MEANS_MULTI_H__
+
+#include <oclUtils.h>
+
+#include <vector>
+
+#include "k_means_cpu.h"
+#include "k_means_engine.h"
+
+// Data-parallel k-means over several devices
+// *********************************************************************
+// The points are split into contiguous partitions, one per device, each
+// held by its own KMeansEngine (context, queues, buffers). Every Lloyd
+// iteration all engines assign and accumulate their partition against the
+// same centroids at once, one host thread each (KMeansEngine::accumulate);
+// the host then adds up the k * D sums and k counts of the partitions, in
+// partition order and in double, and moves the centroids with the rule of
+// kmeans_converge: empty clusters stay, and the loop ends once no centroid
+// moved more than K_MEANS_EPSILON.
+//
+// Partitions are sized by compute units times clock, the estimate
+// oclGetMaxFlopsDev ranks devices by. CPU devices can be split along their
+// NUMA nodes (clCreateSubDevices, OpenCL 1.2), so that every node works on
+// its own queue and memory controller instead of one queue for all of them.
+// *********************************************************************
+
+// Every device of every platform; with split_numa, a CPU device that can
+// be partitioned by NUMA node is replaced by one sub-device per node. The
+// sub-devices are owned by the caller, see KMeansReleaseDevices.
+std::vector<cl_device_id> KMeansAllDevices(bool split_numa);
+
+// Release the sub-devices of a KMeansAllDevices list, once no engine uses them
+void KMeansReleaseDevices(const std::vector<cl_device_id>& devices);
+
+class KMeansMultiEngine
+{
+public:
+	KMeansMultiEngine();
+	~KMeansMultiEngine();
+
+	// One engine per device; source_path is the full path of k_means_kernel.cc
+	cl_int init(const std::vector<cl_device_id>& devices, const char* source_path, const KMeansEngineConfig& config = KMeansEngineConfig());
+
+	// Relative share of the points of every engine, replacing the compute
+	// units times clock estimate; used by the next load. False if there is
+	// not one non-negative share per engine, or all of them are 0.
+	bool setWeights(const std::vector<double>& shares);
+
+	// Partition a dataset over the engines; the host features must stay
+	// valid until the next load. Narrow storage types are fitted to the
+	// whole dataset, so that all partitions store the same values.
+	cl_int load(const KMeansFeatures& features);
+
+	// k-means++ on the host over all points (KMeansSeedHost)
+	void seed(const KMeansOptions& options, float* centroids);
+
+	// Lloyd iterations from centroids (updated in place)
+	cl_int iterate(const KMeansOptions& options, float* centroids, int* iterations = NULL);
+
+	// seed() then iterate()
+	cl_int fit(const KMeansOptions& options, float* centroids, int* iterations = NULL);
+
+	// Raw cluster ids of KMeansEngine::labelBytes(k) bytes each, and
+	// optionally the ids spread over 0-255 for display
+	cl_int predict(int k, const float* centroids, void* labels, unsigned char* display = NULL);
+
+	// Engines and their partitions
+	int numEngines() const { return (int)engines.size(); }
+	const KMeansEngine& engine(int e) const { return *engines[e]; }
+	unsigned int partitionFirst(int e) const { return first[e]; }
+	unsigned int partitionCount(int e) const { return counts[e]; }
+
+private:
+	// not copyable, the engines own their OpenCL objects
+	KMeansMultiEngine(const KMeansMultiEngine&);
+	KMeansMultiEngine& operator=(const KMeansMultiEngine&);
+
+	void release();
+	cl_int prepare(int k);
+
+	std::vector<KMeansEngine*> engines;     // one per device
+	std::vector<double> weights;            // share of the points of every engine
+	std::vector<unsigned int> first;        // first point of every partition
+	std::vector<unsigned int> counts;       // # of points of every partition (0 = engine idle)
+	std::vector<std::vector<const float*> > partitionPlanes;        // planes of every partition, if planar
+	std::vector<float> featureScales;       // stored values of all partitions, see KMeansFeatures::scale
+	std::vector<float> featureOffsets;
+	KMeansFeatures features;                // whole dataset
+	bool bLoaded;                           // a dataset is current
+};
+
+#endif
@@ -0,0 +1,374 @@
+// k-means benchmark sweep and auto-tuning, see k_means_shmoo.h
+// *********************************************************************
+
+// common SDK header for standard utilities and system libs
+#include <oclUtils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "k_means_cpu.h"
+#include "k_means_engine.h"
+#include "k_means_shmoo.h"
+
+// tuning file shared with oclReduction
+#include "../oclReduction/oclTuning.h"
+
+// Seeds of every case, fixed so that reports compare across builds
+#define K_MEANS_SHMOO_SEED 2010
+
+const char* KMeansShmooDeviceName(int device)
+{
+	static const char* names[K_MEANS_SHMOO_DEVICES] = { "gpu", "cpu", "native" };
+	return (device >= 0 && device < K_MEANS_SHMOO_DEVICES) ? names[device] : "unknown";
+}
+
+const char* KMeansShmooVariantName(int variant)
+{
+	static const char* names[K_MEANS_SHMOO_VARIANTS] = { "lloyd", "hamerly", "stream" };
+	return (variant >= 0 && variant < K_MEANS_SHMOO_VARIANTS) ? names[variant] : "unknown";
+}
+
+KMeansShmooConfig::KMeansShmooConfig()
+	: iterations(10), max_groups(64), num_threads(0), csv_path("k_means_shmoo.csv")
+{
+	for (unsigned int n = 1 << 20; n <= (1 << 24); n <<= 2)
+	{
+		sizes.push_back(n);
+	}
+	for (int k = 4; k <= 32; k *= 2)
+	{
+		ks.push_back(k);
+	}
+	dims.push_back(K_MEANS_D);
+	dims.push_back(8);
+	for (int l = 64; l <= 256; l *= 2)
+	{
+		local_sizes.push_back(l);
+	}
+	variants.push_back(K_MEANS_SHMOO_LLOYD);
+	variants.push_back(K_MEANS_SHMOO_HAMERLY);
+	for (int d = 0; d < K_MEANS_SHMOO_DEVICES; d++)
+	{
+		devices.push_back(d);
+	}
+}
+
+// First device of a type on any platform (the CPU device usually comes
+// with another platform than the GPU)
+// *********************************************************************
+static bool KMeansFindDevice(cl_device_type type, cl_device_id* device)
+{
+	cl_platform_id platforms[16];
+	cl_uint uiPlatforms = 0;
+	if (clGetPlatformIDs(16, platforms, &uiPlatforms) != CL_SUCCESS)
+	{
+		return false;
+	}
+	for (cl_uint p = 0; p < uiPlatforms && p < 16; p++)
+	{
+		if (clGetDeviceIDs(platforms[p], type, 1, device, NULL) == CL_SUCCESS)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// One report row; seconds < 0 for a case that did not run
+// *********************************************************************
+static void KMeansShmooRow(FILE* pFile, int device, const char* device_name, int variant, unsigned int count, int k, int D,
+						   bool interleaved, int local_size, int iterations, double seconds)
+{
+	double dBytes = (double)count * (2.0 * D * sizeof(float) + 2.0 * KMeansEngine::labelBytes(k));
+	bool bRan = (seconds >= 0 && iterations > 0);
+	double dIteration = bRan ? seconds / iterations : -1.0;
+	double dPoints = bRan ? count / dIteration * 1.0e-6 : -1.0;
+	double dBandwidth = bRan ? dBytes / dIteration * 1.0e-9 : -1.0;
+
+	fprintf(pFile, "%s,%s,%s,%u,%d,%d,%s,%d,%d,%.6f,%.4f,%.3f,%.3f\n", KMeansShmooDeviceName(device), device_name,
+			KMeansShmooVariantName(variant), count, k, D, interleaved ? "aos" : "soa", local_size, iterations,
+			seconds, bRan ? dIteration * 1.0e3 : -1.0, dPoints, dBandwidth);
+	fflush(pFile);
+	shrLog("%-6s %-7s N = %9u  k = %3d  D = %3d  local = %3d  %4d it  %10.4f ms/it  %9.3f Mpts/s  %8.3f GB/s\n",
+		   KMeansShmooDeviceName(device), KMeansShmooVariantName(variant), count, k, D, local_size, iterations,
+		   bRan ? dIteration * 1.0e3 : -1.0, dPoints, dBandwidth);
+}
+
+// Sweep
+// *********************************************************************
+bool KMeansShmoo(const KMeansShmooConfig& config, const char* source_path)
+{
+	FILE* pFile = fopen(config.csv_path, "w");
+	if (pFile == NULL)
+	{
+		shrLog("Error: could not write %s\n\n", config.csv_path);
+		return false;
+	}
+	fprintf(pFile, "device,device_name,variant,points,k,d,layout,local_size,iterations,seconds,ms_per_iteration,mpoints_per_s,gb_per_s\n");
+	shrLog("k-means shmoo: %d iterations per case, report in %s\n\n", config.iterations, config.csv_path);
+
+	// every size clusters the first points of planes as long as the largest one
+	unsigned int uiMaxCount = 0;
+	for (size_t s = 0; s < config.sizes.size(); s++)
+	{
+		if (config.sizes[s] > uiMaxCount) uiMaxCount = config.sizes[s];
+	}
+
+	for (size_t di = 0; di < config.dims.size(); di++)
+	{
+		const int D = config.dims[di];
+		if (D < 1 || D > K_MEANS_MAX_D || uiMaxCount == 0)
+		{
+			continue;
+		}
+		std::vector<float> data((size_t)uiMaxCount * D);
+		std::vector<const float*> planes(D);
+		srand(K_MEANS_SHMOO_SEED + D);
+		for (int d = 0; d < D; d++)
+		{
+			shrFillArray(&data[(size_t)d * uiMaxCount], (int)uiMaxCount);
+			planes[d] = &data[(size_t)d * uiMaxCount];
+		}
+
+		for (size_t dv = 0; dv < config.devices.size(); dv++)
+		{
+			const int device = config.devices[dv];
+
+			// Native engine: Lloyd on the host thread pool, no work groups
+			if (device == K_MEANS_SHMOO_NATIVE)
+			{
+				std::vector<unsigned int> labels(uiMaxCount);
+				for (size_t s = 0; s < config.sizes.size(); s++)
+				{
+					KMeansFeatures features = { config.sizes[s], D, &planes[0], NULL, NULL, NULL };
+					for (size_t ki = 0; ki < config.ks.size(); ki++)
+					{
+						const int k = config.ks[ki];
+						std::vector<float> centroids(k * D);
+						KMeansSeedHost(features, k, K_MEANS_SHMOO_SEED, K_MEANS_SHMOO_SEED + 1, &centroids[0], config.num_threads);
+						shrDeltaT(1);
+						int iterations = KMeansLloydHost(features, k, &centroids[0], &labels[0], config.iterations, config.num_threads);
+						double seconds = shrDeltaT(1);
+						KMeansShmooRow(pFile, device, "host", K_MEANS_SHMOO_LLOYD, features.count, k, D, false, 0, iterations, seconds);
+					}
+				}
+				continue;
+			}
+
+			// OpenCL devices: one engine per work-group size and variant, each
+			// with its own context, so its programs are built again (or loaded
+			// from the binary cache) and released with the engine
+			cl_device_id cdDevice = NULL;
+			char cDeviceName[256] = "none";
+			bool bFound = KMeansFindDevice((device == K_MEANS_SHMOO_GPU) ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, &cdDevice);
+			if (bFound)
+			{
+				clGetDeviceInfo(cdDevice, CL_DEVICE_NAME, sizeof(cDeviceName) - 1, cDeviceName, NULL);
+				for (char* c = cDeviceName; *c; c++)
+				{
+					if (*c == ',' || *c == '"') *c = ' ';
+				}
+			}
+			else
+			{
+				shrLog("No OpenCL %s device, its cases are reported with -1 times\n", KMeansShmooDeviceName(device));
+			}
+
+			for (size_t li = 0; li < config.local_sizes.size(); li++)
+			{
+				for (size_t vi = 0; vi < config.variants.size(); vi++)
+				{
+					const int variant = config.variants[vi];
+					KMeansEngineConfig engine_config;
+					engine_config.local_size = config.local_sizes[li];
+					engine_config.max_groups = config.max_groups;
+					engine_config.streaming = (variant == K_MEANS_SHMOO_STREAM);
+					KMeansEngine engine;
+					cl_int ciErr1 = bFound ? engine.init(cdDevice, source_path, engine_config) : CL_DEVICE_NOT_FOUND;
+
+					for (size_t s = 0; s < config.sizes.size(); s++)
+					{
+						KMeansFeatures features = { config.sizes[s], D, &planes[0], NULL, NULL, NULL };
+						cl_int ciErr2 = (ciErr1 == CL_SUCCESS) ? engine.load(features) : ciErr1;
+						for (size_t ki = 0; ki < config.ks.size(); ki++)
+						{
+							KMeansOptions options;
+							options.k = config.ks[ki];
+							options.max_iterations = config.iterations;
+							options.random_seed = K_MEANS_SHMOO_SEED;
+							options.random_seed2 = K_MEANS_SHMOO_SEED + 1;
+							options.hamerly = (variant == K_MEANS_SHMOO_HAMERLY);
+							options.num_threads = config.num_threads;
+
+							// only the iterations are timed, seeding is the same for all variants
+							std::vector<float> centroids(options.k * D);
+							int iterations = 0;
+							double seconds = -1.0;
+							if (ciErr2 == CL_SUCCESS && engine.seed(options, &centroids[0]) == CL_SUCCESS)
+							{
+								shrDeltaT(1);
+								if (engine.iterate(options, &centroids[0], &iterations) == CL_SUCCESS)
+								{
+									seconds = shrDeltaT(1);
+								}
+							}
+							KMeansShmooRow(pFile, device, cDeviceName, variant, features.count, options.k, D,
+										   (ciErr2 == CL_SUCCESS) ? engine.interleaved() : false,
+										   (ciErr2 == CL_SUCCESS) ? (int)engine.localWorkSize() : config.local_sizes[li],
+										   iterations, seconds);
+						}
+					}
+				}
+			}
+		}
+	}
+	shrLog("\n");
+
+	bool bWritten = !ferror(pFile);
+	fclose(pFile);
+	return bWritten;
+}
+
+// Auto-tuning
+// *********************************************************************
+KMeansTuning::KMeansTuning()
+{
+	KMeansEngineConfig config;
+	local_size = (int)config.local_size;
+	max_groups = config.max_groups;
+	layout = config.layout;
+	hamerly = false;
+}
+
+// Tuning file kind of a problem; N goes in the size bucket
+static std::string KMeansTuningKind(int D, int k)
+{
+	char cKind[64];
+	sprintf(cKind, "kmeans D=%d k=2^%d", D, oclTuningBucket(k));
+	return std::string(cKind);
+}
+
+// Milliseconds per iteration of one configuration, < 0 if it does not run
+static double KMeansTimeTuning(cl_device_id device, const char* source_path, const KMeansFeatures& features, int k,
+							   int iterations, int num_threads, const KMeansTuning& tuning)
+{
+	KMeansEngineConfig engine_config;
+	engine_config.local_size = tuning.local_size;
+	engine_config.max_groups = tuning.max_groups;
+	engine_config.layout = tuning.layout;
+	KMeansOptions options;
+	options.k = k;
+	options.max_iterations = iterations;
+	options.random_seed = K_MEANS_SHMOO_SEED;
+	options.random_seed2 = K_MEANS_SHMOO_SEED + 1;
+	options.hamerly = tuning.hamerly;
+	options.num_threads = num_threads;
+
+	KMeansEngine engine;
+	std::vector<float> centroids(k * features.D);
+	int iIterations = 0;
+	if (engine.init(device, source_path, engine_config) != CL_SUCCESS ||
+		engine.load(features) != CL_SUCCESS ||
+		engine.seed(options, &centroids[0]) != CL_SUCCESS)
+	{
+		return -1.0;
+	}
+	shrDeltaT(1);
+	if (engine.iterate(options, &centroids[0], &iIterations) != CL_SUCCESS || iIterations < 1)
+	{
+		return -1.0;
+	}
+	return shrDeltaT(1) * 1.0e3 / iIterations;
+}
+
+bool KMeansTune(cl_device_id device, const char* source_path, const KMeansFeatures& features, int k, int iterations,
+				int num_threads, KMeansTuning* best)
+{
+	const int candidateLocal[] = { 64, 128, 256, 512 };
+	const int candidateGroups[] = { 16, 32, 64, 128, 256 };
+	const int candidateLayout[] = { K_MEANS_LAYOUT_PLANAR, K_MEANS_LAYOUT_INTERLEAVED };
+	double dBest = -1.0;
+	shrLog("Tuning k-means for %u points, k = %d, D = %d...\n\n", features.count, k, features.D);
+
+	// work-group size, layout and assignment at the default max_groups
+	KMeansTuning candidate;
+	for (int l = 0; l < 4; l++)
+	{
+		for (int y = 0; y < 2; y++)
+		{
+			for (int h = 0; h < 2; h++)
+			{
+				candidate.local_size = candidateLocal[l];
+				candidate.layout = candidateLayout[y];
+				candidate.hamerly = (h == 1);
+				double ms = KMeansTimeTuning(device, source_path, features, k, iterations, num_threads, candidate);
+				shrLog(" local %3d  %s  %-7s  groups %3d: %10.4f ms/it\n", candidate.local_size, y ? "aos" : "soa",
+					   candidate.hamerly ? "hamerly" : "lloyd", candidate.max_groups, ms);
+				if (ms >= 0 && (dBest < 0 || ms < dBest))
+				{
+					dBest = ms;
+					*best = candidate;
+				}
+			}
+		}
+	}
+	if (dBest < 0)
+	{
+		shrLog("\nNo configuration ran, nothing stored\n\n");
+		return false;
+	}
+
+	// then the # of accumulate groups of the winner
+	candidate = *best;
+	for (int g = 0; g < 5; g++)
+	{
+		if (candidateGroups[g] == best->max_groups)
+		{
+			continue;
+		}
+		candidate.max_groups = candidateGroups[g];
+		double ms = KMeansTimeTuning(device, source_path, features, k, iterations, num_threads, candidate);
+		shrLog(" local %3d  %s  %-7s  groups %3d: %10.4f ms/it\n", candidate.local_size,
+			   (candidate.layout == K_MEANS_LAYOUT_INTERLEAVED) ? "aos" : "soa", candidate.hamerly ? "hamerly" : "lloyd",
+			   candidate.max_groups, ms);
+		if (ms >= 0 && ms < dBest)
+		{
+			dBest = ms;
+			best->max_groups = candidate.max_groups;
+		}
+	}
+
+	shrLog("\nFastest: local %d, %s, %s, groups %d (%.4f ms/it)\n\n", best->local_size,
+		   (best->layout == K_MEANS_LAYOUT_INTERLEAVED) ? "aos" : "soa", best->hamerly ? "hamerly" : "lloyd", best->max_groups, dBest);
+	int values[4] = { best->local_size, best->max_groups, best->layout, best->hamerly ? 1 : 0 };
+	if (!oclSetTuning(device, KMeansTuningKind(features.D, k).c_str(), features.count, values, 4))
+	{
+		shrLog("Could not write the tuning file\n\n");
+	}
+	return true;
+}
+
+bool KMeansGetTuning(cl_device_id device, unsigned int count, int D, int k, KMeansTuning* tuning)
+{
+	int values[4];
+	if (!oclGetTuning(device, KMeansTuningKind(D, k).c_str(), count, values, 4))
+	{
+		return false;
+	}
+
+	// entries the engine could not run as written are ignored
+	bool bPow2 = values[0] > 0 && (values[0] & (values[0] - 1)) == 0;
+	if (!bPow2 || values[0] > K_MEANS_MAX_LOCAL_SIZE || values[1] < 1)
+	{
+		shrLog("Ignoring the tuning entry with local size %d, %d groups\n", values[0], values[1]);
+		return false;
+	}
+	tuning->local_size = values[0];
+	tuning->max_groups = values[1];
+	tuning->layout = values[2];
+	tuning->hamerly = (values[3] != 0);
+	return true;
+}
@@ -0,0 +1,99 @@
+#ifndef __K_MEANS_SHMOO_H__
+#define __K_MEANS_SHMOO_H__
+
+#include <oclUtils.h>
+
+#include <vector>
+
+#include "k_means_cpu.h"
+
+// k-means benchmark sweep ("shmoo")
+// *********************************************************************
+// The clustering counterpart of oclReduction --shmoo: times a fixed number
+// of Lloyd iterations for every combination of N, k, D, work-group size
+// and variant, on the OpenCL GPU and CPU devices and on the native engine,
+// and writes one CSV row per case. Data and seeds are fixed, so the CSV
+// of two builds can be diffed row by row.
+//
+// Bandwidth is the nominal traffic of one iteration over the time of one
+// iteration: the assign and accumulate steps each read the features, and
+// the labels are written once and read once. Hamerly skips part of these
+// reads, so its figure is what a full pass would have to reach.
+// *********************************************************************
+
+// Where a case runs
+enum KMeansShmooDevice
+{
+	K_MEANS_SHMOO_GPU,              // first OpenCL GPU device
+	K_MEANS_SHMOO_CPU,              // first OpenCL CPU device
+	K_MEANS_SHMOO_NATIVE,           // native engine (k_means_cpu.h), Lloyd only
+	K_MEANS_SHMOO_DEVICES
+};
+
+// How the device iterates
+enum KMeansShmooVariant
+{
+	K_MEANS_SHMOO_LLOYD,            // assign / accumulate over the resident features
+	K_MEANS_SHMOO_HAMERLY,          // bounded assignment
+	K_MEANS_SHMOO_STREAM,           // features streamed through the device in chunks
+	K_MEANS_SHMOO_VARIANTS
+};
+
+// Names used on the command line and in the CSV
+const char* KMeansShmooDeviceName(int device);
+const char* KMeansShmooVariantName(int variant);
+
+// Sweep parameters
+// *********************************************************************
+struct KMeansShmooConfig
+{
+	std::vector<unsigned int> sizes;        // # of points
+	std::vector<int> ks;                    // # of clusters
+	std::vector<int> dims;                  // # of features per point
+	std::vector<int> local_sizes;           // requested work-group sizes (the engine may halve them)
+	std::vector<int> variants;              // KMeansShmooVariant
+	std::vector<int> devices;               // KMeansShmooDevice
+	int iterations;                 // iterations timed per case (fewer if a case converges first)
+	int max_groups;                 // maximum # of work groups of the accumulate step
+	int num_threads;                // native engine threads (0 = one per core)
+	const char* csv_path;           // report
+
+	// 1M to 16M points, k = 4 to 32, D = 3 and 8, 64 to 256 work items,
+	// Lloyd and Hamerly, on every device
+	KMeansShmooConfig();
+};
+
+// Run the sweep; source_path is the full path of k_means_kernel.cc.
+// Returns false if the report cannot be written. Cases that cannot run
+// (no such device, out of memory) are logged and reported with -1 times.
+bool KMeansShmoo(const KMeansShmooConfig& config, const char* source_path);
+
+// Auto-tuning
+// *********************************************************************
+// KMeansTune times the engine's launch configurations on one device and
+// dataset: first every work-group size, layout and assignment (Lloyd or
+// Hamerly) with the default max_groups, then every max_groups for the
+// fastest of those. The winner is stored in the tuning file (oclTuning.h)
+// under "kmeans D=<D> k=2^<log2 k>" and the size bucket of N, where
+// KMeansGetTuning finds it on later runs.
+// *********************************************************************
+struct KMeansTuning
+{
+	int local_size;                 // requested work-group size
+	int max_groups;                 // maximum # of work groups of the accumulate step
+	int layout;                     // KMeansLayout
+	bool hamerly;                   // bounded assignment
+
+	// the engine defaults
+	KMeansTuning();
+};
+
+// Time the candidates on the current data with iterations Lloyd iterations
+// each; false if none ran
+bool KMeansTune(cl_device_id device, const char* source_path, const KMeansFeatures& features, int k, int iterations,
+				int num_threads, KMeansTuning* best);
+
+// Stored winner for a device and problem, false if there is none
+bool KMeansGetTuning(cl_device_id device, unsigned int count, int D, int k, KMeansTuning* tuning);
+
+#endif
@@ -0,0 +1,96 @@
+// Raw volume files, see k_means_volume.h
+// *********************************************************************
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "k_means_volume.h"
+
+// Map a raw volume read-only
+// *********************************************************************
+bool KMeansMapVolume(const char* path, KMeansVolume* volume)
+{
+	memset(volume, 0, sizeof(KMeansVolume));
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (unsigned long long)size.QuadPart > (size_t)-1)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	volume->file = file;
+	volume->mapping = mapping;
+	volume->bytes = (size_t)size.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);                      // the mapping keeps the file referenced
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+	// the points are visited front to back in every pass
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	volume->bytes = (size_t)st.st_size;
+#endif
+
+	volume->data = (const float*)data;
+	return true;
+}
+
+// Unmap a volume
+// *********************************************************************
+void KMeansUnmapVolume(KMeansVolume* volume)
+{
+	if (volume->data == NULL)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(volume->data);
+	CloseHandle(volume->mapping);
+	CloseHandle(volume->file);
+#else
+	munmap((void*)volume->data, volume->bytes);
+#endif
+
+	memset(volume, 0, sizeof(KMeansVolume));
+}
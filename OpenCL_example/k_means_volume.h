@@ -0,0 +1,32 @@
+#ifndef __K_MEANS_VOLUME_H__
+#define __K_MEANS_VOLUME_H__
+
+#include <stddef.h>
+
+// Raw volume files
+// *********************************************************************
+// A raw volume is a headerless file of 32 bit floats in host byte order
+// (or of half, 16 or 8 bit unsigned values, which the caller widens).
+// Files are memory-mapped read-only instead of being read into heap
+// copies: the pages are loaded on first access and can be handed to the
+// device directly (CL_MEM_USE_HOST_PTR) or uploaded from the mapping.
+// *********************************************************************
+
+struct KMeansVolume
+{
+	const float* data;              // first value of the mapping, page aligned
+	size_t bytes;                   // file size
+#ifdef _WIN32
+	void* file;                     // file handle
+	void* mapping;                  // file mapping handle
+#endif
+};
+
+// Map a raw volume read-only; returns false (and an empty volume) if the
+// file cannot be opened or mapped, or is empty
+bool KMeansMapVolume(const char* path, KMeansVolume* volume);
+
+// Unmap a volume, does nothing for an empty one
+void KMeansUnmapVolume(KMeansVolume* volume);
+
+#endif
@@ -0,0 +1,305 @@
+// Compiled program cache, see oclProgramCache.h
+// *********************************************************************
+
+#include <oclUtils.h>
+
+// additional includes
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "oclProgramCache.h"
+
+// programs built in this process, one reference each; the key starts with
+// the context, see cacheKeyPrefix
+static std::map<std::string, cl_program> programCache;
+
+// directory of the binaries on disk, empty for none
+static std::string programCacheDir;
+
+////////////////////////////////////////////////////////////////////////////////
+// Mutex of the cache and its directory, created before main so that the
+// first callers from several threads cannot race on its initialization
+////////////////////////////////////////////////////////////////////////////////
+class ProgramCacheMutex
+{
+public:
+#ifdef _WIN32
+    ProgramCacheMutex() { InitializeCriticalSection(&m); }
+    ~ProgramCacheMutex() { DeleteCriticalSection(&m); }
+    void lock() { EnterCriticalSection(&m); }
+    void unlock() { LeaveCriticalSection(&m); }
+private:
+    CRITICAL_SECTION m;
+#else
+    ProgramCacheMutex() { pthread_mutex_init(&m, NULL); }
+    ~ProgramCacheMutex() { pthread_mutex_destroy(&m); }
+    void lock() { pthread_mutex_lock(&m); }
+    void unlock() { pthread_mutex_unlock(&m); }
+private:
+    pthread_mutex_t m;
+#endif
+};
+static ProgramCacheMutex programCacheMutex;
+
+// Holds the cache mutex for the duration of a call
+class ProgramCacheLock
+{
+public:
+    ProgramCacheLock() { programCacheMutex.lock(); }
+    ~ProgramCacheLock() { programCacheMutex.unlock(); }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Open a file, portable between the MS and the POSIX runtimes
+////////////////////////////////////////////////////////////////////////////////
+static FILE* openCacheFile(const char* path, const char* mode)
+{
+    FILE* fp = NULL;
+#ifdef WIN32
+    if (fopen_s(&fp, path, mode) != 0)
+        fp = NULL;
+#else
+    fp = fopen(path, mode);
+#endif
+    return fp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 64 bit FNV-1a hash, printed as the name of the binary
+////////////////////////////////////////////////////////////////////////////////
+static std::string hashName(const std::string& text)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char name[17];
+    for (int i = 15; i >= 0; i--)
+    {
+        name[i] = "0123456789abcdef"[hash & 0xF];
+        hash >>= 4;
+    }
+    name[16] = 0;
+    return std::string(name);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Path of the binary for a device and a source text
+////////////////////////////////////////////////////////////////////////////////
+static std::string binaryPath(cl_device_id device, const char* source, const char* options)
+{
+    char deviceName[256] = "";
+    char driverVersion[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+
+    std::ostringstream text;
+    text << deviceName << '\n' << driverVersion << '\n' << (options ? options : "") << '\n' << source;
+    return programCacheDir + "/" + hashName(text.str()) + ".clbin";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Create and build a program from a binary written by a previous run
+////////////////////////////////////////////////////////////////////////////////
+static cl_program loadBinary(cl_context context, cl_device_id device, const std::string& path, const char* options)
+{
+    FILE* fp = openCacheFile(path.c_str(), "rb");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (length <= 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    unsigned char* binary = (unsigned char*)malloc(length);
+    size_t szBinaryLength = fread(binary, 1, length, fp);
+    fclose(fp);
+
+    cl_int binaryStatus, ciErrNum;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &szBinaryLength,
+                                                   (const unsigned char**)&binary, &binaryStatus, &ciErrNum);
+    free(binary);
+    if (ciErrNum != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+    {
+        if (program) clReleaseProgram(program);
+        return NULL;
+    }
+
+    // binaries still have to be built, which is cheap compared to compiling
+    ciErrNum = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Write the binary of a built program for one device
+////////////////////////////////////////////////////////////////////////////////
+static void saveBinary(cl_program program, cl_device_id device, const std::string& path)
+{
+    cl_uint numDevices = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &numDevices, NULL) != CL_SUCCESS || numDevices == 0)
+        return;
+
+    cl_device_id* devices = (cl_device_id*)malloc(numDevices * sizeof(cl_device_id));
+    size_t* sizes = (size_t*)malloc(numDevices * sizeof(size_t));
+    unsigned char** binaries = (unsigned char**)calloc(numDevices, sizeof(unsigned char*));
+    cl_int ciErrNum = clGetProgramInfo(program, CL_PROGRAM_DEVICES, numDevices * sizeof(cl_device_id), devices, NULL);
+    ciErrNum |= clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), sizes, NULL);
+
+    // only the entry of our device is filled in, NULL entries are skipped
+    cl_uint index = numDevices;
+    for (cl_uint i = 0; i < numDevices; i++)
+    {
+        if (devices[i] == device)
+            index = i;
+    }
+    if (ciErrNum == CL_SUCCESS && index < numDevices && sizes[index] > 0)
+    {
+        binaries[index] = (unsigned char*)malloc(sizes[index]);
+        ciErrNum = clGetProgramInfo(program, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char*), binaries, NULL);
+        if (ciErrNum == CL_SUCCESS)
+        {
+            FILE* fp = openCacheFile(path.c_str(), "wb");
+            if (fp != NULL)
+            {
+                fwrite(binaries[index], 1, sizes[index], fp);
+                fclose(fp);
+            }
+        }
+        free(binaries[index]);
+    }
+
+    free(devices);
+    free(sizes);
+    free(binaries);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start of the cache keys of a context
+////////////////////////////////////////////////////////////////////////////////
+static std::string cacheKeyPrefix(cl_context context)
+{
+    std::ostringstream prefix;
+    prefix << context << '\n';
+    return prefix.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Get a program built for one device, from the cache if possible
+////////////////////////////////////////////////////////////////////////////////
+cl_program oclGetCachedProgram(cl_context context, cl_device_id device, const char* source_path,
+                               const char* preamble, const char* options, cl_int* errcode_ret)
+{
+    if (errcode_ret) *errcode_ret = CL_SUCCESS;
+
+    // held through the build, so that a program is only built once
+    ProgramCacheLock lock;
+
+    // in-process cache
+    std::ostringstream key;
+    key << cacheKeyPrefix(context) << device << '\n' << source_path << '\n'
+        << (options ? options : "") << '\n' << (preamble ? preamble : "");
+    std::map<std::string, cl_program>::iterator it = programCache.find(key.str());
+    if (it != programCache.end())
+    {
+        clRetainProgram(it->second);
+        return it->second;
+    }
+
+    // Load the source code and prepend the preamble
+    size_t program_length;
+    char* source = oclLoadProgSource(source_path, preamble ? preamble : "", &program_length);
+    if (source == NULL)
+        return NULL;
+
+    // binary of a previous run
+    cl_program program = NULL;
+    std::string path;
+    if (!programCacheDir.empty())
+    {
+        path = binaryPath(device, source, options);
+        program = loadBinary(context, device, path, options);
+    }
+
+    // compile from source
+    if (program == NULL)
+    {
+        cl_int ciErrNum;
+        program = clCreateProgramWithSource(context, 1, (const char **)&source, &program_length, &ciErrNum);
+        if (ciErrNum == CL_SUCCESS)
+        {
+            ciErrNum = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        }
+        if (ciErrNum != CL_SUCCESS)
+        {
+            if (errcode_ret) *errcode_ret = ciErrNum;
+            free(source);
+            return program;
+        }
+        if (!path.empty())
+        {
+            saveBinary(program, device, path);
+        }
+    }
+    free(source);
+
+    // one reference stays with the cache, one goes to the caller
+    programCache[key.str()] = program;
+    clRetainProgram(program);
+    return program;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Directory for the program binaries
+////////////////////////////////////////////////////////////////////////////////
+void oclSetProgramCacheDir(const char* cache_dir)
+{
+    ProgramCacheLock lock;
+    programCacheDir = cache_dir ? cache_dir : "";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Release the references held by the cache
+////////////////////////////////////////////////////////////////////////////////
+void oclReleaseProgramCache()
+{
+    ProgramCacheLock lock;
+    for (std::map<std::string, cl_program>::iterator it = programCache.begin(); it != programCache.end(); ++it)
+    {
+        clReleaseProgram(it->second);
+    }
+    programCache.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Release the programs cached for one context
+////////////////////////////////////////////////////////////////////////////////
+void oclReleaseProgramCache(cl_context context)
+{
+    ProgramCacheLock lock;
+    std::string prefix = cacheKeyPrefix(context);
+    std::map<std::string, cl_program>::iterator it = programCache.lower_bound(prefix);
+    while (it != programCache.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        clReleaseProgram(it->second);
+        programCache.erase(it++);
+    }
+}
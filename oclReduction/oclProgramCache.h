@@ -0,0 +1,55 @@
+#ifndef __OCL_PROGRAM_CACHE_H__
+#define __OCL_PROGRAM_CACHE_H__
+
+#include <oclUtils.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//! Compiled program cache
+//!
+//! Programs are keyed by (context, device, source file, preamble, build
+//! options); the preamble carries the compile-time specialization (#define T,
+//! blockSize, nIsPow2, ...). A program built once is kept for the life of the
+//! process. With a cache directory, the device binary is also written to
+//! <dir>/<hash>.clbin and rebuilt from there on the next run; the hash covers
+//! the device, its driver version and the source text, so stale binaries are
+//! never picked up. The cache may be used from several threads; their builds
+//! run one at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//! Get a program built for one device, from the cache if possible
+//!
+//! @return the program with a reference owned by the caller (release it with
+//!         clReleaseProgram), or NULL if the source could not be loaded or
+//!         the program not created.
+//!         On a build error *errcode_ret is set and the program is returned
+//!         uncached so the build log can be inspected.
+//! @param context      context to create the program in
+//! @param device       device to build for
+//! @param source_path  full path of the kernel source
+//! @param preamble     text prepended to the source (may be NULL)
+//! @param options      build options (may be NULL)
+//! @param errcode_ret  error code of the build (may be NULL)
+////////////////////////////////////////////////////////////////////////////////
+cl_program oclGetCachedProgram(cl_context context, cl_device_id device, const char* source_path,
+                               const char* preamble, const char* options, cl_int* errcode_ret);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Directory for the program binaries, NULL (the default) keeps the cache in
+//! memory only. The directory must exist.
+////////////////////////////////////////////////////////////////////////////////
+void oclSetProgramCacheDir(const char* cache_dir);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Release the references held by the cache, call before releasing the contexts
+////////////////////////////////////////////////////////////////////////////////
+void oclReleaseProgramCache();
+
+////////////////////////////////////////////////////////////////////////////////
+//! Release the programs cached for one context, call before releasing it.
+//! The programs hold a reference to their context, so without this a context
+//! outlives its last user.
+////////////////////////////////////////////////////////////////////////////////
+void oclReleaseProgramCache(cl_context context);
+
+#endif
@@ -0,0 +1,585 @@
+// Reduction operator library, see oclReduce.h
+// *********************************************************************
+
+#include <oclUtils.h>
+
+// additional includes
+#include <string.h>
+#include <sstream>
+#include "oclReduce.h"
+#include "oclProgramCache.h"
+
+static const char* opNames[OCL_REDUCE_OPS] = { "sum", "min", "max", "argmin", "argmax", "sumsq", "sumcount", "csum" };
+static const char* inputTypes[] = { "int", "float", "half", "ushort", "uchar" };
+
+const char* oclReduceOpName(int op)
+{
+    return (op >= 0 && op < OCL_REDUCE_OPS) ? opNames[op] : "unknown";
+}
+
+int oclReduceOpByName(const char* name)
+{
+    for (int op = 0; op < OCL_REDUCE_OPS; op++)
+    {
+        if (strcmp(name, opNames[op]) == 0)
+            return op;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Preamble of a reduction kernel specialization
+////////////////////////////////////////////////////////////////////////////////
+std::string oclReducePreamble(oclReduceOp op, oclReduceType type, bool firstPass, int blockSize, int isPow2,
+                              float scale, float offset, bool benchmark)
+{
+    const char* V = (type == OCL_REDUCE_INT) ? "int" : "float";
+    // sums of int inputs in 64 bit, so that e.g. the squares of 16M bytes do not wrap
+    const char* S = (type == OCL_REDUCE_INT && !benchmark) ? "long" : V;
+    const char* VMAX = (type == OCL_REDUCE_INT) ? "INT_MAX" : "FLT_MAX";
+    const char* VMIN = (type == OCL_REDUCE_INT) ? "INT_MIN" : "(-FLT_MAX)";
+    std::ostringstream preamble;
+    preamble.precision(9);
+    preamble.setf(std::ios::showpoint);
+    if (op == OCL_REDUCE_SUM_COMPENSATED && type == OCL_REDUCE_INT)
+        op = OCL_REDUCE_SUM;
+
+    // accumulator type, with the helpers of the compound ones
+    switch (op)
+    {
+    case OCL_REDUCE_ARGMIN:
+    case OCL_REDUCE_ARGMAX:
+        preamble << "typedef struct { " << V << " value; unsigned int index; } reduce_arg_t;" << std::endl;
+        preamble << "reduce_arg_t reduce_arg(" << V << " value, unsigned int index) "
+                 << "{ reduce_arg_t r; r.value = value; r.index = index; return r; }" << std::endl;
+        // ties go to the lowest index, so the result does not depend on the launch configuration
+        preamble << "reduce_arg_t reduce_argmin(reduce_arg_t a, reduce_arg_t b) "
+                 << "{ return (b.value < a.value || (b.value == a.value && b.index < a.index)) ? b : a; }" << std::endl;
+        preamble << "reduce_arg_t reduce_argmax(reduce_arg_t a, reduce_arg_t b) "
+                 << "{ return (b.value > a.value || (b.value == a.value && b.index < a.index)) ? b : a; }" << std::endl;
+        preamble << "#define T reduce_arg_t" << std::endl;
+        break;
+    case OCL_REDUCE_SUM_COUNT:
+        preamble << "typedef struct { " << S << " sum; unsigned int count; } reduce_sum_count_t;" << std::endl;
+        preamble << "reduce_sum_count_t reduce_sum_count(" << S << " sum, unsigned int count) "
+                 << "{ reduce_sum_count_t r; r.sum = sum; r.count = count; return r; }" << std::endl;
+        preamble << "reduce_sum_count_t reduce_sum_count_add(reduce_sum_count_t a, reduce_sum_count_t b) "
+                 << "{ return reduce_sum_count(a.sum + b.sum, a.count + b.count); }" << std::endl;
+        preamble << "#define T reduce_sum_count_t" << std::endl;
+        break;
+    case OCL_REDUCE_SUM_COMPENSATED:
+        preamble << "typedef struct { float sum; float comp; } reduce_csum_t;" << std::endl;
+        preamble << "reduce_csum_t reduce_csum(float sum, float comp) "
+                 << "{ reduce_csum_t r; r.sum = sum; r.comp = comp; return r; }" << std::endl;
+        // Neumaier: the rounding error of a.sum + b.sum joins the compensations
+        preamble << "reduce_csum_t reduce_csum_add(reduce_csum_t a, reduce_csum_t b) "
+                 << "{ float t = a.sum + b.sum; "
+                 << "float e = (fabs(a.sum) >= fabs(b.sum)) ? ((a.sum - t) + b.sum) : ((b.sum - t) + a.sum); "
+                 << "return reduce_csum(t, (a.comp + b.comp) + e); }" << std::endl;
+        preamble << "#define T reduce_csum_t" << std::endl;
+        break;
+    case OCL_REDUCE_SUM:
+    case OCL_REDUCE_SUM_SQUARES:
+        preamble << "#define T " << S << std::endl;
+        break;
+    default:
+        preamble << "#define T " << V << std::endl;
+        break;
+    }
+    preamble << "#define IN_T " << (firstPass ? inputTypes[type] : "T") << std::endl;
+    preamble << "#define blockSize " << blockSize << std::endl;
+    preamble << "#define nIsPow2 " << isPow2 << std::endl;
+    if (!benchmark)
+        preamble << "#define BARRIER_TAIL 1" << std::endl;
+
+    // element i of the input as a V, narrow types widened in registers
+    std::ostringstream element;
+    if (firstPass && type == OCL_REDUCE_HALF)
+        element << "vload_half((i), (p))";
+    else if (firstPass && type != OCL_REDUCE_INT && type != OCL_REDUCE_FLOAT)
+        element << "convert_float((p)[i])";
+    else
+        element << "((p)[i])";
+    if (firstPass && type != OCL_REDUCE_INT && (scale != 1.0f || offset != 0.0f))
+        preamble << "#define ELEMENT(p, i) (" << element.str() << " * " << scale << "f + " << offset << "f)" << std::endl;
+    else
+        preamble << "#define ELEMENT(p, i) " << element.str() << std::endl;
+
+    // operator, identity and the view of an input element
+    switch (op)
+    {
+    default:
+    case OCL_REDUCE_SUM:
+    case OCL_REDUCE_SUM_SQUARES:
+        preamble << "#define IDENTITY 0" << std::endl;
+        preamble << "#define OP(a, b) ((a) + (b))" << std::endl;
+        if (firstPass && op == OCL_REDUCE_SUM_SQUARES)
+            preamble << "#define LOAD(p, i) ((T)ELEMENT(p, i) * ELEMENT(p, i))" << std::endl;
+        else
+            preamble << "#define LOAD(p, i) ELEMENT(p, i)" << std::endl;
+        break;
+    case OCL_REDUCE_MIN:
+    case OCL_REDUCE_MAX:
+        preamble << "#define IDENTITY " << ((op == OCL_REDUCE_MIN) ? VMAX : VMIN) << std::endl;
+        preamble << "#define OP(a, b) " << ((op == OCL_REDUCE_MIN) ? "min" : "max") << "((a), (b))" << std::endl;
+        preamble << "#define LOAD(p, i) ELEMENT(p, i)" << std::endl;
+        break;
+    case OCL_REDUCE_ARGMIN:
+    case OCL_REDUCE_ARGMAX:
+        preamble << "#define IDENTITY reduce_arg(" << ((op == OCL_REDUCE_ARGMIN) ? VMAX : VMIN) << ", 0xffffffffu)" << std::endl;
+        preamble << "#define OP(a, b) " << ((op == OCL_REDUCE_ARGMIN) ? "reduce_argmin" : "reduce_argmax") << "((a), (b))" << std::endl;
+        if (firstPass)
+            preamble << "#define LOAD(p, i) reduce_arg(ELEMENT(p, i), (i))" << std::endl;
+        else
+            preamble << "#define LOAD(p, i) ((p)[i])" << std::endl;
+        break;
+    case OCL_REDUCE_SUM_COUNT:
+        preamble << "#define IDENTITY reduce_sum_count(0, 0)" << std::endl;
+        preamble << "#define OP(a, b) reduce_sum_count_add((a), (b))" << std::endl;
+        if (firstPass)
+            preamble << "#define LOAD(p, i) reduce_sum_count(ELEMENT(p, i), 1)" << std::endl;
+        else
+            preamble << "#define LOAD(p, i) ((p)[i])" << std::endl;
+        break;
+    case OCL_REDUCE_SUM_COMPENSATED:
+        preamble << "#define IDENTITY reduce_csum(0, 0)" << std::endl;
+        preamble << "#define OP(a, b) reduce_csum_add((a), (b))" << std::endl;
+        if (firstPass)
+            preamble << "#define LOAD(p, i) reduce_csum(ELEMENT(p, i), 0)" << std::endl;
+        else
+            preamble << "#define LOAD(p, i) ((p)[i])" << std::endl;
+        break;
+    }
+    return preamble.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Byte size of one partial result
+////////////////////////////////////////////////////////////////////////////////
+size_t oclReduceSize(oclReduceOp op, oclReduceType type)
+{
+    size_t szValue = (type == OCL_REDUCE_INT) ? sizeof(cl_int) : sizeof(cl_float);
+    switch (op)
+    {
+    case OCL_REDUCE_ARGMIN:
+    case OCL_REDUCE_ARGMAX:
+        return szValue + sizeof(cl_uint);
+    case OCL_REDUCE_SUM_COUNT:
+        // the long sum aligns the struct to 8 bytes
+        return (type == OCL_REDUCE_INT) ? 2 * sizeof(cl_long) : szValue + sizeof(cl_uint);
+    case OCL_REDUCE_SUM:
+    case OCL_REDUCE_SUM_SQUARES:
+        return (type == OCL_REDUCE_INT) ? sizeof(cl_long) : szValue;
+    case OCL_REDUCE_SUM_COMPENSATED:
+        return (type == OCL_REDUCE_INT) ? sizeof(cl_long) : 2 * sizeof(cl_float);
+    default:
+        return szValue;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernel of one specialization, from the program cache
+////////////////////////////////////////////////////////////////////////////////
+static cl_kernel reduceKernel(cl_context context, cl_device_id device, const char* source_path,
+                              const std::string& preamble, const char* name, cl_int* errcode_ret,
+                              const char* options = "-cl-fast-relaxed-math")
+{
+    cl_program program = oclGetCachedProgram(context, device, source_path, preamble.c_str(),
+                                             options, errcode_ret);
+    if (program == NULL)
+    {
+        if (*errcode_ret == CL_SUCCESS) *errcode_ret = CL_INVALID_PROGRAM;
+        return NULL;
+    }
+    cl_kernel kernel = NULL;
+    if (*errcode_ret == CL_SUCCESS)
+        kernel = clCreateKernel(program, name, errcode_ret);
+    clReleaseProgram(program);
+    return kernel;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Work-group size of reduce6 for n elements: half of them, rounded to a
+// power of 2, up to maxThreads
+////////////////////////////////////////////////////////////////////////////////
+static int reduceThreads(unsigned int n, int maxThreads)
+{
+    if (n >= (unsigned int)maxThreads * 2)
+        return maxThreads;
+    int threads = 1;
+    while ((unsigned int)threads * 2 < n)
+        threads *= 2;
+    return threads;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// nIsPow2 lets reduce6 read its second element unchecked, which only holds
+// when n is a multiple of 2 * threads
+////////////////////////////////////////////////////////////////////////////////
+static int reduceIsPow2(unsigned int n, int threads)
+{
+    return ((n & (n - 1)) == 0 && n >= (unsigned int)threads * 2) ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduce n elements of a device buffer
+////////////////////////////////////////////////////////////////////////////////
+cl_int oclReduce(cl_command_queue queue, const char* source_path, oclReduceOp op, oclReduceType type,
+                 cl_mem input, unsigned int n, oclReduceResult* result, int maxThreads, int maxBlocks,
+                 float scale, float offset)
+{
+    cl_context context;
+    cl_device_id device;
+    cl_int ciErrNum = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(cl_context), &context, NULL);
+    ciErrNum |= clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    if (ciErrNum != CL_SUCCESS)
+        return ciErrNum;
+    if (maxThreads < 1) maxThreads = 128;
+    if (maxBlocks < 1) maxBlocks = 64;
+
+    // the compensated sum needs strict IEEE adds
+    const char* options = (op == OCL_REDUCE_SUM_COMPENSATED) ? NULL : "-cl-fast-relaxed-math";
+
+    // first pass: at most maxBlocks partials of the input
+    size_t szPartial = oclReduceSize(op, type);
+    int threads = reduceThreads(n, maxThreads);
+    int blocks = (int)MIN((unsigned int)maxBlocks, (n + threads * 2 - 1) / (threads * 2));
+    if (blocks < 1) blocks = 1;
+
+    cl_mem partials = clCreateBuffer(context, CL_MEM_READ_WRITE, blocks * szPartial, NULL, &ciErrNum);
+    if (ciErrNum != CL_SUCCESS)
+        return ciErrNum;
+    cl_kernel first = reduceKernel(context, device, source_path,
+                                   oclReducePreamble(op, type, true, threads, reduceIsPow2(n, threads), scale, offset),
+                                   "reduce6", &ciErrNum, options);
+    if (first)
+    {
+        size_t szGlobal = blocks * threads;
+        size_t szLocal = threads;
+        ciErrNum = clSetKernelArg(first, 0, sizeof(cl_mem), (void*)&input);
+        ciErrNum |= clSetKernelArg(first, 1, sizeof(cl_mem), (void*)&partials);
+        ciErrNum |= clSetKernelArg(first, 2, sizeof(cl_uint), (void*)&n);
+        ciErrNum |= clSetKernelArg(first, 3, szPartial * threads, NULL);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, first, 1, NULL, &szGlobal, &szLocal, 0, NULL, NULL);
+        clReleaseKernel(first);
+    }
+
+    // second pass: one work-group over the partials, in place
+    if (ciErrNum == CL_SUCCESS && blocks > 1)
+    {
+        cl_uint uiPartials = blocks;
+        int finalThreads = reduceThreads(uiPartials, maxThreads);
+        cl_kernel second = reduceKernel(context, device, source_path,
+                                        oclReducePreamble(op, type, false, finalThreads, reduceIsPow2(uiPartials, finalThreads)),
+                                        "reduce6", &ciErrNum, options);
+        if (second)
+        {
+            size_t szLocal = finalThreads;
+            ciErrNum = clSetKernelArg(second, 0, sizeof(cl_mem), (void*)&partials);
+            ciErrNum |= clSetKernelArg(second, 1, sizeof(cl_mem), (void*)&partials);
+            ciErrNum |= clSetKernelArg(second, 2, sizeof(cl_uint), (void*)&uiPartials);
+            ciErrNum |= clSetKernelArg(second, 3, szPartial * finalThreads, NULL);
+            ciErrNum |= clEnqueueNDRangeKernel(queue, second, 1, NULL, &szLocal, &szLocal, 0, NULL, NULL);
+            clReleaseKernel(second);
+        }
+    }
+
+    // decode the T of the operator
+    unsigned char bytes[16];
+    if (ciErrNum == CL_SUCCESS)
+        ciErrNum = clEnqueueReadBuffer(queue, partials, CL_TRUE, 0, szPartial, bytes, 0, NULL, NULL);
+    clReleaseMemObject(partials);
+    if (ciErrNum != CL_SUCCESS)
+        return ciErrNum;
+
+    bool bLongSum = (type == OCL_REDUCE_INT) && (op == OCL_REDUCE_SUM || op == OCL_REDUCE_SUM_SQUARES ||
+                                                 op == OCL_REDUCE_SUM_COUNT || op == OCL_REDUCE_SUM_COMPENSATED);
+    size_t szValue = bLongSum ? sizeof(cl_long) : sizeof(cl_int);
+    cl_int iValue;
+    cl_long lValue;
+    cl_float fValue;
+    cl_uint uiPayload = 0;
+    memcpy(&iValue, bytes, sizeof(cl_int));
+    memcpy(&lValue, bytes, sizeof(cl_long));
+    memcpy(&fValue, bytes, sizeof(cl_float));
+    if (szPartial > szValue)
+        memcpy(&uiPayload, bytes + szValue, sizeof(cl_uint));
+
+    if (type != OCL_REDUCE_INT)
+        result->value = (double)fValue;
+    else
+        result->value = bLongSum ? (double)lValue : (double)iValue;
+    if (op == OCL_REDUCE_SUM_COMPENSATED && type != OCL_REDUCE_INT)
+    {
+        cl_float fComp;
+        memcpy(&fComp, bytes + sizeof(cl_float), sizeof(cl_float));
+        result->value += fComp;
+    }
+    result->index = (op == OCL_REDUCE_ARGMIN || op == OCL_REDUCE_ARGMAX) ? uiPayload : 0;
+    result->count = (op == OCL_REDUCE_SUM_COUNT) ? uiPayload : 0;
+    return CL_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Preamble of the keyed kernels
+////////////////////////////////////////////////////////////////////////////////
+static std::string keyedPreamble(int key_bytes, int blockSize, const oclReduceByKeyOutput& output,
+                                 oclReduceType value_type, int num_values, const float* scale, const float* offset)
+{
+    std::ostringstream preamble;
+    preamble.precision(9);
+    preamble.setf(std::ios::showpoint);
+    preamble << "#define KEY_T " << ((key_bytes == 1) ? "uchar" : (key_bytes == 2) ? "ushort" : "uint") << std::endl;
+    preamble << "#define VALUE_T " << inputTypes[value_type] << std::endl;
+    preamble << "#define VALUE_HALF " << ((value_type == OCL_REDUCE_HALF) ? 1 : 0) << std::endl;
+    if (scale && offset)
+    {
+        preamble << "#define VALUE_SCALE {";
+        for (int v = 0; v < num_values; v++)
+            preamble << ((v > 0) ? ", " : "") << scale[v] << "f";
+        preamble << "}" << std::endl << "#define VALUE_OFFSET {";
+        for (int v = 0; v < num_values; v++)
+            preamble << ((v > 0) ? ", " : "") << offset[v] << "f";
+        preamble << "}" << std::endl;
+    }
+    preamble << "#define blockSize " << blockSize << std::endl;
+    preamble << "#define KEYED_SUM_SQUARES " << ((output.sum_squares != NULL) ? 1 : 0) << std::endl;
+    preamble << "#define KEYED_MIN " << ((output.minimum != NULL) ? 1 : 0) << std::endl;
+    preamble << "#define KEYED_MAX " << ((output.maximum != NULL) ? 1 : 0) << std::endl;
+    return preamble.str();
+}
+
+static size_t roundUp(size_t group_size, size_t global_size)
+{
+    size_t r = global_size % group_size;
+    return (r == 0) ? global_size : global_size + group_size - r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Copies of the bins of a work-group that fit in half of the local memory, a
+// power of 2 up to the work-group size, or 0 if not even one does
+////////////////////////////////////////////////////////////////////////////////
+static cl_uint keyedColumns(cl_uint words, int threads, cl_ulong ulLocalMem)
+{
+    cl_uint columns = (cl_uint)threads;
+    while (columns > 0 && (cl_ulong)words * columns * sizeof(cl_uint) > ulLocalMem / 2)
+        columns /= 2;
+    return columns;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Few keys: bins in local memory, folded over the work-groups
+////////////////////////////////////////////////////////////////////////////////
+static cl_int reduceByKeyLocal(cl_command_queue queue, cl_context context, cl_device_id device, const char* source_path,
+                               const std::string& preamble, cl_mem keys, cl_mem values, cl_uint pitch, cl_uint num_values,
+                               cl_uint n, cl_uint num_keys, cl_uint words, cl_uint columns, const oclReduceByKeyOutput& output,
+                               int threads, int maxBlocks)
+{
+    cl_uint groups = MIN((cl_uint)maxBlocks, (n + threads - 1) / threads);
+    if (groups < 1) groups = 1;
+
+    cl_int ciErrNum;
+    cl_mem partials = clCreateBuffer(context, CL_MEM_READ_WRITE, groups * words * sizeof(cl_uint), NULL, &ciErrNum);
+    if (ciErrNum != CL_SUCCESS)
+        return ciErrNum;
+
+    cl_kernel bin = reduceKernel(context, device, source_path, preamble, "reduce_by_key_local", &ciErrNum);
+    if (bin)
+    {
+        size_t szGlobal = groups * threads;
+        size_t szLocal = threads;
+        ciErrNum = clSetKernelArg(bin, 0, sizeof(cl_mem), (void*)&keys);
+        ciErrNum |= clSetKernelArg(bin, 1, sizeof(cl_mem), (void*)&values);
+        ciErrNum |= clSetKernelArg(bin, 2, sizeof(cl_uint), (void*)&pitch);
+        ciErrNum |= clSetKernelArg(bin, 3, sizeof(cl_uint), (void*)&n);
+        ciErrNum |= clSetKernelArg(bin, 4, sizeof(cl_uint), (void*)&num_keys);
+        ciErrNum |= clSetKernelArg(bin, 5, sizeof(cl_uint), (void*)&num_values);
+        ciErrNum |= clSetKernelArg(bin, 6, sizeof(cl_mem), (void*)&partials);
+        ciErrNum |= clSetKernelArg(bin, 7, words * columns * sizeof(cl_uint), NULL);
+        ciErrNum |= clSetKernelArg(bin, 8, sizeof(cl_uint), (void*)&columns);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, bin, 1, NULL, &szGlobal, &szLocal, 0, NULL, NULL);
+        clReleaseKernel(bin);
+    }
+
+    cl_kernel fold = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        fold = reduceKernel(context, device, source_path, preamble, "reduce_by_key_fold", &ciErrNum);
+    if (fold)
+    {
+        size_t szLocal = threads;
+        size_t szGlobal = roundUp(szLocal, num_keys * num_values);
+        ciErrNum = clSetKernelArg(fold, 0, sizeof(cl_mem), (void*)&partials);
+        ciErrNum |= clSetKernelArg(fold, 1, sizeof(cl_uint), (void*)&groups);
+        ciErrNum |= clSetKernelArg(fold, 2, sizeof(cl_uint), (void*)&num_keys);
+        ciErrNum |= clSetKernelArg(fold, 3, sizeof(cl_uint), (void*)&num_values);
+        ciErrNum |= clSetKernelArg(fold, 4, sizeof(cl_mem), (void*)&output.counts);
+        ciErrNum |= clSetKernelArg(fold, 5, sizeof(cl_mem), (void*)&output.sums);
+        ciErrNum |= clSetKernelArg(fold, 6, sizeof(cl_mem), (void*)&output.sum_squares);
+        ciErrNum |= clSetKernelArg(fold, 7, sizeof(cl_mem), (void*)&output.minimum);
+        ciErrNum |= clSetKernelArg(fold, 8, sizeof(cl_mem), (void*)&output.maximum);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, fold, 1, NULL, &szGlobal, &szLocal, 0, NULL, NULL);
+        clReleaseKernel(fold);
+    }
+
+    clReleaseMemObject(partials);
+    return ciErrNum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Many keys: bitonic sort of (key, index) pairs, then one work-group per
+// run of equal keys
+////////////////////////////////////////////////////////////////////////////////
+static cl_int reduceByKeySort(cl_command_queue queue, cl_context context, cl_device_id device, const char* source_path,
+                              const std::string& preamble, cl_mem keys, cl_mem values, cl_uint pitch, cl_uint num_values,
+                              cl_uint n, cl_uint num_keys, const oclReduceByKeyOutput& output, int threads)
+{
+    // the sort runs over a power of 2 range, padded with skipped points
+    cl_uint padded = 1;
+    while (padded < n)
+        padded *= 2;
+    size_t szLocalPadded = MIN((size_t)threads, (size_t)padded);
+    size_t szPadded = padded;
+
+    cl_int ciErrNum;
+    cl_mem sortKeys = clCreateBuffer(context, CL_MEM_READ_WRITE, padded * sizeof(cl_uint), NULL, &ciErrNum);
+    cl_mem sortIndex = NULL, starts = NULL, ends = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        sortIndex = clCreateBuffer(context, CL_MEM_READ_WRITE, padded * sizeof(cl_uint), NULL, &ciErrNum);
+    if (ciErrNum == CL_SUCCESS)
+        starts = clCreateBuffer(context, CL_MEM_READ_WRITE, num_keys * sizeof(cl_uint), NULL, &ciErrNum);
+    if (ciErrNum == CL_SUCCESS)
+        ends = clCreateBuffer(context, CL_MEM_READ_WRITE, num_keys * sizeof(cl_uint), NULL, &ciErrNum);
+
+    cl_kernel init = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        init = reduceKernel(context, device, source_path, preamble, "reduce_by_key_sort_init", &ciErrNum);
+    if (init)
+    {
+        ciErrNum = clSetKernelArg(init, 0, sizeof(cl_mem), (void*)&keys);
+        ciErrNum |= clSetKernelArg(init, 1, sizeof(cl_uint), (void*)&n);
+        ciErrNum |= clSetKernelArg(init, 2, sizeof(cl_uint), (void*)&num_keys);
+        ciErrNum |= clSetKernelArg(init, 3, sizeof(cl_mem), (void*)&sortKeys);
+        ciErrNum |= clSetKernelArg(init, 4, sizeof(cl_mem), (void*)&sortIndex);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, init, 1, NULL, &szPadded, &szLocalPadded, 0, NULL, NULL);
+        clReleaseKernel(init);
+    }
+
+    cl_kernel bitonic = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        bitonic = reduceKernel(context, device, source_path, preamble, "reduce_by_key_bitonic", &ciErrNum);
+    if (bitonic)
+    {
+        ciErrNum = clSetKernelArg(bitonic, 0, sizeof(cl_mem), (void*)&sortKeys);
+        ciErrNum |= clSetKernelArg(bitonic, 1, sizeof(cl_mem), (void*)&sortIndex);
+        for (cl_uint k = 2; k <= padded && ciErrNum == CL_SUCCESS; k *= 2)
+        {
+            for (cl_uint j = k / 2; j > 0 && ciErrNum == CL_SUCCESS; j /= 2)
+            {
+                ciErrNum = clSetKernelArg(bitonic, 2, sizeof(cl_uint), (void*)&j);
+                ciErrNum |= clSetKernelArg(bitonic, 3, sizeof(cl_uint), (void*)&k);
+                ciErrNum |= clEnqueueNDRangeKernel(queue, bitonic, 1, NULL, &szPadded, &szLocalPadded, 0, NULL, NULL);
+            }
+        }
+        clReleaseKernel(bitonic);
+    }
+
+    cl_kernel clear = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        clear = reduceKernel(context, device, source_path, preamble, "reduce_by_key_segments_clear", &ciErrNum);
+    if (clear)
+    {
+        size_t szLocal = threads;
+        size_t szGlobal = roundUp(szLocal, num_keys);
+        ciErrNum = clSetKernelArg(clear, 0, sizeof(cl_mem), (void*)&starts);
+        ciErrNum |= clSetKernelArg(clear, 1, sizeof(cl_mem), (void*)&ends);
+        ciErrNum |= clSetKernelArg(clear, 2, sizeof(cl_uint), (void*)&num_keys);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, clear, 1, NULL, &szGlobal, &szLocal, 0, NULL, NULL);
+        clReleaseKernel(clear);
+    }
+
+    cl_kernel segments = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        segments = reduceKernel(context, device, source_path, preamble, "reduce_by_key_segments", &ciErrNum);
+    if (segments)
+    {
+        ciErrNum = clSetKernelArg(segments, 0, sizeof(cl_mem), (void*)&sortKeys);
+        ciErrNum |= clSetKernelArg(segments, 1, sizeof(cl_uint), (void*)&padded);
+        ciErrNum |= clSetKernelArg(segments, 2, sizeof(cl_mem), (void*)&starts);
+        ciErrNum |= clSetKernelArg(segments, 3, sizeof(cl_mem), (void*)&ends);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, segments, 1, NULL, &szPadded, &szLocalPadded, 0, NULL, NULL);
+        clReleaseKernel(segments);
+    }
+
+    cl_kernel segmentReduce = NULL;
+    if (ciErrNum == CL_SUCCESS)
+        segmentReduce = reduceKernel(context, device, source_path, preamble, "reduce_by_key_segment_reduce", &ciErrNum);
+    if (segmentReduce)
+    {
+        // one work-group per key, keys beyond 65535 are taken in a grid stride
+        size_t szLocal = threads;
+        size_t szGlobal = MIN(num_keys, 65535u) * szLocal;
+        ciErrNum = clSetKernelArg(segmentReduce, 0, sizeof(cl_mem), (void*)&sortIndex);
+        ciErrNum |= clSetKernelArg(segmentReduce, 1, sizeof(cl_mem), (void*)&values);
+        ciErrNum |= clSetKernelArg(segmentReduce, 2, sizeof(cl_uint), (void*)&pitch);
+        ciErrNum |= clSetKernelArg(segmentReduce, 3, sizeof(cl_uint), (void*)&num_keys);
+        ciErrNum |= clSetKernelArg(segmentReduce, 4, sizeof(cl_uint), (void*)&num_values);
+        ciErrNum |= clSetKernelArg(segmentReduce, 5, sizeof(cl_mem), (void*)&starts);
+        ciErrNum |= clSetKernelArg(segmentReduce, 6, sizeof(cl_mem), (void*)&ends);
+        ciErrNum |= clSetKernelArg(segmentReduce, 7, sizeof(cl_mem), (void*)&output.counts);
+        ciErrNum |= clSetKernelArg(segmentReduce, 8, sizeof(cl_mem), (void*)&output.sums);
+        ciErrNum |= clSetKernelArg(segmentReduce, 9, sizeof(cl_mem), (void*)&output.sum_squares);
+        ciErrNum |= clSetKernelArg(segmentReduce, 10, sizeof(cl_mem), (void*)&output.minimum);
+        ciErrNum |= clSetKernelArg(segmentReduce, 11, sizeof(cl_mem), (void*)&output.maximum);
+        ciErrNum |= clSetKernelArg(segmentReduce, 12, sizeof(cl_float) * threads, NULL);
+        ciErrNum |= clEnqueueNDRangeKernel(queue, segmentReduce, 1, NULL, &szGlobal, &szLocal, 0, NULL, NULL);
+        clReleaseKernel(segmentReduce);
+    }
+
+    if (ends) clReleaseMemObject(ends);
+    if (starts) clReleaseMemObject(starts);
+    if (sortIndex) clReleaseMemObject(sortIndex);
+    if (sortKeys) clReleaseMemObject(sortKeys);
+    return ciErrNum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduce the values of n points by key
+////////////////////////////////////////////////////////////////////////////////
+cl_int oclReduceByKey(cl_command_queue queue, const char* source_path, cl_mem keys, int key_bytes,
+                      cl_mem values, unsigned int pitch, int num_values, unsigned int n, unsigned int num_keys,
+                      const oclReduceByKeyOutput& output, int maxThreads, int maxBlocks, oclReduceByKeyPath path,
+                      oclReduceType value_type, const float* scale, const float* offset)
+{
+    if ((key_bytes != 1 && key_bytes != 2 && key_bytes != 4) || num_values < 1 || num_keys < 1 || pitch < n ||
+        output.counts == NULL || output.sums == NULL || value_type == OCL_REDUCE_INT)
+        return CL_INVALID_VALUE;
+
+    cl_context context;
+    cl_device_id device;
+    cl_ulong ulLocalMem = 0;
+    cl_int ciErrNum = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(cl_context), &context, NULL);
+    ciErrNum |= clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    ciErrNum |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &ulLocalMem, NULL);
+    if (ciErrNum != CL_SUCCESS)
+        return ciErrNum;
+    if (maxThreads < 1) maxThreads = 128;
+    if (maxBlocks < 1) maxBlocks = 64;
+
+    // bins of a work-group: the counts, then num_keys * num_values words per statistic
+    int statistics = 1 + (output.sum_squares ? 1 : 0) + (output.minimum ? 1 : 0) + (output.maximum ? 1 : 0);
+    cl_uint words = num_keys * (1 + num_values * statistics);
+
+    // the work items sharing a column of bins take turns, so the local path
+    // is only picked while at least 1/32 of them get a column of their own
+    cl_uint columns = keyedColumns(words, maxThreads, ulLocalMem);
+    if (path == OCL_REDUCE_BY_KEY_AUTO)
+        path = (columns * 32 >= (cl_uint)maxThreads) ? OCL_REDUCE_BY_KEY_LOCAL : OCL_REDUCE_BY_KEY_SORT;
+    if (columns < 1) columns = 1;
+
+    std::string preamble = keyedPreamble(key_bytes, maxThreads, output, value_type, num_values, scale, offset);
+    if (path == OCL_REDUCE_BY_KEY_LOCAL)
+        return reduceByKeyLocal(queue, context, device, source_path, preamble, keys, values, pitch, num_values,
+                                n, num_keys, words, columns, output, maxThreads, maxBlocks);
+    return reduceByKeySort(queue, context, device, source_path, preamble, keys, values, pitch, num_values,
+                           n, num_keys, output, maxThreads);
+}
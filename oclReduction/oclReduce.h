@@ -0,0 +1,191 @@
+#ifndef __OCL_REDUCE_H__
+#define __OCL_REDUCE_H__
+
+#include <oclUtils.h>
+
+#include <string>
+
+////////////////////////////////////////////////////////////////////////////////
+//! Reduction operator library
+//!
+//! The kernels of oclReduction_kernel.cl reduce with whatever operator the
+//! preamble defines: the accumulator type T, the input type IN_T, the
+//! operator OP, its IDENTITY and LOAD, which turns input element i into a T.
+//! oclReducePreamble writes these for the operators below; the first pass
+//! over the input LOADs values (and their index for argmin / argmax, their
+//! square for the sum of squares), later passes combine partials of type T.
+//!
+//! Argmin and argmax return the lowest index among equal values, whatever
+//! the launch configuration. Min / max / arg results of an empty input are
+//! the identity (index 0xffffffff).
+//!
+//! Every operator combines the elements in an order that only depends on
+//! n and the launch configuration, so results are reproducible from run to
+//! run. The compensated sum also carries the rounding error of every add
+//! (Neumaier), which keeps a float sum of 100M elements about as accurate
+//! as a double one; its programs are built without -cl-fast-relaxed-math,
+//! which would be free to cancel the compensation. Integer inputs reduce
+//! it to the plain sum, which is exact.
+//!
+//! Sums of int inputs (sum, sum of squares, sum and count) accumulate in a
+//! 64 bit long, so they are exact as long as the result fits in one.
+//!
+//! Narrow inputs (half, 16 and 8 bit unsigned) are widened to float as they
+//! are loaded, value = stored * scale + offset, and reduced as floats: the
+//! first pass, which is bound by the bandwidth of the input, reads 2 to 4
+//! times fewer bytes.
+////////////////////////////////////////////////////////////////////////////////
+
+enum oclReduceOp
+{
+    OCL_REDUCE_SUM,
+    OCL_REDUCE_MIN,
+    OCL_REDUCE_MAX,
+    OCL_REDUCE_ARGMIN,          // smallest value and its index
+    OCL_REDUCE_ARGMAX,          // largest value and its index
+    OCL_REDUCE_SUM_SQUARES,     // sum of x * x
+    OCL_REDUCE_SUM_COUNT,       // (sum, count) tuple, e.g. for a mean
+    OCL_REDUCE_SUM_COMPENSATED, // (sum, compensation) tuple, the sum of both
+    OCL_REDUCE_OPS
+};
+
+enum oclReduceType
+{
+    OCL_REDUCE_INT,
+    OCL_REDUCE_FLOAT,
+    OCL_REDUCE_HALF,            // narrow inputs, reduced as float
+    OCL_REDUCE_USHORT,
+    OCL_REDUCE_UCHAR
+};
+
+//! Result of a reduction; value is the sum (compensation included),
+//! minimum, maximum or sum of squares, index the position of the argmin / argmax, count the # of
+//! elements summed by OCL_REDUCE_SUM_COUNT
+struct oclReduceResult
+{
+    double value;
+    unsigned int index;
+    unsigned int count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//! Name of an operator ("sum", "min", "max", "argmin", "argmax", "sumsq",
+//! "sumcount", "csum"), and the operator of a name (-1 if unknown)
+////////////////////////////////////////////////////////////////////////////////
+const char* oclReduceOpName(int op);
+int oclReduceOpByName(const char* name);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Preamble of a reduction kernel specialization
+//!
+//! @param op          operator
+//! @param type        type of the input elements
+//! @param firstPass   true for the pass over the input, false for the passes
+//!                    over partial results
+//! @param blockSize   work-group size
+//! @param isPow2      1 if the # of elements is a power of 2
+//! @param scale       float and narrow inputs: value = element * scale + offset
+//! @param offset
+//! @param benchmark   true for the reduce0-6 benchmark of oclReduction.cpp,
+//!                    whose int sums stay in a 32 bit int and whose reduce6
+//!                    ends without barriers, in lock-step warps; otherwise
+//!                    every level of the tree has its barrier (BARRIER_TAIL)
+////////////////////////////////////////////////////////////////////////////////
+std::string oclReducePreamble(oclReduceOp op, oclReduceType type, bool firstPass, int blockSize, int isPow2,
+                              float scale = 1.0f, float offset = 0.0f, bool benchmark = false);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Byte size of one partial result (the T of an operator)
+////////////////////////////////////////////////////////////////////////////////
+size_t oclReduceSize(oclReduceOp op, oclReduceType type);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Reduce n elements of a device buffer with reduce6: one pass of at most
+//! maxBlocks work-groups over the input, then one work-group over their
+//! partials. Programs come from the program cache (oclProgramCache.h).
+//!
+//! @return CL_SUCCESS, or the first error; result is only written on success
+//! @param queue        queue to run on; its context and device are used
+//! @param source_path  full path of oclReduction_kernel.cl
+//! @param op           operator
+//! @param type         type of the elements of input
+//! @param input        n elements
+//! @param n            # of elements
+//! @param result       out: the reduction
+//! @param maxThreads   work-group size, a power of 2 (at most the device allows)
+//! @param maxBlocks    work-groups of the first pass
+//! @param scale        float and narrow inputs: value = element * scale + offset
+//! @param offset
+////////////////////////////////////////////////////////////////////////////////
+cl_int oclReduce(cl_command_queue queue, const char* source_path, oclReduceOp op, oclReduceType type,
+                 cl_mem input, unsigned int n, oclReduceResult* result, int maxThreads = 128, int maxBlocks = 64,
+                 float scale = 1.0f, float offset = 0.0f);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Reduction by key (oclReduceByKey_kernel.cl)
+//!
+//! Point i has the key keys[i] and num_values values, value v at
+//! values[v * pitch + i]; narrow values are widened to float, value v as
+//! stored * scale[v] + offset[v]. For every key below num_keys the reduction writes
+//! the # of points and the sum of each value, and, for the outputs that are
+//! not NULL, the sum of squares, minimum and maximum of each value (so the
+//! mean, variance and bounding box of k-means clusters come from one pass).
+//! Statistics are laid out key after key, num_values per key; points with
+//! a larger key are skipped. Minimum / maximum of an empty key are FLT_MAX /
+//! -FLT_MAX.
+//!
+//! While copies of the bins of all keys for at least 1/32 of the work items
+//! fit in half of the local memory, every work-group bins its points in
+//! local memory, the copies are merged by a tree and the partials of the
+//! work-groups are folded in group order. Beyond that, (key, index) pairs
+//! are sorted and one work-group reduces the run of each key; that path
+//! needs 8 bytes per point, rounded up to a power of 2, of scratch.
+//! Both paths add in a fixed order, so the results are the same from run
+//! to run for the same work sizes.
+////////////////////////////////////////////////////////////////////////////////
+struct oclReduceByKeyOutput
+{
+    cl_mem counts;          // num_keys cl_uint
+    cl_mem sums;            // num_keys * num_values cl_float
+    cl_mem sum_squares;     // num_keys * num_values cl_float, or NULL
+    cl_mem minimum;         // num_keys * num_values cl_float, or NULL
+    cl_mem maximum;         // num_keys * num_values cl_float, or NULL
+};
+
+//! Paths of oclReduceByKey
+enum oclReduceByKeyPath
+{
+    OCL_REDUCE_BY_KEY_AUTO,
+    OCL_REDUCE_BY_KEY_LOCAL,    // privatized local-memory bins
+    OCL_REDUCE_BY_KEY_SORT      // sort, then reduce the segments
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//! Reduce the values of n points by key
+//!
+//! @return CL_SUCCESS, or the first error; the outputs are written by
+//!         commands enqueued on queue, which are not waited for
+//! @param queue        queue to run on; its context and device are used
+//! @param source_path  full path of oclReduceByKey_kernel.cl
+//! @param keys         n keys of key_bytes (1, 2 or 4) bytes each
+//! @param key_bytes    size of a key
+//! @param values       num_values planes of pitch values of value_type
+//! @param pitch        # of values from one value plane to the next (>= n)
+//! @param num_values   values per point
+//! @param n            # of points
+//! @param num_keys     # of keys
+//! @param output       device buffers of the statistics
+//! @param maxThreads   work-group size, a power of 2 (at most the device allows)
+//! @param maxBlocks    work-groups binning points on the local path
+//! @param path         path to take, AUTO picks by the size of the bins
+//! @param value_type   OCL_REDUCE_FLOAT or a narrow type
+//! @param scale        num_values scales and offsets of the values, or NULL
+//! @param offset       for 1 and 0
+////////////////////////////////////////////////////////////////////////////////
+cl_int oclReduceByKey(cl_command_queue queue, const char* source_path, cl_mem keys, int key_bytes,
+                      cl_mem values, unsigned int pitch, int num_values, unsigned int n, unsigned int num_keys,
+                      const oclReduceByKeyOutput& output, int maxThreads = 128, int maxBlocks = 64,
+                      oclReduceByKeyPath path = OCL_REDUCE_BY_KEY_AUTO, oclReduceType value_type = OCL_REDUCE_FLOAT,
+                      const float* scale = NULL, const float* offset = NULL);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+    Reduction by key (segmented reduction)
+
+    Every point i has a key keys[i] < num_keys and num_values values,
+    value v at values[v * pitch + i] (float, or half, ushort or uchar
+    widened to float in the kernel). The kernels write for every key the
+    # of points, the sum of each value and optionally the sum of squares,
+    the minimum and the maximum of each value; points with a key past
+    num_keys are skipped. Statistics are laid out key after key,
+    num_values per key (the layout of a k-means centroid table).
+
+    Two paths, picked by oclReduceByKey (oclReduce.cpp):
+    - few keys: every work-group keeps columns copies of the bins of all
+      keys in local memory; the work items of a column take turns, one
+      barrier apart, and the columns are merged by a tree, so no atomics
+      are involved and the order of every sum is fixed. The bins are
+      written out as partials and reduce_by_key_fold folds the partials of
+      all work-groups, in work-group order.
+    - many keys: (key, index) pairs are sorted by key (bitonic sort), the
+      segments of equal keys located, and one work-group reduces each one.
+*/
+
+// The following defines are set during runtime compilation, see oclReduce.cpp
+// #define KEY_T uint
+// #define blockSize 128
+// #define KEYED_SUM_SQUARES 1
+// #define KEYED_MIN 1
+// #define KEYED_MAX 1
+// #define VALUE_T float            type of the stored values
+// #define VALUE_HALF 0             values are half, read with vload_half
+// #define VALUE_SCALE {...}        optional: value v = stored * scale[v] + offset[v]
+// #define VALUE_OFFSET {...}
+
+#ifndef _REDUCE_BY_KEY_KERNEL_H_
+#define _REDUCE_BY_KEY_KERNEL_H_
+
+#define KEYED_NONE 0xffffffffu
+
+#if VALUE_HALF
+#define VALUE_LOAD(p, i) vload_half((i), (p))
+#else
+#define VALUE_LOAD(p, i) convert_float((p)[i])
+#endif
+
+#ifdef VALUE_SCALE
+__constant float value_scale[] = VALUE_SCALE;
+__constant float value_offset[] = VALUE_OFFSET;
+#define VALUE(p, v, i) (VALUE_LOAD(p, i) * value_scale[v] + value_offset[v])
+#else
+#define VALUE(p, v, i) VALUE_LOAD(p, i)
+#endif
+
+// # of 32 bit words of the bins of num_keys keys: the counts, then one
+// block of num_keys * num_values words per statistic
+unsigned int keyed_words(unsigned int num_keys, unsigned int num_values)
+{
+    return num_keys * (1 + num_values * (1 + KEYED_SUM_SQUARES + KEYED_MIN + KEYED_MAX));
+}
+
+/*
+    Few keys: privatized local bins
+*/
+
+// Statistic of word w of the bins, for the initial value and the merge
+#define KEYED_COUNT 0
+#define KEYED_SUM 1
+#define KEYED_LO 2
+#define KEYED_HI 3
+unsigned int keyed_statistic(unsigned int w, unsigned int num_keys, unsigned int num_values)
+{
+    unsigned int table = num_keys * num_values;
+    if (w < num_keys) return KEYED_COUNT;
+    w -= num_keys;
+    if (w < table * (1 + KEYED_SUM_SQUARES)) return KEYED_SUM;
+    w -= table * (1 + KEYED_SUM_SQUARES);
+    if (KEYED_MIN && w < table) return KEYED_LO;
+    return KEYED_HI;
+}
+
+// Word w of column col of the bins
+#define KEYED_BIN(w, col) bins[(w) * columns + (col)]
+
+// Bins of the points of this work-group, written to partials[group][word].
+// Column tid % columns belongs to work item tid; columns is a power of 2 up
+// to blockSize and bins has keyed_words() * columns words.
+__kernel void reduce_by_key_local(__global const KEY_T *keys, __global const VALUE_T *values, unsigned int pitch,
+                                  unsigned int n, unsigned int num_keys, unsigned int num_values,
+                                  __global unsigned int *partials, __local unsigned int *bins, unsigned int columns)
+{
+    unsigned int tid = get_local_id(0);
+    unsigned int col = tid % columns;
+    unsigned int words = keyed_words(num_keys, num_values);
+    unsigned int table = num_keys * num_values;
+    unsigned int oSums = num_keys;
+    unsigned int oSquares = oSums + table;
+    unsigned int oMin = oSquares + (KEYED_SUM_SQUARES ? table : 0);
+    unsigned int oMax = oMin + (KEYED_MIN ? table : 0);
+
+    // counts and sums start at 0, bounds at the opposite end of the range
+    for (unsigned int w = tid; w < words * columns; w += blockSize)
+    {
+        unsigned int statistic = keyed_statistic(w / columns, num_keys, num_values);
+        bins[w] = (statistic == KEYED_LO) ? as_uint(FLT_MAX) : (statistic == KEYED_HI) ? as_uint(-FLT_MAX) : 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the same rounds in all work items, so that the barriers line up
+    for (unsigned int first = get_group_id(0) * blockSize; first < n; first += get_global_size(0))
+    {
+        unsigned int i = first + tid;
+        unsigned int key = (i < n) ? keys[i] : KEYED_NONE;
+        for (unsigned int turn = 0; turn < blockSize / columns; turn++)
+        {
+            if (key < num_keys && tid / columns == turn)
+            {
+                KEYED_BIN(key, col)++;
+                for (unsigned int v = 0; v < num_values; v++)
+                {
+                    float x = VALUE(values + v * pitch, v, i);
+                    unsigned int b = key * num_values + v;
+                    KEYED_BIN(oSums + b, col) = as_uint(as_float(KEYED_BIN(oSums + b, col)) + x);
+                    if (KEYED_SUM_SQUARES) KEYED_BIN(oSquares + b, col) = as_uint(as_float(KEYED_BIN(oSquares + b, col)) + x * x);
+                    if (KEYED_MIN) KEYED_BIN(oMin + b, col) = as_uint(fmin(as_float(KEYED_BIN(oMin + b, col)), x));
+                    if (KEYED_MAX) KEYED_BIN(oMax + b, col) = as_uint(fmax(as_float(KEYED_BIN(oMax + b, col)), x));
+                }
+            }
+            if (columns < blockSize)
+            {
+                barrier(CLK_LOCAL_MEM_FENCE);
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // merge the columns with a tree as in reduce6, one level per barrier
+    for (unsigned int s = columns / 2; s > 0; s >>= 1)
+    {
+        for (unsigned int j = tid; j < words * s; j += blockSize)
+        {
+            unsigned int w = j / s;
+            unsigned int c = j % s;
+            float x = as_float(KEYED_BIN(w, c));
+            float y = as_float(KEYED_BIN(w, c + s));
+            switch (keyed_statistic(w, num_keys, num_values))
+            {
+            case KEYED_COUNT: KEYED_BIN(w, c) += KEYED_BIN(w, c + s); break;
+            case KEYED_SUM: KEYED_BIN(w, c) = as_uint(x + y); break;
+            case KEYED_LO: KEYED_BIN(w, c) = as_uint(fmin(x, y)); break;
+            default: KEYED_BIN(w, c) = as_uint(fmax(x, y)); break;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (unsigned int w = tid; w < words; w += blockSize)
+    {
+        partials[get_group_id(0) * words + w] = KEYED_BIN(w, 0);
+    }
+}
+
+// One work item per (key, value): folds the partials of all work-groups
+// in group order, so the result does not depend on scheduling across groups
+__kernel void reduce_by_key_fold(__global const unsigned int *partials, unsigned int groups,
+                                 unsigned int num_keys, unsigned int num_values,
+                                 __global unsigned int *counts, __global float *sums, __global float *sum_squares,
+                                 __global float *minimum, __global float *maximum)
+{
+    unsigned int b = get_global_id(0);
+    unsigned int words = keyed_words(num_keys, num_values);
+    unsigned int table = num_keys * num_values;
+    if (b >= table) return;
+
+    // offsets of the statistics in a work-group's bins
+    unsigned int oSums = num_keys;
+    unsigned int oSquares = oSums + table;
+    unsigned int oMin = oSquares + (KEYED_SUM_SQUARES ? table : 0);
+    unsigned int oMax = oMin + (KEYED_MIN ? table : 0);
+
+    unsigned int count = 0;
+    float sum = 0, squares = 0, lo = FLT_MAX, hi = -FLT_MAX;
+    for (unsigned int g = 0; g < groups; g++)
+    {
+        __global const unsigned int *p = partials + g * words;
+        if (b % num_values == 0) count += p[b / num_values];
+        sum += as_float(p[oSums + b]);
+        if (KEYED_SUM_SQUARES) squares += as_float(p[oSquares + b]);
+        if (KEYED_MIN) lo = fmin(lo, as_float(p[oMin + b]));
+        if (KEYED_MAX) hi = fmax(hi, as_float(p[oMax + b]));
+    }
+    if (b % num_values == 0) counts[b / num_values] = count;
+    sums[b] = sum;
+    if (KEYED_SUM_SQUARES) sum_squares[b] = squares;
+    if (KEYED_MIN) minimum[b] = lo;
+    if (KEYED_MAX) maximum[b] = hi;
+}
+
+/*
+    Many keys: sort, then reduce the segments
+*/
+
+// (key, index) pairs of the padded range, the padding and the skipped
+// points sort to the end
+__kernel void reduce_by_key_sort_init(__global const KEY_T *keys, unsigned int n, unsigned int num_keys,
+                                      __global unsigned int *sort_keys, __global unsigned int *sort_index)
+{
+    unsigned int i = get_global_id(0);
+    unsigned int key = (i < n) ? keys[i] : KEYED_NONE;
+    sort_keys[i] = (key < num_keys) ? key : KEYED_NONE;
+    sort_index[i] = i;
+}
+
+// One compare-exchange step of a bitonic sort over a power of 2 range
+__kernel void reduce_by_key_bitonic(__global unsigned int *sort_keys, __global unsigned int *sort_index,
+                                    unsigned int j, unsigned int k)
+{
+    unsigned int i = get_global_id(0);
+    unsigned int ixj = i ^ j;
+    if (ixj <= i) return;
+
+    unsigned int a = sort_keys[i];
+    unsigned int b = sort_keys[ixj];
+    bool ascending = ((i & k) == 0);
+    if (ascending ? (a > b) : (a < b))
+    {
+        unsigned int t = sort_index[i];
+        sort_keys[i] = b;
+        sort_keys[ixj] = a;
+        sort_index[i] = sort_index[ixj];
+        sort_index[ixj] = t;
+    }
+}
+
+// Empty segments for all keys, before reduce_by_key_segments
+__kernel void reduce_by_key_segments_clear(__global unsigned int *starts, __global unsigned int *ends, unsigned int num_keys)
+{
+    unsigned int key = get_global_id(0);
+    if (key >= num_keys) return;
+    starts[key] = 0;
+    ends[key] = 0;
+}
+
+// [starts[key], ends[key]) is the run of key in the sorted pairs
+__kernel void reduce_by_key_segments(__global const unsigned int *sort_keys, unsigned int padded,
+                                     __global unsigned int *starts, __global unsigned int *ends)
+{
+    unsigned int i = get_global_id(0);
+    unsigned int key = sort_keys[i];
+    if (key == KEYED_NONE) return;
+    if (i == 0 || sort_keys[i - 1] != key) starts[key] = i;
+    if (i == padded - 1 || sort_keys[i + 1] != key) ends[key] = i + 1;
+}
+
+// Tree reduction of sdata[0..blockSize) with op, result in sdata[0]
+#define KEYED_TREE(op) \
+    for (unsigned int s = blockSize / 2; s > 0; s >>= 1) \
+    { \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        if (tid < s) sdata[tid] = op(sdata[tid], sdata[tid + s]); \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+#define KEYED_ADD(a, b) ((a) + (b))
+
+// One work-group per segment (keys in a grid stride)
+__kernel void reduce_by_key_segment_reduce(__global const unsigned int *sort_index, __global const VALUE_T *values,
+                                           unsigned int pitch, unsigned int num_keys, unsigned int num_values,
+                                           __global const unsigned int *starts, __global const unsigned int *ends,
+                                           __global unsigned int *counts, __global float *sums, __global float *sum_squares,
+                                           __global float *minimum, __global float *maximum, __local float *sdata)
+{
+    unsigned int tid = get_local_id(0);
+    for (unsigned int key = get_group_id(0); key < num_keys; key += get_num_groups(0))
+    {
+        unsigned int start = starts[key];
+        unsigned int end = ends[key];
+        if (tid == 0) counts[key] = end - start;
+        for (unsigned int v = 0; v < num_values; v++)
+        {
+            __global const VALUE_T *plane = values + v * pitch;
+            unsigned int b = key * num_values + v;
+
+            float sum = 0;
+            for (unsigned int i = start + tid; i < end; i += blockSize) sum += VALUE(plane, v, sort_index[i]);
+            sdata[tid] = sum;
+            KEYED_TREE(KEYED_ADD)
+            if (tid == 0) sums[b] = sdata[0];
+
+            if (KEYED_SUM_SQUARES)
+            {
+                float squares = 0;
+                for (unsigned int i = start + tid; i < end; i += blockSize) { float x = VALUE(plane, v, sort_index[i]); squares += x * x; }
+                barrier(CLK_LOCAL_MEM_FENCE);
+                sdata[tid] = squares;
+                KEYED_TREE(KEYED_ADD)
+                if (tid == 0) sum_squares[b] = sdata[0];
+            }
+            if (KEYED_MIN)
+            {
+                float lo = FLT_MAX;
+                for (unsigned int i = start + tid; i < end; i += blockSize) lo = fmin(lo, VALUE(plane, v, sort_index[i]));
+                barrier(CLK_LOCAL_MEM_FENCE);
+                sdata[tid] = lo;
+                KEYED_TREE(fmin)
+                if (tid == 0) minimum[b] = sdata[0];
+            }
+            if (KEYED_MAX)
+            {
+                float hi = -FLT_MAX;
+                for (unsigned int i = start + tid; i < end; i += blockSize) hi = fmax(hi, VALUE(plane, v, sort_index[i]));
+                barrier(CLK_LOCAL_MEM_FENCE);
+                sdata[tid] = hi;
+                KEYED_TREE(fmax)
+                if (tid == 0) maximum[b] = sdata[0];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+}
+
+#endif // #ifndef _REDUCE_BY_KEY_KERNEL_H_
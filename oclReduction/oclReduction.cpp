@@ -36,6 +36,18 @@
     "--maxblocks=<N>": Specify the maximum number of thread blocks to launch (kernel 6 only, default 64)
     "--cpufinal":      Read back the per-block results and do final sum of block sums on CPU (default false)
     "--cputhresh=<N>": The threshold of number of blocks sums below which to perform a CPU final reduction (default 1)
+    "--cachedir=<D>":  Directory for the compiled program binaries (default current directory)
+    "--nodiskcache":   Keep compiled programs in memory only
+    "--tune":          Time every kernel, block size and maxblocks on this device for --n elements and
+                       store the fastest in the tuning file; later runs of the same size bucket use it
+                       unless --kernel, --threads or --maxblocks are given
+    "--tunefile=<F>":  Tuning file (default oclTuning.txt)
+    "--op=<OP>":       Also reduce the data with an operator of the library (oclReduce.h) and check it
+                       against the CPU: sum, min, max, argmin, argmax, sumsq, sumcount or csum
+                       (Neumaier-compensated sum)
+    "--bykey=<K>":     Also reduce 3 value planes by K random keys (oclReduceByKey), on the local-memory
+                       and on the sort path, and check counts, sums, sums of squares and bounds against the CPU
+    "--narrow":        With --bykey, store the values as 8 bit and widen them in the kernels
     
 */
 
@@ -43,8 +55,12 @@
 #include <oclUtils.h>
 
 // additional includes
+#include <float.h>
 #include <sstream>
 #include <oclReduction.h>
+#include "oclProgramCache.h"
+#include "oclTuning.h"
+#include "oclReduce.h"
 
 // Forward declarations and sample-specific defines
 // *********************************************************************
@@ -60,6 +76,18 @@ bool runTest( int argc, const char** argv, ReduceType datatype);
 
 #define MAX_BLOCK_DIM_SIZE 65535
 
+// CL objects, private to this sample so that the header can be included
+// by more than one translation unit
+static cl_platform_id cpPlatform;
+static cl_uint uiNumDevices;
+static cl_device_id* cdDevices = NULL;
+static cl_context cxGPUContext;
+static cl_command_queue cqCommandQueue;
+static cl_device_id device;
+static cl_int ciErrNum;
+static const char* source_path;
+static const char* keyed_source_path;
+
 extern "C"
 bool isPow2(unsigned int x)
 {
@@ -67,6 +95,7 @@ bool isPow2(unsigned int x)
 }
 
 cl_kernel getReductionKernel(ReduceType datatype, int whichKernel, int blockSize, int isPowOf2);
+int getReductionWorkGroupSize(ReduceType datatype);
 
 // Main function 
 // *********************************************************************
@@ -116,7 +145,7 @@ int main( int argc, const char** argv)
     //Get the devices
     ciErrNum = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 0, NULL, &uiNumDevices);
     oclCheckError(ciErrNum, CL_SUCCESS);
-    cl_device_id *cdDevices = (cl_device_id *)malloc(uiNumDevices * sizeof(cl_device_id) );
+    cdDevices = (cl_device_id *)malloc(uiNumDevices * sizeof(cl_device_id) );
     ciErrNum = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, uiNumDevices, cdDevices, NULL);
     oclCheckError(ciErrNum, CL_SUCCESS);
 
@@ -145,6 +174,18 @@ int main( int argc, const char** argv)
     oclCheckError(ciErrNum, CL_SUCCESS);
 
     source_path = shrFindFilePath("oclReduction_kernel.cl", argv[0]);
+    keyed_source_path = shrFindFilePath("oclReduceByKey_kernel.cl", argv[0]);
+
+    // programs are built once per specialization, binaries are kept across runs
+    char* cacheDir = NULL;
+    shrGetCmdLineArgumentstr(argc, argv, "cachedir", &cacheDir);
+    if (!shrCheckCmdLineFlag(argc, argv, "nodiskcache"))
+        oclSetProgramCacheDir(cacheDir ? cacheDir : ".");
+
+    // launch configurations found by --tune, per device, driver and size bucket
+    char* tuneFile = NULL;
+    shrGetCmdLineArgumentstr(argc, argv, "tunefile", &tuneFile);
+    oclSetTuningFile(tuneFile ? tuneFile : "oclTuning.txt");
 
     bool bSuccess = false;
     switch (datatype)
@@ -157,6 +198,10 @@ int main( int argc, const char** argv)
         bSuccess = runTest<float>( argc, argv, datatype);
         break;
     }
+    oclReleaseProgramCache();
+    clReleaseCommandQueue(cqCommandQueue);
+    clReleaseContext(cxGPUContext);
+    free(cdDevices);
     
     // finish
     shrExitEX(argc, argv, (bSuccess ? EXIT_SUCCESS : EXIT_FAILURE));
@@ -451,6 +496,297 @@ void shmoo(int minN, int maxN, int maxThreads, int maxBlocks, ReduceType datatyp
     clReleaseMemObject(d_odata);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Auto-tuning: times every kernel with every block size the device allows
+// (and every maxBlocks for kernel 6) on n elements, and stores the fastest
+// configuration that gives the right sum in the tuning file.
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+bool tuneReduce(ReduceType datatype, const char* kind, int n, int maxWorkGroupSize, 
+                int* bestKernel, int* bestThreads, int* bestBlocks)
+{
+    // create random input data on CPU
+    unsigned int bytes = n * sizeof(T);
+    T* h_idata = (T*)malloc(bytes);
+    for(int i = 0; i < n; i++) {
+        // Keep the numbers small so we don't get truncation error in the sum
+        if (datatype == REDUCE_INT)
+            h_idata[i] = (T)(rand() & 0xFF);
+        else
+            h_idata[i] = (rand() & 0xFF) / (T)RAND_MAX;
+    }
+    T cpu_result = reduceCPU<T>(h_idata, n);
+    double threshold = (datatype == REDUCE_FLOAT) ? 1e-8 * n : 1e-12;
+
+    int candidateBlocks[] = { 16, 32, 64, 128, 256, 512 };
+    int numCandidateBlocks = sizeof(candidateBlocks) / sizeof(candidateBlocks[0]);
+    int maxNumBlocks = MIN((n + 63) / 64, MAX_BLOCK_DIM_SIZE);
+
+    T* h_odata = (T*)malloc(maxNumBlocks * sizeof(T));
+    cl_mem d_idata = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, h_idata, NULL);
+    cl_mem d_odata = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, maxNumBlocks * sizeof(T), NULL, NULL);
+
+    int testIterations = 20;
+    double bestTime = -1.0;
+    shrLog("Tuning %s for %d elements...\n\n", kind, n);
+    for (int kernel = 0; kernel < 7; kernel++)
+    {
+        for (int threads = 64; threads <= MIN(maxWorkGroupSize, 512); threads *= 2)
+        {
+            for (int b = 0; b < ((kernel == 6) ? numCandidateBlocks : 1); b++)
+            {
+                int maxBlocks = (kernel == 6) ? candidateBlocks[b] : 64;
+                int numBlocks = 0;
+                int numThreads = 0;
+                getNumBlocksAndThreads(kernel, n, maxBlocks, threads, numBlocks, numThreads);
+                if (numBlocks > maxNumBlocks)
+                    continue;
+
+                double dTotalTime = 0.0;
+                T gpu_result = profileReduce<T>(datatype, n, numThreads, numBlocks, threads, maxBlocks,
+                                                kernel, testIterations, false, 1, &dTotalTime,
+                                                h_odata, d_idata, d_odata);
+                double reduceTime = dTotalTime / (double)(testIterations - 1);
+                bool bCorrect = (datatype == REDUCE_INT) ? (gpu_result == cpu_result) 
+                                                         : (abs((double)gpu_result - (double)cpu_result) < threshold);
+                shrLog(" kernel %d, %3d threads, maxblocks %3d: %.6f s%s\n", kernel, threads, maxBlocks, reduceTime,
+                       bCorrect ? "" : " (wrong sum, skipped)");
+                if (bCorrect && (bestTime < 0 || reduceTime < bestTime))
+                {
+                    bestTime = reduceTime;
+                    *bestKernel = kernel;
+                    *bestThreads = threads;
+                    *bestBlocks = maxBlocks;
+                }
+            }
+        }
+    }
+
+    free(h_idata);
+    free(h_odata);
+    clReleaseMemObject(d_idata);
+    clReleaseMemObject(d_odata);
+
+    if (bestTime < 0)
+    {
+        shrLog("\nNo configuration gave the right sum, nothing stored\n\n");
+        return false;
+    }
+    shrLog("\nFastest: kernel %d, %d threads, maxblocks %d (%.6f s)\n\n", *bestKernel, *bestThreads, *bestBlocks, bestTime);
+    int values[3] = { *bestKernel, *bestThreads, *bestBlocks };
+    if (!oclSetTuning(device, kind, n, values, 3))
+        shrLog("Could not write the tuning file\n\n");
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduces the input with an operator of the library (oclReduce) and checks
+// the result against the CPU
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+bool testReduceOp(ReduceType datatype, const char* opName, T* h_idata, int n, cl_mem d_idata, int maxThreads, int maxBlocks)
+{
+    int op = oclReduceOpByName(opName);
+    if (op < 0)
+    {
+        shrLog("Unknown operator %s\n\n", opName);
+        return false;
+    }
+    oclReduceType type = (datatype == REDUCE_FLOAT) ? OCL_REDUCE_FLOAT : OCL_REDUCE_INT;
+
+    // reference: index of the first minimum / maximum, sums in double, or
+    // in 64 bit integers for int like the device
+    double sum = 0.0, sumSquares = 0.0;
+    long long llSum = 0, llSquares = 0;
+    unsigned int argMin = 0, argMax = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += h_idata[i];
+        sumSquares += (double)h_idata[i] * h_idata[i];
+        llSum += (long long)h_idata[i];
+        llSquares += (long long)h_idata[i] * (long long)h_idata[i];
+        if (h_idata[i] < h_idata[argMin]) argMin = i;
+        if (h_idata[i] > h_idata[argMax]) argMax = i;
+    }
+    if (datatype != REDUCE_FLOAT)
+    {
+        sum = (double)llSum;
+        sumSquares = (double)llSquares;
+    }
+    oclReduceResult expected = { sum, 0, 0 };
+    switch (op)
+    {
+    case OCL_REDUCE_MIN:         expected.value = h_idata[argMin]; break;
+    case OCL_REDUCE_MAX:         expected.value = h_idata[argMax]; break;
+    case OCL_REDUCE_ARGMIN:      expected.value = h_idata[argMin]; expected.index = argMin; break;
+    case OCL_REDUCE_ARGMAX:      expected.value = h_idata[argMax]; expected.index = argMax; break;
+    case OCL_REDUCE_SUM_SQUARES: expected.value = sumSquares; break;
+    case OCL_REDUCE_SUM_COUNT:   expected.count = n; break;
+    default: break;
+    }
+
+    oclReduceResult result;
+    ciErrNum = oclReduce(cqCommandQueue, source_path, (oclReduceOp)op, type, d_idata, n, &result, maxThreads, maxBlocks);
+    oclCheckError(ciErrNum, CL_SUCCESS);
+
+    // the compensated sum must be as close as the rounding of the result allows
+    double threshold = (datatype == REDUCE_FLOAT) ? 1e-6 * fabs(expected.value) + 1e-8 * n : 0.0;
+    if (datatype == REDUCE_FLOAT && op == OCL_REDUCE_SUM_COMPENSATED)
+        threshold = FLT_EPSILON * fabs(expected.value);
+    bool bPassed = (fabs(result.value - expected.value) <= threshold) && 
+                   result.index == expected.index && result.count == expected.count;
+    shrLog(" %s: GPU %.9g (index %u, count %u), CPU %.9g (index %u, count %u)\n", opName, 
+           result.value, result.index, result.count, expected.value, expected.index, expected.count);
+    shrLog("%s\n\n", bPassed ? "PASSED" : "FAILED");
+    return bPassed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduces 3 value planes of n points by numKeys random keys (oclReduceByKey)
+// on both paths and checks the statistics against the CPU; one key in
+// numKeys + 1 is out of range and skipped. With narrow, the values are
+// stored as 8 bit and widened by the kernels with a scale and offset.
+////////////////////////////////////////////////////////////////////////////////
+bool testReduceByKey(int numKeys, int n, int maxThreads, int maxBlocks, bool narrow)
+{
+    const int numValues = 3;
+    if (numKeys < 1 || n < 1)
+    {
+        shrLog("--bykey needs at least 1 key\n\n");
+        return false;
+    }
+
+    // powers of 2, so that stored * scale + offset is exact on both sides
+    const float scale[numValues] = { 1.0f, 0.5f, 0.25f };
+    const float offset[numValues] = { -64.0f, -64.0f, -64.0f };
+    cl_uint* h_keys = (cl_uint*)malloc(n * sizeof(cl_uint));
+    float* h_values = (float*)malloc(n * numValues * sizeof(float));
+    cl_uchar* h_stored = (cl_uchar*)malloc(n * numValues * sizeof(cl_uchar));
+    for (int i = 0; i < n; i++)
+    {
+        h_keys[i] = rand() % (numKeys + 1);
+        for (int v = 0; v < numValues; v++)
+        {
+            h_stored[v * n + i] = (cl_uchar)(rand() & 0xFF);
+            h_values[v * n + i] = (float)h_stored[v * n + i] * scale[v] + offset[v];
+        }
+    }
+
+    // reference, sums in double
+    int table = numKeys * numValues;
+    cl_uint* refCounts = (cl_uint*)calloc(numKeys, sizeof(cl_uint));
+    double* refSums = (double*)calloc(table, sizeof(double));
+    double* refSquares = (double*)calloc(table, sizeof(double));
+    double* refAbs = (double*)calloc(table, sizeof(double));
+    float* refMin = (float*)malloc(table * sizeof(float));
+    float* refMax = (float*)malloc(table * sizeof(float));
+    for (int b = 0; b < table; b++)
+    {
+        refMin[b] = FLT_MAX;
+        refMax[b] = -FLT_MAX;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (h_keys[i] >= (cl_uint)numKeys) continue;
+        refCounts[h_keys[i]]++;
+        for (int v = 0; v < numValues; v++)
+        {
+            float x = h_values[v * n + i];
+            int b = h_keys[i] * numValues + v;
+            refSums[b] += x;
+            refAbs[b] += fabs(x);
+            refSquares[b] += (double)x * x;
+            refMin[b] = MIN(refMin[b], x);
+            refMax[b] = MAX(refMax[b], x);
+        }
+    }
+
+    cl_mem d_keys = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(cl_uint), h_keys, &ciErrNum);
+    oclCheckError(ciErrNum, CL_SUCCESS);
+    cl_mem d_values = narrow ?
+        clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * numValues * sizeof(cl_uchar), h_stored, &ciErrNum) :
+        clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * numValues * sizeof(float), h_values, &ciErrNum);
+    oclCheckError(ciErrNum, CL_SUCCESS);
+    oclReduceByKeyOutput output;
+    output.counts = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, numKeys * sizeof(cl_uint), NULL, &ciErrNum);
+    output.sums = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, table * sizeof(float), NULL, &ciErrNum);
+    output.sum_squares = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, table * sizeof(float), NULL, &ciErrNum);
+    output.minimum = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, table * sizeof(float), NULL, &ciErrNum);
+    output.maximum = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, table * sizeof(float), NULL, &ciErrNum);
+    oclCheckError(ciErrNum, CL_SUCCESS);
+
+    cl_uint* counts = (cl_uint*)malloc(numKeys * sizeof(cl_uint));
+    float* stats = (float*)malloc(4 * table * sizeof(float));
+    bool bPassed = true;
+    const char* pathNames[] = { "auto", "local", "sort" };
+    for (int path = OCL_REDUCE_BY_KEY_LOCAL; path <= OCL_REDUCE_BY_KEY_SORT; path++)
+    {
+        shrDeltaT(0);
+        ciErrNum = oclReduceByKey(cqCommandQueue, keyed_source_path, d_keys, sizeof(cl_uint), d_values, n, numValues,
+                                  n, numKeys, output, maxThreads, maxBlocks, (oclReduceByKeyPath)path,
+                                  narrow ? OCL_REDUCE_UCHAR : OCL_REDUCE_FLOAT, narrow ? scale : NULL, narrow ? offset : NULL);
+        oclCheckError(ciErrNum, CL_SUCCESS);
+        clFinish(cqCommandQueue);
+        double dTime = shrDeltaT(0);
+
+        ciErrNum = clEnqueueReadBuffer(cqCommandQueue, output.counts, CL_FALSE, 0, numKeys * sizeof(cl_uint), counts, 0, NULL, NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, output.sums, CL_FALSE, 0, table * sizeof(float), stats, 0, NULL, NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, output.sum_squares, CL_FALSE, 0, table * sizeof(float), stats + table, 0, NULL, NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, output.minimum, CL_FALSE, 0, table * sizeof(float), stats + 2 * table, 0, NULL, NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, output.maximum, CL_TRUE, 0, table * sizeof(float), stats + 3 * table, 0, NULL, NULL);
+        oclCheckError(ciErrNum, CL_SUCCESS);
+
+        int errors = 0;
+        for (int key = 0; key < numKeys; key++)
+        {
+            if (counts[key] != refCounts[key]) errors++;
+        }
+        for (int b = 0; b < table; b++)
+        {
+            // float sums in another order than the host: relative to the sum of magnitudes
+            if (fabs(stats[b] - refSums[b]) > 1e-4 * refAbs[b] + 1e-3 ||
+                fabs(stats[table + b] - refSquares[b]) > 1e-4 * refSquares[b] + 1e-3 ||
+                stats[2 * table + b] != refMin[b] || stats[3 * table + b] != refMax[b])
+                errors++;
+        }
+
+        // the sums are added in a fixed order, so a second run gives the same bits
+        ciErrNum = oclReduceByKey(cqCommandQueue, keyed_source_path, d_keys, sizeof(cl_uint), d_values, n, numValues,
+                                  n, numKeys, output, maxThreads, maxBlocks, (oclReduceByKeyPath)path,
+                                  narrow ? OCL_REDUCE_UCHAR : OCL_REDUCE_FLOAT, narrow ? scale : NULL, narrow ? offset : NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, output.sums, CL_TRUE, 0, table * sizeof(float), stats + 2 * table, 0, NULL, NULL);
+        oclCheckError(ciErrNum, CL_SUCCESS);
+        if (memcmp(stats, stats + 2 * table, table * sizeof(float)) != 0)
+        {
+            shrLog(" by key (%s): the sums differ between runs\n", pathNames[path]);
+            errors++;
+        }
+        shrLog(" by key (%d keys, %s%s): %.6f s, %d mismatches\n", numKeys, pathNames[path], narrow ? ", uchar" : "", dTime, errors);
+        bPassed &= (errors == 0);
+    }
+    shrLog("%s\n\n", bPassed ? "PASSED" : "FAILED");
+
+    clReleaseMemObject(output.maximum);
+    clReleaseMemObject(output.minimum);
+    clReleaseMemObject(output.sum_squares);
+    clReleaseMemObject(output.sums);
+    clReleaseMemObject(output.counts);
+    clReleaseMemObject(d_values);
+    clReleaseMemObject(d_keys);
+    free(stats);
+    free(counts);
+    free(refMax);
+    free(refMin);
+    free(refAbs);
+    free(refSquares);
+    free(refSums);
+    free(refCounts);
+    free(h_stored);
+    free(h_values);
+    free(h_keys);
+    return bPassed;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // The main function whihc runs the reduction test.
 ////////////////////////////////////////////////////////////////////////////////
@@ -461,10 +797,9 @@ runTest( int argc, const char** argv, ReduceType datatype)
     int size = 1<<24;    // number of elements to reduce
     int maxThreads;
 
-    cl_kernel reductionKernel = getReductionKernel(datatype, 0, 64, 1);        
-    clReleaseKernel(reductionKernel);
-
-    if (smallBlock) 
+    // devices that cannot run more than 64 work items per group get small blocks
+    int maxWorkGroupSize = getReductionWorkGroupSize(datatype);
+    if (maxWorkGroupSize <= 64) 
       maxThreads = 64;  // number of threads per block
     else
       maxThreads = 128;
@@ -478,6 +813,26 @@ runTest( int argc, const char** argv, ReduceType datatype)
     shrGetCmdLineArgumenti( argc, (const char**) argv, "threads", &maxThreads);
     shrGetCmdLineArgumenti( argc, (const char**) argv, "kernel", &whichKernel);
     shrGetCmdLineArgumenti( argc, (const char**) argv, "maxblocks", &maxBlocks);
+
+    // tuned launch configuration of this device and size bucket, unless one is given
+    const char* kind = (datatype == REDUCE_INT) ? "reduce int" : "reduce float";
+    if (shrCheckCmdLineFlag(argc, (const char**) argv, "tune"))
+    {
+        tuneReduce<T>(datatype, kind, size, maxWorkGroupSize, &whichKernel, &maxThreads, &maxBlocks);
+    }
+    else if (!shrCheckCmdLineFlag(argc, (const char**) argv, "kernel") && 
+             !shrCheckCmdLineFlag(argc, (const char**) argv, "threads") && 
+             !shrCheckCmdLineFlag(argc, (const char**) argv, "maxblocks"))
+    {
+        int values[3];
+        if (oclGetTuning(device, kind, size, values, 3))
+        {
+            whichKernel = values[0];
+            maxThreads = values[1];
+            maxBlocks = values[2];
+            shrLog(" tuned: kernel %d, %d threads, maxblocks %d\n", whichKernel, maxThreads, maxBlocks);
+        }
+    }
     
     shrLog(" %d elements\n", size);
     shrLog(" %d threads (max)\n", maxThreads);
@@ -555,13 +910,27 @@ runTest( int argc, const char** argv, ReduceType datatype)
             shrLog("%s\n\n", (diff < threshold) ? "PASSED" : "FAILED");
         }
       
+        // operators of the library on the same data
+        bool bOpPassed = true;
+        char* opName = NULL;
+        if (shrGetCmdLineArgumentstr(argc, argv, "op", &opName))
+        {
+            bOpPassed = testReduceOp<T>(datatype, opName, h_idata, size, d_idata, maxThreads, maxBlocks);
+        }
+        int numKeys = 0;
+        if (shrGetCmdLineArgumenti(argc, argv, "bykey", &numKeys))
+        {
+            bool narrow = (shrCheckCmdLineFlag(argc, (const char**) argv, "narrow") == shrTRUE);
+            bOpPassed &= testReduceByKey(numKeys, size, maxThreads, maxBlocks, narrow);
+        }
+      
         // cleanup
         free(h_idata);
         free(h_odata);
         clReleaseMemObject(d_idata);
         clReleaseMemObject(d_odata);
 
-        return (gpu_result == cpu_result);
+        return (gpu_result == cpu_result) && bOpPassed;
     }
 }
 
@@ -569,42 +938,15 @@ runTest( int argc, const char** argv, ReduceType datatype)
 // *********************************************************************
 cl_kernel getReductionKernel(ReduceType datatype, int whichKernel, int blockSize, int isPowOf2)
 {
-    // compile cl program
-    size_t program_length;
-    char *source; 
-
-    std::ostringstream preamble;   
-
     // create the program
-    // with type specification depending on datatype argument
-    switch (datatype)
-    {
-    default:
-    case REDUCE_INT:
-        preamble << "#define T int" << std::endl;
-        break;
-    case REDUCE_FLOAT:
-        preamble << "#define T float" << std::endl;
-        break;
-    }
-    
-    // set blockSize at compile time
-    preamble << "#define blockSize " << blockSize << std::endl;
+    // with type, operator, blockSize and isPow2 specified at compile time
+    std::string preamble = oclReducePreamble(OCL_REDUCE_SUM, (datatype == REDUCE_FLOAT) ? OCL_REDUCE_FLOAT : OCL_REDUCE_INT,
+                                             true, blockSize, isPowOf2, 1.0f, 0.0f, true);
     
-    // set isPow2 at compile time
-    preamble << "#define nIsPow2 " << isPowOf2 << std::endl;
-    
-    // Load the source code and prepend the preamble
-    source = oclLoadProgSource(source_path, preamble.str().c_str(), &program_length);
-    oclCheckError(source != NULL, shrTRUE);
-    
-    cl_program cpProgram = clCreateProgramWithSource(cxGPUContext, 1,(const char **) &source, 
-                                                     &program_length, &ciErrNum);
-    oclCheckError(ciErrNum, CL_SUCCESS);
-    free(source);
-
-    // build the program
-    ciErrNum = clBuildProgram(cpProgram, 0, NULL, "-cl-fast-relaxed-math", NULL, NULL);
+    // get the program built for this specialization, only the first request compiles it
+    cl_program cpProgram = oclGetCachedProgram(cxGPUContext, device, source_path, preamble.c_str(),
+                                               "-cl-fast-relaxed-math", &ciErrNum);
+    oclCheckError(cpProgram != NULL, shrTRUE);
     if (ciErrNum != CL_SUCCESS)
     {
         // write out standard error, Build Log and PTX, then cleanup and exit
@@ -620,14 +962,20 @@ cl_kernel getReductionKernel(ReduceType datatype, int whichKernel, int blockSize
     cl_kernel ckKernel = clCreateKernel(cpProgram, kernelName.str().c_str(), &ciErrNum);
     oclCheckError(ciErrNum, CL_SUCCESS);
 
-    size_t wgSize;
-    ciErrNum = clGetKernelWorkGroupInfo(ckKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &wgSize, NULL);
-    if (wgSize == 64) 
-      smallBlock = true;
-    else smallBlock = false;
-
-    // NOTE: the program will get deleted when the kernel is also released
+    // NOTE: the cache keeps its own reference, kernels are cheap to create from it
     clReleaseProgram(cpProgram);
     
     return ckKernel;
 }
+
+// Largest work-group size the reduction kernels can run with on the device
+// *********************************************************************
+int getReductionWorkGroupSize(ReduceType datatype)
+{
+    cl_kernel ckKernel = getReductionKernel(datatype, 0, 64, 1);
+    size_t wgSize = 0;
+    ciErrNum = clGetKernelWorkGroupInfo(ckKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &wgSize, NULL);
+    oclCheckError(ciErrNum, CL_SUCCESS);
+    clReleaseKernel(ckKernel);
+    return (int)wgSize;
+}
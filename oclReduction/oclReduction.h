@@ -20,15 +20,4 @@ template <class T>
 void reduce_sm13(int size, int threads, int blocks, 
                  int whichKernel, T *d_idata, T *d_odata);
 
-// CL objects
-cl_platform_id cpPlatform;
-cl_uint uiNumDevices;
-cl_device_id* cdDevices; 
-cl_context cxGPUContext;
-cl_command_queue cqCommandQueue;
-cl_device_id device;
-cl_int ciErrNum;
-const char* source_path;
-bool smallBlock = true;
-
 #endif
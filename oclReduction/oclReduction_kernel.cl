@@ -17,12 +17,38 @@
 // #define T float
 // #define blockSize 128
 // #define nIsPow2 1
+//
+// The operator comes with the preamble too (see oclReducePreamble in
+// oclReduce.cpp); without one the kernels sum:
+// #define IN_T float               type of the input elements (narrow types are widened by LOAD)
+// #define IDENTITY 0               neutral element of OP
+// #define OP(a, b) ((a) + (b))     associative operator on two T
+// #define LOAD(p, i) ((p)[i])      element i of the input as a T
+// #define BARRIER_TAIL 0           1: reduce6 keeps a barrier on the last 6
+//                                  levels too, for runtimes (CPUs) whose
+//                                  work-items do not run in lock-step warps
 
 #ifndef _REDUCE_KERNEL_H_
 #define _REDUCE_KERNEL_H_
 
+#ifndef IN_T
+#define IN_T T
+#endif
+#ifndef BARRIER_TAIL
+#define BARRIER_TAIL 0
+#endif
+#ifndef IDENTITY
+#define IDENTITY 0
+#endif
+#ifndef OP
+#define OP(a, b) ((a) + (b))
+#endif
+#ifndef LOAD
+#define LOAD(p, i) ((p)[i])
+#endif
+
 /*
-    Parallel sum reduction using shared memory
+    Parallel reduction using shared memory
     - takes log(n) steps for n input elements
     - uses n threads
     - only works for power-of-2 arrays
@@ -32,13 +58,13 @@
    operator.  This operator is very expensive on GPUs, and the interleaved 
    inactivity means that no whole warps are active, which is also very 
    inefficient */
-__kernel void reduce0(__global T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
+__kernel void reduce0(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
 {
     // load shared mem
     unsigned int tid = get_local_id(0);
     unsigned int i = get_global_id(0);
     
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -46,7 +72,7 @@ __kernel void reduce0(__global T *g_idata, __global T *g_odata, unsigned int n,
     for(unsigned int s=1; s < get_local_size(0); s *= 2) {
         // modulo arithmetic is slow!
         if ((tid % (2*s)) == 0) {
-            sdata[tid] += sdata[tid + s];
+            sdata[tid] = OP(sdata[tid], sdata[tid + s]);
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
@@ -58,13 +84,13 @@ __kernel void reduce0(__global T *g_idata, __global T *g_odata, unsigned int n,
 
 /* This version uses contiguous threads, but its interleaved 
    addressing results in many shared memory bank conflicts. */
-__kernel void reduce1(__global T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
+__kernel void reduce1(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
 {
     // load shared mem
     unsigned int tid = get_local_id(0);
     unsigned int i = get_global_id(0);
     
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -75,7 +101,7 @@ __kernel void reduce1(__global T *g_idata, __global T *g_odata, unsigned int n,
 
         if (index < get_local_size(0)) 
         {
-            sdata[index] += sdata[index + s];
+            sdata[index] = OP(sdata[index], sdata[index + s]);
         }
 
         barrier(CLK_LOCAL_MEM_FENCE);
@@ -88,13 +114,13 @@ __kernel void reduce1(__global T *g_idata, __global T *g_odata, unsigned int n,
 /*
     This version uses sequential addressing -- no divergence or bank conflicts.
 */
-__kernel void reduce2(__global T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
+__kernel void reduce2(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
 {
     // load shared mem
     unsigned int tid = get_local_id(0);
     unsigned int i = get_global_id(0);
     
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -103,7 +129,7 @@ __kernel void reduce2(__global T *g_idata, __global T *g_odata, unsigned int n,
     {
         if (tid < s) 
         {
-            sdata[tid] += sdata[tid + s];
+            sdata[tid] = OP(sdata[tid], sdata[tid + s]);
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
@@ -116,16 +142,16 @@ __kernel void reduce2(__global T *g_idata, __global T *g_odata, unsigned int n,
     This version uses n/2 threads --
     it performs the first level of reduction when reading from global memory
 */
-__kernel void reduce3(__global T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
+__kernel void reduce3(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local T* sdata)
 {
     // perform first level of reduction,
     // reading from global memory, writing to shared memory
     unsigned int tid = get_local_id(0);
     unsigned int i = get_group_id(0)*(get_local_size(0)*2) + get_local_id(0);
 
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     if (i + get_local_size(0) < n) 
-        sdata[tid] += g_idata[i+get_local_size(0)];  
+        sdata[tid] = OP(sdata[tid], LOAD(g_idata, i+get_local_size(0)));  
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -134,7 +160,7 @@ __kernel void reduce3(__global T *g_idata, __global T *g_odata, unsigned int n,
     {
         if (tid < s) 
         {
-            sdata[tid] += sdata[tid + s];
+            sdata[tid] = OP(sdata[tid], sdata[tid + s]);
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
@@ -147,16 +173,16 @@ __kernel void reduce3(__global T *g_idata, __global T *g_odata, unsigned int n,
     This version unrolls the last warp to avoid synchronization where it 
     isn't needed
 */
-__kernel void reduce4(__global T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
+__kernel void reduce4(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
 {
     // perform first level of reduction,
     // reading from global memory, writing to shared memory
     unsigned int tid = get_local_id(0);
     unsigned int i = get_group_id(0)*(get_local_size(0)*2) + get_local_id(0);
 
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     if (i + get_local_size(0) < n) 
-        sdata[tid] += g_idata[i+get_local_size(0)];  
+        sdata[tid] = OP(sdata[tid], LOAD(g_idata, i+get_local_size(0)));  
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -166,19 +192,19 @@ __kernel void reduce4(__global T *g_idata, __global T *g_odata, unsigned int n,
     {
         if (tid < s) 
         {
-            sdata[tid] += sdata[tid + s];
+            sdata[tid] = OP(sdata[tid], sdata[tid + s]);
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
     if (tid < 32)
     {
-        if (blockSize >=  64) { sdata[tid] += sdata[tid + 32]; }
-        if (blockSize >=  32) { sdata[tid] += sdata[tid + 16]; }
-        if (blockSize >=  16) { sdata[tid] += sdata[tid +  8]; }
-        if (blockSize >=   8) { sdata[tid] += sdata[tid +  4]; }
-        if (blockSize >=   4) { sdata[tid] += sdata[tid +  2]; }
-        if (blockSize >=   2) { sdata[tid] += sdata[tid +  1]; }
+        if (blockSize >=  64) { sdata[tid] = OP(sdata[tid], sdata[tid + 32]); }
+        if (blockSize >=  32) { sdata[tid] = OP(sdata[tid], sdata[tid + 16]); }
+        if (blockSize >=  16) { sdata[tid] = OP(sdata[tid], sdata[tid +  8]); }
+        if (blockSize >=   8) { sdata[tid] = OP(sdata[tid], sdata[tid +  4]); }
+        if (blockSize >=   4) { sdata[tid] = OP(sdata[tid], sdata[tid +  2]); }
+        if (blockSize >=   2) { sdata[tid] = OP(sdata[tid], sdata[tid +  1]); }
     }
 
     // write result for this block to global mem 
@@ -191,33 +217,42 @@ __kernel void reduce4(__global T *g_idata, __global T *g_odata, unsigned int n,
     statement in the host code to handle all the different thread block sizes at 
     compile time.
 */
-__kernel void reduce5(__global T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
+__kernel void reduce5(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
 {
     // perform first level of reduction,
     // reading from global memory, writing to shared memory
     unsigned int tid = get_local_id(0);
     unsigned int i = get_group_id(0)*(get_local_size(0)*2) + get_local_id(0);
 
-    sdata[tid] = (i < n) ? g_idata[i] : 0;
+    sdata[tid] = (i < n) ? LOAD(g_idata, i) : IDENTITY;
     if (i + blockSize < n) 
-        sdata[tid] += g_idata[i+blockSize];  
+        sdata[tid] = OP(sdata[tid], LOAD(g_idata, i+blockSize));  
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
     // do reduction in shared mem
-    if (blockSize >= 512) { if (tid < 256) { sdata[tid] += sdata[tid + 256]; } barrier(CLK_LOCAL_MEM_FENCE); }
-    if (blockSize >= 256) { if (tid < 128) { sdata[tid] += sdata[tid + 128]; } barrier(CLK_LOCAL_MEM_FENCE); }
-    if (blockSize >= 128) { if (tid <  64) { sdata[tid] += sdata[tid +  64]; } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 512) { if (tid < 256) { sdata[tid] = OP(sdata[tid], sdata[tid + 256]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 256) { if (tid < 128) { sdata[tid] = OP(sdata[tid], sdata[tid + 128]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 128) { if (tid <  64) { sdata[tid] = OP(sdata[tid], sdata[tid +  64]); } barrier(CLK_LOCAL_MEM_FENCE); }
     
+#if BARRIER_TAIL
+    if (blockSize >=  64) { if (tid <  32) { sdata[tid] = OP(sdata[tid], sdata[tid + 32]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=  32) { if (tid <  16) { sdata[tid] = OP(sdata[tid], sdata[tid + 16]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=  16) { if (tid <   8) { sdata[tid] = OP(sdata[tid], sdata[tid +  8]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   8) { if (tid <   4) { sdata[tid] = OP(sdata[tid], sdata[tid +  4]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   4) { if (tid <   2) { sdata[tid] = OP(sdata[tid], sdata[tid +  2]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   2) { if (tid <   1) { sdata[tid] = OP(sdata[tid], sdata[tid +  1]); } barrier(CLK_LOCAL_MEM_FENCE); }
+#else
     if (tid < 32)
     {
-        if (blockSize >=  64) { sdata[tid] += sdata[tid + 32]; }
-        if (blockSize >=  32) { sdata[tid] += sdata[tid + 16]; }
-        if (blockSize >=  16) { sdata[tid] += sdata[tid +  8]; }
-        if (blockSize >=   8) { sdata[tid] += sdata[tid +  4]; }
-        if (blockSize >=   4) { sdata[tid] += sdata[tid +  2]; }
-        if (blockSize >=   2) { sdata[tid] += sdata[tid +  1]; }
+        if (blockSize >=  64) { sdata[tid] = OP(sdata[tid], sdata[tid + 32]); }
+        if (blockSize >=  32) { sdata[tid] = OP(sdata[tid], sdata[tid + 16]); }
+        if (blockSize >=  16) { sdata[tid] = OP(sdata[tid], sdata[tid +  8]); }
+        if (blockSize >=   8) { sdata[tid] = OP(sdata[tid], sdata[tid +  4]); }
+        if (blockSize >=   4) { sdata[tid] = OP(sdata[tid], sdata[tid +  2]); }
+        if (blockSize >=   2) { sdata[tid] = OP(sdata[tid], sdata[tid +  1]); }
     }
+#endif
     
     // write result for this block to global mem 
     if (tid == 0) g_odata[get_group_id(0)] = sdata[0];
@@ -228,43 +263,52 @@ __kernel void reduce5(__global T *g_idata, __global T *g_odata, unsigned int n,
     cost of the algorithm while keeping the work complexity O(n) and the step complexity O(log n).
     (Brent's Theorem optimization)
 */
-__kernel void reduce6(__global T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
+__kernel void reduce6(__global IN_T *g_idata, __global T *g_odata, unsigned int n, __local volatile T* sdata)
 {
     // perform first level of reduction,
     // reading from global memory, writing to shared memory
     unsigned int tid = get_local_id(0);
     unsigned int i = get_group_id(0)*(get_local_size(0)*2) + get_local_id(0);
     unsigned int gridSize = blockSize*2*get_num_groups(0);
-    sdata[tid] = 0;
+    sdata[tid] = IDENTITY;
 
     // we reduce multiple elements per thread.  The number is determined by the 
     // number of active thread blocks (via gridDim).  More blocks will result
     // in a larger gridSize and therefore fewer elements per thread
     while (i < n)
     {         
-        sdata[tid] += g_idata[i];
+        sdata[tid] = OP(sdata[tid], LOAD(g_idata, i));
         // ensure we don't read out of bounds -- this is optimized away for powerOf2 sized arrays
         if (nIsPow2 || i + blockSize < n) 
-            sdata[tid] += g_idata[i+blockSize];  
+            sdata[tid] = OP(sdata[tid], LOAD(g_idata, i+blockSize));  
         i += gridSize;
     } 
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
     // do reduction in shared mem
-    if (blockSize >= 512) { if (tid < 256) { sdata[tid] += sdata[tid + 256]; } barrier(CLK_LOCAL_MEM_FENCE); }
-    if (blockSize >= 256) { if (tid < 128) { sdata[tid] += sdata[tid + 128]; } barrier(CLK_LOCAL_MEM_FENCE); }
-    if (blockSize >= 128) { if (tid <  64) { sdata[tid] += sdata[tid +  64]; } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 512) { if (tid < 256) { sdata[tid] = OP(sdata[tid], sdata[tid + 256]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 256) { if (tid < 128) { sdata[tid] = OP(sdata[tid], sdata[tid + 128]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >= 128) { if (tid <  64) { sdata[tid] = OP(sdata[tid], sdata[tid +  64]); } barrier(CLK_LOCAL_MEM_FENCE); }
     
+#if BARRIER_TAIL
+    if (blockSize >=  64) { if (tid <  32) { sdata[tid] = OP(sdata[tid], sdata[tid + 32]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=  32) { if (tid <  16) { sdata[tid] = OP(sdata[tid], sdata[tid + 16]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=  16) { if (tid <   8) { sdata[tid] = OP(sdata[tid], sdata[tid +  8]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   8) { if (tid <   4) { sdata[tid] = OP(sdata[tid], sdata[tid +  4]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   4) { if (tid <   2) { sdata[tid] = OP(sdata[tid], sdata[tid +  2]); } barrier(CLK_LOCAL_MEM_FENCE); }
+    if (blockSize >=   2) { if (tid <   1) { sdata[tid] = OP(sdata[tid], sdata[tid +  1]); } barrier(CLK_LOCAL_MEM_FENCE); }
+#else
     if (tid < 32)
     {
-        if (blockSize >=  64) { sdata[tid] += sdata[tid + 32]; }
-        if (blockSize >=  32) { sdata[tid] += sdata[tid + 16]; }
-        if (blockSize >=  16) { sdata[tid] += sdata[tid +  8]; }
-        if (blockSize >=   8) { sdata[tid] += sdata[tid +  4]; }
-        if (blockSize >=   4) { sdata[tid] += sdata[tid +  2]; }
-        if (blockSize >=   2) { sdata[tid] += sdata[tid +  1]; }
+        if (blockSize >=  64) { sdata[tid] = OP(sdata[tid], sdata[tid + 32]); }
+        if (blockSize >=  32) { sdata[tid] = OP(sdata[tid], sdata[tid + 16]); }
+        if (blockSize >=  16) { sdata[tid] = OP(sdata[tid], sdata[tid +  8]); }
+        if (blockSize >=   8) { sdata[tid] = OP(sdata[tid], sdata[tid +  4]); }
+        if (blockSize >=   4) { sdata[tid] = OP(sdata[tid], sdata[tid +  2]); }
+        if (blockSize >=   2) { sdata[tid] = OP(sdata[tid], sdata[tid +  1]); }
     }
+#endif
     
     // write result for this block to global mem 
     if (tid == 0) g_odata[get_group_id(0)] = sdata[0];
@@ -0,0 +1,161 @@
+// Launch configuration tuning file, see oclTuning.h
+// *********************************************************************
+
+#include <oclUtils.h>
+
+// additional includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <sstream>
+#include "oclTuning.h"
+
+// entries by key (kind, device, driver, bucket), values as written in the file
+static std::map<std::string, std::string> tuningEntries;
+
+// tuning file, empty for none
+static std::string tuningFile;
+
+////////////////////////////////////////////////////////////////////////////////
+// Open a file, portable between the MS and the POSIX runtimes
+////////////////////////////////////////////////////////////////////////////////
+static FILE* openTuningFile(const char* path, const char* mode)
+{
+    FILE* fp = NULL;
+#ifdef WIN32
+    if (fopen_s(&fp, path, mode) != 0)
+        fp = NULL;
+#else
+    fp = fopen(path, mode);
+#endif
+    return fp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Field of a key, with the separators of the file format replaced
+////////////////////////////////////////////////////////////////////////////////
+static std::string keyField(const char* text)
+{
+    std::string field(text);
+    for (size_t i = 0; i < field.size(); i++)
+    {
+        if (field[i] == '\t' || field[i] == '\n' || field[i] == '\r')
+            field[i] = ' ';
+    }
+    return field;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Key of an entry: kind, device name, driver version and size bucket
+////////////////////////////////////////////////////////////////////////////////
+static std::string tuningKey(cl_device_id device, const char* kind, size_t n)
+{
+    char deviceName[256] = "";
+    char driverVersion[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, NULL);
+
+    std::ostringstream key;
+    key << keyField(kind) << '\t' << keyField(deviceName) << '\t' << keyField(driverVersion) << '\t' << oclTuningBucket(n);
+    return key.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Use a tuning file, loading its entries
+////////////////////////////////////////////////////////////////////////////////
+void oclSetTuningFile(const char* path)
+{
+    tuningEntries.clear();
+    tuningFile = path ? path : "";
+    if (tuningFile.empty())
+        return;
+
+    FILE* fp = openTuningFile(path, "r");
+    if (fp == NULL)
+        return;
+
+    // the values follow the 4th tab, lines without them are skipped
+    char line[1024];
+    while (fgets(line, sizeof(line), fp))
+    {
+        std::string text(line);
+        while (!text.empty() && (text[text.size() - 1] == '\n' || text[text.size() - 1] == '\r'))
+            text.erase(text.size() - 1);
+        if (text.empty() || text[0] == '#')
+            continue;
+
+        size_t pos = 0;
+        for (int field = 0; field < 4 && pos != std::string::npos; field++)
+        {
+            pos = text.find('\t', pos);
+            if (pos != std::string::npos) pos++;
+        }
+        if (pos != std::string::npos)
+            tuningEntries[text.substr(0, pos - 1)] = text.substr(pos);
+    }
+    fclose(fp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Size bucket of a problem of n elements
+////////////////////////////////////////////////////////////////////////////////
+int oclTuningBucket(size_t n)
+{
+    int bucket = 0;
+    while (n > 1)
+    {
+        n >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Look up the tuned configuration of a kernel family
+////////////////////////////////////////////////////////////////////////////////
+bool oclGetTuning(cl_device_id device, const char* kind, size_t n, int* values, int count)
+{
+    std::map<std::string, std::string>::const_iterator it = tuningEntries.find(tuningKey(device, kind, n));
+    if (it == tuningEntries.end())
+        return false;
+
+    std::istringstream text(it->second);
+    int* stored = (int*)malloc(count * sizeof(int));
+    int i = 0;
+    while (i < count && (text >> stored[i]))
+        i++;
+    int extra;
+    bool bFound = (i == count) && !(text >> extra);
+    if (bFound)
+    {
+        for (i = 0; i < count; i++)
+            values[i] = stored[i];
+    }
+    free(stored);
+    return bFound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Store the tuned configuration of a kernel family and rewrite the file
+////////////////////////////////////////////////////////////////////////////////
+bool oclSetTuning(cl_device_id device, const char* kind, size_t n, const int* values, int count)
+{
+    std::ostringstream text;
+    for (int i = 0; i < count; i++)
+        text << (i ? " " : "") << values[i];
+    tuningEntries[tuningKey(device, kind, n)] = text.str();
+
+    if (tuningFile.empty())
+        return true;
+
+    FILE* fp = openTuningFile(tuningFile.c_str(), "w");
+    if (fp == NULL)
+        return false;
+    fprintf(fp, "# kind\tdevice\tdriver\tsize bucket (log2)\tvalues\n");
+    for (std::map<std::string, std::string>::const_iterator it = tuningEntries.begin(); it != tuningEntries.end(); ++it)
+        fprintf(fp, "%s\t%s\n", it->first.c_str(), it->second.c_str());
+    bool bWritten = !ferror(fp);
+    fclose(fp);
+    return bWritten;
+}
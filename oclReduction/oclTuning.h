@@ -0,0 +1,53 @@
+#ifndef __OCL_TUNING_H__
+#define __OCL_TUNING_H__
+
+#include <oclUtils.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//! Launch configuration tuning file
+//!
+//! An auto-tuning run times the candidate launch configurations of a kernel
+//! family on the device and stores the winner here; later runs look it up
+//! instead of using fixed heuristics. Entries are keyed by (kind, device
+//! name, driver version, size bucket): the kind names the kernel family and
+//! whatever else the winner depends on (data type, dimension, ...), the
+//! bucket is floor(log2(n)) of the problem size. A new driver therefore
+//! starts from the defaults again instead of reusing stale winners.
+//!
+//! The file is plain text, one entry per line, tab separated:
+//!   kind  device  driver  bucket  value value ...
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//! Use a tuning file, loading its entries. NULL (the default) keeps the
+//! entries in memory only. A missing file is created by the first store.
+////////////////////////////////////////////////////////////////////////////////
+void oclSetTuningFile(const char* path);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Size bucket of a problem of n elements, floor(log2(n))
+////////////////////////////////////////////////////////////////////////////////
+int oclTuningBucket(size_t n);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Look up the tuned configuration of a kernel family
+//!
+//! @return true if an entry with exactly count values exists, which are then
+//!         written to values
+//! @param device  device the configuration was tuned on
+//! @param kind    kernel family, e.g. "reduce int"
+//! @param n       problem size, only its bucket matters
+//! @param values  out: the stored values
+//! @param count   # of values
+////////////////////////////////////////////////////////////////////////////////
+bool oclGetTuning(cl_device_id device, const char* kind, size_t n, int* values, int count);
+
+////////////////////////////////////////////////////////////////////////////////
+//! Store the tuned configuration of a kernel family, replacing the entry with
+//! the same key, and rewrite the tuning file
+//!
+//! @return false if the tuning file could not be written
+////////////////////////////////////////////////////////////////////////////////
+bool oclSetTuning(cl_device_id device, const char* kind, size_t n, const int* values, int count);
+
+#endif